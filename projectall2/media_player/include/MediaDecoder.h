@@ -18,16 +18,20 @@ public:
 
     // 打开本地文件
     bool open(const std::string& path);
-    // 打开自定义网络流
-    bool openNetwork(const std::string& ip, int port);
+    // 打开自定义网络流，title非空时向服务器的片库请求该片名
+    bool openNetwork(const std::string& ip, int port, const std::string& title = "");
     // 解码一帧，返回true表示有帧，false表示流结束
     bool readFrame();
     // 获取解码后的视频帧（YUV420P），调用者负责释放
     AVFrame* getVideoFrame();
     // 获取解码后的音频帧
     AudioFrame getAudioFrame();
-    // 跳转到指定秒数（仅本地文件）
+    // 跳转到指定秒数（网络模式下请求服务器跳转，旧数据在跳转完成消息到达前丢弃）
     void seek(double seconds);
+    // 暂停/恢复（网络模式下通知服务器停止/恢复发送）
+    void setPaused(bool paused);
+    // 播放速率（仅网络模式，由服务器按速率调整发送节拍）
+    void setRate(double rate);
     // 刷新解码器缓冲
     void flush();
     // 关闭
@@ -40,6 +44,8 @@ public:
     AVRational videoTimeBase() const;
     AVRational audioTimeBase() const;
     bool isNetworkMode() const;
+    // 网络模式下服务器拒绝过跳转（直播等）后返回false
+    bool canSeek() const;
 private:
     // 公共
     std::mutex mtx_;
@@ -70,5 +76,12 @@ private:
     // 网络缓冲
     std::vector<AVFrame*> video_queue_;
     std::vector<AudioFrame> audio_queue_;
+    std::atomic<int> seeks_pending_;   // 已发出但还没收到完成消息的跳转请求
+    std::atomic<bool> seekable_;       // 服务器回复过不能跳转后为false，不再发跳转请求
+    // 旧服务器没有编码参数消息，openNetwork读到的第一个数据包留给解码线程
+    std::vector<uint8_t> pending_payload_;
+    PacketMeta pending_meta_;
+    bool has_pending_ = false;
     void networkDecodeLoop();
+    void clearNetworkQueues();
 }; 
\ No newline at end of file
@@ -9,6 +9,8 @@ public:
     ~VideoRenderer();
 
     void resize(int width, int height);
+    int width() const { return width_; }
+    int height() const { return height_; }
     void updateFrame(AVFrame* frame); // 更新YUV420P帧到纹理
     void render(); // 执行绘制
     bool shouldClose() const;
@@ -19,6 +19,64 @@ struct PacketHeader {
     int64_t  pts;        // [NEW] 帧的显示时间戳
 };
 const uint32_t PACKET_MAGIC = 0x12345678;
+// 客户端与服务器之间新增的消息类型（同样以PacketHeader开头）
+const uint32_t DATA_TITLE_REQUEST = 3; // 客户端→服务器：要观看的片名
+const uint32_t DATA_ERROR = 4;         // 服务器→客户端：请求失败的原因
+const uint32_t DATA_SEEK = 5;          // 客户端→服务器：跳转，pts为目标时间（微秒）
+const uint32_t DATA_PAUSE = 6;         // 客户端→服务器：暂停发送
+const uint32_t DATA_RESUME = 7;        // 客户端→服务器：恢复发送
+const uint32_t DATA_SET_RATE = 8;      // 客户端→服务器：播放速率，pts为千分比
+const uint32_t DATA_SEEK_DONE = 9;     // 服务器→客户端：跳转完成，之后是新位置的数据
+const int64_t SEEK_REJECTED = -1;      // 跳转完成消息的pts为这个值表示服务器不能跳转（直播等），流照常继续
+const uint32_t DATA_STREAM_INFO = 10;  // 服务器→客户端：各个流的编码器、参数和extradata
+const uint32_t DATA_HELLO = 11;        // 客户端→服务器：pts为支持的最高协议版本，负载是能解的视频编码（uint32_t的AVCodecID数组）
+const uint32_t DATA_HEARTBEAT = 12;    // 双向：服务器一段时间没有数据时发来，客户端回一个证明自己还在
+
+// 第2版包头：发过DATA_HELLO(2)之后服务器改用这个包头，魔数不同，按每个包的魔数解析
+struct PacketHeaderV2 {
+    uint32_t magic;       // PACKET_MAGIC_V2
+    uint8_t  version;
+    uint8_t  flags;       // PACKET_FLAG_*
+    uint16_t headerSize;  // 包头字节数，超出已知部分的跳过
+    uint16_t dataType;
+    uint16_t streamId;
+    uint32_t dataSize;
+    int64_t  pts;
+    int64_t  dts;
+    int64_t  duration;
+};
+const uint32_t PACKET_MAGIC_V2 = 0x12345679;
+const uint8_t PACKET_FLAG_KEY = 0x01;        // 关键帧
+const uint8_t PACKET_FLAG_DISPOSABLE = 0x02; // 非参考帧，可以丢弃
+
+// DATA_STREAM_INFO的负载：uint32_t流个数，之后每个流一个StreamInfoEntry紧跟extradata
+struct StreamInfoEntry {
+    uint32_t streamId;
+    uint32_t mediaType;      // 0视频 1音频
+    uint32_t codecId;        // FFmpeg的AVCodecID
+    int32_t  tbNum;
+    int32_t  tbDen;
+    uint32_t width;
+    uint32_t height;
+    int32_t  format;
+    uint32_t sampleRate;
+    uint32_t channels;
+    uint64_t channelLayout;
+    int64_t  bitRate;
+    uint32_t extradataSize;
+    uint32_t reserved;
+};
+
+// 收到的一个数据包的包头信息，v1包头没有的字段保持默认值
+struct PacketMeta {
+    int version = 1;
+    uint32_t dataType = 0;
+    uint32_t streamId = 0;
+    uint8_t flags = 0;
+    int64_t pts = 0;
+    int64_t dts = INT64_MIN;  // 未知
+    int64_t duration = 0;
+};
 
 class CTCPClient {
 public:
@@ -36,6 +94,11 @@ public:
 
     // 接收一个完整的数据包
     bool receive_packet(std::vector<uint8_t>& payload, uint32_t& data_type, int64_t& pts);
+    // 接收一个完整的数据包，v1和v2包头都可以，meta中带回标志、dts等
+    bool receive_packet(std::vector<uint8_t>& payload, PacketMeta& meta);
+
+    // 向服务器发送一个数据包（包头+负载）
+    bool send_packet(uint32_t data_type, const void* data, uint32_t size, int64_t pts = 0);
 
 private:
     PlatformSocket m_socket;
@@ -45,6 +108,7 @@ private:
     
     // 辅助函数，确保接收到指定长度的数据
     int recv_all(char* buf, int len);
+    int send_all(const char* buf, int len);
 };
 
 #endif // CTCPCLIENT_H 
\ No newline at end of file
@@ -2,11 +2,51 @@
 #include <iostream>
 #include <cstring>
 
+// 解码后排队的视频帧超过这个数（30fps约2秒）时，v2包头标记为可丢弃的视频包不再解码
+static const size_t NET_VIDEO_BACKLOG_FRAMES = 60;
+
+// 解析DATA_STREAM_INFO，把视频和音频的编码参数填进vpar/apar；没有音频时apar的codec_id置为NONE
+static bool parse_stream_info(const std::vector<uint8_t>& payload, AVCodecParameters* vpar, AVCodecParameters* apar) {
+    uint32_t count = 0;
+    if (payload.size() < sizeof(count)) return false;
+    memcpy(&count, payload.data(), sizeof(count));
+    size_t off = sizeof(count);
+    apar->codec_id = AV_CODEC_ID_NONE;
+    for (uint32_t i = 0; i < count; ++i) {
+        StreamInfoEntry e;
+        if (payload.size() - off < sizeof(e)) return false;
+        memcpy(&e, payload.data() + off, sizeof(e));
+        off += sizeof(e);
+        if (payload.size() - off < e.extradataSize) return false;
+        if (e.mediaType <= 1) {
+            AVCodecParameters* par = e.mediaType == 0 ? vpar : apar;
+            par->codec_type = e.mediaType == 0 ? AVMEDIA_TYPE_VIDEO : AVMEDIA_TYPE_AUDIO;
+            par->codec_id = (AVCodecID)e.codecId;
+            par->width = e.width;
+            par->height = e.height;
+            par->format = e.format;
+            par->sample_rate = e.sampleRate;
+            par->channels = e.channels;
+            par->channel_layout = e.channelLayout;
+            par->bit_rate = e.bitRate;
+            av_freep(&par->extradata);
+            par->extradata_size = 0;
+            if (e.extradataSize > 0) {
+                par->extradata = (uint8_t*)av_mallocz(e.extradataSize + AV_INPUT_BUFFER_PADDING_SIZE);
+                memcpy(par->extradata, payload.data() + off, e.extradataSize);
+                par->extradata_size = e.extradataSize;
+            }
+        }
+        off += e.extradataSize;
+    }
+    return true;
+}
+
 MediaDecoder::MediaDecoder()
     : fmt_(nullptr), vctx_(nullptr), actx_(nullptr), sws_(nullptr), swr_(nullptr),
       vstream_(-1), astream_(-1), w_(0), h_(0), audio_sample_rate_(0), audio_channels_(0),
       video_frame_(nullptr), net_vcodec_(nullptr), net_acodec_(nullptr),
-      net_vctx_(nullptr), net_actx_(nullptr), net_pkt_(nullptr), quit_(false), is_network_mode_(false) {}
+      net_vctx_(nullptr), net_actx_(nullptr), net_pkt_(nullptr), quit_(false), is_network_mode_(false), seeks_pending_(0), seekable_(true) {}
 
 MediaDecoder::~MediaDecoder() {
     close();
@@ -68,7 +108,7 @@ bool MediaDecoder::open(const std::string& path) {
     return true;
 }
 
-bool MediaDecoder::openNetwork(const std::string& ip, int port) {
+bool MediaDecoder::openNetwork(const std::string& ip, int port, const std::string& title) {
     std::lock_guard<std::mutex> lock(mtx_);
     close();
     is_network_mode_ = true;
@@ -77,6 +117,23 @@ bool MediaDecoder::openNetwork(const std::string& ip, int port) {
         std::cerr << "Failed to connect to server." << std::endl;
         return false;
     }
+    // 声明支持v2包头，同时列出本机FFmpeg能解的视频编码，服务器只为列表里没有的编码转码；
+    // 旧服务器不认识这条消息会忽略，继续发v1包头
+    static const AVCodecID candidates[] = {AV_CODEC_ID_H264, AV_CODEC_ID_HEVC, AV_CODEC_ID_AV1, AV_CODEC_ID_VP9,
+                                           AV_CODEC_ID_VP8, AV_CODEC_ID_MPEG4, AV_CODEC_ID_MPEG2VIDEO};
+    std::vector<uint32_t> video_codecs;
+    for (AVCodecID id : candidates) {
+        if (avcodec_find_decoder(id)) {
+            video_codecs.push_back(id);
+        }
+    }
+    if (!net_client_->send_packet(DATA_HELLO, video_codecs.data(), video_codecs.size() * sizeof(uint32_t), 2)) {
+        return false;
+    }
+    if (!title.empty() && !net_client_->send_packet(DATA_TITLE_REQUEST, title.data(), title.size())) {
+        std::cerr << "Failed to send title request." << std::endl;
+        return false;
+    }
     std::vector<uint8_t> info_payload;
     uint32_t info_type;
     int64_t dummy_pts;
@@ -84,6 +141,10 @@ bool MediaDecoder::openNetwork(const std::string& ip, int port) {
         std::cerr << "Failed to receive stream info packet from server." << std::endl;
         return false;
     }
+    if (info_type == DATA_ERROR) {
+        std::cerr << "Server refused the request: " << std::string(info_payload.begin(), info_payload.end()) << std::endl;
+        return false;
+    }
     size_t expected_size = sizeof(uint32_t) * 5 + sizeof(int32_t) * 2;
     if (info_type != 2 || info_payload.size() != expected_size) {
         std::cerr << "Received invalid stream info packet. Type: " << info_type << ", Size: " << info_payload.size() << std::endl;
@@ -98,24 +159,66 @@ bool MediaDecoder::openNetwork(const std::string& ip, int port) {
     memcpy(&audio_format, p, sizeof(uint32_t)); p += sizeof(uint32_t);
     memcpy(&time_base_.num, p, sizeof(int32_t)); p += sizeof(int32_t);
     memcpy(&time_base_.den, p, sizeof(int32_t));
-    net_vcodec_ = avcodec_find_decoder(AV_CODEC_ID_H264);
-    if (!net_vcodec_) return false;
-    net_vctx_ = avcodec_alloc_context3(net_vcodec_);
-    if (avcodec_open2(net_vctx_, net_vcodec_, nullptr) < 0) return false;
-    net_acodec_ = avcodec_find_decoder(AV_CODEC_ID_AAC);
+
+    // 新服务器紧跟着发编码参数消息（编码器和extradata）；旧服务器没有，按H.264/AAC处理，
+    // 这时读到的已经是第一个数据包，留给解码线程
+    AVCodecParameters* vpar = avcodec_parameters_alloc();
+    AVCodecParameters* apar = avcodec_parameters_alloc();
+    vpar->codec_id = AV_CODEC_ID_H264;
+    vpar->width = w_;
+    vpar->height = h_;
+    apar->codec_id = AV_CODEC_ID_AAC;
+    apar->sample_rate = audio_sample_rate_;
+    apar->channels = audio_channels_;
+    apar->format = audio_format;
+    std::vector<uint8_t> next_payload;
+    PacketMeta next_meta;
+    if (!net_client_->receive_packet(next_payload, next_meta)) {
+        avcodec_parameters_free(&vpar);
+        avcodec_parameters_free(&apar);
+        return false;
+    }
+    if (next_meta.dataType == DATA_STREAM_INFO) {
+        if (!parse_stream_info(next_payload, vpar, apar)) {
+            std::cerr << "Received invalid codec parameters from server." << std::endl;
+        }
+    } else {
+        pending_payload_.swap(next_payload);
+        pending_meta_ = next_meta;
+        has_pending_ = true;
+    }
+    net_vcodec_ = avcodec_find_decoder(vpar->codec_id);
+    if (net_vcodec_) {
+        net_vctx_ = avcodec_alloc_context3(net_vcodec_);
+        avcodec_parameters_to_context(net_vctx_, vpar);
+        if (avcodec_open2(net_vctx_, net_vcodec_, nullptr) < 0) {
+            avcodec_free_context(&net_vctx_);
+        }
+    }
+    if (!net_vctx_) {
+        std::cerr << "Cannot open video decoder " << avcodec_get_name(vpar->codec_id) << std::endl;
+        avcodec_parameters_free(&vpar);
+        avcodec_parameters_free(&apar);
+        return false;
+    }
+    net_acodec_ = apar->codec_id != AV_CODEC_ID_NONE ? avcodec_find_decoder(apar->codec_id) : nullptr;
     if (net_acodec_) {
         net_actx_ = avcodec_alloc_context3(net_acodec_);
-        net_actx_->sample_rate = audio_sample_rate_;
-        net_actx_->channels = audio_channels_;
-        net_actx_->sample_fmt = (AVSampleFormat)audio_format;
-        net_actx_->channel_layout = av_get_default_channel_layout(audio_channels_);
+        avcodec_parameters_to_context(net_actx_, apar);
+        if (!net_actx_->channel_layout) {
+            net_actx_->channel_layout = av_get_default_channel_layout(net_actx_->channels);
+        }
         if (avcodec_open2(net_actx_, net_acodec_, nullptr) < 0) {
             avcodec_free_context(&net_actx_);
             net_actx_ = nullptr;
         }
     }
+    std::cout << "Network stream: video " << avcodec_get_name(vpar->codec_id) << ", audio "
+              << (net_actx_ ? avcodec_get_name(apar->codec_id) : "none") << std::endl;
+    avcodec_parameters_free(&vpar);
+    avcodec_parameters_free(&apar);
     net_pkt_ = av_packet_alloc();
-    sws_ = sws_getContext(w_, h_, AV_PIX_FMT_YUV420P, w_, h_, AV_PIX_FMT_YUV420P, SWS_BILINEAR, 0, 0, 0);
+    // 转换上下文在解码出第一帧、知道实际像素格式后再建（HEVC 10bit等不是YUV420P）
     if (net_actx_) {
         swr_ = swr_alloc_set_opts(nullptr,
             AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_FLT, audio_sample_rate_,
@@ -137,24 +240,113 @@ void MediaDecoder::networkDecodeLoop() {
     int yuv_bufsize = av_image_get_buffer_size(AV_PIX_FMT_YUV420P, w_, h_, 1);
     std::vector<uint8_t> yuvbuf(yuv_bufsize);
     av_image_fill_arrays(yuv->data, yuv->linesize, yuvbuf.data(), AV_PIX_FMT_YUV420P, w_, h_, 1);
+    bool wait_keyframe = true; // 开始和跳转之后，v2包头带关键帧标志，之前的视频包解不出来，直接跳过
     while (!quit_ && net_client_ && net_client_->is_connected()) {
         std::vector<uint8_t> packet_payload;
-        uint32_t data_type;
-        int64_t received_pts;
-        if (net_client_->receive_packet(packet_payload, data_type, received_pts)) {
+        PacketMeta meta;
+        bool received;
+        if (has_pending_) {
+            packet_payload.swap(pending_payload_);
+            meta = pending_meta_;
+            has_pending_ = false;
+            received = true;
+        } else {
+            received = net_client_->receive_packet(packet_payload, meta);
+        }
+        uint32_t data_type = meta.dataType;
+        int64_t received_pts = meta.pts;
+        if (received) {
+            if (data_type == DATA_HEARTBEAT) {
+                // 暂停期间服务器不发数据，不回应的话会被当成空闲连接断开
+                std::lock_guard<std::mutex> lk(mtx_);
+                net_client_->send_packet(DATA_HEARTBEAT, nullptr, 0);
+                continue;
+            }
+            if (data_type == DATA_STREAM_INFO) {
+                // 服务器换了码率版本，新参数从下一个关键帧开始生效：分辨率变了就换输出缓冲，
+                // 缩放上下文在下一帧按新的目标尺寸重建；同一编码器的参数集在码流里，解码器不用重开
+                AVCodecParameters* vpar = avcodec_parameters_alloc();
+                AVCodecParameters* apar = avcodec_parameters_alloc();
+                if (parse_stream_info(packet_payload, vpar, apar) && vpar->width > 0 && vpar->height > 0) {
+                    if (vpar->codec_id != net_vctx_->codec_id) {
+                        const AVCodec* codec = avcodec_find_decoder(vpar->codec_id);
+                        AVCodecContext* ctx = codec ? avcodec_alloc_context3(codec) : nullptr;
+                        if (ctx && avcodec_parameters_to_context(ctx, vpar) >= 0 && avcodec_open2(ctx, codec, nullptr) >= 0) {
+                            // 新解码器在锁外打开，只有替换在锁内，其他线程不会看到释放了一半的上下文
+                            std::lock_guard<std::mutex> lk(mtx_);
+                            std::swap(net_vctx_, ctx);
+                            avcodec_free_context(&ctx);
+                            wait_keyframe = true;
+                        } else {
+                            avcodec_free_context(&ctx);
+                            std::cerr << "Cannot open video decoder " << avcodec_get_name(vpar->codec_id) << std::endl;
+                        }
+                    }
+                    if (vpar->width != w_ || vpar->height != h_) {
+                        std::lock_guard<std::mutex> lk(mtx_);
+                        w_ = vpar->width;
+                        h_ = vpar->height;
+                        yuvbuf.resize(av_image_get_buffer_size(AV_PIX_FMT_YUV420P, w_, h_, 1));
+                        av_image_fill_arrays(yuv->data, yuv->linesize, yuvbuf.data(), AV_PIX_FMT_YUV420P, w_, h_, 1);
+                        std::cout << "Stream switched to " << w_ << "x" << h_ << std::endl;
+                    }
+                }
+                avcodec_parameters_free(&vpar);
+                avcodec_parameters_free(&apar);
+                continue;
+            }
+            if (data_type == DATA_SEEK_DONE && received_pts == SEEK_REJECTED) {
+                // 服务器不能跳转（直播等），之后不再发跳转请求；等待期间丢掉了一些包，从下一个关键帧接着解
+                if (seekable_.exchange(false)) {
+                    std::cout << "This stream cannot seek." << std::endl;
+                }
+                if (seeks_pending_ > 0 && --seeks_pending_ == 0) {
+                    wait_keyframe = true;
+                }
+                continue;
+            }
+            if (data_type == DATA_SEEK_DONE) {
+                // 最后一个跳转完成：清空解码器和缓存帧，后面的数据来自新位置
+                if (seeks_pending_ > 0 && --seeks_pending_ == 0) {
+                    avcodec_flush_buffers(net_vctx_);
+                    if (net_actx_) avcodec_flush_buffers(net_actx_);
+                    clearNetworkQueues();
+                    wait_keyframe = true;
+                }
+                continue;
+            }
+            if (seeks_pending_ > 0) {
+                continue; // 跳转请求发出前服务器已发出的旧数据
+            }
+            if (data_type == 0 && meta.version >= 2) {
+                if (wait_keyframe && !(meta.flags & PACKET_FLAG_KEY)) {
+                    continue;
+                }
+                wait_keyframe = false;
+                if (meta.flags & PACKET_FLAG_DISPOSABLE) {
+                    std::lock_guard<std::mutex> lk(mtx_);
+                    if (video_queue_.size() > NET_VIDEO_BACKLOG_FRAMES) continue; // 渲染跟不上，丢掉不影响后续解码的帧
+                }
+            }
             if (data_type == 0) { // Video packet
                 net_pkt_->data = packet_payload.data();
                 net_pkt_->size = packet_payload.size();
+                net_pkt_->pts = meta.pts;
+                net_pkt_->dts = meta.version >= 2 ? meta.dts : AV_NOPTS_VALUE;
+                net_pkt_->flags = (meta.flags & PACKET_FLAG_KEY) ? AV_PKT_FLAG_KEY : 0;
                 int ret = avcodec_send_packet(net_vctx_, net_pkt_);
                 if (ret < 0) continue;
                 while (ret >= 0) {
                     ret = avcodec_receive_frame(net_vctx_, frame);
                     if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) break;
                     if (ret < 0) break;
-                    sws_scale(sws_, frame->data, frame->linesize, 0, h_, yuv->data, yuv->linesize);
+                    sws_ = sws_getCachedContext(sws_, frame->width, frame->height, (AVPixelFormat)frame->format,
+                                                w_, h_, AV_PIX_FMT_YUV420P, SWS_BILINEAR, nullptr, nullptr, nullptr);
+                    if (!sws_) continue;
+                    sws_scale(sws_, frame->data, frame->linesize, 0, frame->height, yuv->data, yuv->linesize);
                     AVFrame* yuv_copy = av_frame_alloc();
                     av_frame_copy_props(yuv_copy, yuv);
-                    yuv_copy->pts = received_pts;
+                    yuv_copy->pts = frame->pts != AV_NOPTS_VALUE ? frame->pts : received_pts;
                     yuv_copy->width = w_; yuv_copy->height = h_; yuv_copy->format = AV_PIX_FMT_YUV420P;
                     for (int i = 0; i < 3; ++i) {
                         int plane_h = (i == 0) ? h_ : h_/2;
@@ -168,6 +360,9 @@ void MediaDecoder::networkDecodeLoop() {
             } else if (data_type == 1 && net_actx_) { // Audio packet
                 net_pkt_->data = packet_payload.data();
                 net_pkt_->size = packet_payload.size();
+                net_pkt_->pts = meta.pts;
+                net_pkt_->dts = meta.version >= 2 ? meta.dts : AV_NOPTS_VALUE;
+                net_pkt_->flags = 0;
                 int ret = avcodec_send_packet(net_actx_, net_pkt_);
                 if (ret < 0) continue;
                 while (ret >= 0) {
@@ -301,6 +496,16 @@ AudioFrame MediaDecoder::getAudioFrame() {
 
 void MediaDecoder::seek(double seconds) {
     std::lock_guard<std::mutex> lock(mtx_);
+    if (is_network_mode_ && !seekable_) {
+        return;
+    }
+    if (is_network_mode_ && net_client_) {
+        seeks_pending_++;
+        if (!net_client_->send_packet(DATA_SEEK, nullptr, 0, (int64_t)(seconds * 1000000))) {
+            seeks_pending_--;
+        }
+        return;
+    }
     if (!is_network_mode_ && fmt_ && vstream_ != -1) {
         int64_t target_ts = seconds / av_q2d(fmt_->streams[vstream_]->time_base);
         av_seek_frame(fmt_, vstream_, target_ts, AVSEEK_FLAG_BACKWARD);
@@ -309,6 +514,29 @@ void MediaDecoder::seek(double seconds) {
     }
 }
 
+void MediaDecoder::setPaused(bool paused) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (is_network_mode_ && net_client_) {
+        net_client_->send_packet(paused ? DATA_PAUSE : DATA_RESUME, nullptr, 0);
+    }
+}
+
+void MediaDecoder::setRate(double rate) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (is_network_mode_ && net_client_) {
+        net_client_->send_packet(DATA_SET_RATE, nullptr, 0, (int64_t)(rate * 1000));
+    }
+}
+
+void MediaDecoder::clearNetworkQueues() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    for (AVFrame* f : video_queue_) {
+        av_frame_free(&f);
+    }
+    video_queue_.clear();
+    audio_queue_.clear();
+}
+
 void MediaDecoder::flush() {
     std::lock_guard<std::mutex> lock(mtx_);
     if (!is_network_mode_) {
@@ -324,6 +552,7 @@ void MediaDecoder::close() {
     if (vctx_) avcodec_free_context(&vctx_);
     if (actx_) avcodec_free_context(&actx_);
     if (sws_) sws_freeContext(sws_);
+    sws_ = nullptr;
     if (swr_) swr_free(&swr_);
     if (net_vctx_) avcodec_free_context(&net_vctx_);
     if (net_actx_) avcodec_free_context(&net_actx_);
@@ -331,6 +560,8 @@ void MediaDecoder::close() {
     if (video_frame_) av_frame_free(&video_frame_);
     video_queue_.clear();
     audio_queue_.clear();
+    pending_payload_.clear();
+    has_pending_ = false;
 }
 
 int MediaDecoder::width() const { return w_; }
@@ -339,4 +570,5 @@ int MediaDecoder::sampleRate() const { return audio_sample_rate_; }
 int MediaDecoder::channels() const { return audio_channels_; }
 AVRational MediaDecoder::videoTimeBase() const { return time_base_; }
 AVRational MediaDecoder::audioTimeBase() const { return audio_time_base_; }
-bool MediaDecoder::isNetworkMode() const { return is_network_mode_; } 
\ No newline at end of file
+bool MediaDecoder::isNetworkMode() const { return is_network_mode_; } 
+bool MediaDecoder::canSeek() const { return !is_network_mode_ || seekable_; }
\ No newline at end of file
@@ -28,24 +28,27 @@ extern "C" {
 int main(int argc, char* argv[]) {
     if (argc < 2) {
         std::cerr << "Usage: " << argv[0] << " <video_file>\n"
-                  << "   or: " << argv[0] << " --network <server_ip> <port>" << std::endl;
+                  << "   or: " << argv[0] << " --network <server_ip> <port> [title]" << std::endl;
         return 1;
     }
     bool is_network_mode = (argc >= 2 && std::string(argv[1]) == "--network");
-    std::string filename, server_ip;
+    std::string filename, server_ip, title;
     int server_port = 0;
     if (is_network_mode) {
         if (argc < 4) {
-            std::cerr << "Usage: " << argv[0] << " --network <server_ip> <port>" << std::endl;
+            std::cerr << "Usage: " << argv[0] << " --network <server_ip> <port> [title]" << std::endl;
             return 1;
         }
         server_ip = argv[2];
         server_port = std::stoi(argv[3]);
+        if (argc >= 5) {
+            title = argv[4]; // 服务器以片库目录启动时必须指定
+        }
     } else {
         filename = argv[1];
     }
     MediaDecoder decoder;
-    bool ok = is_network_mode ? decoder.openNetwork(server_ip, server_port) : decoder.open(filename);
+    bool ok = is_network_mode ? decoder.openNetwork(server_ip, server_port, title) : decoder.open(filename);
     if (!ok) {
         std::cerr << "Failed to open media source." << std::endl;
         return 1;
@@ -59,8 +62,10 @@ int main(int argc, char* argv[]) {
     std::atomic<bool> quit(false);
     std::atomic<bool> paused(false);
     static bool last_space = false, last_q = false, last_right = false, last_left = false;
+    static bool last_up = false, last_down = false;
     int seek_forward_sec = 5, seek_backward_sec = 5;
     double cur_pos_sec = 0.0;
+    double rate = 1.0;
     while (!renderer.shouldClose()) {
         if (quit) break;
         bool cur_q = glfwGetKey(renderer.getWindow(), GLFW_KEY_Q) == GLFW_PRESS;
@@ -72,27 +77,40 @@ int main(int argc, char* argv[]) {
         bool cur_space = glfwGetKey(renderer.getWindow(), GLFW_KEY_SPACE) == GLFW_PRESS;
         if (cur_space && !last_space) {
             paused = !paused;
+            decoder.setPaused(paused);
             std::cout << (paused ? "Paused" : "Playing") << std::endl;
         }
         last_space = cur_space;
-        if (!decoder.isNetworkMode()) {
-            bool cur_right = glfwGetKey(renderer.getWindow(), GLFW_KEY_RIGHT) == GLFW_PRESS;
-            if (cur_right && !last_right) {
-                cur_pos_sec += seek_forward_sec;
-                decoder.seek(cur_pos_sec);
-                decoder.flush();
-                std::cout << "Seek forward " << seek_forward_sec << "s, now at " << cur_pos_sec << "s" << std::endl;
-            }
-            last_right = cur_right;
-            bool cur_left = glfwGetKey(renderer.getWindow(), GLFW_KEY_LEFT) == GLFW_PRESS;
-            if (cur_left && !last_left) {
-                cur_pos_sec -= seek_backward_sec;
-                if (cur_pos_sec < 0) cur_pos_sec = 0;
-                decoder.seek(cur_pos_sec);
-                decoder.flush();
-                std::cout << "Seek backward " << seek_backward_sec << "s, now at " << cur_pos_sec << "s" << std::endl;
+        bool cur_right = glfwGetKey(renderer.getWindow(), GLFW_KEY_RIGHT) == GLFW_PRESS;
+        if (cur_right && !last_right && decoder.canSeek()) {
+            cur_pos_sec += seek_forward_sec;
+            decoder.seek(cur_pos_sec);
+            decoder.flush();
+            std::cout << "Seek forward " << seek_forward_sec << "s, now at " << cur_pos_sec << "s" << std::endl;
+        }
+        last_right = cur_right;
+        bool cur_left = glfwGetKey(renderer.getWindow(), GLFW_KEY_LEFT) == GLFW_PRESS;
+        if (cur_left && !last_left && decoder.canSeek()) {
+            cur_pos_sec -= seek_backward_sec;
+            if (cur_pos_sec < 0) cur_pos_sec = 0;
+            decoder.seek(cur_pos_sec);
+            decoder.flush();
+            std::cout << "Seek backward " << seek_backward_sec << "s, now at " << cur_pos_sec << "s" << std::endl;
+        }
+        last_left = cur_left;
+        if (decoder.isNetworkMode()) {
+            bool cur_up = glfwGetKey(renderer.getWindow(), GLFW_KEY_UP) == GLFW_PRESS;
+            bool cur_down = glfwGetKey(renderer.getWindow(), GLFW_KEY_DOWN) == GLFW_PRESS;
+            double new_rate = rate;
+            if (cur_up && !last_up && rate < 4.0) new_rate = rate * 2;
+            if (cur_down && !last_down && rate > 0.25) new_rate = rate / 2;
+            if (new_rate != rate) {
+                rate = new_rate;
+                decoder.setRate(rate);
+                std::cout << "Rate " << rate << "x" << std::endl;
             }
-            last_left = cur_left;
+            last_up = cur_up;
+            last_down = cur_down;
         }
         if (paused) {
             renderer.pollEvents();
@@ -102,6 +120,10 @@ int main(int argc, char* argv[]) {
         if (decoder.readFrame()) {
             AVFrame* frame = decoder.getVideoFrame();
             if (frame) {
+                // 服务器切换到另一分辨率的码率版本后，窗口跟着新的帧尺寸调整
+                if (frame->width != renderer.width() || frame->height != renderer.height()) {
+                    renderer.resize(frame->width, frame->height);
+                }
                 renderer.updateFrame(frame);
                 renderer.render();
                 av_frame_free(&frame);
@@ -84,31 +84,111 @@ int CTCPClient::recv_all(char* buf, int len) {
 }
 
 bool CTCPClient::receive_packet(std::vector<uint8_t>& payload, uint32_t& data_type, int64_t& pts) {
+    PacketMeta meta;
+    if (!receive_packet(payload, meta)) {
+        return false;
+    }
+    data_type = meta.dataType;
+    pts = meta.pts;
+    return true;
+}
+
+bool CTCPClient::receive_packet(std::vector<uint8_t>& payload, PacketMeta& meta) {
     if (!m_connected) return false;
 
-    PacketHeader header;
-    if (recv_all((char*)&header, sizeof(header)) <= 0) {
+    // 先读魔数，再按版本读包头的其余部分
+    uint32_t magic;
+    if (recv_all((char*)&magic, sizeof(magic)) <= 0) {
         std::cerr << "Server disconnected or error while receiving header." << std::endl;
         close();
         return false;
     }
-
-    if (header.magic != PACKET_MAGIC) {
+    uint32_t data_size;
+    meta = PacketMeta();
+    if (magic == PACKET_MAGIC) {
+        PacketHeader header;
+        header.magic = magic;
+        if (recv_all((char*)&header + sizeof(magic), sizeof(header) - sizeof(magic)) <= 0) {
+            std::cerr << "Server disconnected or error while receiving header." << std::endl;
+            close();
+            return false;
+        }
+        meta.dataType = header.dataType;
+        meta.streamId = header.dataType <= 1 ? header.dataType : 0;
+        meta.pts = header.pts;
+        data_size = header.dataSize;
+    } else if (magic == PACKET_MAGIC_V2) {
+        PacketHeaderV2 header;
+        header.magic = magic;
+        if (recv_all((char*)&header + sizeof(magic), sizeof(header) - sizeof(magic)) <= 0 ||
+            header.headerSize < sizeof(header)) {
+            std::cerr << "Server disconnected or bad v2 packet header." << std::endl;
+            close();
+            return false;
+        }
+        char skip[256];
+        for (int left = header.headerSize - sizeof(header); left > 0;) {
+            int n = recv_all(skip, left < (int)sizeof(skip) ? left : (int)sizeof(skip));
+            if (n <= 0) {
+                close();
+                return false;
+            }
+            left -= n;
+        }
+        meta.version = header.version;
+        meta.dataType = header.dataType;
+        meta.streamId = header.streamId;
+        meta.flags = header.flags;
+        meta.pts = header.pts;
+        meta.dts = header.dts;
+        meta.duration = header.duration;
+        data_size = header.dataSize;
+    } else {
         std::cerr << "Invalid packet magic!" << std::endl;
         close();
         return false;
     }
 
-    payload.resize(header.dataSize);
-    if (header.dataSize > 0) {
-        if (recv_all((char*)payload.data(), header.dataSize) <= 0) {
+    payload.resize(data_size);
+    if (data_size > 0) {
+        if (recv_all((char*)payload.data(), data_size) <= 0) {
             std::cerr << "Failed to receive packet payload." << std::endl;
             close();
             return false;
         }
     }
-    
-    data_type = header.dataType;
-    pts = header.pts;
     return true;
-} 
\ No newline at end of file
+}
+
+int CTCPClient::send_all(const char* buf, int len) {
+    int total = 0;
+    while (total < len) {
+        int ret = send(m_socket, buf + total, len - total, MSG_NOSIGNAL);
+        if (ret <= 0) {
+            return ret;
+        }
+        total += ret;
+    }
+    return total;
+}
+
+bool CTCPClient::send_packet(uint32_t data_type, const void* data, uint32_t size, int64_t pts) {
+    if (!m_connected) return false;
+
+    PacketHeader header;
+    header.magic = PACKET_MAGIC;
+    header.dataType = data_type;
+    header.dataSize = size;
+    header.pts = pts;
+    std::vector<char> buf(sizeof(header) + size);
+    memcpy(buf.data(), &header, sizeof(header));
+    if (size > 0) {
+        memcpy(buf.data() + sizeof(header), data, size);
+    }
+    if (send_all(buf.data(), (int)buf.size()) <= 0) {
+        std::cerr << "Failed to send packet to server." << std::endl;
+        close();
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,59 @@
+#!/bin/sh
+# 在同一负载下比较epoll和io_uring两个I/O后端：依次用--io epoll和--io uring启动服务器，
+# 用stream_bench压同样的连接数和时长，记录总吞吐和服务器进程消耗的CPU时间，按每CPU秒的吞吐给出结论。
+#
+# 用法: ./compare_io_backends.sh <video_file|catalog_dir> [stream_bench参数...]
+# 例如: ./compare_io_backends.sh sample.mp4 -c 2000 -t 4 -d 30
+# 环境变量: PORT（默认18080）、SERVER_ARGS（两个后端共用的服务器参数，默认"--workers 4 --mode vod"）
+# 服务器需以-DHAVE_LIBURING编译（见README）。
+set -e
+
+if [ $# -lt 1 ]; then
+    sed -n '2,8p' "$0"
+    exit 1
+fi
+SOURCE=$1
+shift
+PORT=${PORT:-18080}
+SERVER_ARGS=${SERVER_ARGS:---workers 4 --mode vod}
+HZ=$(getconf CLK_TCK)
+
+# 进程累计的用户+内核CPU时间（时钟滴答）
+cpu_ticks() {
+    awk '{print $14 + $15}' "/proc/$1/stat"
+}
+
+run_backend() {
+    backend=$1
+    # shellcheck disable=SC2086
+    ./test_server_epoll --io "$backend" $SERVER_ARGS --log-level warn "$PORT" "$SOURCE" &
+    pid=$!
+    sleep 2
+    if ! kill -0 "$pid" 2>/dev/null; then
+        echo "server failed to start with --io $backend" >&2
+        exit 1
+    fi
+    before=$(cpu_ticks "$pid")
+    mbps=$(./stream_bench "$@" 127.0.0.1 "$PORT" | awk '/aggregate throughput/ {print $3}')
+    after=$(cpu_ticks "$pid")
+    kill "$pid"
+    wait "$pid" 2>/dev/null || true
+    cpu_s=$(awk -v t=$((after - before)) -v hz="$HZ" 'BEGIN {printf "%.2f", t / hz}')
+    echo "$backend $mbps $cpu_s"
+}
+
+epoll=$(run_backend epoll "$@")
+uring=$(run_backend uring "$@")
+
+echo "$epoll
+$uring" | awk '
+    { mbps[$1] = $2; cpu[$1] = $3; eff[$1] = $3 > 0 ? $2 / $3 : 0 }
+    END {
+        printf "%-8s %12s %12s %16s\n", "backend", "Mbit/s", "server CPU s", "Mbit/s per CPU s"
+        for (b in mbps) printf "%-8s %12.1f %12.2f %16.1f\n", b, mbps[b], cpu[b], eff[b]
+        # io_uring只有在吞吐不低于epoll、每CPU秒的吞吐高出10%以上时才值得换成默认
+        if (mbps["uring"] >= mbps["epoll"] && eff["uring"] >= eff["epoll"] * 1.1)
+            print "result: uring wins on this workload"
+        else
+            print "result: keep epoll as the default"
+    }'
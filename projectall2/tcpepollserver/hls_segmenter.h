@@ -0,0 +1,361 @@
+// HLS切片：把片源原样（不解码不转码）重新封装成MPEG-TS或fMP4分片，外加m3u8播放列表，写进一个目录
+//
+// 只用一个输出封装器从头写到尾，输出经自定义AVIO写到当前分片的文件：到了目标时长后在下一个视频关键帧前
+// 冲刷封装器、关闭文件，再把后面的字节写进新分片。分片先写成<名字>.tmp，写完才改名，读的一方（HTTP）
+// 只会看到完整的分片。fMP4的文件头（moov）单独写进init.mp4。只在一个线程里使用。
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "mapped_source.h"
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/opt.h>
+}
+
+enum HlsFormat {
+    HLS_TS,    // MPEG-TS分片，所有播放器都支持
+    HLS_FMP4   // 分片MP4（CMAF），HEVC在Apple设备上只能这样播
+};
+
+struct HlsSegment {
+    std::string name;       // 相对播放列表的文件名
+    double duration = 0;    // 秒
+};
+
+const char* const HLS_PLAYLIST = "index.m3u8";
+const char* const HLS_INIT_SEGMENT = "init.mp4";
+const size_t HLS_AVIO_BUFFER = 64 * 1024;
+
+// 生成播放列表：done为false时是还在增长的EVENT列表，播放器会按目标时长重新拉取；切完后是带ENDLIST的VOD列表
+inline std::string hls_playlist(const std::vector<HlsSegment>& segments, HlsFormat format, int target_s, bool done) {
+    int target = target_s;
+    for (const HlsSegment& s : segments) {
+        target = std::max(target, (int)(s.duration + 0.999)); // TARGETDURATION不能小于任何分片取整后的时长
+    }
+    std::string out = "#EXTM3U\n";
+    out += format == HLS_FMP4 ? "#EXT-X-VERSION:7\n" : "#EXT-X-VERSION:3\n";
+    out += "#EXT-X-TARGETDURATION:" + std::to_string(target) + "\n";
+    out += "#EXT-X-MEDIA-SEQUENCE:0\n";
+    out += done ? "#EXT-X-PLAYLIST-TYPE:VOD\n" : "#EXT-X-PLAYLIST-TYPE:EVENT\n";
+    out += "#EXT-X-INDEPENDENT-SEGMENTS\n";
+    if (format == HLS_FMP4) {
+        out += std::string("#EXT-X-MAP:URI=\"") + HLS_INIT_SEGMENT + "\"\n";
+    }
+    char line[64];
+    for (const HlsSegment& s : segments) {
+        snprintf(line, sizeof(line), "#EXTINF:%.3f,\n", s.duration);
+        out += line;
+        out += s.name + "\n";
+    }
+    if (done) {
+        out += "#EXT-X-ENDLIST\n";
+    }
+    return out;
+}
+
+// 读回以前切好的播放列表：必须是完整的（有ENDLIST）、格式相同、列出的分片都还在，否则返回false重新切
+inline bool hls_load_playlist(const std::string& dir, HlsFormat format, std::vector<HlsSegment>* segments) {
+    FILE* f = fopen((dir + "/" + HLS_PLAYLIST).c_str(), "r");
+    if (!f) {
+        return false;
+    }
+    const char* ext = format == HLS_FMP4 ? ".m4s" : ".ts";
+    bool ended = false;
+    bool has_map = false;
+    double duration = -1;
+    char line[512];
+    segments->clear();
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (strncmp(line, "#EXTINF:", 8) == 0) {
+            duration = atof(line + 8);
+        } else if (strcmp(line, "#EXT-X-ENDLIST") == 0) {
+            ended = true;
+        } else if (strncmp(line, "#EXT-X-MAP:", 11) == 0) {
+            has_map = true;
+        } else if (line[0] != '#' && line[0] != '\0') {
+            size_t len = strlen(line);
+            struct stat st;
+            if (duration < 0 || len <= strlen(ext) || strcmp(line + len - strlen(ext), ext) != 0 ||
+                stat((dir + "/" + line).c_str(), &st) != 0) {
+                break;
+            }
+            segments->push_back({line, duration});
+            duration = -1;
+        }
+    }
+    fclose(f);
+    struct stat st;
+    if (format == HLS_FMP4 && (!has_map || stat((dir + "/" + HLS_INIT_SEGMENT).c_str(), &st) != 0)) {
+        return false;
+    }
+    return ended && !segments->empty();
+}
+
+class HlsSegmenter {
+public:
+    HlsSegmenter() = default;
+    HlsSegmenter(const HlsSegmenter&) = delete;
+    HlsSegmenter& operator=(const HlsSegmenter&) = delete;
+    ~HlsSegmenter() {
+        if (fd_ >= 0) {
+            close(fd_);
+            unlink(tmp_path_.c_str());
+        }
+        av_packet_free(&pkt_);
+        if (out_) {
+            if (out_->pb) {
+                av_freep(&out_->pb->buffer);
+                avio_context_free(&out_->pb);
+            }
+            avformat_free_context(out_);
+        }
+        if (in_) mapped_close_input(&in_);
+    }
+
+    // 打开片源和输出封装器，写好文件头（fMP4写进init.mp4）；失败时返回false，原因见error()
+    bool open(const std::string& path, const std::string& dir, HlsFormat format, int target_s) {
+        dir_ = dir;
+        format_ = format;
+        target_s_ = target_s;
+        unlink((dir_ + "/" + HLS_PLAYLIST).c_str()); // 旧的完整列表作废，切到一半崩溃也不会留下对不上的列表
+        if (mapped_open_input(&in_, path.c_str()) != 0) {
+            return fail("cannot open source");
+        }
+        if (avformat_find_stream_info(in_, nullptr) < 0) {
+            return fail("cannot find stream information");
+        }
+        int video = av_find_best_stream(in_, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+        int audio = av_find_best_stream(in_, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+        if (video < 0 && audio < 0) {
+            return fail("no audio or video stream");
+        }
+        // 没有视频时按音频切，音频包都能作为分片开头
+        cut_stream_ = video >= 0 ? video : audio;
+
+        if (avformat_alloc_output_context2(&out_, nullptr, format == HLS_FMP4 ? "mp4" : "mpegts", nullptr) < 0) {
+            return fail("no muxer for the segment format");
+        }
+        stream_map_.assign(in_->nb_streams, -1);
+        for (int index : {video, audio}) {
+            if (index < 0) continue;
+            AVStream* os = avformat_new_stream(out_, nullptr);
+            if (!os || avcodec_parameters_copy(os->codecpar, in_->streams[index]->codecpar) < 0) {
+                return fail("out of memory");
+            }
+            os->codecpar->codec_tag = 0;
+            os->time_base = in_->streams[index]->time_base;
+            stream_map_[index] = os->index;
+        }
+        uint8_t* buffer = (uint8_t*)av_malloc(HLS_AVIO_BUFFER);
+        out_->pb = buffer ? avio_alloc_context(buffer, HLS_AVIO_BUFFER, 1, this, nullptr, write_packet, nullptr) : nullptr;
+        if (!out_->pb) {
+            av_free(buffer);
+            return fail("out of memory");
+        }
+        out_->pb->seekable = 0;
+
+        // fMP4：文件头只有空的moov，每次冲刷写出一个moof+mdat，分片之间不共享字节偏移；不写尾部的索引
+        AVDictionary* opts = nullptr;
+        if (format == HLS_FMP4) {
+            av_dict_set(&opts, "movflags", "frag_custom+empty_moov+default_base_moof+skip_trailer", 0);
+            if (!open_file(HLS_INIT_SEGMENT)) {
+                av_dict_free(&opts);
+                return false;
+            }
+        } else if (!open_file(segment_name(0))) {
+            return false;
+        }
+        int ret = avformat_write_header(out_, &opts);
+        av_dict_free(&opts);
+        if (ret < 0) {
+            return fail("cannot write the container header");
+        }
+        if (format == HLS_FMP4) {
+            avio_flush(out_->pb);
+            if (!finish_file(HLS_INIT_SEGMENT) || !open_file(segment_name(0))) {
+                return false;
+            }
+        }
+        pkt_ = av_packet_alloc();
+        if (!pkt_) {
+            return fail("out of memory");
+        }
+        return true;
+    }
+
+    // 切完整个片源，每个分片改名到位后回调一次；最后写出完整的播放列表。出错时返回false
+    bool run(const std::function<void(const HlsSegment&)>& on_segment) {
+        double start = -1;   // 当前分片第一个包的时间（秒）
+        double end = 0;      // 已写出的包的最晚结束时间
+        while (av_read_frame(in_, pkt_) >= 0) {
+            int index = pkt_->stream_index;
+            if (index >= (int)stream_map_.size() || stream_map_[index] < 0 || pkt_->pts == AV_NOPTS_VALUE) {
+                av_packet_unref(pkt_);
+                continue;
+            }
+            AVRational tb = in_->streams[index]->time_base;
+            double t = pkt_->pts * av_q2d(tb);
+            if (start < 0) {
+                start = t;
+            }
+            // 到了目标时长，在切分流的关键帧前换下一个分片
+            if (index == cut_stream_ && (pkt_->flags & AV_PKT_FLAG_KEY) && t - start >= target_s_) {
+                if (!cut(t - start, false, on_segment)) {
+                    av_packet_unref(pkt_);
+                    return false;
+                }
+                start = t;
+            }
+            end = std::max(end, t + pkt_->duration * av_q2d(tb));
+            pkt_->stream_index = stream_map_[index];
+            av_packet_rescale_ts(pkt_, tb, out_->streams[pkt_->stream_index]->time_base);
+            pkt_->pos = -1;
+            int ret = av_write_frame(out_, pkt_);
+            av_packet_unref(pkt_);
+            if (ret < 0) {
+                return fail("muxing failed");
+            }
+        }
+        if (av_write_trailer(out_) < 0) {
+            return fail("cannot finish the last segment");
+        }
+        avio_flush(out_->pb);
+        if (start >= 0 && !cut(std::max(end - start, 0.001), true, on_segment)) {
+            return false;
+        }
+        if (segments_.empty()) {
+            return fail("source has no packets");
+        }
+        return write_playlist();
+    }
+
+    HlsFormat format() const { return format_; }
+    const std::vector<HlsSegment>& segments() const { return segments_; }
+    const std::string& error() const { return error_; }
+
+private:
+    bool fail(const char* what) {
+        error_ = what;
+        return false;
+    }
+
+    std::string segment_name(size_t n) const {
+        char name[32];
+        snprintf(name, sizeof(name), "seg%05zu%s", n, format_ == HLS_FMP4 ? ".m4s" : ".ts");
+        return name;
+    }
+
+    // 结束当前分片（冲刷封装器里缓着的数据），改名到位后开始下一个；last时尾部已经由av_write_trailer冲刷
+    bool cut(double duration, bool last, const std::function<void(const HlsSegment&)>& on_segment) {
+        if (!last && av_write_frame(out_, nullptr) < 0) {
+            return fail("muxing failed");
+        }
+        avio_flush(out_->pb);
+        std::string name = segment_name(segments_.size());
+        if (!finish_file(name)) {
+            return false;
+        }
+        segments_.push_back({name, duration});
+        on_segment(segments_.back());
+        if (last) {
+            return true;
+        }
+        // TS分片各自要能独立解码：下一个包前重发PAT/PMT
+        if (format_ == HLS_TS) {
+            av_opt_set(out_->priv_data, "mpegts_flags", "+resend_headers", 0);
+        }
+        return open_file(segment_name(segments_.size()));
+    }
+
+    bool open_file(const std::string& name) {
+        tmp_path_ = dir_ + "/" + name + ".tmp";
+        fd_ = ::open(tmp_path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd_ < 0) {
+            return fail("cannot create segment file");
+        }
+        write_error_ = 0;
+        return true;
+    }
+
+    bool finish_file(const std::string& name) {
+        if (fd_ < 0) {
+            return fail("no open segment file");
+        }
+        int fd = fd_;
+        fd_ = -1;
+        if (close(fd) != 0 || write_error_ != 0 || rename(tmp_path_.c_str(), (dir_ + "/" + name).c_str()) != 0) {
+            unlink(tmp_path_.c_str());
+            return fail("cannot write segment file");
+        }
+        return true;
+    }
+
+    bool write_playlist() {
+        std::string path = dir_ + "/" + HLS_PLAYLIST;
+        std::string tmp = path + ".tmp";
+        std::string text = hls_playlist(segments_, format_, target_s_, true);
+        FILE* f = fopen(tmp.c_str(), "w");
+        if (!f) {
+            return fail("cannot write playlist");
+        }
+        bool ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+        ok = fclose(f) == 0 && ok;
+        if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+            unlink(tmp.c_str());
+            return fail("cannot write playlist");
+        }
+        return true;
+    }
+
+    // AVIO的写回调：写进当前分片的文件；两个分片之间封装器不会写任何东西
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+    static int write_packet(void* opaque, const uint8_t* buf, int size) {
+#else
+    static int write_packet(void* opaque, uint8_t* buf, int size) {
+#endif
+        HlsSegmenter* self = (HlsSegmenter*)opaque;
+        if (self->fd_ < 0) {
+            return AVERROR(EINVAL);
+        }
+        int done = 0;
+        while (done < size) {
+            ssize_t n = write(self->fd_, buf + done, size - done);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                self->write_error_ = errno;
+                return AVERROR(errno);
+            }
+            done += (int)n;
+        }
+        return size;
+    }
+
+    AVFormatContext* in_ = nullptr;
+    AVFormatContext* out_ = nullptr;
+    AVPacket* pkt_ = nullptr;
+    std::vector<int> stream_map_;   // 输入流编号到输出流编号，不要的流是-1
+    int cut_stream_ = -1;
+    HlsFormat format_ = HLS_TS;
+    int target_s_ = 4;
+    std::string dir_;
+    int fd_ = -1;                   // 正在写的分片
+    std::string tmp_path_;
+    int write_error_ = 0;
+    std::vector<HlsSegment> segments_;
+    std::string error_;
+};
@@ -0,0 +1,194 @@
+// 片源文件的共享只读映射
+//
+// 文件模式下每个客户端有自己的AVFormatContext，原来各自经由file:协议读文件：每个客户端一份用户态缓冲，
+// 每次读都是一次read系统调用。这里同一个文件在进程里只mmap一次，所有读者的AVIOContext直接从映射中取数据，
+// 没有read调用，数据只在页缓存里有一份。映射整体提示MADV_SEQUENTIAL，每个读者再在自己位置的前方
+// 按窗口提示MADV_WILLNEED，让缺页尽量在读到之前就被预读好。最后一个读者关闭后解除映射。
+// 映射中的文件被截断会让读者收到SIGBUS：服务中的片源不能原地改写，更新时写新文件再rename（与包索引相同）。
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+const int MAPPED_AVIO_BUFFER = 4096;                 // AVIOContext自带缓冲只用于零碎的小读，大块读直接拷进目标
+const int64_t MAPPED_READAHEAD = 2 * 1024 * 1024;    // 每个读者提前提示预读的窗口
+
+// 一个文件的只读映射，按路径在进程内共享
+class MappedFile {
+public:
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() {
+        if (map_) munmap(map_, size_);
+    }
+
+    // 取path的共享映射：已有且文件没变就复用，否则新建；不是普通文件、空文件或映射失败时返回空
+    static std::shared_ptr<const MappedFile> open(const std::string& path) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+            return nullptr;
+        }
+        int64_t mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        static std::mutex mtx;
+        static std::map<std::string, std::weak_ptr<const MappedFile>> files;
+        std::lock_guard<std::mutex> lock(mtx);
+        // 顺手清掉最后一个读者已经关闭的文件，片库里看过的片名再多，表里也只留正在读的
+        for (auto it = files.begin(); it != files.end();) {
+            it = it->second.expired() ? files.erase(it) : std::next(it);
+        }
+        std::shared_ptr<const MappedFile> file = files[path].lock();
+        if (file && file->size_ == (size_t)st.st_size && file->mtime_ns_ == mtime_ns) {
+            return file;
+        }
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return nullptr;
+        }
+        void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            return nullptr;
+        }
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        file.reset(new MappedFile(map, st.st_size, mtime_ns));
+        files[path] = file;
+        return file;
+    }
+
+    const uint8_t* data() const { return (const uint8_t*)map_; }
+    int64_t size() const { return (int64_t)size_; }
+
+    // 提示内核预读[offset, offset+len)，按页对齐
+    void prefetch(int64_t offset, int64_t len) const {
+        static const int64_t page = sysconf(_SC_PAGESIZE);
+        int64_t begin = offset & ~(page - 1);
+        int64_t end = std::min<int64_t>(offset + len, (int64_t)size_);
+        if (end > begin) {
+            madvise((uint8_t*)map_ + begin, end - begin, MADV_WILLNEED);
+        }
+    }
+
+private:
+    MappedFile(void* map, size_t size, int64_t mtime_ns) : map_(map), size_(size), mtime_ns_(mtime_ns) {}
+
+    void* map_;
+    size_t size_;
+    int64_t mtime_ns_;
+};
+
+// 一个AVIOContext的读位置，映射本身由所有读者共享
+struct MappedReader {
+    std::shared_ptr<const MappedFile> file;
+    int64_t pos = 0;
+    int64_t advised = 0;  // 已经提示预读到的位置
+};
+
+inline int mapped_avio_read(void* opaque, uint8_t* buf, int size) {
+    MappedReader* r = (MappedReader*)opaque;
+    int64_t left = r->file->size() - r->pos;
+    if (left <= 0) {
+        return AVERROR_EOF;
+    }
+    // 读到预读窗口的后一半时把窗口往前推
+    if (r->pos + MAPPED_READAHEAD / 2 >= r->advised || r->pos < r->advised - MAPPED_READAHEAD) {
+        r->file->prefetch(r->pos, MAPPED_READAHEAD);
+        r->advised = r->pos + MAPPED_READAHEAD;
+    }
+    int n = (int)std::min<int64_t>(size, left);
+    memcpy(buf, r->file->data() + r->pos, n);
+    r->pos += n;
+    return n;
+}
+
+inline int64_t mapped_avio_seek(void* opaque, int64_t offset, int whence) {
+    MappedReader* r = (MappedReader*)opaque;
+    int64_t pos;
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return r->file->size();
+    case SEEK_SET:
+        pos = offset;
+        break;
+    case SEEK_CUR:
+        pos = r->pos + offset;
+        break;
+    case SEEK_END:
+        pos = r->file->size() + offset;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+    if (pos < 0) {
+        return AVERROR(EINVAL);
+    }
+    r->pos = pos;
+    return pos;
+}
+
+// 在共享映射上建一个只读AVIOContext；direct模式下大块读绕过自带缓冲
+inline AVIOContext* mapped_avio_open(std::shared_ptr<const MappedFile> file) {
+    uint8_t* buffer = (uint8_t*)av_malloc(MAPPED_AVIO_BUFFER);
+    if (!buffer) {
+        return nullptr;
+    }
+    MappedReader* reader = new MappedReader;
+    reader->file = std::move(file);
+    AVIOContext* pb = avio_alloc_context(buffer, MAPPED_AVIO_BUFFER, 0, reader, mapped_avio_read, nullptr, mapped_avio_seek);
+    if (!pb) {
+        av_free(buffer);
+        delete reader;
+        return nullptr;
+    }
+    pb->direct = 1;
+    return pb;
+}
+
+inline void mapped_avio_free(AVIOContext** pb) {
+    if (!*pb) {
+        return;
+    }
+    delete (MappedReader*)(*pb)->opaque;
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+}
+
+// 打开片源：普通文件经共享映射读取，其他（URL、管道、映射失败）照常交给avformat_open_input
+inline int mapped_open_input(AVFormatContext** fmt_ctx, const char* filename) {
+    std::shared_ptr<const MappedFile> file = MappedFile::open(filename);
+    AVIOContext* pb = file ? mapped_avio_open(std::move(file)) : nullptr;
+    if (!pb) {
+        return avformat_open_input(fmt_ctx, filename, nullptr, nullptr);
+    }
+    *fmt_ctx = avformat_alloc_context();
+    if (!*fmt_ctx) {
+        mapped_avio_free(&pb);
+        return AVERROR(ENOMEM);
+    }
+    (*fmt_ctx)->pb = pb;
+    (*fmt_ctx)->flags |= AVFMT_FLAG_CUSTOM_IO;
+    int ret = avformat_open_input(fmt_ctx, filename, nullptr, nullptr);
+    if (ret < 0) {
+        mapped_avio_free(&pb);  // 失败时avformat_open_input释放了上下文，但不管自定义的pb
+    }
+    return ret;
+}
+
+// 关闭mapped_open_input打开的片源（两种打开方式都可以）
+inline void mapped_close_input(AVFormatContext** fmt_ctx) {
+    AVIOContext* pb = *fmt_ctx && ((*fmt_ctx)->flags & AVFMT_FLAG_CUSTOM_IO) ? (*fmt_ctx)->pb : nullptr;
+    avformat_close_input(fmt_ctx);
+    mapped_avio_free(&pb);
+}
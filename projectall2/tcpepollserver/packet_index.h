@@ -0,0 +1,239 @@
+// 媒体文件的包索引（边车文件<源文件>.idx）
+//
+// 按解封装顺序记录每个音视频包的pts、dts、大小、文件内偏移和关键帧标记，另存一份视频关键帧的下标表，
+// 以及服务器发给客户端的流信息包（连同其后的编码参数消息）。记录定长、按8字节对齐连续存放，打开时整个文件mmap进来直接当数组用，
+// 不解析也不拷贝，多个线程可以共享同一份只读映射。
+// 索引头里记下源文件的大小和修改时间，源文件变了就视为过期，由调用方重建。
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+constexpr char PACKET_INDEX_MAGIC[8] = {'P', 'K', 'T', 'I', 'D', 'X', '\0', '\0'};
+constexpr uint32_t PACKET_INDEX_VERSION = 2;  // 2：流信息后面加了编码参数消息，旧索引自动重建
+constexpr uint8_t PACKET_INDEX_KEY = 0x01;  // 关键帧
+
+struct PacketIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t source_size;      // 建索引时源文件的大小和修改时间，用于判断是否过期
+    int64_t source_mtime_ns;
+    int32_t video_stream;      // 源文件中的流序号
+    int32_t audio_stream;      // 没有音频时为-1
+    int32_t video_tb_num;
+    int32_t video_tb_den;
+    int32_t audio_tb_num;
+    int32_t audio_tb_den;
+    int64_t duration_us;
+    uint64_t entry_count;
+    uint64_t keyframe_count;
+    uint32_t info_size;        // 流信息包和编码参数消息（各自PacketHeader+负载）的总字节数
+    uint32_t reserved;
+    // 之后依次是：流信息包（补齐到8字节）、entry_count条PacketIndexEntry、keyframe_count个uint64_t记录下标
+};
+
+struct PacketIndexEntry {
+    int64_t pts;        // 所在流的time_base，未知为AV_NOPTS_VALUE
+    int64_t dts;
+    int64_t pos;        // 在源文件中的字节偏移，未知为-1
+    int64_t ts_us;      // 解码时间戳换算成微秒（没有dts时用pts），跳转和码率统计都用它
+    uint32_t size;      // 源文件中的负载字节数（annex-B转换前）
+    uint8_t stream;     // 0视频 1音频，与PacketHeader::dataType一致
+    uint8_t flags;      // PACKET_INDEX_KEY
+    uint16_t reserved;
+};
+
+static_assert(sizeof(PacketIndexHeader) % 8 == 0, "index sections must stay 8-byte aligned");
+static_assert(sizeof(PacketIndexEntry) == 40, "on-disk entry layout changed");
+
+inline std::string packet_index_path(const std::string& source) {
+    return source + ".idx";
+}
+
+// 文件名是不是索引（或正在写的临时索引<索引>.tmp.XXXXXX），片库列出片名时要排除
+inline bool packet_index_is_sidecar(const std::string& name) {
+    size_t n = strlen(".idx");
+    bool is_index = name.size() >= n && name.compare(name.size() - n, n, ".idx") == 0;
+    return is_index || name.find(".idx.tmp.") != std::string::npos;
+}
+
+// 取源文件的大小和修改时间，写入/校验索引头用
+inline bool packet_index_stat(const std::string& source, uint64_t* size, int64_t* mtime_ns) {
+    struct stat st;
+    if (stat(source.c_str(), &st) != 0) {
+        return false;
+    }
+    *size = (uint64_t)st.st_size;
+    *mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+inline size_t packet_index_align(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+// 一份只读映射的索引，析构时解除映射
+class PacketIndex {
+public:
+    PacketIndex(const PacketIndex&) = delete;
+    PacketIndex& operator=(const PacketIndex&) = delete;
+    ~PacketIndex() {
+        if (map_) munmap(map_, map_size_);
+    }
+
+    // 映射path处的索引；文件不存在、格式不对或与源文件不匹配时返回空
+    static std::shared_ptr<const PacketIndex> open(const std::string& path, const std::string& source) {
+        uint64_t source_size;
+        int64_t source_mtime_ns;
+        if (!packet_index_stat(source, &source_size, &source_mtime_ns)) {
+            return nullptr;
+        }
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return nullptr;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(PacketIndexHeader)) {
+            close(fd);
+            return nullptr;
+        }
+        void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            return nullptr;
+        }
+        std::shared_ptr<PacketIndex> index(new PacketIndex(map, st.st_size));
+        const PacketIndexHeader& h = index->header();
+        if (memcmp(h.magic, PACKET_INDEX_MAGIC, sizeof(h.magic)) != 0 || h.version != PACKET_INDEX_VERSION ||
+            h.header_size != sizeof(PacketIndexHeader) || h.source_size != source_size ||
+            h.source_mtime_ns != source_mtime_ns) {
+            return nullptr;
+        }
+        // 各段长度来自文件内容，逐段和剩余字节比较，不做可能溢出的乘法
+        size_t left = (size_t)st.st_size - sizeof(PacketIndexHeader);
+        if (packet_index_align(h.info_size) > left) {
+            return nullptr;
+        }
+        left -= packet_index_align(h.info_size);
+        if (h.entry_count > left / sizeof(PacketIndexEntry)) {
+            return nullptr;
+        }
+        left -= h.entry_count * sizeof(PacketIndexEntry);
+        if (left % sizeof(uint64_t) != 0 || h.keyframe_count != left / sizeof(uint64_t)) {
+            return nullptr;
+        }
+        // 关键帧表里的下标直接用来访问记录，越界的索引当作损坏
+        const uint64_t* kf = index->keyframes();
+        for (size_t i = 0; i < h.keyframe_count; ++i) {
+            if (kf[i] >= h.entry_count) {
+                return nullptr;
+            }
+        }
+        madvise(map, st.st_size, MADV_WILLNEED);
+        index->compute_bitrates();
+        return index;
+    }
+
+    const PacketIndexHeader& header() const { return *(const PacketIndexHeader*)map_; }
+    const uint8_t* info_packet() const { return (const uint8_t*)map_ + sizeof(PacketIndexHeader); }
+    size_t info_size() const { return header().info_size; }
+    const PacketIndexEntry* entries() const {
+        return (const PacketIndexEntry*)(info_packet() + packet_index_align(header().info_size));
+    }
+    size_t size() const { return header().entry_count; }
+    const uint64_t* keyframes() const { return (const uint64_t*)(entries() + header().entry_count); }
+    size_t keyframe_count() const { return header().keyframe_count; }
+
+    // 不晚于ts_us的最后一个视频关键帧；目标在第一个关键帧之前时返回第一个，没有关键帧时返回空
+    const PacketIndexEntry* keyframe_at(int64_t ts_us) const {
+        const uint64_t* kf = keyframes();
+        size_t lo = 0, hi = keyframe_count();
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (entries()[kf[mid]].ts_us <= ts_us) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (keyframe_count() == 0) return nullptr;
+        return &entries()[kf[lo > 0 ? lo - 1 : 0]];
+    }
+
+    // 整个文件的平均码率和任意一秒窗口内的峰值码率（bit/s），只看负载字节，不需要解码
+    uint64_t average_bitrate() const { return avg_bps_; }
+    uint64_t peak_bitrate() const { return peak_bps_; }
+
+private:
+    PacketIndex(void* map, size_t size) : map_(map), map_size_(size) {}
+
+    // 记录按解封装顺序排列，时间戳基本单调，用滑动窗口统计峰值即可
+    void compute_bitrates() {
+        const PacketIndexEntry* e = entries();
+        size_t n = size();
+        uint64_t total = 0;
+        uint64_t window = 0;
+        size_t tail = 0;
+        for (size_t i = 0; i < n; ++i) {
+            total += e[i].size;
+            window += e[i].size;
+            while (tail < i && e[i].ts_us - e[tail].ts_us >= 1000000) {
+                window -= e[tail].size;
+                tail++;
+            }
+            peak_bps_ = std::max(peak_bps_, window * 8);
+        }
+        int64_t duration = header().duration_us;
+        avg_bps_ = duration > 0 ? total * 8 * 1000000 / (uint64_t)duration : 0;
+    }
+
+    void* map_;
+    size_t map_size_;
+    uint64_t avg_bps_ = 0;
+    uint64_t peak_bps_ = 0;
+};
+
+// 写出索引文件：先在同一目录下写唯一命名的临时文件再rename，正在映射旧索引的进程和同时建同一个索引的进程互不影响
+inline bool packet_index_write(const std::string& path, const PacketIndexHeader& header, const std::vector<uint8_t>& info,
+                               const std::vector<PacketIndexEntry>& entries, const std::vector<uint64_t>& keyframes) {
+    std::string tmp = path + ".tmp.XXXXXX";
+    int fd = mkstemp(&tmp[0]);
+    if (fd < 0) {
+        return false;
+    }
+    fchmod(fd, 0644); //mkstemp建的是0600，索引和源文件一样给其他用户读
+    FILE* fp = fdopen(fd, "wb");
+    if (!fp) {
+        int saved = errno;
+        close(fd);
+        unlink(tmp.c_str());
+        errno = saved;
+        return false;
+    }
+    static const uint8_t zeros[8] = {0};
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              fwrite(info.data(), 1, info.size(), fp) == info.size() &&
+              fwrite(zeros, 1, packet_index_align(info.size()) - info.size(), fp) ==
+                  packet_index_align(info.size()) - info.size() &&
+              fwrite(entries.data(), sizeof(PacketIndexEntry), entries.size(), fp) == entries.size() &&
+              fwrite(keyframes.data(), sizeof(uint64_t), keyframes.size(), fp) == keyframes.size();
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        int saved = errno;
+        unlink(tmp.c_str());
+        errno = saved;
+        return false;
+    }
+    return true;
+}
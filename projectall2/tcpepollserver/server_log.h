@@ -0,0 +1,271 @@
+// 服务器异步分级日志
+//
+// 热路径上的LOGx()只把格式化好的一行写进本线程的无锁环形缓冲区（单生产者单消费者），
+// 由后台线程统一取出写到stdout/stderr，工作线程不会因为终端或管道I/O而阻塞。
+// 每个调用点各自限速（每秒最多log_rate条），超出的条数在下一条放行的日志后面注明。
+// 低于SERVER_LOG_MIN_LEVEL的级别在编译期就被消除，例如默认构建中的LOGT()不产生任何代码。
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum LogLevel {
+    LOG_LEVEL_TRACE = 0,
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_OFF
+};
+
+// 编译期最低级别，-DSERVER_LOG_MIN_LEVEL=0 打开逐事件的trace日志
+#ifndef SERVER_LOG_MIN_LEVEL
+#define SERVER_LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+constexpr size_t LOG_RECORD_TEXT = 240;
+constexpr size_t LOG_RING_RECORDS = 1024;
+
+struct LogRecord {
+    int64_t ts_us;
+    uint32_t suppressed;  // 同一调用点在此之前被限速丢掉的条数
+    uint16_t len;
+    uint8_t level;
+    char text[LOG_RECORD_TEXT];
+};
+
+// 每个线程一个：线程自己推进head，后台线程推进tail，缓冲区满时丢弃并计数，绝不阻塞调用方
+struct LogRing {
+    LogRecord records[LOG_RING_RECORDS];
+    std::atomic<uint64_t> head{0};
+    std::atomic<uint64_t> tail{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<bool> closed{false};  // 所属线程已退出，取空后移除
+    char name[32] = "main";
+};
+
+// 调用点的限速状态，由宏在每个调用点放一个静态实例
+struct LogSite {
+    std::atomic<int64_t> window{-1};
+    std::atomic<uint32_t> count{0};
+    std::atomic<uint32_t> suppressed{0};
+};
+
+struct LogState {
+    std::atomic<int> level{LOG_LEVEL_INFO};
+    std::atomic<uint32_t> rate{20};
+    std::atomic<bool> running{false};
+    std::mutex mtx;  // 只保护rings的增删，不在写日志的路径上
+    std::vector<std::shared_ptr<LogRing>> rings;
+    std::thread drain;
+};
+
+inline LogState& log_state() {
+    static LogState state;
+    return state;
+}
+
+inline int log_level() {
+    return log_state().level.load(std::memory_order_relaxed);
+}
+
+inline int64_t log_now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+struct LogRingHolder {
+    std::shared_ptr<LogRing> ring;
+    ~LogRingHolder() {
+        if (ring) ring->closed.store(true, std::memory_order_release);
+    }
+};
+
+inline LogRing* log_thread_ring() {
+    thread_local LogRingHolder holder;
+    if (!holder.ring) {
+        holder.ring = std::make_shared<LogRing>();
+        LogState& st = log_state();
+        std::lock_guard<std::mutex> lock(st.mtx);
+        st.rings.push_back(holder.ring);
+    }
+    return holder.ring.get();
+}
+
+// 给本线程的日志加上名字前缀，例如"worker 0"
+inline void log_set_thread_name(const char* name) {
+    LogRing* ring = log_thread_ring();
+    snprintf(ring->name, sizeof(ring->name), "%s", name);
+}
+
+// 每秒一个窗口，窗口内超过rate条就只计数；换窗口时把上个窗口的计数交给这一条带出去
+inline bool log_site_admit(LogSite& site, int64_t now_us, uint32_t* suppressed) {
+    uint32_t limit = log_state().rate.load(std::memory_order_relaxed);
+    if (limit == 0) {
+        return true;
+    }
+    int64_t sec = now_us / 1000000;
+    int64_t window = site.window.load(std::memory_order_relaxed);
+    if (window != sec && site.window.compare_exchange_strong(window, sec, std::memory_order_relaxed)) {
+        site.count.store(0, std::memory_order_relaxed);
+        *suppressed = site.suppressed.exchange(0, std::memory_order_relaxed);
+    }
+    if (site.count.fetch_add(1, std::memory_order_relaxed) < limit) {
+        return true;
+    }
+    site.suppressed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+__attribute__((format(printf, 3, 4)))
+inline void log_write(int level, LogSite& site, const char* fmt, ...) {
+    int64_t now = log_now_us();
+    uint32_t suppressed = 0;
+    if (!log_site_admit(site, now, &suppressed)) {
+        return;
+    }
+    LogRing* ring = log_thread_ring();
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) >= LOG_RING_RECORDS) {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    LogRecord& rec = ring->records[head % LOG_RING_RECORDS];
+    rec.ts_us = now;
+    rec.level = (uint8_t)level;
+    rec.suppressed = suppressed;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(rec.text, sizeof(rec.text), fmt, ap);
+    va_end(ap);
+    rec.len = (uint16_t)(n < 0 ? 0 : std::min((size_t)n, sizeof(rec.text) - 1));
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+inline void log_format_record(std::string& out, const LogRing& ring, const LogRecord& rec) {
+    static const char level_chars[] = "TDIWE";
+    char prefix[64];
+    time_t sec = (time_t)(rec.ts_us / 1000000);
+    struct tm tm_buf;
+    localtime_r(&sec, &tm_buf);
+    int n = snprintf(prefix, sizeof(prefix), "%02d:%02d:%02d.%03d %c [%s] ", tm_buf.tm_hour, tm_buf.tm_min,
+                     tm_buf.tm_sec, (int)(rec.ts_us % 1000000 / 1000), level_chars[rec.level], ring.name);
+    out.append(prefix, n);
+    out.append(rec.text, rec.len);
+    if (rec.len == LOG_RECORD_TEXT - 1) {
+        out.append("...");
+    }
+    if (rec.suppressed) {
+        n = snprintf(prefix, sizeof(prefix), " (%u similar suppressed)", rec.suppressed);
+        out.append(prefix, n);
+    }
+    out.push_back('\n');
+}
+
+// 取出所有线程缓冲区中的日志并写出，返回是否有内容
+inline bool log_drain_once() {
+    LogState& st = log_state();
+    std::vector<std::shared_ptr<LogRing>> rings;
+    {
+        std::lock_guard<std::mutex> lock(st.mtx);
+        rings = st.rings;
+    }
+    std::string out, err;
+    for (auto& ring : rings) {
+        bool closed = ring->closed.load(std::memory_order_acquire);
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        for (; tail != head; ++tail) {
+            const LogRecord& rec = ring->records[tail % LOG_RING_RECORDS];
+            log_format_record(rec.level >= LOG_LEVEL_WARN ? err : out, *ring, rec);
+        }
+        ring->tail.store(tail, std::memory_order_release);
+        uint64_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+        if (dropped) {
+            char line[96];
+            int n = snprintf(line, sizeof(line), "[%s] log buffer full, %llu records dropped\n", ring->name,
+                             (unsigned long long)dropped);
+            err.append(line, n);
+        }
+        if (closed) {
+            std::lock_guard<std::mutex> lock(st.mtx);
+            for (auto it = st.rings.begin(); it != st.rings.end(); ++it) {
+                if (*it == ring) {
+                    st.rings.erase(it);
+                    break;
+                }
+            }
+        }
+    }
+    if (!out.empty()) {
+        fwrite(out.data(), 1, out.size(), stdout);
+        fflush(stdout);
+    }
+    if (!err.empty()) {
+        fwrite(err.data(), 1, err.size(), stderr);
+        fflush(stderr);
+    }
+    return !out.empty() || !err.empty();
+}
+
+inline void log_shutdown() {
+    LogState& st = log_state();
+    if (st.running.exchange(false) && st.drain.joinable()) {
+        st.drain.join();
+    }
+    log_drain_once();
+}
+
+// 设定运行期级别和每个调用点每秒的条数上限（0表示不限速），启动后台输出线程
+inline void log_init(int level, uint32_t rate) {
+    LogState& st = log_state();
+    st.level.store(level, std::memory_order_relaxed);
+    st.rate.store(rate, std::memory_order_relaxed);
+    if (st.running.exchange(true)) {
+        return;
+    }
+    st.drain = std::thread([&st] {
+        while (st.running.load(std::memory_order_relaxed)) {
+            if (!log_drain_once()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+        }
+    });
+    atexit(log_shutdown);
+}
+
+// 解析--log-level的取值，无法识别时返回-1
+inline int log_parse_level(const char* name) {
+    static const char* const names[] = {"trace", "debug", "info", "warn", "error", "off"};
+    for (int i = LOG_LEVEL_TRACE; i <= LOG_LEVEL_OFF; ++i) {
+        if (strcmp(name, names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+// 级别是常量，低于编译期下限时整个分支（包括参数求值）被编译器去掉
+#define SERVER_LOG(level, ...)                                              \
+    do {                                                                    \
+        if ((level) >= SERVER_LOG_MIN_LEVEL && (level) >= log_level()) {    \
+            static LogSite log_site_;                                       \
+            log_write((level), log_site_, __VA_ARGS__);                     \
+        }                                                                   \
+    } while (0)
+
+#define LOGT(...) SERVER_LOG(LOG_LEVEL_TRACE, __VA_ARGS__)
+#define LOGD(...) SERVER_LOG(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOGI(...) SERVER_LOG(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOGW(...) SERVER_LOG(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOGE(...) SERVER_LOG(LOG_LEVEL_ERROR, __VA_ARGS__)
@@ -0,0 +1,157 @@
+// 服务器运行指标
+//
+// 计数器、瞬时值和耗时直方图都只由所属线程写入：写入是relaxed原子读-加-写，没有锁也没有lock前缀指令，
+// 抓取线程随时读取（各个值之间不保证是同一时刻的快照，对监控足够）。
+// metrics_start()在独立的本地端口上启动一个抓取线程，按Prometheus文本格式（0.0.4）输出。
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// 单写线程的计数器
+struct MetricCounter {
+    std::atomic<uint64_t> value{0};
+    void add(uint64_t n = 1) { value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+// 单写线程的瞬时值
+struct MetricGauge {
+    std::atomic<int64_t> value{0};
+    void set(int64_t v) { value.store(v, std::memory_order_relaxed); }
+    void add(int64_t n) { value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    int64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+// 固定桶边界的耗时直方图，记录纳秒，输出时换算成秒
+struct MetricHistogram {
+    static constexpr int BUCKETS = 14;
+    static constexpr uint64_t bounds_ns[BUCKETS] = {
+        10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000,
+        5000000, 10000000, 25000000, 50000000, 100000000, 1000000000};
+    MetricCounter buckets[BUCKETS + 1];  // 最后一个是+Inf
+    MetricCounter sum_ns;
+    MetricCounter count;
+
+    void observe_ns(uint64_t ns) {
+        int i = 0;
+        while (i < BUCKETS && ns > bounds_ns[i]) ++i;
+        buckets[i].add();
+        sum_ns.add(ns);
+        count.add();
+    }
+};
+
+inline uint64_t metrics_now_ns() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 同一指标的所有样本必须紧跟在它的HELP/TYPE之后
+inline void metric_family(std::string& out, const char* name, const char* type, const char* help) {
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+inline void metric_sample(std::string& out, const char* name, const std::string& labels, double value) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.17g", value);
+    out += name;
+    if (!labels.empty()) {
+        out += '{';
+        out += labels;
+        out += '}';
+    }
+    out += ' ';
+    out += buf;
+    out += '\n';
+}
+
+inline void metric_histogram(std::string& out, const char* name, const std::string& labels, const MetricHistogram& h) {
+    std::string bucket_name = std::string(name) + "_bucket";
+    std::string prefix = labels.empty() ? std::string() : labels + ",";
+    uint64_t cumulative = 0;
+    char le[32];
+    for (int i = 0; i <= MetricHistogram::BUCKETS; ++i) {
+        cumulative += h.buckets[i].get();
+        if (i < MetricHistogram::BUCKETS) {
+            snprintf(le, sizeof(le), "le=\"%g\"", MetricHistogram::bounds_ns[i] / 1e9);
+        } else {
+            snprintf(le, sizeof(le), "le=\"+Inf\"");
+        }
+        metric_sample(out, bucket_name.c_str(), prefix + le, (double)cumulative);
+    }
+    metric_sample(out, (std::string(name) + "_sum").c_str(), labels, h.sum_ns.get() / 1e9);
+    metric_sample(out, (std::string(name) + "_count").c_str(), labels, (double)cumulative);
+}
+
+// 在127.0.0.1:port上提供GET /metrics，每次抓取调用render生成正文；抓取线程是独立的，不经过事件循环
+inline bool metrics_start(int port, std::function<std::string()> render) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return false;
+    }
+    int opt = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(sock, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(sock, 16) < 0) {
+        close(sock);
+        return false;
+    }
+    std::thread([sock, render] {
+        while (true) {
+            int conn = accept4(sock, nullptr, nullptr, SOCK_CLOEXEC);
+            if (conn < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                break;
+            }
+            timeval tv = {1, 0};  // 抓取方迟迟不发请求时不至于卡住
+            setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            char req[2048];
+            ssize_t n = recv(conn, req, sizeof(req) - 1, 0);
+            std::string response;
+            if (n > 0 && (strncmp(req, "GET /metrics", 12) == 0 || strncmp(req, "GET / ", 6) == 0)) {
+                std::string body = render();
+                char head[160];
+                snprintf(head, sizeof(head),
+                         "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                         "Content-Length: %zu\r\nConnection: close\r\n\r\n", body.size());
+                response = head + body;
+            } else {
+                response = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            }
+            size_t sent = 0;
+            while (sent < response.size()) {
+                ssize_t w = send(conn, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+                if (w <= 0) break;
+                sent += w;
+            }
+            close(conn);
+        }
+        close(sock);
+    }).detach();
+    return true;
+}
@@ -0,0 +1,1165 @@
+// 流媒体服务器压测工具
+//
+// 在一台机器上向test_server_epoll建立成千上万个并发连接，按CTCPClient::receive_packet同样的方式解析数据流（声明支持v2包头，
+// 两种包头按魔数区分），
+// 默认只解析不解码（负载读出即丢），也可以让前N个连接用libavcodec真正解码视频。
+// 统计每个连接和总体的吞吐、首个关键帧时间、视频包的到达抖动和卡顿，用于评估硬件容量和发现服务器性能回退。
+// 加--publish FILE时自己先做推流端，把文件按实时速度推到频道live/<名字>，所有连接订阅这个频道，
+// 另外统计每个视频包从推出到订阅者收到的转发延迟。
+// 加--hls时端口是服务器的HLS端口：先取一次片名的播放列表（等它切完），之后每个连接用保持连接的HTTP/1.1
+// 依次循环下载各个分片，统计吞吐和每个分片的下载时间，和同一片名走原生TCP协议的结果对比。
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "server_metrics.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavcodec/bsf.h>
+#include <libavformat/avformat.h>
+}
+
+// 和服务器、客户端完全一致的数据包头
+struct PacketHeader {
+    uint32_t magic;
+    uint32_t dataType; // 0: video, 1: audio, 2: stream_info
+    uint32_t dataSize;
+    int64_t  pts;
+};
+const uint32_t PACKET_MAGIC = 0x12345678;
+
+// 第2版包头：连接后发DATA_HELLO(2)，服务器之后的数据包用它，带关键帧标志和dts
+struct PacketHeaderV2 {
+    uint32_t magic;
+    uint8_t  version;
+    uint8_t  flags;
+    uint16_t headerSize;  // 包头字节数，超出已知部分的跳过
+    uint16_t dataType;
+    uint16_t streamId;
+    uint32_t dataSize;
+    int64_t  pts;
+    int64_t  dts;
+    int64_t  duration;
+};
+static_assert(sizeof(PacketHeaderV2) == 40, "wire layout changed");
+const uint32_t PACKET_MAGIC_V2 = 0x12345679;
+const uint8_t PACKET_FLAG_KEY = 0x01;
+
+// 两种包头解析出来的公共字段；v1包头没有标志和dts
+struct PacketMeta {
+    int version = 1;
+    uint32_t dataType = 0;
+    uint32_t dataSize = 0;
+    uint8_t flags = 0;
+    int64_t pts = 0;
+    int64_t dts = AV_NOPTS_VALUE;
+};
+
+const uint32_t DATA_TITLE_REQUEST = 3;
+const uint32_t DATA_ERROR = 4;
+const uint32_t DATA_STREAM_INFO = 10;
+const uint32_t DATA_HELLO = 11;
+const uint32_t DATA_PUBLISH = 13;
+const uint32_t MAX_PAYLOAD = 64 * 1024 * 1024; // 超过这个长度视为数据流错乱
+
+struct BenchConfig {
+    const char* host = "127.0.0.1";
+    int port = 0;
+    int connections = 100;
+    int threads = 1;
+    int ramp = 0;              // 每秒新建的连接数，0表示一次全部发起
+    int duration_s = 30;
+    int interval_s = 1;        // 汇总输出的间隔
+    int stall_ms = 100;        // 视频晚于播放进度超过这个时长才计为一次卡顿
+    int decode = 0;            // 前N个连接解码视频
+    const char* title = nullptr;
+    bool per_conn = false;     // 结束时逐个连接输出
+    const char* publish = nullptr; // 推流的文件，title须为live/<频道名>
+    bool hls = false;          // 压HLS的HTTP端口而不是原生协议
+};
+
+// 和服务器一致的编码参数消息条目
+struct StreamInfoEntry {
+    uint32_t streamId;
+    uint32_t mediaType;
+    uint32_t codecId;
+    int32_t  tbNum;
+    int32_t  tbDen;
+    uint32_t width;
+    uint32_t height;
+    int32_t  format;
+    uint32_t sampleRate;
+    uint32_t channels;
+    uint64_t channelLayout;
+    int64_t  bitRate;
+    uint32_t extradataSize;
+    uint32_t reserved;
+};
+static_assert(sizeof(StreamInfoEntry) == 64, "wire layout changed");
+
+// 推流端推出的视频包：pts到发送时刻，订阅者收到同一个pts时据此算转发延迟
+struct PublishLog {
+    std::mutex mtx;
+    std::map<int64_t, int64_t> sent_us;
+};
+const size_t PUBLISH_LOG_PACKETS = 8192; // 只留最近这么多个，足够覆盖服务器的广播环
+BenchConfig g_config;
+sockaddr_in g_addr;
+std::atomic<bool> g_stop{false};
+PublishLog g_publish_log;
+std::atomic<int> g_publish_state{0}; // 推流端：0还在准备，1已经推出第一个视频包，-1失败
+std::string g_hls_base;                  // HLS：/hls/<编码后的片名>/
+std::vector<std::string> g_hls_segments; // 开始压测前取到的分片列表，所有连接共用
+const int HLS_PLAYLIST_WAIT_S = 300;     // 等服务器切完片名的最长时间
+
+enum ConnPhase {
+    CONN_IDLE,        // 还没到发起连接的时间
+    CONN_CONNECTING,
+    CONN_HEADER,      // 正在读包头
+    CONN_PAYLOAD,     // 正在读负载
+    CONN_CLOSED
+};
+
+// 每个连接的状态和统计，只由所属线程访问
+struct Conn {
+    int id = 0;
+    int fd = -1;
+    ConnPhase phase = CONN_IDLE;
+    uint8_t header_buf[sizeof(PacketHeaderV2)];
+    size_t header_got = 0;
+    size_t header_need = sizeof(uint32_t); // 先读魔数，再按版本定包头长度
+    uint32_t header_skip = 0;           // v2包头中不认识的尾部字段
+    PacketMeta header;
+    uint32_t payload_got = 0;
+    // v1包头没有关键帧标志：边收边扫描整个视频负载里的NAL头，直到遇到IDR/SPS或第一个普通slice
+    uint32_t nal_window = 0xffffffff;
+    bool nal_scan_done = false;
+    bool nal_key = false;
+    std::vector<uint8_t> payload;       // 需要完整负载时（流信息、错误消息、解码）才收集
+
+    int64_t start_us = 0;               // 发起连接的时刻，其余时间都相对于它
+    int64_t connected_us = -1;
+    int64_t first_byte_us = -1;
+    int64_t info_us = -1;
+    int64_t first_key_us = -1;
+    int64_t first_frame_us = -1;        // 解码出第一帧（只有解码的连接）
+    uint64_t bytes = 0;
+    uint64_t video_packets = 0;
+    uint64_t audio_packets = 0;
+    int32_t tb_num = 0;
+    int32_t tb_den = 0;
+
+    // 抖动：相邻视频包到达间隔与解码时间线间隔之差，按RFC 3550的方式平滑。时间线用v2包头的dts，
+    // v1只有pts，B帧的pts是乱序的，用到目前为止的最大pts代替
+    bool has_last = false;
+    int64_t last_arrival_us = 0;
+    int64_t last_ts_us = 0;
+    double jitter_us = 0;
+    // 卡顿：模拟一个没有缓冲的播放器，从第一个关键帧开始按墙上时间推进，视频到得比需要的晚就卡住等它
+    int64_t play_wall_origin_us = -1;
+    int64_t play_media_origin_us = 0;
+    int64_t stalled_us = 0;
+    uint32_t stalls = 0;
+
+    std::string error;
+    AVCodecContext* dec = nullptr;
+    AVPacket* dec_pkt = nullptr;
+    AVFrame* dec_frame = nullptr;
+    uint64_t decoded_frames = 0;
+    uint64_t decode_ns = 0;
+    std::vector<int64_t> relay_us;      // 推流时：每个视频包从推出到收到的延迟
+
+    // HLS：一次一个请求，读完响应头再按Content-Length读响应体
+    std::string http_head;
+    uint64_t body_left = 0;
+    size_t next_segment = 0;
+    int64_t request_us = 0;
+    std::vector<int64_t> fetch_us;      // 每个分片从发出请求到收完的时间
+};
+
+// 每个线程的汇总计数，只由所属线程写，报告线程随时读
+struct WorkerStats {
+    MetricGauge active;
+    MetricCounter failed;
+    MetricCounter closed;
+    MetricCounter refused;        // 服务器回复了错误消息（例如准入控制拒绝）
+    MetricCounter bytes;
+    MetricCounter packets;
+    MetricCounter keyframed;      // 已经收到第一个关键帧的连接数
+    MetricCounter stalls;
+};
+
+struct Worker {
+    int index = 0;
+    int epollfd = -1;
+    std::vector<Conn> conns;
+    WorkerStats stats;
+    std::thread thread;
+};
+
+static int64_t now_us() {
+    return (int64_t)(metrics_now_ns() / 1000);
+}
+
+static void close_conn(Worker& w, Conn& c, const char* error) {
+    if (c.phase == CONN_CLOSED || c.phase == CONN_IDLE) {
+        return;
+    }
+    if (error && c.error.empty()) {
+        c.error = error;
+    }
+    bool was_connected = c.connected_us >= 0;
+    epoll_ctl(w.epollfd, EPOLL_CTL_DEL, c.fd, nullptr);
+    close(c.fd);
+    c.fd = -1;
+    c.phase = CONN_CLOSED;
+    if (was_connected) {
+        w.stats.active.add(-1);
+        w.stats.closed.add();
+    } else {
+        w.stats.failed.add();
+    }
+}
+
+static bool start_conn(Worker& w, Conn& c) {
+    c.start_us = now_us();
+    c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c.fd < 0) {
+        c.error = strerror(errno);
+        c.phase = CONN_CLOSED;
+        w.stats.failed.add();
+        return false;
+    }
+    if (connect(c.fd, (sockaddr*)&g_addr, sizeof(g_addr)) < 0 && errno != EINPROGRESS) {
+        c.error = strerror(errno);
+        close(c.fd);
+        c.fd = -1;
+        c.phase = CONN_CLOSED;
+        w.stats.failed.add();
+        return false;
+    }
+    c.phase = CONN_CONNECTING;
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+    ev.data.u32 = (uint32_t)(&c - w.conns.data());
+    epoll_ctl(w.epollfd, EPOLL_CTL_ADD, c.fd, &ev);
+    return true;
+}
+
+//HLS：请求下一个分片，到最后一个后从头再来
+static bool send_segment_request(Worker& w, Conn& c) {
+    const std::string& name = g_hls_segments[c.next_segment++ % g_hls_segments.size()];
+    std::string request = "GET " + g_hls_base + name + " HTTP/1.1\r\nHost: " + g_config.host + "\r\n\r\n";
+    c.request_us = now_us();
+    if (send(c.fd, request.data(), request.size(), MSG_NOSIGNAL) != (ssize_t)request.size()) {
+        close_conn(w, c, "cannot send request");
+        return false;
+    }
+    return true;
+}
+
+//连接建立：片库模式下先发送片名请求（HLS时是第一个分片的请求），之后只关心可读事件
+static void on_connected(Worker& w, Conn& c) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err != 0) {
+        close_conn(w, c, strerror(err));
+        return;
+    }
+    c.connected_us = now_us() - c.start_us;
+    c.phase = CONN_HEADER;
+    w.stats.active.add(1);
+    if (g_config.hls) {
+        if (!send_segment_request(w, c)) {
+            return;
+        }
+    } else {
+        // 要v2包头（关键帧标志和dts），旧服务器忽略这条消息，继续发v1包头
+        PacketHeader hello{PACKET_MAGIC, DATA_HELLO, 0, 2};
+        std::string msg((const char*)&hello, sizeof(hello));
+        if (g_config.title) {
+            PacketHeader header;
+            header.magic = PACKET_MAGIC;
+            header.dataType = DATA_TITLE_REQUEST;
+            header.dataSize = strlen(g_config.title);
+            header.pts = 0;
+            msg.append((const char*)&header, sizeof(header));
+            msg += g_config.title;
+        }
+        if (send(c.fd, msg.data(), msg.size(), MSG_NOSIGNAL) != (ssize_t)msg.size()) {
+            close_conn(w, c, "cannot send title request");
+            return;
+        }
+    }
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.u32 = (uint32_t)(&c - w.conns.data());
+    epoll_ctl(w.epollfd, EPOLL_CTL_MOD, c.fd, &ev);
+}
+
+//v1包头：扫描一段annex-B视频负载，找IDR或SPS（服务器的h264_mp4toannexb在每个关键帧前插入SPS/PPS）。
+//起始码可能跨两次recv，状态留在连接里；SEI等其他NAL跳过，遇到普通slice就可以停了
+static void scan_keyframe(Conn& c, const uint8_t* p, size_t n) {
+    for (size_t i = 0; i < n && !c.nal_scan_done; ++i) {
+        if ((c.nal_window & 0xffffff) == 0x000001) {
+            int type = p[i] & 0x1f;
+            if (type == 5 || type == 7) {
+                c.nal_key = true;
+                c.nal_scan_done = true;
+            } else if (type == 1) {
+                c.nal_scan_done = true;
+            }
+        }
+        c.nal_window = (c.nal_window << 8) | p[i];
+    }
+}
+
+static void decode_video(Conn& c, int64_t arrival_us) {
+    uint64_t start = metrics_now_ns();
+    if (av_new_packet(c.dec_pkt, (int)c.payload.size()) < 0) {
+        return;
+    }
+    memcpy(c.dec_pkt->data, c.payload.data(), c.payload.size());
+    c.dec_pkt->pts = c.header.pts;
+    c.dec_pkt->dts = c.header.dts;
+    if (avcodec_send_packet(c.dec, c.dec_pkt) == 0) {
+        while (avcodec_receive_frame(c.dec, c.dec_frame) == 0) {
+            if (c.first_frame_us < 0) {
+                c.first_frame_us = arrival_us - c.start_us;
+            }
+            c.decoded_frames++;
+            av_frame_unref(c.dec_frame);
+        }
+    }
+    av_packet_unref(c.dec_pkt);
+    c.decode_ns += metrics_now_ns() - start;
+}
+
+//一个完整的包到达
+static void on_packet(Worker& w, Conn& c, int64_t arrival_us) {
+    w.stats.packets.add();
+    const PacketMeta& h = c.header;
+    if (h.dataType == 2) {
+        c.info_us = arrival_us - c.start_us;
+        // 流信息：width, height, sample_rate, channels, format, tb_num, tb_den
+        if (c.payload.size() >= 28) {
+            memcpy(&c.tb_num, c.payload.data() + 20, sizeof(c.tb_num));
+            memcpy(&c.tb_den, c.payload.data() + 24, sizeof(c.tb_den));
+        }
+        return;
+    }
+    if (h.dataType == DATA_ERROR) {
+        w.stats.refused.add();
+        close_conn(w, c, ("server: " + std::string(c.payload.begin(), c.payload.end())).c_str());
+        return;
+    }
+    if (h.dataType == 1) {
+        c.audio_packets++;
+        return;
+    }
+    if (h.dataType != 0) {
+        return;
+    }
+    c.video_packets++;
+    if (g_config.publish) {
+        std::lock_guard<std::mutex> lock(g_publish_log.mtx);
+        auto it = g_publish_log.sent_us.find(h.pts);
+        // 连接之前推出的包是加入时补发的GOP，不算转发延迟
+        if (it != g_publish_log.sent_us.end() && it->second >= c.start_us) {
+            c.relay_us.push_back(arrival_us - it->second);
+        }
+    }
+    if (c.first_key_us < 0) {
+        bool key = h.version >= 2 ? (h.flags & PACKET_FLAG_KEY) != 0 : c.nal_key;
+        if (!key) {
+            return; //关键帧之前的视频没法播放，不计入抖动和卡顿
+        }
+        c.first_key_us = arrival_us - c.start_us;
+        w.stats.keyframed.add();
+    }
+    if (c.dec) {
+        decode_video(c, arrival_us);
+    }
+    if (c.tb_den <= 0) {
+        return;
+    }
+    bool has_dts = h.dts != AV_NOPTS_VALUE;
+    int64_t ts_us = (int64_t)((double)(has_dts ? h.dts : h.pts) * c.tb_num * 1000000 / c.tb_den);
+    // 服务器循环播放时时间戳会跳回开头，作为新的起点
+    if (c.has_last && ts_us + 1000000 < c.last_ts_us) {
+        c.has_last = false;
+        c.play_wall_origin_us = -1;
+    }
+    // 只有pts时，比之前小的是重排序的B帧，不代表时间线倒退
+    if (!has_dts && c.has_last) {
+        ts_us = std::max(ts_us, c.last_ts_us);
+    }
+    if (c.has_last) {
+        double d = (double)(arrival_us - c.last_arrival_us) - (double)(ts_us - c.last_ts_us);
+        c.jitter_us += (std::fabs(d) - c.jitter_us) / 16;
+    }
+    c.has_last = true;
+    c.last_arrival_us = arrival_us;
+    c.last_ts_us = ts_us;
+
+    if (c.play_wall_origin_us < 0) {
+        c.play_wall_origin_us = arrival_us;
+        c.play_media_origin_us = ts_us;
+        return;
+    }
+    // 播放进度 = 起点以来的墙上时间 - 已经卡住的时间；这个包的解码时间落在进度之后才来得及
+    int64_t position = arrival_us - c.play_wall_origin_us - c.stalled_us;
+    int64_t late = position - (ts_us - c.play_media_origin_us);
+    if (late > 0) {
+        c.stalled_us += late;
+        if (late >= (int64_t)g_config.stall_ms * 1000) {
+            c.stalls++;
+            w.stats.stalls.add();
+        }
+    }
+}
+
+//读出socket中所有可读的数据并逐包解析；负载只在需要时收集，其余读出即丢
+static void on_readable(Worker& w, Conn& c, std::vector<uint8_t>& scratch) {
+    while (c.phase == CONN_HEADER || c.phase == CONN_PAYLOAD) {
+        ssize_t n = recv(c.fd, scratch.data(), scratch.size(), 0);
+        if (n == 0) {
+            close_conn(w, c, "closed by server");
+            return;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) close_conn(w, c, strerror(errno));
+            return;
+        }
+        int64_t arrival_us = now_us();
+        if (c.first_byte_us < 0) {
+            c.first_byte_us = arrival_us - c.start_us;
+        }
+        c.bytes += n;
+        w.stats.bytes.add(n);
+        const uint8_t* p = scratch.data();
+        size_t left = n;
+        while (left > 0 && c.phase != CONN_CLOSED) {
+            if (c.phase == CONN_HEADER) {
+                if (c.header_skip > 0) {
+                    size_t take = std::min<size_t>(left, c.header_skip);
+                    c.header_skip -= take;
+                    p += take;
+                    left -= take;
+                    if (c.header_skip > 0) break;
+                } else {
+                    size_t take = std::min(left, c.header_need - c.header_got);
+                    memcpy(c.header_buf + c.header_got, p, take);
+                    c.header_got += take;
+                    p += take;
+                    left -= take;
+                    if (c.header_got < c.header_need) break;
+                    uint32_t magic;
+                    memcpy(&magic, c.header_buf, sizeof(magic));
+                    size_t full = magic == PACKET_MAGIC ? sizeof(PacketHeader)
+                                : magic == PACKET_MAGIC_V2 ? sizeof(PacketHeaderV2) : 0;
+                    if (full == 0) {
+                        close_conn(w, c, "bad packet header");
+                        return;
+                    }
+                    if (c.header_got < full) {
+                        c.header_need = full; //魔数读完了，接着读这个版本包头的其余部分
+                        continue;
+                    }
+                    c.header = PacketMeta();
+                    if (magic == PACKET_MAGIC) {
+                        PacketHeader v1;
+                        memcpy(&v1, c.header_buf, sizeof(v1));
+                        c.header.dataType = v1.dataType;
+                        c.header.dataSize = v1.dataSize;
+                        c.header.pts = v1.pts;
+                    } else {
+                        PacketHeaderV2 v2;
+                        memcpy(&v2, c.header_buf, sizeof(v2));
+                        if (v2.headerSize < sizeof(v2)) {
+                            close_conn(w, c, "bad packet header");
+                            return;
+                        }
+                        c.header.version = v2.version;
+                        c.header.dataType = v2.dataType;
+                        c.header.dataSize = v2.dataSize;
+                        c.header.flags = v2.flags;
+                        c.header.pts = v2.pts;
+                        c.header.dts = v2.dts;
+                        c.header_skip = v2.headerSize - sizeof(v2);
+                    }
+                    c.header_got = 0;
+                    c.header_need = sizeof(uint32_t);
+                    if (c.header.dataSize > MAX_PAYLOAD) {
+                        close_conn(w, c, "bad packet header");
+                        return;
+                    }
+                    if (c.header_skip > 0) continue;
+                }
+                c.payload_got = 0;
+                c.payload.clear();
+                c.nal_window = 0xffffffff;
+                c.nal_scan_done = c.header.version >= 2 || c.first_key_us >= 0;
+                c.nal_key = false;
+                c.phase = CONN_PAYLOAD;
+            } else {
+                size_t take = std::min<size_t>(left, c.header.dataSize - c.payload_got);
+                if (c.header.dataType == 0 && !c.nal_scan_done) {
+                    scan_keyframe(c, p, take);
+                }
+                bool keep = c.header.dataType != 0 && c.header.dataType != 1;
+                if (keep || (c.header.dataType == 0 && c.dec)) {
+                    c.payload.insert(c.payload.end(), p, p + take);
+                }
+                c.payload_got += take;
+                p += take;
+                left -= take;
+            }
+            if (c.phase == CONN_PAYLOAD && c.payload_got == c.header.dataSize) {
+                c.phase = CONN_HEADER;
+                on_packet(w, c, arrival_us);
+            }
+        }
+    }
+}
+
+//HLS：解析HTTP响应，响应体读出即丢；一个分片收完就请求下一个
+static void on_http_readable(Worker& w, Conn& c, std::vector<uint8_t>& scratch) {
+    while (c.phase == CONN_HEADER || c.phase == CONN_PAYLOAD) {
+        ssize_t n = recv(c.fd, scratch.data(), scratch.size(), 0);
+        if (n == 0) {
+            close_conn(w, c, "closed by server");
+            return;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) close_conn(w, c, strerror(errno));
+            return;
+        }
+        int64_t arrival_us = now_us();
+        if (c.first_byte_us < 0) {
+            c.first_byte_us = arrival_us - c.start_us;
+        }
+        c.bytes += n;
+        w.stats.bytes.add(n);
+        const char* p = (const char*)scratch.data();
+        size_t left = n;
+        while (left > 0 && c.phase != CONN_CLOSED) {
+            if (c.phase == CONN_HEADER) {
+                size_t old = c.http_head.size();
+                c.http_head.append(p, left);
+                size_t end = c.http_head.find("\r\n\r\n", old >= 3 ? old - 3 : 0);
+                if (end == std::string::npos) {
+                    if (c.http_head.size() > 8192) {
+                        close_conn(w, c, "bad HTTP response");
+                        return;
+                    }
+                    break;
+                }
+                size_t used = end + 4 - old;
+                p += used;
+                left -= used;
+                c.http_head.resize(end + 2);
+                int status = 0;
+                sscanf(c.http_head.c_str(), "HTTP/%*d.%*d %d", &status);
+                const char* length = strcasestr(c.http_head.c_str(), "\r\nContent-Length:");
+                if (status != 200) {
+                    w.stats.refused.add();
+                    close_conn(w, c, ("server: HTTP " + std::to_string(status)).c_str());
+                    return;
+                }
+                if (!length) {
+                    close_conn(w, c, "HTTP response without Content-Length");
+                    return;
+                }
+                c.body_left = strtoull(length + 17, nullptr, 10);
+                c.http_head.clear();
+                c.phase = CONN_PAYLOAD;
+            } else {
+                size_t take = (size_t)std::min<uint64_t>(left, c.body_left);
+                c.body_left -= take;
+                p += take;
+                left -= take;
+            }
+            if (c.phase == CONN_PAYLOAD && c.body_left == 0) {
+                w.stats.packets.add();
+                c.fetch_us.push_back(arrival_us - c.request_us);
+                c.phase = CONN_HEADER;
+                if (!send_segment_request(w, c)) {
+                    return;
+                }
+            }
+        }
+    }
+}
+
+//压测线程：负责conns中的连接，按ramp节奏发起，之后只处理可读事件
+static void worker_loop(Worker* w) {
+    std::vector<uint8_t> scratch(256 * 1024);
+    std::vector<epoll_event> events(256);
+    size_t next = 0;
+    // 每个线程分到ramp/threads的发起速率
+    double rate = g_config.ramp > 0 ? (double)g_config.ramp / g_config.threads : 0;
+    int64_t ramp_start = now_us();
+    while (!g_stop.load(std::memory_order_relaxed)) {
+        int64_t t = now_us();
+        while (next < w->conns.size() && (rate == 0 || next < (size_t)((t - ramp_start) * rate / 1e6) + 1)) {
+            start_conn(*w, w->conns[next++]);
+        }
+        int timeout = next < w->conns.size() ? 10 : 100;
+        int n = epoll_wait(w->epollfd, events.data(), events.size(), timeout);
+        for (int i = 0; i < n; ++i) {
+            Conn& c = w->conns[events[i].data.u32];
+            if (c.phase == CONN_CONNECTING) {
+                on_connected(*w, c);
+                if (c.phase == CONN_CLOSED) continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                if (g_config.hls) {
+                    on_http_readable(*w, c, scratch);
+                } else {
+                    on_readable(*w, c, scratch);
+                }
+            }
+        }
+    }
+    for (Conn& c : w->conns) {
+        close_conn(*w, c, nullptr);
+    }
+}
+
+static bool send_message(int fd, uint32_t data_type, const void* payload, uint32_t size, int64_t pts) {
+    PacketHeader header{PACKET_MAGIC, data_type, size, pts};
+    iovec iov[2] = {{&header, sizeof(header)}, {(void*)payload, size}};
+    msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    size_t total = sizeof(header) + size;
+    while (total > 0) {
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        total -= n;
+        // 部分写出：跳过已经发出的部分
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov[0].iov_len) {
+            n -= msg.msg_iov[0].iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov[0].iov_base = (uint8_t*)msg.msg_iov[0].iov_base + n;
+            msg.msg_iov[0].iov_len -= n;
+        }
+    }
+    return true;
+}
+
+static void append_stream_entry(std::vector<uint8_t>& out, uint32_t stream_id, const AVCodecParameters* par, AVRational tb) {
+    StreamInfoEntry e = {};
+    e.streamId = stream_id;
+    e.mediaType = stream_id;
+    e.codecId = par->codec_id;
+    e.tbNum = tb.num;
+    e.tbDen = tb.den;
+    e.width = par->width;
+    e.height = par->height;
+    e.format = par->format;
+    e.sampleRate = par->sample_rate;
+    e.channels = par->channels;
+    e.channelLayout = par->channel_layout;
+    e.bitRate = par->bit_rate;
+    e.extradataSize = par->extradata ? par->extradata_size : 0;
+    out.insert(out.end(), (const uint8_t*)&e, (const uint8_t*)&e + sizeof(e));
+    out.insert(out.end(), par->extradata, par->extradata + e.extradataSize);
+}
+
+//推流端的准备：打开文件和annex-B转换，连上服务器，发推流请求、流信息和编码参数。失败时返回错误原因
+static const char* publish_open(AVFormatContext** fmt, AVBSFContext** bsf, int* video, int* audio, int* fd) {
+    if (avformat_open_input(fmt, g_config.publish, nullptr, nullptr) < 0 || avformat_find_stream_info(*fmt, nullptr) < 0) {
+        return "cannot open the publish file";
+    }
+    *video = av_find_best_stream(*fmt, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    *audio = av_find_best_stream(*fmt, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+    if (*video < 0) {
+        return "no video stream in the publish file";
+    }
+    AVStream* vs = (*fmt)->streams[*video];
+    const char* name = vs->codecpar->codec_id == AV_CODEC_ID_H264 ? "h264_mp4toannexb"
+                     : vs->codecpar->codec_id == AV_CODEC_ID_HEVC ? "hevc_mp4toannexb" : "null";
+    const AVBitStreamFilter* filter = av_bsf_get_by_name(name);
+    if (!filter || av_bsf_alloc(filter, bsf) < 0 || avcodec_parameters_copy((*bsf)->par_in, vs->codecpar) < 0) {
+        return "cannot set up the annex-B filter";
+    }
+    (*bsf)->time_base_in = vs->time_base;
+    if (av_bsf_init(*bsf) < 0) {
+        return "cannot set up the annex-B filter";
+    }
+
+    *fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (*fd < 0 || connect(*fd, (sockaddr*)&g_addr, sizeof(g_addr)) < 0) {
+        return "cannot connect the publisher";
+    }
+    int one = 1;
+    setsockopt(*fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    const char* channel = g_config.title + strlen("live/");
+    // 流信息：width, height, sample_rate, channels, format, tb_num, tb_den
+    const AVCodecParameters* ap = *audio >= 0 ? (*fmt)->streams[*audio]->codecpar : nullptr;
+    uint32_t info[7] = {(uint32_t)vs->codecpar->width, (uint32_t)vs->codecpar->height,
+                        ap ? (uint32_t)ap->sample_rate : 0, ap ? (uint32_t)ap->channels : 0, ap ? (uint32_t)ap->format : 0,
+                        (uint32_t)vs->time_base.num, (uint32_t)vs->time_base.den};
+    std::vector<uint8_t> streams(sizeof(uint32_t));
+    uint32_t count = 1;
+    append_stream_entry(streams, 0, (*bsf)->par_out, vs->time_base);
+    if (ap) {
+        append_stream_entry(streams, 1, ap, (*fmt)->streams[*audio]->time_base);
+        count++;
+    }
+    memcpy(streams.data(), &count, sizeof(count));
+    if (!send_message(*fd, DATA_PUBLISH, channel, strlen(channel), 0) || !send_message(*fd, 2, info, sizeof(info), 0) ||
+        !send_message(*fd, DATA_STREAM_INFO, streams.data(), streams.size(), 0)) {
+        return "cannot send the publish request";
+    }
+    return nullptr;
+}
+
+//推流线程：按解码时间戳实时推出音视频包，到文件尾回到开头，时间戳接着往后排（频道里的pts不回退）
+static void publish_loop() {
+    AVFormatContext* fmt = nullptr;
+    AVBSFContext* bsf = nullptr;
+    int video = -1, audio = -1, fd = -1;
+    const char* error = publish_open(&fmt, &bsf, &video, &audio, &fd);
+    AVPacket* pkt = av_packet_alloc();
+    AVPacket* out = av_packet_alloc();
+    int64_t loop_offset_us = 0;   // 之前各轮的总时长
+    int64_t last_us = 0;          // 本轮最晚的时间戳（相对文件开头）
+    int64_t wall_start = now_us();
+    while (!error && !g_stop.load(std::memory_order_relaxed)) {
+        if (av_read_frame(fmt, pkt) < 0) {
+            loop_offset_us += last_us + 40000;
+            last_us = 0;
+            av_seek_frame(fmt, video, 0, AVSEEK_FLAG_BACKWARD);
+            av_bsf_flush(bsf);
+            continue;
+        }
+        int index = pkt->stream_index;
+        if (index != video && index != audio) {
+            av_packet_unref(pkt);
+            continue;
+        }
+        AVRational tb = fmt->streams[index]->time_base;
+        int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+        if (ts != AV_NOPTS_VALUE) {
+            int64_t us = av_rescale_q(ts, tb, AVRational{1, 1000000}) - std::max<int64_t>(fmt->start_time, 0);
+            last_us = std::max(last_us, us);
+            int64_t wait = wall_start + loop_offset_us + us - now_us();
+            if (wait > 0) {
+                std::this_thread::sleep_for(std::chrono::microseconds(wait));
+            }
+        }
+        int64_t offset = av_rescale_q(loop_offset_us, AVRational{1, 1000000}, tb);
+        if (index == audio) {
+            if (!send_message(fd, 1, pkt->data, pkt->size, pkt->pts + offset)) error = "publisher disconnected";
+            av_packet_unref(pkt);
+            continue;
+        }
+        if (av_bsf_send_packet(bsf, pkt) < 0) {
+            av_packet_unref(pkt);
+            continue;
+        }
+        while (!error && av_bsf_receive_packet(bsf, out) == 0) {
+            int64_t pts = out->pts + offset;
+            int64_t sent = now_us();
+            {
+                std::lock_guard<std::mutex> lock(g_publish_log.mtx);
+                g_publish_log.sent_us[pts] = sent;
+                while (g_publish_log.sent_us.size() > PUBLISH_LOG_PACKETS) {
+                    g_publish_log.sent_us.erase(g_publish_log.sent_us.begin());
+                }
+            }
+            if (!send_message(fd, 0, out->data, out->size, pts)) error = "publisher disconnected";
+            av_packet_unref(out);
+            g_publish_state = 1;
+        }
+    }
+    if (error) {
+        printf("Publisher: %s\n", error);
+        g_publish_state = -1;
+    }
+    av_packet_free(&pkt);
+    av_packet_free(&out);
+    av_bsf_free(&bsf);
+    avformat_close_input(&fmt);
+    if (fd >= 0) close(fd);
+}
+
+//片名按URL路径编码，保留字符以外的都写成%XX
+static std::string url_encode(const char* s) {
+    std::string out;
+    for (; *s; ++s) {
+        unsigned char ch = (unsigned char)*s;
+        if (isalnum(ch) || strchr("-._~", ch)) {
+            out.push_back((char)ch);
+        } else {
+            char hex[4];
+            snprintf(hex, sizeof(hex), "%%%02X", ch);
+            out += hex;
+        }
+    }
+    return out;
+}
+
+//用阻塞socket取一次播放列表（Connection: close，读到对端关闭）；返回HTTP状态码，出错时返回-1
+static int http_get(const std::string& path, std::string* body) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (sockaddr*)&g_addr, sizeof(g_addr)) < 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    std::string request = "GET " + path + " HTTP/1.1\r\nHost: " + g_config.host + "\r\nConnection: close\r\n\r\n";
+    std::string response;
+    char buf[16384];
+    bool sent = send(fd, request.data(), request.size(), MSG_NOSIGNAL) == (ssize_t)request.size();
+    while (sent) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) break;
+        response.append(buf, n);
+    }
+    close(fd);
+    size_t end = response.find("\r\n\r\n");
+    int status = 0;
+    if (end == std::string::npos || sscanf(response.c_str(), "HTTP/%*d.%*d %d", &status) != 1) {
+        return -1;
+    }
+    body->assign(response, end + 4, std::string::npos);
+    return status;
+}
+
+//HLS：等服务器把片名切完（第一次请求时才开始切），取到完整的分片列表
+static bool hls_fetch_playlist() {
+    g_hls_base = "/hls/" + url_encode(g_config.title) + "/";
+    for (int waited = 0; waited < HLS_PLAYLIST_WAIT_S; ++waited) {
+        std::string body;
+        int status = http_get(g_hls_base + "index.m3u8", &body);
+        if (status != 200) {
+            printf("Cannot get the playlist for %s: %s\n", g_config.title,
+                   status < 0 ? "no HTTP response" : ("HTTP " + std::to_string(status)).c_str());
+            return false;
+        }
+        if (body.find("#EXT-X-ENDLIST") != std::string::npos) {
+            g_hls_segments.clear();
+            size_t pos = 0;
+            while (pos < body.size()) {
+                size_t eol = std::min(body.find('\n', pos), body.size());
+                std::string line = body.substr(pos, eol - pos);
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                if (!line.empty() && line[0] != '#') g_hls_segments.push_back(line);
+                pos = eol + 1;
+            }
+            return !g_hls_segments.empty();
+        }
+        if (waited == 0) {
+            printf("Waiting for the server to segment %s...\n", g_config.title);
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+    printf("Timed out waiting for %s to be segmented.\n", g_config.title);
+    return false;
+}
+
+static double percentile(std::vector<int64_t>& v, double q) {
+    if (v.empty()) return NAN;
+    size_t k = std::min(v.size() - 1, (size_t)(q * (v.size() - 1) + 0.5));
+    std::nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k] / 1000.0;
+}
+
+//还没发生的时间点输出"-"
+static void format_ms(char (&buf)[16], int64_t us) {
+    if (us < 0) {
+        snprintf(buf, sizeof(buf), "-");
+    } else {
+        snprintf(buf, sizeof(buf), "%.1f", us / 1000.0);
+    }
+}
+
+static void usage(const char* prog) {
+    printf("用法: %s [-c connections] [-t threads] [-r ramp_per_s] [-d seconds] [-i interval_s]\n"
+           "          [--title NAME] [--decode N] [--stall-ms N] [--per-conn] [--publish FILE] [--hls] <host> <port>\n", prog);
+    printf("  -c, --connections N  并发连接数（默认100）\n");
+    printf("  -t, --threads N      压测线程数（默认1），连接轮流分配到各线程\n");
+    printf("  -r, --ramp N         每秒新建的连接数（默认0，一次全部发起）\n");
+    printf("  -d, --duration N     运行秒数（默认30）\n");
+    printf("  -i, --interval N     汇总输出的间隔秒数（默认1）\n");
+    printf("  --title NAME         服务器是片库模式时请求的片名\n");
+    printf("  --decode N           前N个连接用libavcodec解码视频（默认0，只解析不解码）\n");
+    printf("  --stall-ms N         视频晚于播放进度超过N毫秒计为一次卡顿（默认100）\n");
+    printf("  --per-conn           结束时逐个连接输出统计\n");
+    printf("  --publish FILE       先把FILE实时推到--title指定的频道live/<名字>，连接都订阅它，并统计转发延迟\n");
+    printf("  --hls                port是服务器的HLS端口：等--title切完后，每个连接保持连接循环下载各个分片\n");
+}
+
+int main(int argc, char* argv[]) {
+    static const option long_opts[] = {
+        {"connections", required_argument, nullptr, 'c'},
+        {"threads", required_argument, nullptr, 't'},
+        {"ramp", required_argument, nullptr, 'r'},
+        {"duration", required_argument, nullptr, 'd'},
+        {"interval", required_argument, nullptr, 'i'},
+        {"title", required_argument, nullptr, 'T'},
+        {"decode", required_argument, nullptr, 'D'},
+        {"stall-ms", required_argument, nullptr, 'S'},
+        {"per-conn", no_argument, nullptr, 'p'},
+        {"publish", required_argument, nullptr, 'P'},
+        {"hls", no_argument, nullptr, 'H'},
+        {nullptr, 0, nullptr, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "c:t:r:d:i:T:D:S:pP:H", long_opts, nullptr)) != -1) {
+        switch (opt) {
+        case 'c': g_config.connections = std::max(1, atoi(optarg)); break;
+        case 't': g_config.threads = std::max(1, atoi(optarg)); break;
+        case 'r': g_config.ramp = std::max(0, atoi(optarg)); break;
+        case 'd': g_config.duration_s = std::max(1, atoi(optarg)); break;
+        case 'i': g_config.interval_s = std::max(1, atoi(optarg)); break;
+        case 'T': g_config.title = optarg; break;
+        case 'D': g_config.decode = std::max(0, atoi(optarg)); break;
+        case 'S': g_config.stall_ms = std::max(1, atoi(optarg)); break;
+        case 'p': g_config.per_conn = true; break;
+        case 'P': g_config.publish = optarg; break;
+        case 'H': g_config.hls = true; break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return -1;
+    }
+    g_config.host = argv[optind];
+    g_config.port = atoi(argv[optind + 1]);
+    if (g_config.publish && (!g_config.title || strncmp(g_config.title, "live/", 5) != 0 || !g_config.title[5])) {
+        printf("--publish needs --title live/<channel>\n");
+        return -1;
+    }
+    if (g_config.hls && (!g_config.title || g_config.publish || g_config.decode > 0)) {
+        printf("--hls needs --title and cannot be combined with --publish or --decode\n");
+        return -1;
+    }
+
+    addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* res = nullptr;
+    if (getaddrinfo(g_config.host, nullptr, &hints, &res) != 0 || !res) {
+        printf("Cannot resolve %s\n", g_config.host);
+        return -1;
+    }
+    memcpy(&g_addr, res->ai_addr, sizeof(g_addr));
+    g_addr.sin_port = htons(g_config.port);
+    freeaddrinfo(res);
+
+    // 每个连接一个描述符，尽量把上限调到硬限制
+    rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)g_config.connections + 64) {
+        printf("Warning: open file limit %llu is below %d connections.\n", (unsigned long long)rl.rlim_cur,
+               g_config.connections);
+    }
+
+    const AVCodec* h264 = g_config.decode > 0 ? avcodec_find_decoder(AV_CODEC_ID_H264) : nullptr;
+    if (g_config.decode > 0 && !h264) {
+        printf("H.264 decoder not available.\n");
+        return -1;
+    }
+
+    if (g_config.hls && !hls_fetch_playlist()) {
+        return -1;
+    }
+
+    // 推流端先开播，订阅者连上来时频道已经有流信息和第一个关键帧
+    std::thread publisher;
+    if (g_config.publish) {
+        publisher = std::thread(publish_loop);
+        while (g_publish_state == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        if (g_publish_state < 0) {
+            publisher.join();
+            return -1;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(200)); // 让服务器处理完开播
+    }
+
+    std::vector<Worker> workers(g_config.threads);
+    for (int i = 0; i < g_config.connections; ++i) {
+        Worker& w = workers[i % g_config.threads];
+        Conn c;
+        c.id = i;
+        if (i < g_config.decode) {
+            c.dec = avcodec_alloc_context3(h264);
+            c.dec->thread_count = 1;
+            if (avcodec_open2(c.dec, h264, nullptr) < 0) {
+                printf("Cannot open H.264 decoder.\n");
+                return -1;
+            }
+            c.dec_pkt = av_packet_alloc();
+            c.dec_frame = av_frame_alloc();
+        }
+        w.conns.push_back(std::move(c));
+    }
+    for (int i = 0; i < g_config.threads; ++i) {
+        workers[i].index = i;
+        workers[i].epollfd = epoll_create1(EPOLL_CLOEXEC);
+        workers[i].thread = std::thread(worker_loop, &workers[i]);
+    }
+
+    printf("%d connections to %s:%d over %d thread(s) for %d s%s\n", g_config.connections, g_config.host,
+           g_config.port, g_config.threads, g_config.duration_s, g_config.title ? (std::string(", title ") + g_config.title).c_str() : "");
+    if (g_config.hls) {
+        printf("HLS: %zu segments under %s\n", g_hls_segments.size(), g_hls_base.c_str());
+    }
+    printf("%6s %7s %7s %7s %7s %10s %10s %8s %7s\n", "time", "active", "failed", "closed", "refused",
+           "Mbit/s", g_config.hls ? "segs/s" : "pkts/s", "keyframed", "stalls");
+    auto start = std::chrono::steady_clock::now();
+    uint64_t last_bytes = 0, last_packets = 0;
+    for (int elapsed = 0; elapsed < g_config.duration_s;) {
+        int step = std::min(g_config.interval_s, g_config.duration_s - elapsed);
+        std::this_thread::sleep_until(start + std::chrono::seconds(elapsed + step));
+        elapsed += step;
+        int64_t active = 0;
+        uint64_t failed = 0, closed = 0, refused = 0, bytes = 0, packets = 0, keyframed = 0, stalls = 0;
+        for (Worker& w : workers) {
+            active += w.stats.active.get();
+            failed += w.stats.failed.get();
+            closed += w.stats.closed.get();
+            refused += w.stats.refused.get();
+            bytes += w.stats.bytes.get();
+            packets += w.stats.packets.get();
+            keyframed += w.stats.keyframed.get();
+            stalls += w.stats.stalls.get();
+        }
+        printf("%5ds %7lld %7llu %7llu %7llu %10.1f %10.0f %8llu %7llu\n", elapsed, (long long)active,
+               (unsigned long long)failed, (unsigned long long)closed, (unsigned long long)refused,
+               (bytes - last_bytes) * 8 / 1e6 / step, (double)(packets - last_packets) / step,
+               (unsigned long long)keyframed, (unsigned long long)stalls);
+        fflush(stdout);
+        last_bytes = bytes;
+        last_packets = packets;
+    }
+    g_stop = true;
+    for (Worker& w : workers) {
+        w.thread.join();
+        close(w.epollfd);
+    }
+    if (publisher.joinable()) {
+        publisher.join();
+    }
+    double run_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // 汇总：线程都已退出，可以直接读每个连接的统计
+    std::vector<int64_t> connect_us, first_byte_us, first_key_us, first_frame_us, jitter_us;
+    std::vector<int64_t> conn_kbps, relay_us, fetch_us;
+    uint64_t total_bytes = 0, total_stalls = 0, total_frames = 0, total_decode_ns = 0;
+    int64_t total_stalled_us = 0;
+    int errors = 0;
+    if (g_config.per_conn) {
+        printf("\n%5s %9s %9s %9s %9s %9s %8s %8s %7s %10s  %s\n", "conn", "connect", "firstbyte", "firstkey",
+               "firstfrm", "Mbit/s", "video", "audio", "stalls", "jitter_ms", "error");
+    }
+    for (Worker& w : workers) {
+        for (Conn& c : w.conns) {
+            if (c.connected_us >= 0) connect_us.push_back(c.connected_us);
+            if (c.first_byte_us >= 0) first_byte_us.push_back(c.first_byte_us);
+            if (c.first_key_us >= 0) first_key_us.push_back(c.first_key_us);
+            if (c.first_frame_us >= 0) first_frame_us.push_back(c.first_frame_us);
+            if (c.has_last) jitter_us.push_back((int64_t)c.jitter_us);
+            relay_us.insert(relay_us.end(), c.relay_us.begin(), c.relay_us.end());
+            fetch_us.insert(fetch_us.end(), c.fetch_us.begin(), c.fetch_us.end());
+            double mbps = c.bytes * 8 / 1e6 / run_s;
+            if (c.connected_us >= 0) conn_kbps.push_back((int64_t)(mbps * 1000));
+            total_bytes += c.bytes;
+            total_stalls += c.stalls;
+            total_stalled_us += c.stalled_us;
+            total_frames += c.decoded_frames;
+            total_decode_ns += c.decode_ns;
+            if (!c.error.empty() && c.error != "closed by server") errors++;
+            if (g_config.per_conn) {
+                char t[4][16];
+                format_ms(t[0], c.connected_us);
+                format_ms(t[1], c.first_byte_us);
+                format_ms(t[2], c.first_key_us);
+                format_ms(t[3], c.first_frame_us);
+                printf("%5d %9s %9s %9s %9s %9.2f %8llu %8llu %7u %10.2f  %s\n", c.id, t[0], t[1], t[2], t[3], mbps,
+                       (unsigned long long)c.video_packets, (unsigned long long)c.audio_packets, c.stalls,
+                       c.jitter_us / 1000.0, c.error.c_str());
+            }
+            if (c.dec) {
+                avcodec_free_context(&c.dec);
+                av_packet_free(&c.dec_pkt);
+                av_frame_free(&c.dec_frame);
+            }
+        }
+    }
+    printf("\nSummary over %.1f s: %zu/%d connected, %d with errors\n", run_s, connect_us.size(),
+           g_config.connections, errors);
+    printf("  aggregate throughput  %.1f Mbit/s\n", total_bytes * 8 / 1e6 / run_s);
+    if (!conn_kbps.empty()) {
+        printf("  per-connection Mbit/s p5 %.2f  p50 %.2f  p95 %.2f\n", percentile(conn_kbps, 0.05),
+               percentile(conn_kbps, 0.5), percentile(conn_kbps, 0.95));
+    }
+    if (!connect_us.empty()) {
+        printf("  %-21s %8s %8s %8s %8s (ms)\n", "", "p50", "p95", "p99", "max");
+    }
+    struct Row {
+        const char* name;
+        std::vector<int64_t>* v;
+    };
+    const Row rows[] = {
+        {"connect", &connect_us},
+        {"first byte", &first_byte_us},
+        {"first keyframe", &first_key_us},
+        {"first decoded frame", &first_frame_us},
+        {"video jitter", &jitter_us},
+        {"publish to receive", &relay_us},
+        {"segment fetch", &fetch_us},
+    };
+    for (const Row& r : rows) {
+        if (r.v->empty()) continue;
+        printf("  %-21s %8.1f %8.1f %8.1f %8.1f   (n=%zu)\n", r.name, percentile(*r.v, 0.5), percentile(*r.v, 0.95),
+               percentile(*r.v, 0.99), percentile(*r.v, 1.0), r.v->size());
+    }
+    printf("  stalls %llu, total stalled %.1f s\n", (unsigned long long)total_stalls, total_stalled_us / 1e6);
+    if (g_config.decode > 0) {
+        printf("  decoded %llu frames, %.2f ms per frame\n", (unsigned long long)total_frames,
+               total_frames ? total_decode_ns / 1e6 / total_frames : 0.0);
+    }
+    return 0;
+}
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <cctype>
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
@@ -7,11 +8,44 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/sockios.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <vector>
 #include <map>
+#include <algorithm>
 #include <string>
+#include <thread>
+#include <memory>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <queue>
+#include <functional>
+#include <list>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <condition_variable>
+#include <dirent.h>
+
+#include "server_log.h"
+#include "server_metrics.h"
+#include "packet_index.h"
+#include "mapped_source.h"
+#include "timer_wheel.h"
+#include "transcoder.h"
+#include "hls_segmenter.h"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 
 extern "C" {
 #include <libavformat/avformat.h>
@@ -28,90 +62,1420 @@ struct PacketHeader {
 };
 const uint32_t PACKET_MAGIC = 0x12345678;
 
+// 第2版包头：发过DATA_HELLO声明支持v2的客户端，之后的数据包改用这个包头。魔数不同，
+// 客户端按每个包的魔数决定怎么解析，切换前已经排队的v1包照样能读
+struct PacketHeaderV2 {
+    uint32_t magic;       // PACKET_MAGIC_V2
+    uint8_t  version;     // 2
+    uint8_t  flags;       // PACKET_FLAG_*
+    uint16_t headerSize;  // 包头字节数，以后的版本可以在末尾追加字段，客户端跳过不认识的部分
+    uint16_t dataType;
+    uint16_t streamId;    // 流信息消息中的流编号；视频0，音频1，控制消息0
+    uint32_t dataSize;
+    int64_t  pts;         // 所在流的time_base
+    int64_t  dts;
+    int64_t  duration;
+};
+static_assert(sizeof(PacketHeaderV2) == 40, "wire layout changed");
+const uint32_t PACKET_MAGIC_V2 = 0x12345679;
+const uint8_t PACKET_FLAG_KEY = 0x01;         // 关键帧，可以从这里开始解码
+const uint8_t PACKET_FLAG_DISPOSABLE = 0x02;  // 非参考帧，丢掉不影响后面的帧
+
+// 编码参数消息（DATA_STREAM_INFO）的负载：uint32_t流个数，之后每个流一个StreamInfoEntry紧跟extradata
+struct StreamInfoEntry {
+    uint32_t streamId;
+    uint32_t mediaType;      // 0视频 1音频，与dataType一致
+    uint32_t codecId;        // FFmpeg的AVCodecID
+    int32_t  tbNum;
+    int32_t  tbDen;
+    uint32_t width;
+    uint32_t height;
+    int32_t  format;         // AVPixelFormat或AVSampleFormat
+    uint32_t sampleRate;
+    uint32_t channels;
+    uint64_t channelLayout;
+    int64_t  bitRate;
+    uint32_t extradataSize;  // 视频是annex-B转换后的参数集，音频如AAC的AudioSpecificConfig
+    uint32_t reserved;
+};
+static_assert(sizeof(StreamInfoEntry) == 64, "wire layout changed");
+
+// 已经封装好的数据包（PacketHeader+负载），通过引用计数共享，每个包只封装一次；
+// v2客户端发送时另写包头，负载部分同样共享
+struct FramedPacket {
+    std::vector<uint8_t> bytes;
+    uint32_t dataType = 0;
+    bool keyframe = false;
+    bool disposable = false;  // 非参考帧，拥塞时可以丢弃
+    int64_t pts = 0;
+    int64_t dts = 0;
+    int64_t duration = 0;
+    int64_t ts_us = AV_NOPTS_VALUE;  // 解码时间戳换算成微秒，转码输出按它安排发送节拍
+};
+typedef std::shared_ptr<const FramedPacket> FramedPacketPtr;
+
+// 广播源：一条解封装+BSF流水线按实时速度产出数据包，所有订阅者共享同一份；
+// 推流频道也是一个广播源，包来自发布端的连接，不经过解封装
+struct LiveSource {
+    std::string filename;
+    bool ingest = false;                 // 推流频道或上游会话：info_packet在流信息收齐时才填上（在所属登记表的锁内），
+                                         // 上游重连后参数变了会在登记表的锁和mtx内换成新的
+    MetricCounter ingest_packets;        // 推流频道收到的音视频包数和负载字节数
+    MetricCounter ingest_bytes;
+    AVFormatContext* fmt_ctx = nullptr;  // 只由生产线程访问
+    AVBSFContext* bsf_ctx = nullptr;
+    int video_stream_index = -1;
+    int audio_stream_index = -1;
+    std::vector<uint8_t> info_packet;    // 流信息包，订阅者首先收到；新订阅者在mtx内读取
+
+    std::mutex mtx;                      // 保护以下字段
+    std::deque<FramedPacketPtr> ring;    // 最近产出的数据包
+    uint64_t base_seq = 0;               // ring.front()的序号
+    bool has_gop = false;                // 环里是否还有最近一个视频关键帧
+    uint64_t gop_seq = 0;                // 最近一个视频关键帧的序号，新客户端从这里开始
+    std::vector<int> notify_fds;         // 各工作线程的eventfd，有新包时唤醒
+    bool ended = false;                  // 推流频道的发布端已断开或上游会话结束，订阅者发完环里剩下的包后断开
+};
+const size_t LIVE_RING_PACKETS = 1024;   // 广播环保留的包数，掉出窗口的客户端会跳到最新关键帧
+const size_t LIVE_GOP_MAX_PACKETS = 8192; // 为保住当前GOP，环最多可以超出到这个包数
+
+// 推流频道登记表：按订阅用的片名live/<频道名>索引，发布端断开时摘掉，同名频道可以重新推流
+struct ChannelRegistry {
+    std::mutex mtx;
+    std::map<std::string, std::shared_ptr<LiveSource>> channels;
+};
+const char CHANNEL_PREFIX[] = "live/";
+const size_t MAX_INGEST_PACKET = 16 * 1024 * 1024; // 推流端单个包负载的上限
+const size_t INGEST_READ_BUFFER = 64 * 1024;       // 一次从socket读多少字节，推流端一次读进多个包
+
+// 点播包存储中的一条记录，指向data里一段已封装好的PacketHeader+负载
+struct PacketRecord {
+    size_t offset;      // 在PacketStore::data中的起始位置
+    uint32_t size;      // 包头+负载的总长度
+    uint32_t dataType;
+    int64_t pts;
+    int64_t dts;
+    int64_t duration;
+    int64_t ts_us;      // 发送节拍用的解码时间戳（微秒）
+    bool keyframe;
+    bool disposable;    // 非参考帧，拥塞时可以丢弃
+};
+
+// 点播包存储：文件只解封装、转换annex-B一次，结果是只读的连续记录数组，
+// 所有点播客户端共享，各自只保存一个记录下标
+struct PacketStore {
+    std::string filename;
+    std::vector<uint8_t> info_packet;    // 流信息包
+    std::vector<uint8_t> data;           // 所有记录首尾相接
+    std::vector<PacketRecord> records;   // 按解封装顺序排列
+    std::vector<size_t> keyframes;       // 视频关键帧记录的下标，按时间递增，供跳转使用
+    std::shared_ptr<const PacketIndex> index; // 源文件的包索引，没有时为空
+    uint64_t avg_bps = 0;                // 负载的平均码率（bit/s），自适应码率按它排序和比较
+    std::vector<uint8_t> codec_info;     // info_packet中编码参数消息那一段，切换版本时单独重发
+    // 自适应码率：片名的所有版本按码率从低到高排列（含自己），只在客户端请求的主版本上填写；
+    // 其他版本由renditions持有，客户端持有主版本就保住了全部版本
+    std::vector<const PacketStore*> ladder;
+    std::vector<std::shared_ptr<const PacketStore>> renditions;
+    AVCodecID video_codec = AV_CODEC_ID_NONE; // 客户端解不了的编码由转码线程池转成H.264
+};
+const char RENDITION_SEPARATOR = '@';         // 片源movie.mp4的其他码率版本命名为movie@<标签>.<扩展名>
+const int64_t ABR_ALIGN_US = 1000;            // 两个版本的关键帧时间相差不超过这么多算对齐
+const int64_t ABR_SAMPLE_MS = 1000;           // 排空速率的采样周期
+const double ABR_SAFETY = 0.8;                // 只选平均码率不超过排空速率这个比例的版本
+const int ABR_PROBE_SAMPLES = 8;              // 连续这么多次采样都不拥塞、排空速率也够得上高一档时试着升一档
+const int ABR_PROBE_MAX_SAMPLES = 64;         // 升档失败后等待的采样次数逐次加倍，最多这么多
+const size_t ABR_AUDIO_BACKTRACK = 256;       // 切换时在新版本里往回找音频的最多记录数
+
+// 客户端发给服务器的消息同样以PacketHeader开头；dataType 0~2由服务器发出，新增的消息从3开始编号
+const uint32_t DATA_TITLE_REQUEST = 3;   // 客户端→服务器：负载是要观看的片名（片库目录中的文件名）
+const uint32_t DATA_ERROR = 4;           // 服务器→客户端：请求失败的原因（文本），随后断开
+const uint32_t DATA_SEEK = 5;            // 客户端→服务器：跳转，pts为目标时间（微秒）
+const uint32_t DATA_PAUSE = 6;           // 客户端→服务器：暂停发送
+const uint32_t DATA_RESUME = 7;          // 客户端→服务器：恢复发送
+const uint32_t DATA_SET_RATE = 8;        // 客户端→服务器：播放速率，pts为千分比（1000为原速）
+const uint32_t DATA_SEEK_DONE = 9;       // 服务器→客户端：跳转完成，之后的数据从pts（微秒）附近的关键帧开始；pts为SEEK_REJECTED表示不能跳转
+const int64_t SEEK_REJECTED = -1;        // 直播、频道、边缘节点和还没开始推流的客户端不能跳转，流照常继续
+const uint32_t DATA_STREAM_INFO = 10;    // 服务器→客户端：各个流的编码器、参数和extradata，紧跟在流信息包之后
+const uint32_t DATA_HELLO = 11;          // 客户端→服务器：pts为客户端支持的最高协议版本，2表示之后的数据包用v2包头；
+                                         // v2的负载是客户端能解的视频编码（uint32_t的AVCodecID数组），可以为空
+const uint32_t DATA_HEARTBEAT = 12;      // 双向：一段时间没有数据时的心跳，没有负载；客户端的心跳只用来证明还在
+const uint32_t DATA_PUBLISH = 13;        // 客户端→服务器：负载是频道名，之后这个连接推送流信息和音视频包（片库模式）
+const size_t MAX_CLIENT_MESSAGE = 4096;  // 客户端消息负载的上限
+
+// 片库：目录中的每个文件是一个片名，第一次被请求时在后台线程封装成点播包存储，之后留在缓存里，
+// 打开和avformat_find_stream_info的代价每个片名只付一次。缓存总量超过预算时按LRU淘汰，
+// 正在观看的客户端各自持有包存储的引用，淘汰只是让最后一个观众离开后释放内存
+struct TitleWaiter {
+    int worker;
+    int clientsock;
+    uint64_t serial;    // 区分fd被复用后的新连接
+};
+struct CatalogEntry {
+    std::shared_ptr<const PacketStore> store;
+    size_t bytes = 0;
+    bool loading = false;
+    std::vector<TitleWaiter> waiters;        // 加载完成后要通知的客户端
+    std::list<std::string>::iterator lru_pos;
+};
+struct Catalog {
+    std::string dir;
+    size_t budget_bytes = 0;
+    std::mutex mtx;                          // 保护以下字段
+    std::map<std::string, CatalogEntry> entries;
+    std::list<std::string> lru;              // 已缓存的片名，最近请求的在前
+    size_t cached_bytes = 0;
+    std::condition_variable cv;              // 有待加载的片名时唤醒加载线程
+    std::deque<std::pair<std::string, std::string>> load_jobs; // 待加载的片名和路径，由probe-threads个加载线程依次取走
+};
+
+// 转码任务：同一个片名和档位只转一次，输出逐包追加，请求它的所有客户端各自按下标从头读取。
+// 转码比实时快时观众只受发送节拍限制，追上转码进度的观众等新包通知；最后一个观众离开后任务停下，输出随之释放。
+// 输出和片库缓存共用--cache-mb的预算，超出时裁掉所有观众都已取过的GOP，之后的新观众从保留的第一个关键帧起播
+const char TRANSCODE_SEPARATOR = '#';        // 片名请求movie.mkv#480p表示要480p档位的转码输出
+const int TRANSCODE_WAKE_MS = 100;           // 新包攒这么久（或者遇到视频关键帧）才唤醒等新包的观众
+struct TranscodeViewer {
+    int clientsock;
+    bool waiting = false;                    // 已追上转码进度，在等新包通知
+    size_t index = 0;                        // 已经取到的包下标，之前的包可以裁掉
+};
+struct TranscodeJob {
+    std::string key;                         // 片名#档位
+    std::string path;
+    TranscodeProfile profile;
+    std::atomic<double> encode_fps{0};       // 最近一秒的编码帧率
+    std::mutex mtx;                          // 保护以下字段
+    std::vector<uint8_t> info_packet;        // 片源和编码器都打开之后才填写
+    std::deque<FramedPacketPtr> packets;     // 保留的输出，第一个包的下标是base
+    size_t base = 0;                         // 已经裁掉的包数
+    size_t bytes = 0;                        // packets占用的字节
+    size_t counted_bytes = 0;                // 其中已经记进片库缓存的字节
+    std::deque<size_t> keyframes;            // 保留的视频关键帧的下标，供跳转和裁剪使用
+    bool done = false;                       // 转码结束，packets不再增长
+    std::vector<TitleWaiter> waiters;        // 等编码器打开的客户端
+    std::map<std::pair<int, uint64_t>, TranscodeViewer> viewers; // 按工作线程和连接编号登记的观众
+    std::chrono::steady_clock::time_point woke_at; // 上次唤醒观众的时间
+    ~TranscodeJob();
+};
+// 转码线程池：线程数有上限，多出来的任务排队；编码帧率和队列长度从指标导出，用来决定线程数
+struct TranscodePool {
+    std::mutex mtx;                          // 保护jobs和active
+    std::condition_variable cv;
+    std::deque<std::shared_ptr<TranscodeJob>> jobs;
+    std::map<std::string, std::weak_ptr<TranscodeJob>> active; // 排队中、转码中和转完后还有观众的任务
+    std::atomic<int> running{0};
+    MetricCounter frames;                    // 累计编码的视频帧数
+};
+
+// 工作线程的收件箱：片库加载线程把结果投递到等待客户端所在的线程，用eventfd唤醒
+struct TitleReady {
+    int clientsock;
+    uint64_t serial;
+    std::shared_ptr<const PacketStore> store;  // 为空表示加载失败
+    std::shared_ptr<TranscodeJob> transcode;   // 转码请求：编码器已打开，为空且store也为空表示失败
+    std::shared_ptr<LiveSource> live;          // 边缘节点：上游开播了，三个都为空表示上游失败
+};
+
+// 边缘节点（--upstream）：本地观众请求的片名由一路到源站的上游连接供流，同一片名的本地观众共享这一路，
+// 源站对每个片名只看到一个连接。包进一个广播环，和推流频道一样扇出；上游断开时重连，本地观众不断开
+struct Upstream {
+    std::string title;
+    std::shared_ptr<LiveSource> src;         // 会话和各个本地观众持有，只剩会话持有时说明没人在看
+    std::atomic<bool> connected{false};      // 这次连接已经在转发音视频包
+    std::vector<TitleWaiter> waiters;        // 上游开播前到达的观众（在登记表的锁内）
+};
+struct UpstreamRegistry {
+    std::mutex mtx;                          // 保护sessions、各会话的waiters和开播时填写的info_packet
+    std::map<std::string, std::shared_ptr<Upstream>> sessions;
+    MetricCounter reconnects;
+    MetricCounter bytes;                     // 从上游收到的字节数
+};
+enum UpstreamEnd {
+    UPSTREAM_LOST,       // 连接断开或卡住，重连
+    UPSTREAM_REFUSED,    // 源站回了错误消息，会话结束
+    UPSTREAM_ABANDONED   // 没有本地观众了
+};
+// HLS：片名第一次被请求时排进切片线程池，之后的请求都用内存里的分片表和磁盘上的分片
+struct HlsTitle {
+    std::string title;
+    std::string dir;                    // 分片和播放列表所在目录
+    std::mutex mtx;                     // 保护以下字段，切片线程每切好一个分片追加一次
+    std::vector<HlsSegment> segments;
+    std::string playlist;               // 按当前分片表渲染好的播放列表
+    bool done = false;
+    bool failed = false;
+    std::chrono::steady_clock::time_point failed_at; // 失败过了HLS_RETRY_MS后的第一个请求重新切
+};
+struct HlsCache {
+    std::mutex mtx;                     // 保护titles和jobs
+    std::condition_variable cv;
+    std::map<std::string, std::shared_ptr<HlsTitle>> titles;  // 切过（或正在切）的片名，不淘汰：分片在磁盘上
+    std::deque<std::pair<std::shared_ptr<HlsTitle>, std::string>> jobs; // 等切片线程的片名和片源路径
+    std::atomic<int> segmenting{0};
+};
+const size_t HTTP_MAX_HEADER = 8192;         // 请求头的上限，超过回431
+const size_t HTTP_MAX_PENDING = 64 * 1024;   // 流水线上还没处理的请求字节上限，超过直接断开
+const int HTTP_IDLE_MS = 15000;              // 保持连接的空闲超时
+const int HLS_RETRY_MS = 30000;              // 切片失败的片名这么久之内直接回500，之后的请求重新切
+
+const int UPSTREAM_CONNECT_MS = 3000;
+const int UPSTREAM_POLL_MS = 1000;        // 接收超时，读线程至少这么久醒来一次检查会话
+const int UPSTREAM_STALL_MS = 15000;      // 这么久没收到任何字节（源站默认每5秒至少一个心跳）就重连
+const int UPSTREAM_LINGER_MS = 5000;      // 最后一个本地观众离开后上游连接再保留这么久，马上回来的观众不用重新连
+const int UPSTREAM_RETRY_MIN_MS = 250;
+const int UPSTREAM_RETRY_MAX_MS = 8000;
+
+// 文件模式的客户端在后台线程打开片源（avformat_open_input、探测、BSF初始化），
+// 事件循环只登记连接，接入风暴时已有的流不会被逐个打开文件卡住
+struct ProbeJob {
+    int worker;
+    int clientsock;
+    uint64_t serial;
+    const char* filename;
+};
+struct ProbeResult {
+    int clientsock;
+    uint64_t serial;
+    AVFormatContext* fmt_ctx = nullptr;  // 为空表示打开失败
+    AVBSFContext* bsf_ctx = nullptr;
+    int video_stream_index = -1;
+    int audio_stream_index = -1;
+    std::vector<uint8_t> info_packet;
+};
+struct ProbePool {
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<ProbeJob> jobs;
+};
+
+// 工作线程的收件箱：后台线程（片库加载、打开片源、准入采样）把结果投递到客户端所在的线程，用eventfd唤醒
+struct WorkerInbox {
+    std::atomic<int> notify_fd{-1};
+    std::mutex mtx;
+    std::vector<TitleReady> ready;
+    std::vector<ProbeResult> probed;
+    std::vector<TitleWaiter> transcoded;     // 转码任务有新包时要推送的观众
+};
+
+// 准入控制：采样线程定期汇总出口带宽和进程CPU，新连接在超过上限时被拒绝或排队
+struct Admission {
+    std::atomic<uint64_t> out_bps{0};        // 最近一个采样周期的出口带宽（bit/s）
+    std::atomic<uint64_t> per_client_bps{0}; // 同期每个客户端的平均带宽，不知道片源码率时用来估算新客户端
+    std::atomic<int> cpu_percent{0};         // 进程CPU时间占全部核的百分比
+    std::atomic<uint64_t> reserved_bps{0};   // 本周期内已放行客户端的预计码率，接入风暴时不至于全部放行
+    std::atomic<int> queued{0};              // 各线程排队中的客户端数
+};
+const int ACCEPT_BATCH = 64;                 // 每次监听socket就绪最多接受的连接数，剩下的下一轮继续
+const int ADMISSION_SAMPLE_MS = 500;
+
+// 每个连接的输出队列：定长槽位环加字节上限，元素是引用计数的已封装数据包，
+// 用head_offset记录队首已发送的字节数，部分发送时不拷贝也不搬移数据
+class OutputQueue {
+public:
+    struct Slice {
+        uint8_t header[sizeof(PacketHeaderV2)];
+        uint32_t header_len = 0;           // 0表示data中已包含包头
+        const uint8_t* data = nullptr;
+        size_t size = 0;
+        std::shared_ptr<const void> owner; // 共享包等负载的持有者
+        AVBufferRef* buf = nullptr;        // 或者AVPacket负载的引用
+        uint32_t dataType = 0;
+        bool keyframe = false;
+        int64_t pts = 0;
+        bool fixed = false;                // data位于点播包存储（io_uring注册缓冲区）中
+        size_t total() const { return header_len + size; }
+    };
+    static const size_t SLOTS = 256;
+
+    OutputQueue() : slots_(SLOTS) {}
+    ~OutputQueue() { clear(); }
+    // 移动后原队列换到一组新的空槽位，仍然可以继续使用
+    OutputQueue(OutputQueue&& other) : slots_(SLOTS) { swap(other); }
+    OutputQueue& operator=(OutputQueue&& other) noexcept {
+        clear();
+        swap(other);
+        return *this;
+    }
+    OutputQueue(const OutputQueue&) = delete;
+    OutputQueue& operator=(const OutputQueue&) = delete;
+
+    bool empty() const { return count_ == 0; }
+    size_t size() const { return count_; }
+    // 槽位用完或未发送字节达到cap时视为满，生产者停止填充
+    bool full(size_t cap) const { return count_ == slots_.size() || queued_bytes() >= cap; }
+    size_t queued_bytes() const { return bytes_ - head_offset_; }
+
+    // 取一个空槽位填写，填好后调用commit()入队
+    Slice& prepare() { return slots_[(head_ + count_) % slots_.size()]; }
+    void commit() {
+        if (count_ == 0) {
+            since_ = std::chrono::steady_clock::now();
+        }
+        bytes_ += prepare().total();
+        count_++;
+    }
+    // 队列最近一次由空变为非空的时间，即还没发出的最早元素的入队时间
+    std::chrono::steady_clock::time_point since() const { return since_; }
+
+    // 从队首开始填充iovec，返回使用的个数
+    int fill_iov(iovec* iov, int max_iov) const {
+        int n = 0;
+        for (size_t i = 0; i < count_ && n + 2 <= max_iov; ++i) {
+            const Slice& s = slots_[(head_ + i) % slots_.size()];
+            size_t off = (i == 0) ? head_offset_ : 0;
+            if (off < s.header_len) {
+                iov[n].iov_base = (void*)(s.header + off);
+                iov[n].iov_len = s.header_len - off;
+                n++;
+                off = 0;
+            } else {
+                off -= s.header_len;
+            }
+            if (off < s.size) {
+                iov[n].iov_base = (void*)(s.data + off);
+                iov[n].iov_len = s.size - off;
+                n++;
+            }
+        }
+        return n;
+    }
+
+    // 队首如果是点播包存储中首尾相接的记录，返回这段连续内存，供io_uring的write_fixed直接发送
+    bool fixed_run(const uint8_t** data, size_t* len, size_t max_len) const {
+        if (count_ == 0 || !slots_[head_].fixed) return false;
+        const Slice& first = slots_[head_];
+        *data = first.data + head_offset_;
+        *len = first.size - head_offset_;
+        for (size_t i = 1; i < count_ && *len < max_len; ++i) {
+            const Slice& s = slots_[(head_ + i) % slots_.size()];
+            if (!s.fixed || s.data != *data + *len) break;
+            *len += s.size;
+        }
+        return true;
+    }
+
+    // 丢弃还没开始发送的元素，返回丢弃的个数；队首已发出一部分的保留，保证字节流完整
+    size_t drop_unsent() {
+        size_t keep = head_offset_ > 0 ? 1 : 0;
+        size_t dropped = 0;
+        while (count_ > keep) {
+            Slice& s = slots_[(head_ + count_ - 1) % slots_.size()];
+            bytes_ -= s.total();
+            release(s);
+            count_--;
+            dropped++;
+        }
+        return dropped;
+    }
+
+    // 已发送n字节：发完的元素出队并释放引用，队首剩余部分只推进偏移；返回发完的元素个数
+    size_t consume(size_t n) {
+        size_t popped = 0;
+        while (n > 0 && count_ > 0) {
+            Slice& s = slots_[head_];
+            size_t remaining = s.total() - head_offset_;
+            if (n < remaining) {
+                head_offset_ += n;
+                break;
+            }
+            n -= remaining;
+            pop_front();
+            popped++;
+        }
+        return popped;
+    }
+
+    void clear() {
+        while (count_ > 0) pop_front();
+    }
+
+private:
+    static void release(Slice& s) {
+        s.owner.reset();
+        av_buffer_unref(&s.buf);
+        s.header_len = 0;
+        s.data = nullptr;
+        s.size = 0;
+        s.dataType = 0;
+        s.keyframe = false;
+        s.pts = 0;
+        s.fixed = false;
+    }
+    void pop_front() {
+        Slice& s = slots_[head_];
+        bytes_ -= s.total();
+        release(s);
+        head_ = (head_ + 1) % slots_.size();
+        head_offset_ = 0;
+        count_--;
+    }
+    void swap(OutputQueue& other) {
+        slots_.swap(other.slots_);
+        std::swap(head_, other.head_);
+        std::swap(count_, other.count_);
+        std::swap(bytes_, other.bytes_);
+        std::swap(head_offset_, other.head_offset_);
+        std::swap(since_, other.since_);
+    }
+
+    std::vector<Slice> slots_;
+    size_t head_ = 0;
+    size_t count_ = 0;
+    size_t bytes_ = 0;        // 队列中所有元素的总字节数
+    size_t head_offset_ = 0;  // 队首元素已发送的字节数
+    std::chrono::steady_clock::time_point since_;
+};
+
+// 每个客户端的运行指标：只由所属工作线程更新，抓取线程通过g_metrics读取
+struct ClientStats {
+    int sock = -1;
+    int worker = 0;
+    std::string peer;
+    const char* mode = "file";
+    MetricCounter bytes_sent;
+    MetricCounter packets_sent;
+    MetricCounter eagain;              // 发送缓冲区满的次数
+    MetricCounter wraparounds;         // file/vod循环回到开头的次数
+    MetricCounter live_skips;          // 掉出直播窗口后跳到直播点的次数
+    MetricCounter dropped_disposable;  // 丢弃的非参考视频包数
+    MetricCounter dropped_gop;         // 跳GOP丢弃的视频包数
+    MetricCounter dropped_bytes;
+    MetricGauge backlog_bytes;         // 最近一次发送后的积压（输出队列+内核发送缓冲区）
+    MetricCounter rendition_switches;  // 自适应码率切换版本的次数
+    MetricGauge rendition_bps;         // 当前版本的平均码率
+    MetricGauge drain_bps;             // 最近测得的排空速率
+};
+
+// 每个线程（工作线程、广播源线程）的汇总指标
+struct ThreadStats {
+    std::string name;
+    MetricGauge clients;
+    MetricCounter accepts;
+    MetricCounter disconnects;
+    MetricCounter rejected;        // 准入控制拒绝的连接
+    MetricCounter queued;          // 准入控制排过队的连接
+    MetricCounter bytes_sent;
+    MetricCounter packets_sent;
+    MetricCounter eagain;
+    MetricCounter coalesced;       // 为攒批推迟的发送
+    MetricCounter heartbeats;      // 发出的心跳
+    MetricCounter idle_timeouts;   // 空闲超时断开的连接
+    MetricCounter slow_evictions;  // 积压没有按期发完而断开的慢客户端
+    MetricCounter http_requests;   // 处理过的HLS HTTP请求
+    MetricCounter http_bytes;      // HTTP连接写出的字节数（含sendfile）
+    MetricHistogram send_latency;  // 一次sendmsg（io_uring为提交到完成）的耗时
+    MetricHistogram demux_time;    // 每个包的av_read_frame+BSF耗时
+    MetricHistogram loop_time;     // 事件循环处理一批事件的耗时
+};
+
+// 指标注册表：只在线程启动、客户端连接和断开时加锁，更新指标本身不经过这里
+struct MetricsRegistry {
+    std::mutex mtx;
+    std::vector<std::shared_ptr<ThreadStats>> threads;
+    std::vector<std::shared_ptr<ClientStats>> clients;
+};
+MetricsRegistry g_metrics;
+thread_local std::shared_ptr<ThreadStats> t_stats;
+thread_local int t_worker_id = -1;
+
 // 保存每个客户端连接的状态
 struct ClientState {
     AVFormatContext* fmt_ctx = nullptr;
     int video_stream_index = -1;
     int audio_stream_index = -1; // 新增音频流索引
     AVBSFContext* bsf_ctx = nullptr;
-    std::vector<uint8_t> pending_data; // 用于处理非阻塞发送时未发完的数据
+    AVPacket* read_pkt = nullptr;      // av_read_frame的输出
+    AVPacket* filt_pkt = nullptr;      // BSF的输出
+    OutputQueue outq;                  // 待发送的数据包，发送阻塞时积压在这里
     bool header_sent = false; // 标记包头是否已发送
+    // 广播模式：客户端只保存订阅游标，数据包与其他订阅者共享
+    std::shared_ptr<LiveSource> live;
+    uint64_t live_cursor = 0;          // 下一个要取的包序号
+    bool wait_keyframe = true;         // 刚加入或掉队后，等到关键帧再发视频
+    uint64_t burst_end = 0;            // 加入时缓存GOP的结束序号，之前的包不参与拥塞丢包
+    // 点播模式：客户端只保存共享包存储中的位置
+    std::shared_ptr<const PacketStore> vod;
+    size_t vod_index = 0;              // 下一个要入队的记录下标
+    int64_t vod_last_audio_us = INT64_MIN; // 最近入队的音频包时间，切换版本时据此去重
+    // 自适应码率：vod_title是请求的主版本（持有全部版本），vod指向当前版本（与vod_title共享所有权）
+    std::shared_ptr<const PacketStore> vod_title;
+    size_t abr_level = 0;              // 当前版本在ladder中的位置
+    size_t abr_target = 0;             // 要切到的版本，在下一个对齐的关键帧切换
+    size_t abr_video_from = 0;         // 切换后从这个记录起才发视频，之前是新版本上一个GOP的
+    int64_t abr_audio_after_us = INT64_MIN; // 切换后新版本里不晚于它的音频已经由旧版本发过
+    WheelTimer abr_timer;
+    uint64_t abr_delivered = 0;        // 上次采样时已经离开socket的累计字节数
+    std::chrono::steady_clock::time_point abr_sampled_at;
+    uint64_t abr_rate_bps = 0;         // 排空速率的滑动平均
+    int abr_calm = 0;                  // 连续不拥塞的采样次数
+    int abr_probe_samples = ABR_PROBE_SAMPLES; // 试着升档前要等的不拥塞采样次数，升档失败一次加倍
+    bool abr_probing = false;          // 当前的升档是试探，稳住ABR_PROBE_SAMPLES次采样之前拥塞算失败
+    // 转码：客户端只保存共享转码输出中的位置
+    std::shared_ptr<TranscodeJob> transcode;
+    size_t transcode_index = 0;        // 下一个要入队的包下标
+    // 推流端：之后的输入是要转发给频道订阅者的流信息和音视频包，这个连接上不发送任何数据
+    std::shared_ptr<LiveSource> publishing;
+    std::vector<uint8_t> publish_info; // 开播前攒下的流信息包
+    AVCodecID publish_codec = AV_CODEC_ID_H264; // 推流视频的编码，v1包头没有关键帧标志时据此扫描NAL
+    // 实时节拍：按包的时间戳安排发送，最多领先播放进度burst_ms
+    bool paced = false;
+    std::chrono::steady_clock::time_point pace_start; // 客户端时间线的起点
+    int64_t pace_origin_us = AV_NOPTS_VALUE;          // 本轮循环第一个包的时间戳
+    int64_t pace_base_us = 0;                         // 本轮循环起点在客户端时间线上的位置
+    int64_t pace_last_us = 0;                         // 最近入队的包在客户端时间线上的位置
+    int64_t pace_prev_us[2] = {AV_NOPTS_VALUE, AV_NOPTS_VALUE}; // 本轮视频、音频上一个包在客户端时间线上的位置
+    int64_t pace_step_us[2] = {0, 0};                 // 视频、音频最近的包间隔，循环时接上最后一个包的时长
+    std::chrono::steady_clock::time_point pace_wake;  // 已登记的唤醒时间
+    // 文件模式下已读出但还没到发送时间的包
+    AVPacket* held_pkt = nullptr;
+    uint32_t held_type = 0;
+    int64_t held_ts_us = AV_NOPTS_VALUE;
+    bool held = false;
+    bool held_keyframe = false;
+    bool held_disposable = false;
+    // 拥塞丢包（广播和实时发送的客户端）：积压超过阈值先丢非参考帧，更严重时丢到下一个关键帧，音频始终保留
+    bool drop_enabled = false;
+    bool skip_to_keyframe = false;     // 正在跳过当前GOP
+    size_t fill_backlog = 0;           // 本轮填充开始时采样的积压字节数
+    std::shared_ptr<ClientStats> stats;
+    uint64_t serial = 0;               // 本线程内唯一的连接编号
+    // 片库模式：收到片名请求并加载好包存储之前不发送任何数据
+    bool awaiting_title = false;
+    bool opening = false;              // 文件模式：后台线程还在打开片源
+    bool queued = false;               // 超过准入上限，排队等待开始推流
+    std::string inbuf;                 // 还没凑成完整消息的客户端输入
+    int protocol = 1;                  // 发给这个客户端的包头版本，收到DATA_HELLO后可能升到2
+    std::vector<AVCodecID> video_codecs; // v2客户端在DATA_HELLO里声明能解的视频编码，为空时只当它能解H.264
+    // 连接级超时，挂在本线程的定时器轮上，状态析构时自动取消
+    WheelTimer heartbeat_timer;
+    WheelTimer idle_timer;
+    WheelTimer drain_timer;
+    std::chrono::steady_clock::time_point last_send;   // 最近一次有字节写进socket
+    std::chrono::steady_clock::time_point last_input;  // 最近一次收到客户端的字节
+    uint64_t drain_target = 0;         // drain_timer到期前累计发送字节数应达到的值
+    // 客户端控制：暂停期间不填充也不发送；跳转在没有在途发送时执行（io_uring的发送引用着队列中的数据）
+    bool paused = false;
+    std::chrono::steady_clock::time_point paused_at;
+    int64_t seek_target_us = AV_NOPTS_VALUE;
+    int rate_permille = 1000;          // 实时发送的速率
+    // io_uring后端：每个连接同时最多一个发送和一个接收在途
+    uint32_t conn_id = 0;
+    bool send_inflight = false;
+    std::unique_ptr<struct UringSendCtx> uring_send;
+};
+
+// io_uring请求在途期间必须保持有效的sendmsg参数和接收缓冲区，客户端移除后暂存到全部完成为止
+struct UringSendCtx {
+    iovec iov[16];
+    msghdr msg;
+    std::vector<char> recv_buf = std::vector<char>(64); // 推流端换成INGEST_READ_BUFFER
+    int inflight = 0; // 在途的send和recv个数
+    uint64_t send_start_ns = 0;
+};
+
+// 发送节拍定时器：每个工作线程一个最小堆，配合timerfd在最早的到期时间唤醒
+struct PaceTimer {
+    std::chrono::steady_clock::time_point when;
+    int clientsock;
+    bool operator>(const PaceTimer& other) const { return when > other.when; }
+};
+thread_local std::priority_queue<PaceTimer, std::vector<PaceTimer>, std::greater<PaceTimer>> pace_timers;
+thread_local int pace_timer_fd = -1;
+thread_local std::chrono::steady_clock::time_point pace_timer_armed = std::chrono::steady_clock::time_point::max();
+
+// 连接级超时：每个工作线程一个定时器轮，事件循环按它的下一格设置等待超时
+const int64_t CLIENT_TIMER_TICK_MS = 100;  // 一格的时长，也是这些超时的精度
+const size_t CLIENT_TIMER_SLOTS = 1024;    // 槽数（2的幂），一圈约102秒
+enum ClientTimer {
+    TIMER_HEARTBEAT,  // 一段时间没有写出任何字节时发心跳
+    TIMER_IDLE,       // 没在推流（等片名、暂停）又没有任何输入的客户端到期断开
+    TIMER_DRAIN,      // 发送阻塞时积压的字节在期限内没有发完，判为慢客户端断开
+    TIMER_ABR,        // 采样排空速率，决定自适应码率要切到哪个版本
+    TIMER_HTTP_IDLE   // HLS的HTTP连接空闲超时，owner是HTTP连接的socket
+};
+thread_local TimerWheel client_timers(CLIENT_TIMER_SLOTS, CLIENT_TIMER_TICK_MS);
+
+enum IoBackend {
+    IO_EPOLL,  // 就绪通知 + 非阻塞sendmsg（默认）
+    IO_URING   // 完成通知，批量提交accept/recv/send，点播包存储注册为固定缓冲区
+};
+
+enum StreamMode {
+    MODE_FILE,      // 每个客户端独立解封装（默认）
+    MODE_BROADCAST, // 每个源只解封装一次，按实时速度扇出给所有客户端
+    MODE_VOD        // 文件预先封装进共享的只读包存储，每个客户端独立游标从头播放
 };
 
 // 用于管理所有客户端状态的映射（利用标准库中的map提升工作效率）
-std::map<int, ClientState> client_states;
+// 每个工作线程各自持有一份，连接只在接受它的线程里处理，因此无需加锁
+thread_local std::map<int, ClientState> client_states;
+
+// HLS的HTTP连接：一次处理一个请求（流水线上的后续请求留在in里），响应头和播放列表这样的小响应体放在out里，
+// 分片文件的内容用sendfile从页缓存直接发出
+struct HttpConn {
+    std::string in;              // 收到、还没处理的请求字节
+    std::string out;             // 待发送的响应头和内存里的响应体
+    size_t out_sent = 0;
+    int file_fd = -1;            // 正在发送的分片文件
+    off_t file_off = 0;
+    off_t file_end = 0;
+    bool close_after = false;    // 当前响应发完就关闭（Connection: close或请求有误）
+    bool peer_closed = false;    // 对端已关闭写方向，处理完收到的请求就关闭
+    std::chrono::steady_clock::time_point last_active;
+    WheelTimer idle_timer;
+};
+thread_local std::map<int, HttpConn> http_conns;
+
+// 服务器启动参数
+struct ServerConfig {
+    int port = 0;
+    const char* video_filename = nullptr;
+    int workers = 1; // 工作线程数，每个线程独立的epoll实例和监听socket
+    StreamMode mode = MODE_FILE;
+    size_t out_queue_bytes = 1024 * 1024; // 每个连接输出队列的字节上限
+    bool pace = false;     // file/vod模式按时间戳实时发送
+    int burst_ms = 1000;   // 实时发送时允许领先播放进度的时长，用于快速起播
+    size_t drop_bytes = 512 * 1024;      // 积压超过此值开始丢非参考帧，0表示不丢包
+    size_t gop_drop_bytes = 1024 * 1024; // 积压超过此值丢弃视频直到下一个关键帧
+    IoBackend io = IO_EPOLL;
+    int log_level = LOG_LEVEL_INFO;
+    uint32_t log_rate = 20;              // 每个日志调用点每秒最多输出的条数，0表示不限
+    int metrics_port = 0;                // 本地Prometheus指标端口，0表示不开启
+    size_t cache_bytes = 2048ull * 1024 * 1024; // 片库缓存的内存预算
+    bool use_index = true;               // 打开片源时使用（必要时现场建立）<文件>.idx包索引
+    bool build_index = false;            // 只为参数中的文件建立包索引，然后退出
+    int backlog = 1024;                  // listen()的连接队列长度
+    int probe_threads = 2;               // 打开片源的后台线程数：文件模式探测片源，片库模式加载片名
+    uint64_t max_out_bps = 0;            // 出口带宽上限（bit/s），0表示不限
+    int max_cpu = 0;                     // 进程CPU占全部核的百分比上限，0表示不限
+    int admission_queue_ms = 5000;       // 超过上限的新连接排队等待的时长，0表示直接拒绝
+    int coalesce_ms = 10;                // 攒批发送：未发出的数据最多等这么久，0表示有数据就发
+    size_t coalesce_bytes = 16 * 1024;   // 攒够这么多字节立即发送
+    bool use_mmap = true;                // 推流的片源经共享只读映射读取
+    int heartbeat_ms = 5000;             // 这么久没有写出任何数据时发心跳，0表示不发
+    int idle_ms = 120000;                // 等片名或暂停中的客户端这么久没有输入就断开，0表示不限
+    int drain_ms = 30000;                // 发送阻塞时的积压必须在这么久内发完，否则断开，0表示不限
+    bool abr = true;                     // 点播片源旁有其他码率版本时按客户端的排空速率切换
+    int transcode_threads = 2;           // 片库模式下转码线程池的线程数，0表示不转码
+    std::vector<TranscodeProfile> profiles = {{"h264", 0, 2500}}; // 转码档位，第一个是解不了的片源自动使用的默认档位
+    std::string upstream_host;           // 设置后本进程是边缘节点，片名请求都向这个源站要
+    int upstream_port = 0;
+    int hls_port = 0;                    // 片库模式下以HLS提供片名的HTTP端口，0表示不开启
+    std::string hls_dir;                 // 分片和播放列表的缓存目录，默认<片库>/.hls
+    HlsFormat hls_format = HLS_TS;
+    int hls_segment_s = 4;               // 分片的目标时长（秒），实际在这之后的第一个关键帧处切
+    int hls_threads = 2;                 // 同时切片的片名数，多出来的排队
+};
+ServerConfig g_config;
+std::shared_ptr<LiveSource> g_live_source; // 广播模式下的共享源
+std::shared_ptr<const PacketStore> g_packet_store; // 点播模式下的共享包存储
+std::shared_ptr<const PacketIndex> g_file_index;   // 单文件（非片库）时源文件的包索引，可能为空
+std::unique_ptr<Catalog> g_catalog;                // 片库模式（参数是目录）下的缓存
+std::vector<std::unique_ptr<WorkerInbox>> g_inboxes; // 按工作线程编号
+thread_local WorkerInbox* t_inbox = nullptr;
+ProbePool g_probe_pool;
+TranscodePool g_transcode_pool;
+
+//任务释放时把记过账的字节还给片库缓存
+TranscodeJob::~TranscodeJob() {
+    if (g_catalog && counted_bytes > 0) {
+        std::lock_guard<std::mutex> lock(g_catalog->mtx);
+        g_catalog->cached_bytes -= counted_bytes;
+    }
+}
+ChannelRegistry g_channels;
+UpstreamRegistry g_upstreams;
+HlsCache g_hls;
+std::vector<int> g_http_socks;                     // HLS的HTTP监听socket，按工作线程编号
+Admission g_admission;
+// 排队等待准入的客户端，按到达顺序
+struct QueuedClient {
+    int clientsock;
+    uint64_t serial;
+    std::chrono::steady_clock::time_point since;
+};
+thread_local std::deque<QueuedClient> t_admission_queue;
+thread_local int t_spare_fd = -1;  // 文件描述符用尽时腾出来接受并关闭新连接，避免监听socket一直就绪
+thread_local uint64_t t_next_serial = 0;
 
 // 函数声明
-int initserver(int port);
+int initserver(int port, bool reuseport);
 void set_non_blocking(int sock);
+void run_worker(int worker_id, int listensock);
+void accept_client(int epollfd, int clientsock);
 void add_client(int epollfd, int clientsock, const char* video_filename);
+void register_client(int epollfd, int clientsock);
+void add_live_client(int epollfd, int clientsock, const std::shared_ptr<LiveSource>& src);
 void remove_client(int epollfd, int clientsock);
 void handle_write(int epollfd, int clientsock);
+static void push_bytes(OutputQueue& q, const std::vector<uint8_t>& bytes);
+static bool push_avpacket(OutputQueue& q, int protocol, uint32_t data_type, AVPacket* pkt, bool disposable);
+static void push_framed(OutputQueue& q, int protocol, const FramedPacketPtr& fp);
+static uint32_t frame_header(uint8_t* out, int protocol, uint32_t data_type, uint32_t size, int64_t pts, int64_t dts,
+                             int64_t duration, bool keyframe, bool disposable);
+bool fill_file_client(int clientsock, ClientState& state);
+bool fill_live_client(int clientsock, ClientState& state);
+bool fill_vod_client(int clientsock, ClientState& state);
+int flush_output(int clientsock, ClientState& state);
+static void track_client(int clientsock, ClientState& state);
+static void note_sent(ClientState& state, size_t bytes);
+static void register_thread_stats(const char* name);
+std::string render_metrics();
+size_t client_backlog_bytes(int clientsock, const ClientState& state);
+void notify_live_clients(int epollfd);
+static bool pace_due(int clientsock, ClientState& state, int64_t ts_us, uint32_t data_type);
+static bool output_full(const ClientState& state);
+static bool flush_due(int clientsock, ClientState& state);
+static void begin_fill(int clientsock, ClientState& state);
+static bool admit_packet(int clientsock, ClientState& state, uint32_t data_type, bool keyframe, bool disposable, size_t size);
+static bool packet_disposable(const AVPacket* pkt, AVCodecID codec_id);
+static void hold_packet(ClientState& state, uint32_t data_type, AVPacket* pkt, AVRational time_base);
+static void pace_restart_loop(ClientState& state);
+void schedule_pace_timer(int clientsock, ClientState& state, std::chrono::steady_clock::time_point when);
+void handle_pace_timer(int epollfd);
+static void arm_pace_timer(std::chrono::steady_clock::time_point when);
+bool build_stream_info(AVFormatContext* fmt_ctx, int video_stream_index, int audio_stream_index, std::vector<uint8_t>& out);
+bool init_annexb_bsf(AVCodecParameters* codecpar, AVBSFContext** bsf_ctx);
+std::shared_ptr<LiveSource> open_live_source(const char* filename);
+void live_source_loop(std::shared_ptr<LiveSource> src);
+std::shared_ptr<PacketStore> build_packet_store(const char* filename, const std::shared_ptr<const PacketIndex>& index);
+std::shared_ptr<const PacketStore> build_title_store(const char* filename, const std::shared_ptr<const PacketIndex>& index);
+std::shared_ptr<const PacketIndex> build_packet_index(const char* filename);
+std::shared_ptr<const PacketIndex> load_packet_index(const char* filename);
+std::shared_ptr<const PacketIndex> open_packet_index(const char* filename);
+static void log_packet_index(const char* filename, const PacketIndex* index);
+void add_vod_client(int epollfd, int clientsock, const std::shared_ptr<const PacketStore>& store);
+void add_catalog_client(int epollfd, int clientsock);
+void handle_read(int epollfd, int clientsock);
+static bool client_input(int epollfd, int clientsock, const char* data, size_t len);
+static void handle_title_request(int epollfd, int clientsock, ClientState& state, const std::string& title);
+static void catalog_load(const std::string& title, const std::string& path);
+static void catalog_worker_loop();
+static void wake_eventfd(int fd);
+void handle_inbox(int epollfd);
+static void handle_catalog_ready(int epollfd);
+static void probe_worker_loop();
+static bool open_file_source(const char* filename, ProbeResult& r);
+static void handle_probe_results(int epollfd);
+static void accept_batch(int epollfd, int listensock, bool http);
+static bool admission_open();
+static void admission_release(int epollfd);
+static void admission_monitor_loop();
+static void send_error(int clientsock, const char* reason);
+static void live_rejoin(ClientState& state);
+static uint64_t expected_client_bps();
+static void queue_for_admission(int clientsock, ClientState& state);
+static void start_vod_stream(ClientState& state, const std::shared_ptr<const PacketStore>& store);
+static void reject_client(int epollfd, int clientsock, const char* reason);
+static void handle_control(int epollfd, int clientsock, ClientState& state, const PacketHeader& header);
+static void apply_pending_seek(int epollfd, int clientsock, ClientState& state);
+static int64_t seek_file_client(ClientState& state, int64_t target_us);
+static int64_t seek_vod_client(ClientState& state, int64_t target_us);
+static void push_message(OutputQueue& q, int protocol, uint32_t data_type, int64_t pts);
+static void start_client_timers(int clientsock, ClientState& state);
+static int64_t client_timer_now_ms();
+static int64_t ms_since(std::chrono::steady_clock::time_point since, std::chrono::steady_clock::time_point now);
+static void handle_client_timers(int epollfd);
+static int client_timer_timeout();
+static void watch_drain(ClientState& state);
+static void abr_sample(int clientsock, ClientState& state);
+static bool abr_switch(int clientsock, ClientState& state, int64_t key_us);
+static const TranscodeProfile* find_profile(const std::string& name);
+static bool needs_transcode(const ClientState& state, const PacketStore& store);
+static void request_transcode(int epollfd, int clientsock, ClientState& state, const std::string& title,
+                              const std::string& path, const TranscodeProfile& profile);
+static void start_transcode_stream(ClientState& state, const std::shared_ptr<TranscodeJob>& job, int clientsock);
+static void transcode_worker_loop();
+bool fill_transcode_client(int clientsock, ClientState& state);
+static void notify_transcode_clients(int epollfd);
+static int64_t seek_transcode_client(ClientState& state, int64_t target_us);
+static void join_live_source(int clientsock, ClientState& state, const std::shared_ptr<LiveSource>& src);
+static void handle_publish(int epollfd, int clientsock, ClientState& state, const std::string& channel);
+static void subscribe_channel(int epollfd, int clientsock, ClientState& state, const std::string& title);
+static bool ingest_input(int clientsock, ClientState& state);
+static FramedPacketPtr reframe_packet(const PacketHeaderV2& header, bool has_flags, const uint8_t* payload, AVCodecID codec_id);
+static int parse_packet_header(const uint8_t* data, size_t len, PacketHeaderV2* header, bool* has_flags);
+static void end_publish(ClientState& state);
+static void start_live_subscriber(int epollfd, int clientsock, ClientState& state, const std::shared_ptr<LiveSource>& src);
+static void subscribe_upstream(int epollfd, int clientsock, ClientState& state, const std::string& title);
+static void upstream_loop(std::shared_ptr<Upstream> up);
+static void annexb_picture_flags(const uint8_t* data, size_t size, AVCodecID codec_id, bool* keyframe, bool* disposable);
+static bool catalog_title_path(const std::string& name, std::string* path);
+static std::shared_ptr<HlsTitle> hls_title(const std::string& title, const std::string& path);
+static void hls_segment_title(const std::shared_ptr<HlsTitle>& t, const std::string& path);
+static void hls_worker_loop();
+static void add_http_conn(int epollfd, int sock);
+static void close_http_conn(int epollfd, int sock);
+static void http_serve(int epollfd, int sock);
+static void http_read(int epollfd, int sock);
+static bool http_next_request(HttpConn& conn);
+static int http_send(int sock, HttpConn& conn);
+static void http_idle(int epollfd, WheelTimer* timer);
+#ifdef HAVE_LIBURING
+void run_worker_uring(int worker_id, int listensock);
+static void uring_register_client(int clientsock, ClientState& state);
+static void uring_submit_send(int clientsock, ClientState& state);
+static void uring_forget_client(int clientsock, ClientState& state);
+#endif
+
+static void usage(const char* prog) {
+    printf("用法: %s [--workers N] [--mode file|broadcast|vod] [--out-queue-kb N] [--pace] [--burst-ms N]\n"
+           "          [--drop-kb N] [--gop-drop-kb N] [--io epoll|uring]\n"
+           "          [--log-level L] [--log-rate N] [--metrics-port N] [--cache-mb N] [--no-index]\n"
+           "          [--backlog N] [--probe-threads N] [--max-out-mbps N] [--max-cpu N] [--admission-queue-ms N]\n"
+           "          [--coalesce-ms N] [--coalesce-kb N] [--no-mmap] [--heartbeat-ms N] [--idle-ms N] [--drain-ms N]\n"
+           "          [--no-abr] [--transcode-threads N] [--profile NAME=HEIGHT:KBPS]...\n"
+           "          [--hls-port N] [--hls-dir DIR] [--hls-format ts|fmp4] [--hls-segment-s N] [--hls-threads N]\n"
+           "          <port> <video_file|catalog_dir>\n"
+           "       %s [options] --upstream HOST:PORT <port>\n"
+           "       %s --build-index <video_file>...\n", prog, prog, prog);
+    printf("  --workers N   工作线程数（默认1，0表示按CPU核数），多线程时用SO_REUSEPORT分摊连接\n");
+    printf("  --mode M      file: 每个客户端独立解封装（默认）；broadcast: 单一源实时扇出给所有客户端；\n");
+    printf("                vod: 启动时把文件封装进共享包存储，客户端各自从头播放\n");
+    printf("  --out-queue-kb N  每个连接输出队列的上限（KB，默认1024）\n");
+    printf("  --pace        file/vod模式按时间戳实时发送，而不是按网络速度发完整个文件\n");
+    printf("  --burst-ms N  实时发送时允许领先播放进度的时长（默认1000），用于快速起播\n");
+    printf("  --drop-kb N   广播/实时发送的客户端积压超过N KB时丢弃非参考帧（默认512，0表示不丢包）\n");
+    printf("  --gop-drop-kb N  积压超过N KB时丢弃视频直到下一个关键帧（默认1024），音频始终保留\n");
+    printf("  --io B        I/O后端：epoll（默认）或uring（需要以-DHAVE_LIBURING编译并链接liburing）\n");
+    printf("  --log-level L trace|debug|info|warn|error|off（默认info；trace需以-DSERVER_LOG_MIN_LEVEL=0编译）\n");
+    printf("  --log-rate N  每个日志调用点每秒最多输出N条（默认20，0表示不限），超出部分只计数\n");
+    printf("  --metrics-port N  在127.0.0.1:N上以Prometheus文本格式提供/metrics（默认不开启）\n");
+    printf("  --cache-mb N  参数为目录时按片名点播，已打开片源的缓存预算（MB，默认2048），超出时按LRU淘汰\n");
+    printf("  --no-index    不使用<文件>.idx包索引（默认第一次打开片源时建立，之后直接mmap）\n");
+    printf("  --build-index 离线为给出的文件建立或更新包索引后退出\n");
+    printf("  --backlog N   监听socket的连接队列长度（默认1024）\n");
+    printf("  --probe-threads N  打开片源的后台线程数（默认2）：文件模式下探测片源，片库模式下加载未缓存的片名\n");
+    printf("  --max-out-mbps N   出口带宽超过N Mbit/s时不再放行新客户端（默认不限）\n");
+    printf("  --max-cpu N   进程CPU超过全部核的N%%时不再放行新客户端（默认不限）\n");
+    printf("  --admission-queue-ms N  超过上限的新客户端最多排队N毫秒，超时拒绝（默认5000，0表示直接拒绝）\n");
+    printf("  --coalesce-ms N  攒批发送：数据不足--coalesce-kb时最多等N毫秒再一次发出（默认10，0表示不攒批）\n");
+    printf("  --coalesce-kb N  攒够N KB立即发送（默认16）\n");
+    printf("  --no-mmap     片源经各自的file:协议读取，而不是进程内共享的只读映射\n");
+    printf("  --heartbeat-ms N  N毫秒没有写出任何数据时给客户端发心跳（默认5000，0表示不发）\n");
+    printf("  --idle-ms N   等片名或暂停中的客户端N毫秒没有任何输入就断开（默认120000，0表示不限）\n");
+    printf("  --drain-ms N  发送阻塞时已积压的数据N毫秒内没有发完就断开慢客户端（默认30000，0表示不限）\n");
+    printf("  --no-abr      vod模式不加载片源旁的<主名>@<标签>.*其他码率版本，不做自适应码率切换\n");
+    printf("  --transcode-threads N  片库模式下同时进行的转码任务数（默认2，0表示不转码）\n");
+    printf("  --profile NAME=HEIGHT:KBPS  定义转码档位，客户端请求<片名>#NAME（HEIGHT为0保持源尺寸）；\n");
+    printf("                内置h264=0:2500，视频不是H.264、客户端又没声明能解的片源自动使用的档位，同名时覆盖\n");
+    printf("  --upstream HOST:PORT  边缘节点：不读本地文件，客户端请求的片名向这个源站要，同一片名共用一路上游连接，\n");
+    printf("                断开时自动重连\n");
+    printf("  --hls-port N  片库模式下在端口N上以HLS提供片名：http://<主机>:N/hls/<片名>/index.m3u8（只支持epoll后端）\n");
+    printf("  --hls-dir DIR 分片和播放列表的缓存目录（默认<片库>/.hls），比片源新的完整列表重启后直接复用\n");
+    printf("  --hls-format F  分片格式：ts（默认，MPEG-TS）或fmp4（分片MP4，带init.mp4）\n");
+    printf("  --hls-segment-s N  分片的目标时长（秒，默认4），在这之后的第一个关键帧处切\n");
+    printf("  --hls-threads N  同时切片的片名数（默认2），更多的新片名排队\n");
+}
 
 int main(int argc, char* argv[]) {
-    if (argc != 3) {
-        printf("用法: %s <port> <video_file>\n", argv[0]);
+    static const option long_opts[] = {
+        {"workers", required_argument, nullptr, 'w'},
+        {"mode", required_argument, nullptr, 'm'},
+        {"out-queue-kb", required_argument, nullptr, 'q'},
+        {"pace", no_argument, nullptr, 'p'},
+        {"burst-ms", required_argument, nullptr, 'b'},
+        {"drop-kb", required_argument, nullptr, 'd'},
+        {"gop-drop-kb", required_argument, nullptr, 'g'},
+        {"io", required_argument, nullptr, 'i'},
+        {"log-level", required_argument, nullptr, 'l'},
+        {"log-rate", required_argument, nullptr, 'r'},
+        {"metrics-port", required_argument, nullptr, 'M'},
+        {"cache-mb", required_argument, nullptr, 'C'},
+        {"no-index", no_argument, nullptr, 'N'},
+        {"build-index", no_argument, nullptr, 'B'},
+        {"backlog", required_argument, nullptr, 'k'},
+        {"probe-threads", required_argument, nullptr, 'P'},
+        {"max-out-mbps", required_argument, nullptr, 'O'},
+        {"max-cpu", required_argument, nullptr, 'U'},
+        {"admission-queue-ms", required_argument, nullptr, 'A'},
+        {"coalesce-ms", required_argument, nullptr, 'c'},
+        {"coalesce-kb", required_argument, nullptr, 'K'},
+        {"no-mmap", no_argument, nullptr, 'x'},
+        {"heartbeat-ms", required_argument, nullptr, 'H'},
+        {"idle-ms", required_argument, nullptr, 'I'},
+        {"drain-ms", required_argument, nullptr, 'D'},
+        {"no-abr", no_argument, nullptr, 'R'},
+        {"transcode-threads", required_argument, nullptr, 'T'},
+        {"profile", required_argument, nullptr, 'F'},
+        {"upstream", required_argument, nullptr, 'E'},
+        {"hls-port", required_argument, nullptr, 'L'},
+        {"hls-dir", required_argument, nullptr, 'Y'},
+        {"hls-format", required_argument, nullptr, 'f'},
+        {"hls-segment-s", required_argument, nullptr, 's'},
+        {"hls-threads", required_argument, nullptr, 'j'},
+        {nullptr, 0, nullptr, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "w:m:q:pb:d:g:i:l:r:M:C:NBk:P:O:U:A:c:K:xH:I:D:RT:F:E:L:Y:f:s:j:", long_opts, nullptr)) != -1) {
+        switch (opt) {
+        case 'w':
+            g_config.workers = atoi(optarg);
+            break;
+        case 'm':
+            if (strcmp(optarg, "file") == 0) {
+                g_config.mode = MODE_FILE;
+            } else if (strcmp(optarg, "broadcast") == 0) {
+                g_config.mode = MODE_BROADCAST;
+            } else if (strcmp(optarg, "vod") == 0) {
+                g_config.mode = MODE_VOD;
+            } else {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'q':
+            g_config.out_queue_bytes = (size_t)std::max(1, atoi(optarg)) * 1024;
+            break;
+        case 'p':
+            g_config.pace = true;
+            break;
+        case 'b':
+            g_config.burst_ms = std::max(0, atoi(optarg));
+            break;
+        case 'd':
+            g_config.drop_bytes = (size_t)std::max(0, atoi(optarg)) * 1024;
+            break;
+        case 'g':
+            g_config.gop_drop_bytes = (size_t)std::max(1, atoi(optarg)) * 1024;
+            break;
+        case 'i':
+            if (strcmp(optarg, "epoll") == 0) {
+                g_config.io = IO_EPOLL;
+            } else if (strcmp(optarg, "uring") == 0) {
+#ifdef HAVE_LIBURING
+                g_config.io = IO_URING;
+#else
+                printf("io_uring backend not compiled in (build with -DHAVE_LIBURING -luring).\n");
+                return -1;
+#endif
+            } else {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'l':
+            g_config.log_level = log_parse_level(optarg);
+            if (g_config.log_level < 0) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'r':
+            g_config.log_rate = (uint32_t)std::max(0, atoi(optarg));
+            break;
+        case 'M':
+            g_config.metrics_port = std::max(0, atoi(optarg));
+            break;
+        case 'C':
+            g_config.cache_bytes = (size_t)std::max(1, atoi(optarg)) * 1024 * 1024;
+            break;
+        case 'N':
+            g_config.use_index = false;
+            break;
+        case 'B':
+            g_config.build_index = true;
+            break;
+        case 'k':
+            g_config.backlog = std::max(1, atoi(optarg));
+            break;
+        case 'P':
+            g_config.probe_threads = std::max(1, atoi(optarg));
+            break;
+        case 'O':
+            g_config.max_out_bps = (uint64_t)std::max(0, atoi(optarg)) * 1000000;
+            break;
+        case 'U':
+            g_config.max_cpu = std::max(0, atoi(optarg));
+            break;
+        case 'A':
+            g_config.admission_queue_ms = std::max(0, atoi(optarg));
+            break;
+        case 'c':
+            g_config.coalesce_ms = std::max(0, atoi(optarg));
+            break;
+        case 'K':
+            g_config.coalesce_bytes = (size_t)std::max(1, atoi(optarg)) * 1024;
+            break;
+        case 'x':
+            g_config.use_mmap = false;
+            break;
+        case 'H':
+            g_config.heartbeat_ms = std::max(0, atoi(optarg));
+            break;
+        case 'I':
+            g_config.idle_ms = std::max(0, atoi(optarg));
+            break;
+        case 'D':
+            g_config.drain_ms = std::max(0, atoi(optarg));
+            break;
+        case 'R':
+            g_config.abr = false;
+            break;
+        case 'T':
+            g_config.transcode_threads = std::max(0, atoi(optarg));
+            break;
+        case 'F': {
+            TranscodeProfile profile;
+            const char* eq = strchr(optarg, '=');
+            if (!eq || eq == optarg || sscanf(eq + 1, "%d:%d", &profile.height, &profile.kbps) != 2 ||
+                profile.height < 0 || profile.kbps <= 0) {
+                usage(argv[0]);
+                return -1;
+            }
+            profile.name.assign(optarg, eq - optarg);
+            auto it = std::find_if(g_config.profiles.begin(), g_config.profiles.end(),
+                                   [&profile](const TranscodeProfile& p) { return p.name == profile.name; });
+            if (it != g_config.profiles.end()) {
+                *it = profile;
+            } else {
+                g_config.profiles.push_back(profile);
+            }
+            break;
+        }
+        case 'E': {
+            const char* colon = strrchr(optarg, ':');
+            if (!colon || colon == optarg || atoi(colon + 1) <= 0) {
+                usage(argv[0]);
+                return -1;
+            }
+            g_config.upstream_host.assign(optarg, colon - optarg);
+            g_config.upstream_port = atoi(colon + 1);
+            break;
+        }
+        case 'L':
+            g_config.hls_port = std::max(0, atoi(optarg));
+            break;
+        case 'Y':
+            g_config.hls_dir = optarg;
+            break;
+        case 'f':
+            if (strcmp(optarg, "ts") == 0) {
+                g_config.hls_format = HLS_TS;
+            } else if (strcmp(optarg, "fmp4") == 0) {
+                g_config.hls_format = HLS_FMP4;
+            } else {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 's':
+            g_config.hls_segment_s = std::max(1, atoi(optarg));
+            break;
+        case 'j':
+            g_config.hls_threads = std::max(1, atoi(optarg));
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (g_config.build_index) {
+        // 离线建索引：每个文件重新扫描一遍，已有的索引也覆盖
+        if (optind == argc) {
+            usage(argv[0]);
+            return -1;
+        }
+        log_init(g_config.log_level, g_config.log_rate);
+        int failed = 0;
+        for (int i = optind; i < argc; ++i) {
+            if (!build_packet_index(argv[i])) {
+                failed++;
+            }
+        }
+        return failed ? -1 : 0;
+    }
+    // 边缘节点只有端口一个参数，没有本地片源
+    bool edge = !g_config.upstream_host.empty();
+    if (argc - optind != (edge ? 1 : 2)) {
+        usage(argv[0]);
         return -1;
     }
+    g_config.port = atoi(argv[optind]);
+    g_config.video_filename = edge ? g_config.upstream_host.c_str() : argv[optind + 1];
+    if (g_config.workers <= 0) {
+        g_config.workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    log_init(g_config.log_level, g_config.log_rate);
+
     //检查文件是否存在
-    const char* video_filename = argv[2];
-    FILE* test_file = fopen(video_filename, "rb");
-    if (!test_file) {
-        perror("Error opening video file");
-        return -1;
+    const char* video_filename = g_config.video_filename;
+    struct stat st;
+    if (edge) {
+        if (g_config.mode != MODE_FILE) {
+            LOGE("An edge server relays whatever the upstream sends; --mode does not apply.");
+            return -1;
+        }
+    } else if (stat(video_filename, &st) == 0 && S_ISDIR(st.st_mode)) {
+        // 片库模式：客户端连接后发送片名，片源按需加载成点播包存储
+        if (g_config.mode == MODE_BROADCAST) {
+            LOGE("Broadcast mode streams a single file, not a catalog directory.");
+            return -1;
+        }
+        g_catalog.reset(new Catalog());
+        g_catalog->dir = video_filename;
+        g_catalog->budget_bytes = g_config.cache_bytes;
+        g_config.mode = MODE_VOD;
+        for (int i = 0; i < g_config.probe_threads; ++i) {
+            std::thread(catalog_worker_loop).detach();
+        }
+        for (int i = 0; i < g_config.transcode_threads; ++i) {
+            std::thread(transcode_worker_loop).detach();
+        }
+        if (g_config.hls_port > 0) {
+            // 分片缓存默认放在片库里的隐藏目录，以.开头的名字不会被当成片名
+            if (g_config.hls_dir.empty()) {
+                g_config.hls_dir = g_catalog->dir + "/.hls";
+            }
+            if (mkdir(g_config.hls_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+                LOGE("Cannot create HLS cache directory %s: %s", g_config.hls_dir.c_str(), strerror(errno));
+                return -1;
+            }
+            for (int i = 0; i < g_config.hls_threads; ++i) {
+                std::thread(hls_worker_loop).detach();
+            }
+        }
+    } else {
+        FILE* test_file = fopen(video_filename, "rb");
+        if (!test_file) {
+            LOGE("Error opening video file: %s", strerror(errno));
+            return -1;
+        }
+        fclose(test_file);
     }
-    fclose(test_file);
 
-    // 初始化并监听socket
-    int listensock = initserver(atoi(argv[1]));
-    if (listensock < 0) {
-        printf("initserver() failed.\n");
+    if (g_config.hls_port > 0 && !g_catalog) {
+        LOGE("--hls-port serves titles from a catalog directory.");
+        return -1;
+    }
+    if (g_config.hls_port > 0 && g_config.io == IO_URING) {
+        LOGE("--hls-port is only supported with the epoll backend.");
         return -1;
     }
-    printf("Server listening on port %s, streaming file %s\n", argv[1], video_filename);
+
+    // 单文件时先取包索引：文件模式的客户端用它跳过探测和定位跳转，点播存储用它预分配，准入控制用它估算码率。
+    // 点播模式没有现成的索引时由下面建包存储的那一遍解封装顺带建立
+    if (!g_catalog && !edge) {
+        g_file_index = g_config.mode == MODE_VOD ? open_packet_index(video_filename) : load_packet_index(video_filename);
+    }
+    // 广播模式：启动前打开共享源，由独立的生产线程按实时速度解封装
+    if (g_config.mode == MODE_BROADCAST) {
+        g_live_source = open_live_source(video_filename);
+        if (!g_live_source) {
+            LOGE("open_live_source() failed.");
+            return -1;
+        }
+        std::thread(live_source_loop, g_live_source).detach();
+    }
+    // 文件模式：每个客户端仍然各自解封装，打开片源交给后台线程
+    if (g_config.mode == MODE_FILE && !edge) {
+        for (int i = 0; i < g_config.probe_threads; ++i) {
+            std::thread(probe_worker_loop).detach();
+        }
+    }
+    // 点播模式：启动前一次性解封装整个文件，之后只读共享
+    if (g_config.mode == MODE_VOD && !g_catalog) {
+        g_packet_store = build_title_store(video_filename, g_file_index);
+        if (!g_packet_store) {
+            LOGE("build_packet_store() failed.");
+            return -1;
+        }
+        g_file_index = g_packet_store->index;
+    }
+
+    // 每个工作线程一个监听socket，由内核按SO_REUSEPORT把新连接分散到各线程
+    // 在主线程里统一创建，端口被占用等错误能在启动时直接暴露
+    bool reuseport = g_config.workers > 1;
+    std::vector<int> listensocks;
+    for (int i = 0; i < g_config.workers; ++i) {
+        int listensock = initserver(g_config.port, reuseport);
+        if (listensock < 0) {
+            LOGE("initserver() failed.");
+            return -1;
+        }
+        listensocks.push_back(listensock);
+        g_inboxes.emplace_back(new WorkerInbox());
+        if (g_config.hls_port > 0) {
+            int http_sock = initserver(g_config.hls_port, reuseport);
+            if (http_sock < 0) {
+                LOGE("initserver() failed for the HLS port.");
+                return -1;
+            }
+            g_http_socks.push_back(http_sock);
+        }
+    }
+    if (g_config.max_out_bps > 0 || g_config.max_cpu > 0) {
+        std::thread(admission_monitor_loop).detach();
+    }
+    if (g_config.metrics_port > 0) {
+        if (metrics_start(g_config.metrics_port, render_metrics)) {
+            LOGI("Metrics available at http://127.0.0.1:%d/metrics", g_config.metrics_port);
+        } else {
+            LOGE("Cannot listen on metrics port %d: %s", g_config.metrics_port, strerror(errno));
+        }
+    }
+    if (edge) {
+        LOGI("Server listening on port %d with %d %s worker(s), relaying titles from upstream %s:%d",
+             g_config.port, g_config.workers, g_config.io == IO_URING ? "io_uring" : "epoll",
+             g_config.upstream_host.c_str(), g_config.upstream_port);
+    } else {
+        LOGI("Server listening on port %d with %d %s worker(s), streaming %s %s",
+             g_config.port, g_config.workers, g_config.io == IO_URING ? "io_uring" : "epoll",
+             g_catalog ? "catalog" : "file", video_filename);
+    }
+    if (g_config.hls_port > 0) {
+        LOGI("HLS (%s, %d s segments) at http://<host>:%d/hls/<title>/index.m3u8, cached in %s",
+             g_config.hls_format == HLS_FMP4 ? "fmp4" : "ts", g_config.hls_segment_s, g_config.hls_port,
+             g_config.hls_dir.c_str());
+    }
+
+    if (g_config.workers == 1) {
+        run_worker(0, listensocks[0]);
+        return 0;
+    }
+    std::vector<std::thread> workers;
+    for (int i = 0; i < g_config.workers; ++i) {
+        workers.emplace_back(run_worker, i, listensocks[i]);
+    }
+    for (auto& t : workers) {
+        t.join();
+    }
+    return 0;
+}
+
+// 工作线程：独立的epoll循环，负责本线程接受的所有客户端（demux、过滤、发送）
+void run_worker(int worker_id, int listensock) {
+    char thread_name[32];
+    snprintf(thread_name, sizeof(thread_name), "worker %d", worker_id);
+    log_set_thread_name(thread_name);
+    t_worker_id = worker_id;
+    t_inbox = g_inboxes[worker_id].get();
+    register_thread_stats(thread_name);
+#ifdef HAVE_LIBURING
+    if (g_config.io == IO_URING) {
+        run_worker_uring(worker_id, listensock);
+        return;
+    }
+#endif
     //创建epoll实例
     int epollfd = epoll_create1(0);
     if (epollfd == -1) {
-        perror("epoll_create1");
-        return -1;
+        LOGE("epoll_create1: %s", strerror(errno));
+        return;
     }
 
-    //把监听socket添加到epoll实例，监听EPOLLIN实例
+    //把监听socket添加到epoll实例，监听EPOLLIN实例（水平触发，非阻塞以便一次接受一批连接）
+    set_non_blocking(listensock);
+    t_spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
     epoll_event ev;
     ev.events = EPOLLIN;
     ev.data.fd = listensock;
     if (epoll_ctl(epollfd, EPOLL_CTL_ADD, listensock, &ev) == -1) {
-        perror("epoll_ctl: listen_sock");
-        return -1;
+        LOGE("epoll_ctl: listen_sock: %s", strerror(errno));
+        close(epollfd);
+        return;
+    }
+    // HLS的HTTP监听socket，同样每个线程一个
+    int http_listensock = g_http_socks.empty() ? -1 : g_http_socks[worker_id];
+    if (http_listensock >= 0) {
+        set_non_blocking(http_listensock);
+        ev.events = EPOLLIN;
+        ev.data.fd = http_listensock;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, http_listensock, &ev) == -1) {
+            LOGE("epoll_ctl: http listen_sock: %s", strerror(errno));
+            close(epollfd);
+            return;
+        }
+    }
+
+    // 广播模式下订阅共享源的新包通知
+    int live_notify_fd = -1;
+    if (g_live_source) {
+        live_notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        ev.events = EPOLLIN;
+        ev.data.fd = live_notify_fd;
+        if (live_notify_fd == -1 || epoll_ctl(epollfd, EPOLL_CTL_ADD, live_notify_fd, &ev) == -1) {
+            LOGE("eventfd: live notify: %s", strerror(errno));
+            close(epollfd);
+            return;
+        }
+        std::lock_guard<std::mutex> lock(g_live_source->mtx);
+        g_live_source->notify_fds.push_back(live_notify_fd);
+    }
+
+    // 收件箱：加载完成的片源、打开好的文件、准入余量的通知
+    int inbox_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ev.events = EPOLLIN;
+    ev.data.fd = inbox_fd;
+    if (inbox_fd == -1 || epoll_ctl(epollfd, EPOLL_CTL_ADD, inbox_fd, &ev) == -1) {
+        LOGE("eventfd: inbox: %s", strerror(errno));
+        close(epollfd);
+        return;
+    }
+    t_inbox->notify_fd = inbox_fd;
+
+    // 实时发送的节拍定时器（广播源本身已按实时速度产出，不需要）；攒批发送推迟的flush也靠它唤醒
+    if ((g_config.pace && !g_live_source) || g_config.coalesce_ms > 0) {
+        pace_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        ev.events = EPOLLIN;
+        ev.data.fd = pace_timer_fd;
+        if (pace_timer_fd == -1 || epoll_ctl(epollfd, EPOLL_CTL_ADD, pace_timer_fd, &ev) == -1) {
+            LOGE("timerfd: pace timer: %s", strerror(errno));
+            close(epollfd);
+            return;
+        }
     }
 
     std::vector<epoll_event> events(64);//用于接收epoll_wait的返回值
     while (true) {
-        int nfds = epoll_wait(epollfd, events.data(), events.size(), -1);
+        int nfds = epoll_wait(epollfd, events.data(), events.size(), client_timer_timeout());
         if (nfds == -1) {
-            perror("epoll_wait");
-            return -1;
+            if (errno == EINTR) continue;
+            LOGE("epoll_wait: %s", strerror(errno));
+            break;
         }
 
+        uint64_t loop_start = metrics_now_ns();
         for (int n = 0; n < nfds; ++n) {
             //以下是监听情况，用于观察服务端运行情况
-            printf("Epoll event on fd=%d, events=%s%s%s%s\n",
-                   events[n].data.fd,
-                   (events[n].events & EPOLLIN) ? "EPOLLIN " : "",
-                   (events[n].events & EPOLLOUT) ? "EPOLLOUT " : "",
-                   (events[n].events & EPOLLERR) ? "EPOLLERR " : "",
-                   (events[n].events & EPOLLHUP) ? "EPOLLHUP " : "");
-
-            if (events[n].data.fd == listensock) {
+            LOGT("Epoll event on fd=%d, events=%s%s%s%s",
+                 events[n].data.fd,
+                 (events[n].events & EPOLLIN) ? "EPOLLIN " : "",
+                 (events[n].events & EPOLLOUT) ? "EPOLLOUT " : "",
+                 (events[n].events & EPOLLERR) ? "EPOLLERR " : "",
+                 (events[n].events & EPOLLHUP) ? "EPOLLHUP " : "");
+
+            if (events[n].data.fd == live_notify_fd) {
+                // 共享源产出了新包，推给已追上直播点的订阅者
+                uint64_t counter;
+                while (read(live_notify_fd, &counter, sizeof(counter)) > 0) {}
+                notify_live_clients(epollfd);
+            } else if (events[n].data.fd == inbox_fd) {
+                // 后台线程送来了等待中的客户端要的片源，或者准入有了余量
+                uint64_t counter;
+                while (read(inbox_fd, &counter, sizeof(counter)) > 0) {}
+                handle_inbox(epollfd);
+            } else if (events[n].data.fd == pace_timer_fd) {
+                // 有客户端的下一个包到了发送时间
+                uint64_t expirations;
+                while (read(pace_timer_fd, &expirations, sizeof(expirations)) > 0) {}
+                handle_pace_timer(epollfd);
+            } else if (events[n].data.fd == listensock) {
                 // 处理新的连接
-                struct sockaddr_in client_addr;
-                socklen_t client_len = sizeof(client_addr);
-                int clientsock = accept(listensock, (struct sockaddr*)&client_addr, &client_len);
-                if (clientsock == -1) {
-                    perror("accept");
+                accept_batch(epollfd, listensock, false);
+            } else if (events[n].data.fd == http_listensock) {
+                accept_batch(epollfd, http_listensock, true);
+            } else if (!http_conns.empty() && http_conns.count(events[n].data.fd)) {
+                // HLS的HTTP连接
+                int sock = events[n].data.fd;
+                if (events[n].events & (EPOLLHUP | EPOLLERR)) {
+                    close_http_conn(epollfd, sock);
                     continue;
                 }
-                add_client(epollfd, clientsock, video_filename);
+                if (events[n].events & EPOLLIN) {
+                    http_read(epollfd, sock);
+                } else if (events[n].events & EPOLLOUT) {
+                    http_serve(epollfd, sock);
+                }
             } else {
                 // 处理已连接的客户端事件
                 int clientsock = events[n].data.fd;
@@ -124,44 +1488,99 @@ int main(int argc, char* argv[]) {
                     // 可以向客户端写数据
                     handle_write(epollfd, clientsock);
                 }
-                 if (events[n].events & EPOLLIN) {
-                    // 接收数据以检测断开
-                    char dummy_buf[1];
-                    ssize_t n = recv(clientsock, dummy_buf, sizeof(dummy_buf), 0);
-                    if (n <= 0) { // 0 or -1 indicates disconnection or error
-                        remove_client(epollfd, clientsock);
-                    }
+                if (events[n].events & EPOLLIN) {
+                    // 读取客户端消息，同时检测断开
+                    handle_read(epollfd, clientsock);
                 }
             }
         }
+        // 本批事件处理完再走定时器轮，到期断开的连接不会再出现在同一批事件里
+        handle_client_timers(epollfd);
+        t_stats->loop_time.observe_ns(metrics_now_ns() - loop_start);
     }
 
+    close(epollfd);
     close(listensock);
-    return 0;
+    if (http_listensock >= 0) {
+        close(http_listensock);
+    }
+}
+
+//按服务模式初始化新接受的客户端
+void accept_client(int epollfd, int clientsock) {
+    if (g_catalog || !g_config.upstream_host.empty()) {
+        add_catalog_client(epollfd, clientsock);
+    } else if (g_live_source) {
+        add_live_client(epollfd, clientsock, g_live_source);
+    } else if (g_packet_store) {
+        add_vod_client(epollfd, clientsock, g_packet_store);
+    } else {
+        add_client(epollfd, clientsock, g_config.video_filename);
+    }
+}
+
+//监听socket就绪时把排队的连接一次接下来，每轮最多ACCEPT_BATCH个，剩下的留给下一轮，不饿死已有客户端。
+//http为true时是HLS的监听socket，接下来的是HTTP连接
+static void accept_batch(int epollfd, int listensock, bool http) {
+    for (int i = 0; i < ACCEPT_BATCH; ++i) {
+        int clientsock = accept4(listensock, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientsock == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if ((errno == EMFILE || errno == ENFILE) && t_spare_fd >= 0) {
+                // 描述符用尽：腾出备用的描述符接受并立即关闭一个连接，否则水平触发的监听socket会一直就绪
+                LOGW("accept: %s, shedding connection.", strerror(errno));
+                close(t_spare_fd);
+                clientsock = accept4(listensock, nullptr, nullptr, SOCK_CLOEXEC);
+                if (clientsock >= 0) {
+                    close(clientsock);
+                    t_stats->rejected.add();
+                }
+                t_spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOGE("accept: %s", strerror(errno));
+            }
+            return;
+        }
+        if (http) {
+            add_http_conn(epollfd, clientsock);
+            continue;
+        }
+        t_stats->accepts.add();
+        accept_client(epollfd, clientsock);
+    }
 }
+
 //按流程socket()->connect()->listen()->epoll_create()->epoll_ctl->epoll_wait
-int initserver(int port) {
+//reuseport为true时多个socket可绑定同一端口，内核按四元组哈希分配连接
+int initserver(int port, bool reuseport) {
     int sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock < 0) {
-        perror("socket() failed");
+        LOGE("socket() failed: %s", strerror(errno));
         return -1;
     }
 
     int opt = 1;
     setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) != 0) {
+        LOGE("setsockopt(SO_REUSEPORT) failed: %s", strerror(errno));
+        close(sock);
+        return -1;
+    }
 
     struct sockaddr_in servaddr;
     servaddr.sin_family = AF_INET;
     servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
     servaddr.sin_port = htons(port);
     if (bind(sock, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
-        perror("bind() failed");
+        LOGE("bind() failed: %s", strerror(errno));
         close(sock);
         return -1;
     }
 
-    if (listen(sock, 5) != 0) {
-        perror("listen() failed");
+    if (listen(sock, g_config.backlog) != 0) {
+        LOGE("listen() failed: %s", strerror(errno));
         close(sock);
         return -1;
     }
@@ -173,245 +1592,4060 @@ void set_non_blocking(int sock) {
     fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
 }
 
+//文件模式的客户端：先登记连接，打开片源交给后台线程，完成后由handle_probe_results开始推流
 void add_client(int epollfd, int clientsock, const char* video_filename) {
     set_non_blocking(clientsock);
-    
+
     ClientState state;
-    if (avformat_open_input(&state.fmt_ctx, video_filename, nullptr, nullptr) != 0) {
-        fprintf(stderr, "Could not open video file %s\n", video_filename);
-        close(clientsock);
-        return;
+    state.opening = true;
+    client_states[clientsock] = std::move(state);
+    register_client(epollfd, clientsock);
+    auto it = client_states.find(clientsock);
+    if (it == client_states.end()) {
+        return; //登记失败或被准入控制拒绝
     }
-    if (avformat_find_stream_info(state.fmt_ctx, nullptr) < 0) {
-        fprintf(stderr, "Could not find stream information\n");
-        avformat_close_input(&state.fmt_ctx);
-        close(clientsock);
-        return;
+    {
+        std::lock_guard<std::mutex> lock(g_probe_pool.mtx);
+        g_probe_pool.jobs.push_back({t_worker_id, clientsock, it->second.serial, video_filename});
     }
-    state.video_stream_index = av_find_best_stream(state.fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
-    state.audio_stream_index = av_find_best_stream(state.fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0); // 查找音频流
-    if (state.video_stream_index < 0) {
-        fprintf(stderr, "Could not find video stream in input file\n");
-        avformat_close_input(&state.fmt_ctx);
-        close(clientsock);
-        return;
+    g_probe_pool.cv.notify_one();
+}
+
+//打开要推流的片源：默认经进程内共享的只读映射读取，--no-mmap时走file:协议；关闭统一用mapped_close_input
+static int open_source_input(AVFormatContext** fmt_ctx, const char* filename) {
+    if (!g_config.use_mmap) {
+        return avformat_open_input(fmt_ctx, filename, nullptr, nullptr);
     }
+    return mapped_open_input(fmt_ctx, filename);
+}
 
-    // 获取音频参数
-    uint32_t audio_sample_rate = 0;
-    uint32_t audio_channels = 0;
-    uint32_t audio_format = 0;
-    if (state.audio_stream_index >= 0) {
-        AVCodecParameters* audio_par = state.fmt_ctx->streams[state.audio_stream_index]->codecpar;
-        audio_sample_rate = audio_par->sample_rate;
-        audio_channels = audio_par->channels;
-        audio_format = audio_par->format;
+//打开片源：有包索引时不再探测，流序号和流信息包在建索引时已经确定
+static bool open_file_source(const char* filename, ProbeResult& r) {
+    if (open_source_input(&r.fmt_ctx, filename) != 0) {
+        LOGE("Could not open video file %s", filename);
+        return false;
+    }
+    const PacketIndex* index = g_file_index.get();
+    if (index && (unsigned)index->header().video_stream < r.fmt_ctx->nb_streams) {
+        r.video_stream_index = index->header().video_stream;
+        r.audio_stream_index = index->header().audio_stream;
+        r.info_packet.assign(index->info_packet(), index->info_packet() + index->info_size());
+    } else {
+        if (avformat_find_stream_info(r.fmt_ctx, nullptr) < 0) {
+            LOGE("Could not find stream information");
+            mapped_close_input(&r.fmt_ctx);
+            return false;
+        }
+        r.video_stream_index = av_find_best_stream(r.fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+        r.audio_stream_index = av_find_best_stream(r.fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0); // 查找音频流
+        if (r.video_stream_index < 0) {
+            LOGE("Could not find video stream in input file");
+            mapped_close_input(&r.fmt_ctx);
+            return false;
+        }
+        if (!build_stream_info(r.fmt_ctx, r.video_stream_index, r.audio_stream_index, r.info_packet)) {
+            mapped_close_input(&r.fmt_ctx);
+            return false;
+        }
+    }
+    //初始化比特流过滤器（h264模式）一定要统一格式
+    if (!init_annexb_bsf(r.fmt_ctx->streams[r.video_stream_index]->codecpar, &r.bsf_ctx)) {
+        mapped_close_input(&r.fmt_ctx);
+        return false;
     }
+    return true;
+}
 
-    //存视频元信息，按包处理
-    AVStream* stream = state.fmt_ctx->streams[state.video_stream_index];
-    AVCodecParameters* codecpar = stream->codecpar;
+//唤醒等在eventfd上的线程；计数已到上限（EAGAIN）说明对方还没读走上一次唤醒，不用再写
+static void wake_eventfd(int fd) {
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) != (ssize_t)sizeof(one) && errno != EAGAIN) {
+        LOGW("eventfd write on fd %d: %s", fd, strerror(errno));
+    }
+}
 
-    PacketHeader info_header;
-    info_header.magic = PACKET_MAGIC;
-    info_header.dataType = 2; // Using 2 for stream info
-    info_header.dataSize = sizeof(uint32_t) * 5 + sizeof(int32_t) * 2; // width, height, audio_sample_rate, audio_channels, audio_format, tb_num, tb_den
-    info_header.pts = 0; // Not used for info packet
+//打开片源的后台线程：取任务、打开文件，把结果投递回客户端所在的工作线程
+static void probe_worker_loop() {
+    log_set_thread_name("probe");
+    while (true) {
+        ProbeJob job;
+        {
+            std::unique_lock<std::mutex> lock(g_probe_pool.mtx);
+            g_probe_pool.cv.wait(lock, [] { return !g_probe_pool.jobs.empty(); });
+            job = g_probe_pool.jobs.front();
+            g_probe_pool.jobs.pop_front();
+        }
+        ProbeResult r;
+        r.clientsock = job.clientsock;
+        r.serial = job.serial;
+        open_file_source(job.filename, r);
+        WorkerInbox* inbox = g_inboxes[job.worker].get();
+        {
+            std::lock_guard<std::mutex> lock(inbox->mtx);
+            inbox->probed.push_back(std::move(r));
+        }
+        wake_eventfd(inbox->notify_fd);
+    }
+}
 
-    uint32_t width = codecpar->width;
-    uint32_t height = codecpar->height;
-    int32_t tb_num = stream->time_base.num;
-    int32_t tb_den = stream->time_base.den;
-
-    state.pending_data.resize(sizeof(info_header) + info_header.dataSize);
-    uint8_t* p = state.pending_data.data();
-    memcpy(p, &info_header, sizeof(info_header)); p += sizeof(info_header);
-    memcpy(p, &width, sizeof(width)); p += sizeof(width);
-    memcpy(p, &height, sizeof(height)); p += sizeof(height);
-    memcpy(p, &audio_sample_rate, sizeof(audio_sample_rate)); p += sizeof(audio_sample_rate);
-    memcpy(p, &audio_channels, sizeof(audio_channels)); p += sizeof(audio_channels);
-    memcpy(p, &audio_format, sizeof(audio_format)); p += sizeof(audio_format);
-    memcpy(p, &tb_num, sizeof(tb_num)); p += sizeof(tb_num);
-    memcpy(p, &tb_den, sizeof(tb_den));
-    
-    printf("Queued stream info for client %d: %ux%u, time_base: %d/%d, audio: %u Hz, %u ch, fmt=%u\n", clientsock, width, height, tb_num, tb_den, audio_sample_rate, audio_channels, audio_format);
-    
-    //初始化比特流过滤器（h264模式）一定要统一格式
-    const AVBitStreamFilter* bsf = av_bsf_get_by_name("h264_mp4toannexb");
-    if (!bsf) {
-        fprintf(stderr, "Failed to find h264_mp4toannexb bitstream filter\n");
-        avformat_close_input(&state.fmt_ctx);
-        close(clientsock);
-        return;
+//片源打开好了：交给还在等待的客户端开始推流；客户端已经断开的话直接释放
+static void handle_probe_results(int epollfd) {
+    std::vector<ProbeResult> probed;
+    {
+        std::lock_guard<std::mutex> lock(t_inbox->mtx);
+        probed.swap(t_inbox->probed);
     }
-    if (av_bsf_alloc(bsf, &state.bsf_ctx) < 0) {
-        fprintf(stderr, "Failed to allocate bitstream filter context\n");
-        avformat_close_input(&state.fmt_ctx);
-        close(clientsock);
-        return;
+    for (ProbeResult& r : probed) {
+        auto it = client_states.find(r.clientsock);
+        if (it == client_states.end() || it->second.serial != r.serial || !it->second.opening) {
+            av_bsf_free(&r.bsf_ctx);
+            mapped_close_input(&r.fmt_ctx);
+            continue;
+        }
+        if (!r.fmt_ctx) {
+            reject_client(epollfd, r.clientsock, "cannot open source");
+            continue;
+        }
+        ClientState& state = it->second;
+        state.opening = false;
+        state.fmt_ctx = r.fmt_ctx;
+        state.bsf_ctx = r.bsf_ctx;
+        state.video_stream_index = r.video_stream_index;
+        state.audio_stream_index = r.audio_stream_index;
+        push_bytes(state.outq, r.info_packet);
+        LOGD("Queued stream info for client %d (%zu bytes)", r.clientsock, r.info_packet.size());
+        state.read_pkt = av_packet_alloc();
+        state.filt_pkt = av_packet_alloc();
+        state.held_pkt = av_packet_alloc();
+        state.paced = g_config.pace;
+        state.pace_start = std::chrono::steady_clock::now();
+        state.drop_enabled = state.paced && g_config.drop_bytes > 0;
+        handle_write(epollfd, r.clientsock);
     }
-    avcodec_parameters_copy(state.bsf_ctx->par_in, state.fmt_ctx->streams[state.video_stream_index]->codecpar);
-    if (av_bsf_init(state.bsf_ctx) < 0) {
-        fprintf(stderr, "Failed to init bitstream filter context\n");
-        av_bsf_free(&state.bsf_ctx);
-        avformat_close_input(&state.fmt_ctx);
-        close(clientsock);
+}
+
+//把新客户端socket添加到epoll，监听读写，设置边缘触发
+//准入控制超过上限时直接拒绝，或者先登记连接、排队等有余量再开始推流
+void register_client(int epollfd, int clientsock) {
+    ClientState& state = client_states[clientsock];
+    if (!admission_open()) {
+        if (g_config.admission_queue_ms == 0) {
+            t_stats->rejected.add();
+            LOGW("Rejected connection on socket %d: server busy.", clientsock);
+            client_states.erase(clientsock);
+            send_error(clientsock, "server busy");
+            close(clientsock);
+            return;
+        }
+        state.queued = true;
+    } else if (g_config.max_out_bps > 0) {
+        g_admission.reserved_bps.fetch_add(expected_client_bps(), std::memory_order_relaxed);
+    }
+#ifdef HAVE_LIBURING
+    if (g_config.io == IO_URING) {
+        uring_register_client(clientsock, state);
+        track_client(clientsock, state);
+        queue_for_admission(clientsock, state);
+        handle_write(-1, clientsock);
         return;
     }
-
-    client_states[clientsock] = std::move(state);
-
-    //把新客户端socket添加到epoll，监听读写，设置边缘触发
+#endif
     epoll_event ev;
     ev.events = EPOLLIN | EPOLLOUT | EPOLLET; // 监听读、写和边缘触发
     ev.data.fd = clientsock;
     if (epoll_ctl(epollfd, EPOLL_CTL_ADD, clientsock, &ev) == -1) {
-        perror("epoll_ctl: add client");
+        LOGE("epoll_ctl: add client: %s", strerror(errno));
         client_states.erase(clientsock);
         close(clientsock);
         return;
     }
-    
+    track_client(clientsock, state);
+    queue_for_admission(clientsock, state);
+}
+
+//新客户端的预计码率：片源有包索引就用平均码率，否则用最近采样的每客户端平均带宽
+static uint64_t expected_client_bps() {
+    if (g_file_index && g_file_index->average_bitrate() > 0) {
+        return g_file_index->average_bitrate();
+    }
+    return g_admission.per_client_bps.load(std::memory_order_relaxed);
+}
+
+//出口带宽（加上本周期已放行客户端的预计码率）和CPU是否都还在上限以内
+static bool admission_open() {
+    if (g_config.max_out_bps > 0) {
+        uint64_t projected = g_admission.out_bps.load(std::memory_order_relaxed) +
+                             g_admission.reserved_bps.load(std::memory_order_relaxed) + expected_client_bps();
+        if (projected > g_config.max_out_bps) {
+            return false;
+        }
+    }
+    if (g_config.max_cpu > 0 && g_admission.cpu_percent.load(std::memory_order_relaxed) >= g_config.max_cpu) {
+        return false;
+    }
+    return true;
+}
+
+//排队的客户端记下到达时间，采样线程发现有余量时通过收件箱唤醒本线程
+static void queue_for_admission(int clientsock, ClientState& state) {
+    if (!state.queued) {
+        return;
+    }
+    t_stats->queued.add();
+    g_admission.queued.fetch_add(1, std::memory_order_relaxed);
+    t_admission_queue.push_back({clientsock, state.serial, std::chrono::steady_clock::now()});
+    LOGD("Client %d queued for admission.", clientsock);
+}
+
+//按到达顺序放行排队的客户端，等太久的拒绝；已断开的直接出队
+static void admission_release(int epollfd) {
+    auto now = std::chrono::steady_clock::now();
+    auto max_wait = std::chrono::milliseconds(g_config.admission_queue_ms);
+    while (!t_admission_queue.empty()) {
+        QueuedClient c = t_admission_queue.front();
+        auto it = client_states.find(c.clientsock);
+        if (it == client_states.end() || it->second.serial != c.serial || !it->second.queued) {
+            t_admission_queue.pop_front();
+            g_admission.queued.fetch_sub(1, std::memory_order_relaxed);
+            continue;
+        }
+        ClientState& state = it->second;
+        if (admission_open()) {
+            t_admission_queue.pop_front();
+            g_admission.queued.fetch_sub(1, std::memory_order_relaxed);
+            if (g_config.max_out_bps > 0) {
+                g_admission.reserved_bps.fetch_add(expected_client_bps(), std::memory_order_relaxed);
+            }
+            state.queued = false;
+            // 排队期间直播点和时间线都已经往前走了，从现在重新起算
+            state.pace_start = now;
+            if (state.live) {
+                live_rejoin(state);
+            }
+            LOGD("Client %d admitted after %lld ms.", c.clientsock,
+                 (long long)std::chrono::duration_cast<std::chrono::milliseconds>(now - c.since).count());
+            handle_write(epollfd, c.clientsock);
+            continue;
+        }
+        if (now - c.since < max_wait) {
+            break;
+        }
+        t_admission_queue.pop_front();
+        g_admission.queued.fetch_sub(1, std::memory_order_relaxed);
+        t_stats->rejected.add();
+        reject_client(epollfd, c.clientsock, "server busy");
+    }
+}
+
+//进程累计的CPU时间（用户态+内核态，秒）
+static double process_cpu_seconds() {
+    rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+//准入控制的采样线程：定期汇总各线程的发送字节数和进程CPU时间；有客户端在排队时唤醒各工作线程重新判断
+static void admission_monitor_loop() {
+    log_set_thread_name("admission");
+    unsigned ncpu = std::max(1u, std::thread::hardware_concurrency());
+    auto last_wall = std::chrono::steady_clock::now();
+    double last_cpu = process_cpu_seconds();
+    uint64_t last_bytes = 0;
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(ADMISSION_SAMPLE_MS));
+        uint64_t bytes = 0;
+        int64_t clients = 0;
+        {
+            std::lock_guard<std::mutex> lock(g_metrics.mtx);
+            for (auto& t : g_metrics.threads) {
+                bytes += t->bytes_sent.get();
+                clients += t->clients.get();
+            }
+        }
+        auto wall = std::chrono::steady_clock::now();
+        double cpu = process_cpu_seconds();
+        double secs = std::chrono::duration<double>(wall - last_wall).count();
+        uint64_t bps = secs > 0 ? (uint64_t)((bytes - last_bytes) * 8 / secs) : 0;
+        g_admission.out_bps.store(bps, std::memory_order_relaxed);
+        g_admission.per_client_bps.store(clients > 0 ? bps / clients : 0, std::memory_order_relaxed);
+        g_admission.cpu_percent.store(secs > 0 ? (int)((cpu - last_cpu) * 100 / (secs * ncpu)) : 0,
+                                      std::memory_order_relaxed);
+        g_admission.reserved_bps.store(0, std::memory_order_relaxed);
+        last_wall = wall;
+        last_cpu = cpu;
+        last_bytes = bytes;
+        if (g_admission.queued.load(std::memory_order_relaxed) > 0) {
+            for (auto& inbox : g_inboxes) {
+                int fd = inbox->notify_fd;
+                if (fd >= 0) wake_eventfd(fd);
+            }
+        }
+    }
+}
+
+//为新客户端建立指标并登记到注册表
+static void track_client(int clientsock, ClientState& state) {
     char client_ip[INET_ADDRSTRLEN];
     struct sockaddr_in client_addr;
     socklen_t client_len = sizeof(client_addr);
     getpeername(clientsock, (struct sockaddr*)&client_addr, &client_len);
     inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-    printf("Client %s (socket=%d) connected.\n", client_ip, clientsock);
+    LOGI("Client %s (socket=%d) connected.", client_ip, clientsock);
+
+    auto stats = std::make_shared<ClientStats>();
+    stats->sock = clientsock;
+    stats->worker = t_worker_id;
+    stats->peer = std::string(client_ip) + ":" + std::to_string(ntohs(client_addr.sin_port));
+    stats->mode = state.live ? "broadcast" : (state.vod || state.awaiting_title) ? "vod" : "file";
+    state.stats = stats;
+    state.serial = ++t_next_serial;
+    t_stats->clients.add(1);
+    start_client_timers(clientsock, state);
+    std::lock_guard<std::mutex> lock(g_metrics.mtx);
+    g_metrics.clients.push_back(std::move(stats));
+}
+
+//编码参数消息中追加一个流
+static void append_stream_entry(std::vector<uint8_t>& out, uint32_t stream_id, const AVCodecParameters* par, AVRational time_base) {
+    StreamInfoEntry e = {};
+    e.streamId = stream_id;
+    e.mediaType = stream_id;
+    e.codecId = par->codec_id;
+    e.tbNum = time_base.num;
+    e.tbDen = time_base.den;
+    e.width = par->width;
+    e.height = par->height;
+    e.format = par->format;
+    e.sampleRate = par->sample_rate;
+    e.channels = par->channels;
+    e.channelLayout = par->channel_layout;
+    e.bitRate = par->bit_rate;
+    e.extradataSize = par->extradata ? par->extradata_size : 0;
+    out.insert(out.end(), (const uint8_t*)&e, (const uint8_t*)&e + sizeof(e));
+    out.insert(out.end(), par->extradata, par->extradata + e.extradataSize);
+}
+
+//存视频元信息，按包处理：PacketHeader + width, height, audio_sample_rate, audio_channels, audio_format, tb_num, tb_den
+//后面紧跟一条编码参数消息（DATA_STREAM_INFO），旧客户端不认识这个类型会跳过
+bool build_stream_info(AVFormatContext* fmt_ctx, int video_stream_index, int audio_stream_index, std::vector<uint8_t>& out) {
+    if (video_stream_index < 0) return false;
+
+    // 获取音频参数
+    uint32_t audio_sample_rate = 0;
+    uint32_t audio_channels = 0;
+    uint32_t audio_format = 0;
+    if (audio_stream_index >= 0) {
+        AVCodecParameters* audio_par = fmt_ctx->streams[audio_stream_index]->codecpar;
+        audio_sample_rate = audio_par->sample_rate;
+        audio_channels = audio_par->channels;
+        audio_format = audio_par->format;
+    }
+
+    AVStream* stream = fmt_ctx->streams[video_stream_index];
+    AVCodecParameters* codecpar = stream->codecpar;
+
+    PacketHeader info_header;
+    info_header.magic = PACKET_MAGIC;
+    info_header.dataType = 2; // Using 2 for stream info
+    info_header.dataSize = sizeof(uint32_t) * 5 + sizeof(int32_t) * 2;
+    info_header.pts = 0; // Not used for info packet
+
+    uint32_t width = codecpar->width;
+    uint32_t height = codecpar->height;
+    int32_t tb_num = stream->time_base.num;
+    int32_t tb_den = stream->time_base.den;
+
+    out.resize(sizeof(info_header) + info_header.dataSize);
+    uint8_t* p = out.data();
+    memcpy(p, &info_header, sizeof(info_header)); p += sizeof(info_header);
+    memcpy(p, &width, sizeof(width)); p += sizeof(width);
+    memcpy(p, &height, sizeof(height)); p += sizeof(height);
+    memcpy(p, &audio_sample_rate, sizeof(audio_sample_rate)); p += sizeof(audio_sample_rate);
+    memcpy(p, &audio_channels, sizeof(audio_channels)); p += sizeof(audio_channels);
+    memcpy(p, &audio_format, sizeof(audio_format)); p += sizeof(audio_format);
+    memcpy(p, &tb_num, sizeof(tb_num)); p += sizeof(tb_num);
+    memcpy(p, &tb_den, sizeof(tb_den));
+
+    // 视频的extradata取BSF的输出参数，和实际发送的annex-B码流一致
+    AVBSFContext* bsf_ctx = nullptr;
+    if (!init_annexb_bsf(codecpar, &bsf_ctx)) {
+        return false;
+    }
+    std::vector<uint8_t> streams(sizeof(uint32_t));
+    uint32_t stream_count = 1;
+    append_stream_entry(streams, 0, bsf_ctx->par_out, stream->time_base);
+    av_bsf_free(&bsf_ctx);
+    if (audio_stream_index >= 0) {
+        append_stream_entry(streams, 1, fmt_ctx->streams[audio_stream_index]->codecpar,
+                            fmt_ctx->streams[audio_stream_index]->time_base);
+        stream_count++;
+    }
+    memcpy(streams.data(), &stream_count, sizeof(stream_count));
+    PacketHeader streams_header;
+    streams_header.magic = PACKET_MAGIC;
+    streams_header.dataType = DATA_STREAM_INFO;
+    streams_header.dataSize = streams.size();
+    streams_header.pts = 0;
+    out.insert(out.end(), (const uint8_t*)&streams_header, (const uint8_t*)&streams_header + sizeof(streams_header));
+    out.insert(out.end(), streams.begin(), streams.end());
+
+    LOGD("Stream info: %s %ux%u, time_base: %d/%d, audio: %s %u Hz, %u ch, fmt=%u", avcodec_get_name(codecpar->codec_id),
+         width, height, tb_num, tb_den, audio_stream_index >= 0 ? avcodec_get_name(fmt_ctx->streams[audio_stream_index]->codecpar->codec_id) : "none",
+         audio_sample_rate, audio_channels, audio_format);
+    return true;
+}
+
+//初始化比特流过滤器：H.264/HEVC转成annex-B（关键帧前带参数集），其他编码原样通过，失败时*bsf_ctx保持为空
+bool init_annexb_bsf(AVCodecParameters* codecpar, AVBSFContext** bsf_ctx) {
+    const char* name = codecpar->codec_id == AV_CODEC_ID_H264 ? "h264_mp4toannexb"
+                     : codecpar->codec_id == AV_CODEC_ID_HEVC ? "hevc_mp4toannexb"
+                     : "null";
+    const AVBitStreamFilter* bsf = av_bsf_get_by_name(name);
+    if (!bsf) {
+        LOGE("Failed to find %s bitstream filter", name);
+        return false;
+    }
+    if (av_bsf_alloc(bsf, bsf_ctx) < 0) {
+        LOGE("Failed to allocate bitstream filter context");
+        return false;
+    }
+    avcodec_parameters_copy((*bsf_ctx)->par_in, codecpar);
+    if (av_bsf_init(*bsf_ctx) < 0) {
+        LOGE("Failed to init bitstream filter context");
+        av_bsf_free(bsf_ctx);
+        return false;
+    }
+    return true;
 }
 
 //移除客户端并释放资源
 void remove_client(int epollfd, int clientsock) {
-    printf("Client (socket=%d) disconnected.\n", clientsock);
+    LOGI("Client (socket=%d) disconnected.", clientsock);
     epoll_ctl(epollfd, EPOLL_CTL_DEL, clientsock, nullptr);
     
     auto it = client_states.find(clientsock);
     if (it != client_states.end()) {
+        if (ClientStats* stats = it->second.stats.get()) {
+            if (stats->dropped_disposable.get() || stats->dropped_gop.get()) {
+                LOGI("Client (socket=%d) dropped %llu disposable + %llu GOP video packets (%llu bytes).", clientsock,
+                     (unsigned long long)stats->dropped_disposable.get(), (unsigned long long)stats->dropped_gop.get(),
+                     (unsigned long long)stats->dropped_bytes.get());
+            }
+            t_stats->clients.add(-1);
+            t_stats->disconnects.add();
+            std::lock_guard<std::mutex> lock(g_metrics.mtx);
+            auto& clients = g_metrics.clients;
+            auto pos = std::find(clients.begin(), clients.end(), it->second.stats);
+            if (pos != clients.end()) {
+                *pos = std::move(clients.back());
+                clients.pop_back();
+            }
+        }
+#ifdef HAVE_LIBURING
+        if (g_config.io == IO_URING) {
+            uring_forget_client(clientsock, it->second);
+        }
+#endif
+        if (it->second.publishing) {
+            end_publish(it->second);
+        }
+        if (it->second.transcode) {
+            std::lock_guard<std::mutex> lock(it->second.transcode->mtx);
+            it->second.transcode->viewers.erase({t_worker_id, it->second.serial});
+        }
         av_bsf_free(&it->second.bsf_ctx);
-        avformat_close_input(&it->second.fmt_ctx);
+        mapped_close_input(&it->second.fmt_ctx);
+        av_packet_free(&it->second.read_pkt);
+        av_packet_free(&it->second.filt_pkt);
+        av_packet_free(&it->second.held_pkt);
         client_states.erase(it);
     }
     close(clientsock);
 }
 
 void handle_write(int epollfd, int clientsock) {
-    printf("[LOG] handle_write called for socket %d\n", clientsock);
+    LOGT("handle_write called for socket %d", clientsock);
 
     auto it = client_states.find(clientsock);
     if (it == client_states.end()) return;
     
     ClientState& state = it->second;
+    if (state.awaiting_title || state.opening || state.queued || state.paused || state.publishing) {
+        return; //片源还没准备好、还在排队，客户端暂停了，或者是只上行的推流端
+    }
 
-    if (!state.pending_data.empty()) {
-        ssize_t n = write(clientsock, state.pending_data.data(), state.pending_data.size());
-        if (n >= 0) {
-            if (n < state.pending_data.size()) {
-                printf("[LOG] Partial write of pending data to socket %d: wrote %zd of %zu bytes.\n", clientsock, n, state.pending_data.size());
-                state.pending_data.erase(state.pending_data.begin(), state.pending_data.begin() + n);
-                return; //Buffer 满, 等下一个 EPOLLOUT.
-            }
-            state.pending_data.clear();
-             printf("[LOG] Finished sending pending data to socket %d.\n", clientsock);
+    // 主循环：按模式把数据包填进输出队列，再批量发出，直到发送阻塞或没有新数据
+    while (true) {
+        bool ok;
+        if (state.live) {
+            ok = fill_live_client(clientsock, state);
+        } else if (state.vod) {
+            ok = fill_vod_client(clientsock, state);
+        } else if (state.transcode) {
+            ok = fill_transcode_client(clientsock, state);
         } else {
-            if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                perror("write pending data");
-                remove_client(epollfd, clientsock);
+            ok = fill_file_client(clientsock, state);
+        }
+        if (!ok) {
+            remove_client(epollfd, clientsock);
+            return;
+        }
+        if (state.outq.empty()) {
+            return; //已追上直播点等源的新包通知，或者下一个包还没到发送时间
+        }
+        if (!flush_due(clientsock, state)) {
+            return; //攒批：数据还少，定时器到期或有更多数据时再发
+        }
+#ifdef HAVE_LIBURING
+        if (g_config.io == IO_URING) {
+            uring_submit_send(clientsock, state); //异步发送，完成后再来填充
+            return;
+        }
+#endif
+        int ret = flush_output(clientsock, state);
+        if (ret < 0) {
+            LOGE("sendmsg on output queue: %s", strerror(errno));
+            remove_client(epollfd, clientsock);
+            return;
+        }
+        if (ret == 0) {
+            watch_drain(state);
+            size_t backlog = client_backlog_bytes(clientsock, state);
+            state.stats->eagain.add();
+            t_stats->eagain.add();
+            state.stats->backlog_bytes.set(backlog);
+            LOGD("Socket %d would block, backlog %zu bytes.", clientsock, backlog);
+            return; //Buffer 满, 等下一个 EPOLLOUT.
+        }
+    }
+}
+
+//把整块字节（如流信息包）放进输出队列
+static void push_bytes(OutputQueue& q, const std::vector<uint8_t>& bytes) {
+    auto owner = std::make_shared<std::vector<uint8_t>>(bytes);
+    OutputQueue::Slice& s = q.prepare();
+    s.data = owner->data();
+    s.size = owner->size();
+    s.owner = owner;
+    s.dataType = 2;
+    q.commit();
+}
+
+//按客户端的协议版本写包头，返回包头长度；v1包头没有位置放dts、时长和标志
+static uint32_t frame_header(uint8_t* out, int protocol, uint32_t data_type, uint32_t size, int64_t pts, int64_t dts,
+                             int64_t duration, bool keyframe, bool disposable) {
+    if (protocol < 2) {
+        PacketHeader header;
+        header.magic = PACKET_MAGIC;
+        header.dataType = data_type;
+        header.dataSize = size;
+        header.pts = pts;
+        memcpy(out, &header, sizeof(header));
+        return sizeof(header);
+    }
+    PacketHeaderV2 header;
+    header.magic = PACKET_MAGIC_V2;
+    header.version = 2;
+    header.flags = (keyframe ? PACKET_FLAG_KEY : 0) | (disposable ? PACKET_FLAG_DISPOSABLE : 0);
+    header.headerSize = sizeof(header);
+    header.dataType = (uint16_t)data_type;
+    header.streamId = data_type <= 1 ? (uint16_t)data_type : 0;
+    header.dataSize = size;
+    header.pts = pts;
+    header.dts = dts;
+    header.duration = duration;
+    memcpy(out, &header, sizeof(header));
+    return sizeof(header);
+}
+
+//把只有包头的控制消息放进输出队列
+static void push_message(OutputQueue& q, int protocol, uint32_t data_type, int64_t pts) {
+    OutputQueue::Slice& s = q.prepare();
+    s.header_len = frame_header(s.header, protocol, data_type, 0, pts, pts, 0, false, false);
+    s.dataType = data_type;
+    s.pts = pts;
+    q.commit();
+}
+
+//把AVPacket放进输出队列：包头单独存放，负载只增加引用计数，不拷贝
+static bool push_avpacket(OutputQueue& q, int protocol, uint32_t data_type, AVPacket* pkt, bool disposable) {
+    if (av_packet_make_refcounted(pkt) < 0) {
+        return false;
+    }
+    OutputQueue::Slice& s = q.prepare();
+    s.header_len = frame_header(s.header, protocol, data_type, pkt->size, pkt->pts, pkt->dts, pkt->duration,
+                                (pkt->flags & AV_PKT_FLAG_KEY) != 0, disposable);
+    s.buf = av_buffer_ref(pkt->buf);
+    if (!s.buf) {
+        s.header_len = 0;
+        return false;
+    }
+    s.data = pkt->data;
+    s.size = pkt->size;
+    s.dataType = data_type;
+    s.keyframe = (pkt->flags & AV_PKT_FLAG_KEY) != 0;
+    s.pts = pkt->pts;
+    q.commit();
+    return true;
+}
+
+//把共享的已封装数据包放进输出队列；v2客户端另写包头，只引用其中的负载
+static void push_framed(OutputQueue& q, int protocol, const FramedPacketPtr& fp) {
+    OutputQueue::Slice& s = q.prepare();
+    s.data = fp->bytes.data();
+    s.size = fp->bytes.size();
+    if (protocol >= 2) {
+        s.data += sizeof(PacketHeader);
+        s.size -= sizeof(PacketHeader);
+        s.header_len = frame_header(s.header, protocol, fp->dataType, s.size, fp->pts, fp->dts, fp->duration,
+                                    fp->keyframe, fp->disposable);
+    }
+    s.owner = fp;
+    s.dataType = fp->dataType;
+    s.keyframe = fp->keyframe;
+    s.pts = fp->pts;
+    q.commit();
+}
+
+//文件模式：本客户端自己解封装，直到输出队列满（实时发送时遇到未到时间的包就先留着）
+bool fill_file_client(int clientsock, ClientState& state) {
+    begin_fill(clientsock, state);
+    while (!output_full(state)) {
+        if (state.held) {
+            if (!pace_due(clientsock, state, state.held_ts_us, state.held_type)) {
+                break;
             }
-            return; //等下一个 EPOLLOUT.
+            bool ok = true;
+            if (admit_packet(clientsock, state, state.held_type, state.held_keyframe, state.held_disposable, state.held_pkt->size)) {
+                ok = push_avpacket(state.outq, state.protocol, state.held_type, state.held_pkt, state.held_disposable);
+            }
+            av_packet_unref(state.held_pkt);
+            state.held = false;
+            if (!ok) return false;
+            continue;
+        }
+
+        // 先取完BSF中已过滤好的视频包
+        int ret2 = av_bsf_receive_packet(state.bsf_ctx, state.filt_pkt);
+        if (ret2 == 0) {
+            hold_packet(state, 0, state.filt_pkt, state.fmt_ctx->streams[state.video_stream_index]->time_base); //0 ：video
+            continue;
+        } else if (ret2 != AVERROR(EAGAIN) && ret2 != AVERROR_EOF) {
+            return false;
+        }
+
+        uint64_t demux_start = metrics_now_ns();
+        int ret = av_read_frame(state.fmt_ctx, state.read_pkt);
+        if (ret < 0) {
+            LOGD("End of file on %s. Seeking to beginning.", state.fmt_ctx->url);
+            av_seek_frame(state.fmt_ctx, state.video_stream_index, 0, AVSEEK_FLAG_BACKWARD);
+            av_bsf_flush(state.bsf_ctx);
+            pace_restart_loop(state);
+            state.stats->wraparounds.add();
+            continue;
+        }
+
+        if (state.read_pkt->stream_index == state.video_stream_index) {
+            // 视频包交给BSF，下一轮取出过滤结果
+            if (av_bsf_send_packet(state.bsf_ctx, state.read_pkt) < 0) {
+                av_packet_unref(state.read_pkt);
+            }
+            t_stats->demux_time.observe_ns(metrics_now_ns() - demux_start);
+        } else if (state.read_pkt->stream_index == state.audio_stream_index && state.audio_stream_index >= 0) {
+            //音频包处理：负载按引用入队，不拷贝
+            t_stats->demux_time.observe_ns(metrics_now_ns() - demux_start);
+            hold_packet(state, 1, state.read_pkt, state.fmt_ctx->streams[state.audio_stream_index]->time_base); //1 ：audio
+        } else {
+            av_packet_unref(state.read_pkt);
+        }
+    }
+    return true;
+}
+
+//把读出的包转到held_pkt，记下发送节拍用的时间戳
+static void hold_packet(ClientState& state, uint32_t data_type, AVPacket* pkt, AVRational time_base) {
+    int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    state.held_ts_us = ts != AV_NOPTS_VALUE ? av_rescale_q(ts, time_base, AV_TIME_BASE_Q) : AV_NOPTS_VALUE;
+    state.held_type = data_type;
+    state.held_keyframe = (pkt->flags & AV_PKT_FLAG_KEY) != 0;
+    state.held_disposable = data_type == 0 && packet_disposable(pkt, state.fmt_ctx->streams[state.video_stream_index]->codecpar->codec_id);
+    av_packet_move_ref(state.held_pkt, pkt);
+    state.held = true;
+}
+
+//把输出队列尽量发出去：一次sendmsg带上多个包的包头和负载
+//返回1表示队列已清空，0表示发送阻塞，-1表示出错
+int flush_output(int clientsock, ClientState& state) {
+    const int max_iov = 64;
+    iovec iov[max_iov];
+    OutputQueue& q = state.outq;
+    while (!q.empty()) {
+        msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = q.fill_iov(iov, max_iov);
+        uint64_t send_start = metrics_now_ns();
+        ssize_t n = sendmsg(clientsock, &msg, MSG_NOSIGNAL);
+        t_stats->send_latency.observe_ns(metrics_now_ns() - send_start);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        note_sent(state, n);
+    }
+    state.stats->backlog_bytes.set(0);
+    state.drain_timer.cancel();
+    return 1;
+}
+
+//记录已发出的字节并让输出队列出队
+static void note_sent(ClientState& state, size_t bytes) {
+    size_t packets = state.outq.consume(bytes);
+    state.last_send = std::chrono::steady_clock::now();
+    state.stats->bytes_sent.add(bytes);
+    state.stats->packets_sent.add(packets);
+    t_stats->bytes_sent.add(bytes);
+    t_stats->packets_sent.add(packets);
+}
+
+//客户端积压：输出队列中未发送的字节 + 内核发送缓冲区中还没发出的字节
+size_t client_backlog_bytes(int clientsock, const ClientState& state) {
+    int unsent = 0;
+    if (ioctl(clientsock, SIOCOUTQ, &unsent) < 0) {
+        unsent = 0;
+    }
+    return state.outq.queued_bytes() + unsent;
+}
+
+//把一个AVPacket封装成共享的数据包
+static FramedPacketPtr make_framed_packet(uint32_t data_type, const AVPacket* pkt, AVRational time_base, AVCodecID codec_id) {
+    auto fp = std::make_shared<FramedPacket>();
+    PacketHeader header;
+    header.magic = PACKET_MAGIC;
+    header.dataType = data_type;
+    header.dataSize = pkt->size;
+    header.pts = pkt->pts;
+    fp->bytes.resize(sizeof(header) + pkt->size);
+    memcpy(fp->bytes.data(), &header, sizeof(header));
+    memcpy(fp->bytes.data() + sizeof(header), pkt->data, pkt->size);
+    fp->dataType = data_type;
+    fp->keyframe = (pkt->flags & AV_PKT_FLAG_KEY) != 0;
+    fp->disposable = data_type == 0 && packet_disposable(pkt, codec_id);
+    fp->pts = pkt->pts;
+    fp->dts = pkt->dts;
+    fp->duration = pkt->duration;
+    int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    fp->ts_us = ts != AV_NOPTS_VALUE ? av_rescale_q(ts, time_base, AV_TIME_BASE_Q) : AV_NOPTS_VALUE;
+    return fp;
+}
+
+//打开广播源：只探测一次，流信息包和BSF由所有订阅者共用
+std::shared_ptr<LiveSource> open_live_source(const char* filename) {
+    auto src = std::make_shared<LiveSource>();
+    src->filename = filename;
+    if (open_source_input(&src->fmt_ctx, filename) != 0) {
+        LOGE("Could not open video file %s", filename);
+        return nullptr;
+    }
+    if (avformat_find_stream_info(src->fmt_ctx, nullptr) < 0) {
+        LOGE("Could not find stream information");
+        mapped_close_input(&src->fmt_ctx);
+        return nullptr;
+    }
+    src->video_stream_index = av_find_best_stream(src->fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    src->audio_stream_index = av_find_best_stream(src->fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+    if (!build_stream_info(src->fmt_ctx, src->video_stream_index, src->audio_stream_index, src->info_packet) ||
+        !init_annexb_bsf(src->fmt_ctx->streams[src->video_stream_index]->codecpar, &src->bsf_ctx)) {
+        mapped_close_input(&src->fmt_ctx);
+        return nullptr;
+    }
+    return src;
+}
+
+//把新包追加到广播环并唤醒各工作线程
+static void live_source_publish(LiveSource* src, FramedPacketPtr fp) {
+    std::vector<int> fds;
+    {
+        std::lock_guard<std::mutex> lock(src->mtx);
+        if (fp->dataType == 0 && fp->keyframe) {
+            src->gop_seq = src->base_seq + src->ring.size();
+            src->has_gop = true;
         }
+        src->ring.push_back(std::move(fp));
+        // 超出窗口的旧包照常淘汰，但当前GOP要整个留着，除非GOP长得离谱
+        while (src->ring.size() > LIVE_RING_PACKETS &&
+               (!src->has_gop || src->base_seq < src->gop_seq || src->ring.size() > LIVE_GOP_MAX_PACKETS)) {
+            src->ring.pop_front();
+            src->base_seq++;
+        }
+        if (src->has_gop && src->gop_seq < src->base_seq) {
+            src->has_gop = false;
+        }
+        fds = src->notify_fds;
     }
+    for (int fd : fds) {
+        wake_eventfd(fd);
+    }
+}
 
-    // 主循环：一直读或写
+//广播源的生产线程：按包的时间戳实时解封装，到文件尾后回到开头循环播放
+void live_source_loop(std::shared_ptr<LiveSource> src) {
+    log_set_thread_name("live source");
+    register_thread_stats("live source");
+    AVPacket* pkt = av_packet_alloc();
+    AVPacket* filtered = av_packet_alloc();
+    auto wall_start = std::chrono::steady_clock::now();
+    int64_t ts_start = AV_NOPTS_VALUE;
     while (true) {
-        AVPacket* original_pkt = av_packet_alloc();
-        if (!original_pkt) return;
-        
-        int ret = av_read_frame(state.fmt_ctx, original_pkt);
+        uint64_t demux_start = metrics_now_ns();
+        int ret = av_read_frame(src->fmt_ctx, pkt);
         if (ret < 0) {
-            printf("[LOG] End of file on socket %d. Seeking to beginning.\n", clientsock);
-            av_seek_frame(state.fmt_ctx, state.video_stream_index, 0, AVSEEK_FLAG_BACKWARD);
-            if (state.bsf_ctx) av_bsf_flush(state.bsf_ctx);
-            av_packet_free(&original_pkt);
+            LOGI("Live source %s reached end of file. Looping.", src->filename.c_str());
+            av_seek_frame(src->fmt_ctx, src->video_stream_index, 0, AVSEEK_FLAG_BACKWARD);
+            av_bsf_flush(src->bsf_ctx);
+            ts_start = AV_NOPTS_VALUE;
+            continue;
+        }
+        bool is_video = pkt->stream_index == src->video_stream_index;
+        bool is_audio = pkt->stream_index == src->audio_stream_index && src->audio_stream_index >= 0;
+        if (!is_video && !is_audio) {
+            av_packet_unref(pkt);
             continue;
         }
 
-        if (original_pkt->stream_index == state.video_stream_index) {
-            // 视频包处理
-            if (state.bsf_ctx) {
-                if (av_bsf_send_packet(state.bsf_ctx, original_pkt) < 0) {
-                    av_packet_free(&original_pkt);
-                    break;
-                }
-                av_packet_free(&original_pkt);
-                while (true) {
-                    AVPacket* filtered_pkt = av_packet_alloc();
-                    if (!filtered_pkt) break;
-                    int ret2 = av_bsf_receive_packet(state.bsf_ctx, filtered_pkt);
-                    if (ret2 == AVERROR(EAGAIN) || ret2 == AVERROR_EOF) {
-                        av_packet_free(&filtered_pkt);
-                        break;
-                    } else if (ret2 < 0) {
-                        av_packet_free(&filtered_pkt);
-                        remove_client(epollfd, clientsock);
-                        return;
-                    }
-                    PacketHeader header;
-                    header.magic = PACKET_MAGIC;
-                    header.dataType = 0; //0 ：video
-                    header.dataSize = filtered_pkt->size;
-                    header.pts = filtered_pkt->pts;
-                    std::vector<uint8_t> send_buffer;
-                    send_buffer.resize(sizeof(header) + filtered_pkt->size);
-                    memcpy(send_buffer.data(), &header, sizeof(header));
-                    memcpy(send_buffer.data() + sizeof(header), filtered_pkt->data, filtered_pkt->size);
-                    ssize_t n = write(clientsock, send_buffer.data(), send_buffer.size());
-                    av_packet_free(&filtered_pkt);
-                    if (n < 0) {
-                        if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                            perror("write on new packet");
-                            remove_client(epollfd, clientsock);
-                        } else {
-                            printf("[LOG] write would block on socket %d. Storing %zu bytes.\n", clientsock, send_buffer.size());
-                            state.pending_data = send_buffer;
-                        }
-                        return;
-                    } else if (n < send_buffer.size()) {
-                        printf("[LOG] Partial write to socket %d: wrote %zd of %zu bytes.\n", clientsock, n, send_buffer.size());
-                        state.pending_data.assign(send_buffer.begin() + n, send_buffer.end());
-                        return;
-                    }
-                }
+        // 按解码时间戳节拍发布，模拟直播源
+        int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+        if (ts != AV_NOPTS_VALUE) {
+            int64_t us = av_rescale_q(ts, src->fmt_ctx->streams[pkt->stream_index]->time_base, AV_TIME_BASE_Q);
+            if (ts_start == AV_NOPTS_VALUE) {
+                ts_start = us;
+                wall_start = std::chrono::steady_clock::now();
             }
-        } else if (original_pkt->stream_index == state.audio_stream_index && state.audio_stream_index >= 0) {
-            //音频包处理
-            PacketHeader header;
-            header.magic = PACKET_MAGIC;
-            header.dataType = 1; //1 ：audio
-            header.dataSize = original_pkt->size;
-            header.pts = original_pkt->pts;
-            std::vector<uint8_t> send_buffer;
-            send_buffer.resize(sizeof(header) + original_pkt->size);
-            memcpy(send_buffer.data(), &header, sizeof(header));
-            memcpy(send_buffer.data() + sizeof(header), original_pkt->data, original_pkt->size);
-            ssize_t n = write(clientsock, send_buffer.data(), send_buffer.size());
-            av_packet_free(&original_pkt);
-            if (n < 0) {
-                if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                    perror("write on new audio packet");
-                    remove_client(epollfd, clientsock);
-                } else {
-                    printf("write would block on socket %d. Storing %zu bytes.\n", clientsock, send_buffer.size());
-                    state.pending_data = send_buffer;
+            std::this_thread::sleep_until(wall_start + std::chrono::microseconds(us - ts_start));
+        }
+
+        if (is_audio) {
+            t_stats->demux_time.observe_ns(metrics_now_ns() - demux_start);
+            live_source_publish(src.get(), make_framed_packet(1, pkt, src->fmt_ctx->streams[pkt->stream_index]->time_base, AV_CODEC_ID_NONE));
+            av_packet_unref(pkt);
+            continue;
+        }
+        if (av_bsf_send_packet(src->bsf_ctx, pkt) < 0) {
+            av_packet_unref(pkt);
+            continue;
+        }
+        t_stats->demux_time.observe_ns(metrics_now_ns() - demux_start);
+        while (av_bsf_receive_packet(src->bsf_ctx, filtered) == 0) {
+            live_source_publish(src.get(), make_framed_packet(0, filtered, src->fmt_ctx->streams[src->video_stream_index]->time_base,
+                                                          src->bsf_ctx->par_out->codec_id));
+            av_packet_unref(filtered);
+        }
+    }
+}
+
+//新观众的起点（调用方持有src->mtx）：环里有关键帧就从最近一个关键帧开始，先把这个GOP一次性发过去，
+//解码器立刻就有参考帧可用，不用等下一个IDR；还没有关键帧时从直播点开始
+static uint64_t live_join_seq(const LiveSource* src) {
+    return src->has_gop ? src->gop_seq : src->base_seq + src->ring.size();
+}
+
+//暂停或排队之后回到直播：同新观众一样从最近的关键帧开始
+static void live_rejoin(ClientState& state) {
+    std::lock_guard<std::mutex> lock(state.live->mtx);
+    state.live_cursor = live_join_seq(state.live.get());
+    state.burst_end = state.live->base_seq + state.live->ring.size();
+    state.wait_keyframe = true;
+}
+
+//广播客户端：不再解封装，直接加入共享源的直播点
+void add_live_client(int epollfd, int clientsock, const std::shared_ptr<LiveSource>& src) {
+    set_non_blocking(clientsock);
+
+    ClientState state;
+    join_live_source(clientsock, state, src);
+    client_states[clientsock] = std::move(state);
+    register_client(epollfd, clientsock);
+}
+
+//订阅广播源：先发流信息包，再从最近的关键帧开始跟上直播点
+static void join_live_source(int clientsock, ClientState& state, const std::shared_ptr<LiveSource>& src) {
+    state.live = src;
+    state.drop_enabled = g_config.drop_bytes > 0;
+    {
+        // 流信息和加入位置在同一把锁里取：上游换了参数时，要么拿到新信息，要么从环里读到随后的编码参数消息
+        std::lock_guard<std::mutex> lock(src->mtx);
+        push_bytes(state.outq, src->info_packet);
+        state.live_cursor = live_join_seq(src.get());
+        state.burst_end = src->base_seq + src->ring.size();
+    }
+    state.wait_keyframe = true;
+    LOGD("Client %d joining with %llu cached packets.", clientsock,
+         (unsigned long long)(state.burst_end - state.live_cursor));
+}
+
+//从共享源批量取包，cursor落后于环的窗口时返回true并跳到直播点
+static bool live_source_fetch(LiveSource* src, uint64_t& cursor, std::vector<FramedPacketPtr>& out, size_t max_count) {
+    std::lock_guard<std::mutex> lock(src->mtx);
+    bool lagged = false;
+    uint64_t end_seq = src->base_seq + src->ring.size();
+    if (cursor < src->base_seq) {
+        cursor = end_seq;
+        lagged = true;
+    }
+    while (cursor < end_seq && out.size() < max_count) {
+        out.push_back(src->ring[cursor - src->base_seq]);
+        cursor++;
+    }
+    return lagged;
+}
+
+//广播客户端：按游标从共享源取包填进输出队列，每个客户端只有游标的开销
+bool fill_live_client(int clientsock, ClientState& state) {
+    std::vector<FramedPacketPtr> batch;
+    begin_fill(clientsock, state);
+    while (!output_full(state)) {
+        batch.clear();
+        size_t room = OutputQueue::SLOTS - state.outq.size();
+        if (live_source_fetch(state.live.get(), state.live_cursor, batch, std::min<size_t>(room, 32))) {
+            LOGW("Client %d fell behind the live window. Skipping to live edge.", clientsock);
+            state.stats->live_skips.add();
+            state.wait_keyframe = true;
+        }
+        if (batch.empty()) {
+            if (state.live->ingest && state.outq.empty()) {
+                std::lock_guard<std::mutex> lock(state.live->mtx);
+                if (state.live->ended) {
+                    LOGI("Client %d reached the end of channel %s.", clientsock, state.live->filename.c_str());
+                    return false; //发布端已断开，剩下的包都发完了
                 }
-                return;
-            } else if (n < send_buffer.size()) {
-                printf("Partial write to socket %d: wrote %zd of %zu bytes.\n", clientsock, n, send_buffer.size());
-                state.pending_data.assign(send_buffer.begin() + n, send_buffer.end());
-                return;
             }
+            break; //已追上直播点
+        }
+        uint64_t first_seq = state.live_cursor - batch.size();
+        size_t i = 0;
+        for (; i < batch.size() && !output_full(state); ++i) {
+            const FramedPacketPtr& fp = batch[i];
+            if (fp->dataType == 0 && state.wait_keyframe) {
+                if (!fp->keyframe) continue;
+                state.wait_keyframe = false;
+            }
+            // 入场突发的GOP本身就会造成积压，不能让它触发丢包，否则刚缓存的参考帧会被丢掉
+            bool in_burst = first_seq + i < state.burst_end;
+            if (!in_burst && !admit_packet(clientsock, state, fp->dataType, fp->keyframe, fp->disposable, fp->bytes.size())) {
+                continue;
+            }
+            push_framed(state.outq, state.protocol, fp);
+        }
+        // 队列满了：把未取用的包还给游标，下次继续
+        state.live_cursor -= batch.size() - i;
+    }
+    return true;
+}
+
+//共享源有新包时，推送给所有已追上直播点的客户端（输出队列非空说明在等EPOLLOUT）
+void notify_live_clients(int epollfd) {
+    std::vector<int> ready;
+    for (auto& kv : client_states) {
+        if (kv.second.live && kv.second.outq.empty()) {
+            ready.push_back(kv.first);
+        }
+    }
+    for (int clientsock : ready) {
+        handle_write(epollfd, clientsock);
+    }
+}
+
+//把一个AVPacket封装后追加到点播包存储
+static void append_packet_record(PacketStore* store, uint32_t data_type, const AVPacket* pkt, AVRational time_base,
+                                 AVCodecID codec_id) {
+    PacketHeader header;
+    header.magic = PACKET_MAGIC;
+    header.dataType = data_type;
+    header.dataSize = pkt->size;
+    header.pts = pkt->pts;
+
+    PacketRecord rec;
+    rec.offset = store->data.size();
+    rec.size = sizeof(header) + pkt->size;
+    rec.dataType = data_type;
+    rec.pts = pkt->pts;
+    rec.dts = pkt->dts;
+    rec.duration = pkt->duration;
+    int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    if (ts != AV_NOPTS_VALUE) {
+        rec.ts_us = av_rescale_q(ts, time_base, AV_TIME_BASE_Q);
+    } else {
+        rec.ts_us = store->records.empty() ? 0 : store->records.back().ts_us;
+    }
+    rec.keyframe = (pkt->flags & AV_PKT_FLAG_KEY) != 0;
+    rec.disposable = data_type == 0 && packet_disposable(pkt, codec_id);
+    store->data.insert(store->data.end(), (const uint8_t*)&header, (const uint8_t*)&header + sizeof(header));
+    store->data.insert(store->data.end(), pkt->data, pkt->data + pkt->size);
+    if (data_type == 0 && rec.keyframe) {
+        store->keyframes.push_back(store->records.size());
+    }
+    store->records.push_back(rec);
+}
+
+//一遍解封装中收集包索引的记录：单独建索引和建点播存储时顺带建索引共用，冷启动只读一遍片源
+struct PacketIndexScan {
+    PacketIndexHeader header = {};
+    std::vector<uint8_t> info;
+    std::vector<PacketIndexEntry> entries;
+    std::vector<uint64_t> keyframes;
+    AVRational video_tb = {0, 1};
+    AVRational audio_tb = {0, 1};
+    int64_t first_us = INT64_MAX;
+    int64_t last_us = INT64_MIN;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    //记下源文件的大小、修改时间和流参数，之后逐包add
+    bool begin(const char* filename, AVFormatContext* fmt_ctx, int video_stream_index, int audio_stream_index,
+               const std::vector<uint8_t>& info_packet) {
+        memcpy(header.magic, PACKET_INDEX_MAGIC, sizeof(header.magic));
+        header.version = PACKET_INDEX_VERSION;
+        header.header_size = sizeof(header);
+        if (!packet_index_stat(filename, &header.source_size, &header.source_mtime_ns)) {
+            LOGE("Could not stat %s: %s", filename, strerror(errno));
+            return false;
+        }
+        video_tb = fmt_ctx->streams[video_stream_index]->time_base;
+        if (audio_stream_index >= 0) {
+            audio_tb = fmt_ctx->streams[audio_stream_index]->time_base;
+        }
+        header.video_stream = video_stream_index;
+        header.audio_stream = audio_stream_index;
+        header.video_tb_num = video_tb.num;
+        header.video_tb_den = video_tb.den;
+        header.audio_tb_num = audio_tb.num;
+        header.audio_tb_den = audio_tb.den;
+        info = info_packet;
+        return true;
+    }
+
+    //记录源文件中的原始包（annex-B转换前），大小和偏移都按源文件算
+    void add(const AVPacket* pkt, bool is_video) {
+        PacketIndexEntry e = {};
+        e.pts = pkt->pts;
+        e.dts = pkt->dts;
+        e.pos = pkt->pos;
+        e.size = pkt->size;
+        e.stream = is_video ? 0 : 1;
+        e.flags = (pkt->flags & AV_PKT_FLAG_KEY) ? PACKET_INDEX_KEY : 0;
+        int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+        if (ts != AV_NOPTS_VALUE) {
+            e.ts_us = av_rescale_q(ts, is_video ? video_tb : audio_tb, AV_TIME_BASE_Q);
+            first_us = std::min(first_us, e.ts_us);
+            last_us = std::max(last_us, e.ts_us);
         } else {
-            av_packet_free(&original_pkt);
-            continue;
+            e.ts_us = entries.empty() ? 0 : entries.back().ts_us;
+        }
+        if (is_video && (e.flags & PACKET_INDEX_KEY)) {
+            keyframes.push_back(entries.size());
         }
+        entries.push_back(e);
+    }
+
+    //写到边车文件，返回映射好的索引；索引写不了（例如目录只读）时返回空
+    std::shared_ptr<const PacketIndex> finish(const char* filename) {
+        header.duration_us = last_us > first_us ? last_us - first_us : 0;
+        header.entry_count = entries.size();
+        header.keyframe_count = keyframes.size();
+        header.info_size = (uint32_t)info.size();
+        std::string path = packet_index_path(filename);
+        if (!packet_index_write(path, header, info, entries, keyframes)) {
+            LOGW("Cannot write packet index %s: %s", path.c_str(), strerror(errno));
+            return nullptr;
+        }
+        long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        LOGI("Built packet index %s: %zu packets, %zu keyframes in %lld ms", path.c_str(), entries.size(), keyframes.size(), ms);
+        std::shared_ptr<const PacketIndex> index = PacketIndex::open(path, filename);
+        log_packet_index(filename, index.get());
+        return index;
+    }
+};
+
+//构建点播包存储：整个文件解封装、转换annex-B一次，之后只读
+//有包索引时跳过avformat_find_stream_info，流信息包和存储大小都从索引得到；
+//没有索引（且没有--no-index）时在同一遍解封装里顺带建好索引，不用为建索引再读一遍片源
+std::shared_ptr<PacketStore> build_packet_store(const char* filename, const std::shared_ptr<const PacketIndex>& index) {
+    auto store = std::make_shared<PacketStore>();
+    store->filename = filename;
+    store->index = index;
+    std::unique_ptr<PacketIndexScan> scan;
+    AVFormatContext* fmt_ctx = nullptr;
+    AVBSFContext* bsf_ctx = nullptr;
+    if (avformat_open_input(&fmt_ctx, filename, nullptr, nullptr) != 0) {
+        LOGE("Could not open video file %s", filename);
+        return nullptr;
     }
-} 
\ No newline at end of file
+    int video_stream_index;
+    int audio_stream_index;
+    if (index && (unsigned)index->header().video_stream < fmt_ctx->nb_streams) {
+        video_stream_index = index->header().video_stream;
+        audio_stream_index = index->header().audio_stream;
+        store->info_packet.assign(index->info_packet(), index->info_packet() + index->info_size());
+    } else {
+        if (avformat_find_stream_info(fmt_ctx, nullptr) < 0) {
+            LOGE("Could not find stream information");
+            avformat_close_input(&fmt_ctx);
+            return nullptr;
+        }
+        video_stream_index = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+        audio_stream_index = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+        if (!build_stream_info(fmt_ctx, video_stream_index, audio_stream_index, store->info_packet)) {
+            avformat_close_input(&fmt_ctx);
+            return nullptr;
+        }
+        if (!index && g_config.use_index) {
+            scan.reset(new PacketIndexScan());
+            if (!scan->begin(filename, fmt_ctx, video_stream_index, audio_stream_index, store->info_packet)) {
+                scan.reset();
+            }
+        }
+    }
+    if (!init_annexb_bsf(fmt_ctx->streams[video_stream_index]->codecpar, &bsf_ctx)) {
+        avformat_close_input(&fmt_ctx);
+        return nullptr;
+    }
+    // 预留空间避免反复扩容拷贝：有索引时按负载总量加包头（annex-B转换会略有出入），否则按文件大小
+    if (index) {
+        size_t total = 0;
+        for (size_t i = 0; i < index->size(); ++i) {
+            total += index->entries()[i].size + sizeof(PacketHeader);
+        }
+        store->records.reserve(index->size());
+        store->data.reserve(total + total / 64);
+    } else if (fmt_ctx->pb && avio_size(fmt_ctx->pb) > 0) {
+        store->data.reserve(avio_size(fmt_ctx->pb));
+    }
+
+    AVPacket* pkt = av_packet_alloc();
+    AVPacket* filtered = av_packet_alloc();
+    while (av_read_frame(fmt_ctx, pkt) >= 0) {
+        if (scan && (pkt->stream_index == video_stream_index || (pkt->stream_index == audio_stream_index && audio_stream_index >= 0))) {
+            scan->add(pkt, pkt->stream_index == video_stream_index);
+        }
+        if (pkt->stream_index == video_stream_index) {
+            if (av_bsf_send_packet(bsf_ctx, pkt) == 0) {
+                while (av_bsf_receive_packet(bsf_ctx, filtered) == 0) {
+                    append_packet_record(store.get(), 0, filtered, fmt_ctx->streams[video_stream_index]->time_base,
+                                         bsf_ctx->par_out->codec_id);
+                    av_packet_unref(filtered);
+                }
+            }
+        } else if (pkt->stream_index == audio_stream_index && audio_stream_index >= 0) {
+            append_packet_record(store.get(), 1, pkt, fmt_ctx->streams[audio_stream_index]->time_base, AV_CODEC_ID_NONE);
+        }
+        av_packet_unref(pkt);
+    }
+    av_packet_free(&pkt);
+    av_packet_free(&filtered);
+    store->video_codec = bsf_ctx->par_out->codec_id;
+    av_bsf_free(&bsf_ctx);
+    avformat_close_input(&fmt_ctx);
+
+    if (store->records.empty()) {
+        LOGE("No packets found in %s", filename);
+        return nullptr;
+    }
+    if (scan) {
+        store->index = scan->finish(filename);
+    }
+    store->data.shrink_to_fit();
+    // 流信息包后面如果跟着编码参数消息，单独留一份
+    PacketHeader info_header;
+    memcpy(&info_header, store->info_packet.data(), sizeof(info_header));
+    store->codec_info.assign(store->info_packet.begin() + sizeof(info_header) + info_header.dataSize, store->info_packet.end());
+    uint64_t payload = 0;
+    int64_t first_us = INT64_MAX;
+    int64_t last_us = INT64_MIN;
+    for (const PacketRecord& rec : store->records) {
+        payload += rec.size - sizeof(PacketHeader);
+        first_us = std::min(first_us, rec.ts_us);
+        last_us = std::max(last_us, rec.ts_us);
+    }
+    store->avg_bps = last_us > first_us ? payload * 8 * 1000000 / (uint64_t)(last_us - first_us) : 0;
+    LOGI("Packet store for %s: %zu packets, %zu bytes, %llu kbit/s", filename, store->records.size(), store->data.size(),
+         (unsigned long long)(store->avg_bps / 1000));
+    return store;
+}
+
+//片源的其他码率版本：同一目录下名为<主名>@<标签>.<扩展名>的文件（主名是去掉扩展名的文件名），包索引不算
+static std::vector<std::string> find_renditions(const std::string& source) {
+    size_t slash = source.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : source.substr(0, slash);
+    std::string name = slash == std::string::npos ? source : source.substr(slash + 1);
+    std::string prefix = name.substr(0, name.rfind('.')) + RENDITION_SEPARATOR;
+    std::vector<std::string> paths;
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        return paths;
+    }
+    while (dirent* e = readdir(d)) {
+        std::string entry = e->d_name;
+        if (entry.size() > prefix.size() && entry.compare(0, prefix.size(), prefix) == 0 && !packet_index_is_sidecar(entry)) {
+            paths.push_back(dir + "/" + entry);
+        }
+    }
+    closedir(d);
+    std::sort(paths.begin(), paths.end());
+    return paths;
+}
+
+//两个版本能否在关键帧处无缝切换：主版本至少一半的关键帧在另一版本里有时间相同的关键帧
+static bool renditions_aligned(const PacketStore& a, const PacketStore& b) {
+    size_t matched = 0;
+    size_t j = 0;
+    for (size_t i : a.keyframes) {
+        int64_t t = a.records[i].ts_us;
+        while (j < b.keyframes.size() && b.records[b.keyframes[j]].ts_us < t - ABR_ALIGN_US) {
+            j++;
+        }
+        if (j < b.keyframes.size() && b.records[b.keyframes[j]].ts_us <= t + ABR_ALIGN_US) {
+            matched++;
+        }
+    }
+    return !a.keyframes.empty() && matched * 2 >= a.keyframes.size();
+}
+
+//构建片名的包存储：主版本加上旁边找得到的其他码率版本。关键帧和主版本对不齐的版本切不过去，不用；
+//其他版本加载失败不影响主版本
+std::shared_ptr<const PacketStore> build_title_store(const char* filename, const std::shared_ptr<const PacketIndex>& index) {
+    std::shared_ptr<PacketStore> store = build_packet_store(filename, index);
+    if (!store) {
+        return nullptr;
+    }
+    store->ladder.push_back(store.get());
+    if (g_config.abr) {
+        for (const std::string& path : find_renditions(filename)) {
+            std::shared_ptr<PacketStore> r = build_packet_store(path.c_str(), open_packet_index(path.c_str()));
+            if (!r) {
+                LOGW("Skipping rendition %s: cannot load.", path.c_str());
+            } else if (r->avg_bps == 0 || !renditions_aligned(*store, *r)) {
+                LOGW("Skipping rendition %s: keyframes are not aligned with %s.", path.c_str(), filename);
+            } else {
+                store->ladder.push_back(r.get());
+                store->renditions.push_back(r);
+            }
+        }
+        std::sort(store->ladder.begin(), store->ladder.end(),
+                  [](const PacketStore* a, const PacketStore* b) { return a->avg_bps < b->avg_bps; });
+    }
+    if (store->ladder.size() > 1) {
+        std::string rates;
+        for (const PacketStore* s : store->ladder) {
+            rates += (rates.empty() ? "" : ", ") + std::to_string(s->avg_bps / 1000);
+        }
+        LOGI("Title %s has %zu renditions (%s kbit/s).", filename, store->ladder.size(), rates.c_str());
+    }
+    return store;
+}
+
+//扫描整个文件建立包索引并写到边车文件，返回映射好的索引；文件打不开或索引写不了（例如目录只读）时返回空
+std::shared_ptr<const PacketIndex> build_packet_index(const char* filename) {
+    PacketIndexScan scan;
+    AVFormatContext* fmt_ctx = nullptr;
+    if (avformat_open_input(&fmt_ctx, filename, nullptr, nullptr) != 0) {
+        LOGE("Could not open video file %s", filename);
+        return nullptr;
+    }
+    if (avformat_find_stream_info(fmt_ctx, nullptr) < 0) {
+        LOGE("Could not find stream information");
+        avformat_close_input(&fmt_ctx);
+        return nullptr;
+    }
+    int video_stream_index = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    int audio_stream_index = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+    std::vector<uint8_t> info;
+    if (!build_stream_info(fmt_ctx, video_stream_index, audio_stream_index, info) ||
+        !scan.begin(filename, fmt_ctx, video_stream_index, audio_stream_index, info)) {
+        avformat_close_input(&fmt_ctx);
+        return nullptr;
+    }
+
+    AVPacket* pkt = av_packet_alloc();
+    while (av_read_frame(fmt_ctx, pkt) >= 0) {
+        bool is_video = pkt->stream_index == video_stream_index;
+        if (is_video || (pkt->stream_index == audio_stream_index && audio_stream_index >= 0)) {
+            scan.add(pkt, is_video);
+        }
+        av_packet_unref(pkt);
+    }
+    av_packet_free(&pkt);
+    avformat_close_input(&fmt_ctx);
+    if (scan.entries.empty()) {
+        LOGE("No packets found in %s", filename);
+        return nullptr;
+    }
+    return scan.finish(filename);
+}
+
+//打开已有且没过期的包索引，不现场建立；--no-index时返回空
+std::shared_ptr<const PacketIndex> open_packet_index(const char* filename) {
+    if (!g_config.use_index) {
+        return nullptr;
+    }
+    std::shared_ptr<const PacketIndex> index = PacketIndex::open(packet_index_path(filename), filename);
+    log_packet_index(filename, index.get());
+    return index;
+}
+
+static void log_packet_index(const char* filename, const PacketIndex* index) {
+    if (index) {
+        LOGI("Packet index for %s: %zu packets, %zu keyframes, %.1f s, %llu kbit/s average, %llu kbit/s peak",
+             filename, index->size(), index->keyframe_count(), index->header().duration_us / 1e6,
+             (unsigned long long)(index->average_bitrate() / 1000), (unsigned long long)(index->peak_bitrate() / 1000));
+    }
+}
+
+//打开片源的包索引：已有且没过期就直接mmap，否则现场建立；--no-index时返回空
+std::shared_ptr<const PacketIndex> load_packet_index(const char* filename) {
+    if (!g_config.use_index) {
+        return nullptr;
+    }
+    std::shared_ptr<const PacketIndex> index = open_packet_index(filename);
+    if (!index) {
+        index = build_packet_index(filename);
+    }
+    return index;
+}
+
+//点播客户端：不打开文件，只记录共享包存储中的位置
+void add_vod_client(int epollfd, int clientsock, const std::shared_ptr<const PacketStore>& store) {
+    set_non_blocking(clientsock);
+
+    ClientState state;
+    start_vod_stream(state, store);
+    client_states[clientsock] = std::move(state);
+    register_client(epollfd, clientsock);
+}
+
+//从头播放一个点播包存储：先发流信息包
+static void start_vod_stream(ClientState& state, const std::shared_ptr<const PacketStore>& store) {
+    push_bytes(state.outq, store->info_packet);
+    state.vod = store;
+    state.vod_index = 0;
+    state.paced = g_config.pace;
+    state.pace_start = std::chrono::steady_clock::now();
+    state.drop_enabled = state.paced && g_config.drop_bytes > 0;
+    // 有多个版本时从请求的版本起播，之后按排空速率切换；片库客户端这时已经登记过定时器
+    if (store->ladder.size() > 1) {
+        state.vod_title = store;
+        state.abr_level = state.abr_target = std::find(store->ladder.begin(), store->ladder.end(), store.get()) - store->ladder.begin();
+        if (state.abr_timer.owner >= 0) {
+            client_timers.schedule(&state.abr_timer, client_timer_now_ms(), ABR_SAMPLE_MS);
+        }
+    }
+}
+
+//片库客户端：连接后等待片名请求，在此之前不发送数据
+void add_catalog_client(int epollfd, int clientsock) {
+    set_non_blocking(clientsock);
+
+    ClientState state;
+    state.awaiting_title = true;
+    client_states[clientsock] = std::move(state);
+    register_client(epollfd, clientsock);
+}
+
+//读取客户端发来的数据（边缘触发，读到EAGAIN为止），对端关闭或协议错误时移除
+void handle_read(int epollfd, int clientsock) {
+    char buf[INGEST_READ_BUFFER];
+    while (client_states.count(clientsock)) {
+        ssize_t n = recv(clientsock, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n <= 0 || !client_input(epollfd, clientsock, buf, n)) { // 0 or -1 indicates disconnection or error
+            remove_client(epollfd, clientsock);
+            return;
+        }
+    }
+}
+
+//把收到的字节拼成完整消息逐条处理，返回false表示协议错误
+//处理消息可能移除客户端，因此每条消息前都重新查找状态
+static bool client_input(int epollfd, int clientsock, const char* data, size_t len) {
+    auto it = client_states.find(clientsock);
+    if (it == client_states.end()) return true;
+    it->second.last_input = std::chrono::steady_clock::now();
+    it->second.inbuf.append(data, len);
+    while (true) {
+        it = client_states.find(clientsock);
+        if (it == client_states.end()) return true;
+        ClientState& state = it->second;
+        if (state.publishing) {
+            return ingest_input(clientsock, state); //开始推流之后的输入都是要转发的包
+        }
+        if (state.inbuf.size() < sizeof(PacketHeader)) return true;
+        PacketHeader header;
+        memcpy(&header, state.inbuf.data(), sizeof(header));
+        if (header.magic != PACKET_MAGIC || header.dataSize > MAX_CLIENT_MESSAGE) {
+            LOGW("Client %d sent an invalid message header.", clientsock);
+            return false;
+        }
+        if (state.inbuf.size() < sizeof(header) + header.dataSize) return true;
+        std::string payload = state.inbuf.substr(sizeof(header), header.dataSize);
+        state.inbuf.erase(0, sizeof(header) + header.dataSize);
+        switch (header.dataType) {
+        case DATA_TITLE_REQUEST:
+            handle_title_request(epollfd, clientsock, state, payload);
+            break;
+        case DATA_HELLO:
+            // 只影响之后入队的包，已经排队的v1包客户端按魔数照样解析
+            state.protocol = header.pts >= 2 ? 2 : 1;
+            state.video_codecs.clear();
+            for (size_t off = 0; state.protocol >= 2 && off + sizeof(uint32_t) <= payload.size(); off += sizeof(uint32_t)) {
+                uint32_t id;
+                memcpy(&id, payload.data() + off, sizeof(id));
+                state.video_codecs.push_back((AVCodecID)id);
+            }
+            LOGD("Client %d speaks protocol v%d, %zu video codec(s) declared.", clientsock, state.protocol,
+                 state.video_codecs.size());
+            break;
+        case DATA_SEEK:
+        case DATA_PAUSE:
+        case DATA_RESUME:
+        case DATA_SET_RATE:
+            handle_control(epollfd, clientsock, state, header);
+            break;
+        case DATA_PUBLISH:
+            handle_publish(epollfd, clientsock, state, payload);
+            break;
+        case DATA_HEARTBEAT:
+            break; //收到字节时已经记下了活动时间
+        default:
+            LOGD("Client %d sent unknown message type %u, ignored.", clientsock, header.dataType);
+            break;
+        }
+    }
+}
+
+//片名只能是片库目录下的普通文件名，旁边的包索引文件不算；合法时给出完整路径
+static bool catalog_title_path(const std::string& name, std::string* path) {
+    struct stat st;
+    *path = g_catalog->dir + "/" + name;
+    return !name.empty() && name[0] != '.' && name.find('/') == std::string::npos && !packet_index_is_sidecar(name) &&
+           stat(path->c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+//片名请求：已缓存的直接开始播放，否则登记等待并在需要时启动后台加载
+static void handle_title_request(int epollfd, int clientsock, ClientState& state, const std::string& title) {
+    if ((!g_catalog && g_config.upstream_host.empty()) || !state.awaiting_title) {
+        LOGD("Client %d sent a title request outside catalog setup, ignored.", clientsock);
+        return;
+    }
+    if (!g_config.upstream_host.empty()) {
+        subscribe_upstream(epollfd, clientsock, state, title); //边缘节点的片名（包括源站的live/频道）都向源站要
+        return;
+    }
+    if (title.compare(0, sizeof(CHANNEL_PREFIX) - 1, CHANNEL_PREFIX) == 0) {
+        subscribe_channel(epollfd, clientsock, state, title);
+        return;
+    }
+    // 片名后面可以带#<档位>，要的是转码后的版本
+    std::string name = title;
+    const TranscodeProfile* profile = nullptr;
+    size_t separator = title.rfind(TRANSCODE_SEPARATOR);
+    if (separator != std::string::npos) {
+        name = title.substr(0, separator);
+        profile = find_profile(title.substr(separator + 1));
+        if (!profile) {
+            reject_client(epollfd, clientsock, "unknown profile");
+            return;
+        }
+    }
+    std::string path;
+    if (!catalog_title_path(name, &path)) {
+        reject_client(epollfd, clientsock, "unknown title");
+        return;
+    }
+    LOGI("Client %d requested title %s.", clientsock, title.c_str());
+    if (profile) {
+        request_transcode(epollfd, clientsock, state, name, path, *profile);
+        return;
+    }
+
+    std::shared_ptr<const PacketStore> store;
+    {
+        std::lock_guard<std::mutex> lock(g_catalog->mtx);
+        CatalogEntry& entry = g_catalog->entries[title];
+        if (entry.store) {
+            g_catalog->lru.splice(g_catalog->lru.begin(), g_catalog->lru, entry.lru_pos);
+            store = entry.store;
+        } else {
+            entry.waiters.push_back({t_worker_id, clientsock, state.serial});
+            if (!entry.loading) {
+                entry.loading = true;
+                g_catalog->load_jobs.emplace_back(title, path);
+                g_catalog->cv.notify_one();
+            }
+        }
+    }
+    if (store && needs_transcode(state, *store)) {
+        request_transcode(epollfd, clientsock, state, name, path, g_config.profiles[0]);
+    } else if (store) {
+        state.awaiting_title = false;
+        start_vod_stream(state, store);
+        handle_write(epollfd, clientsock);
+    }
+}
+
+//片库加载线程：依次取待加载的片名，线程数固定，同时请求很多未缓存片名时多出来的排队
+static void catalog_worker_loop() {
+    log_set_thread_name("catalog");
+    while (true) {
+        std::pair<std::string, std::string> job;
+        {
+            std::unique_lock<std::mutex> lock(g_catalog->mtx);
+            g_catalog->cv.wait(lock, [] { return !g_catalog->load_jobs.empty(); });
+            job = std::move(g_catalog->load_jobs.front());
+            g_catalog->load_jobs.pop_front();
+        }
+        catalog_load(job.first, job.second);
+    }
+}
+
+//缓存超出预算时淘汰最久没人请求的片名，最近的一个总是留下；调用者持有g_catalog->mtx
+static void catalog_evict() {
+    while (g_catalog->cached_bytes > g_catalog->budget_bytes && g_catalog->lru.size() > 1) {
+        std::string victim = g_catalog->lru.back();
+        g_catalog->lru.pop_back();
+        auto it = g_catalog->entries.find(victim);
+        g_catalog->cached_bytes -= it->second.bytes;
+        g_catalog->entries.erase(it);
+        LOGI("Evicted title %s from the catalog cache.", victim.c_str());
+    }
+}
+
+//加载一个片名：把片源封装成包存储放进缓存，超出预算时淘汰最久没人请求的片源，再通知所有等待者
+static void catalog_load(const std::string& title, const std::string& path) {
+    auto start = std::chrono::steady_clock::now();
+    std::shared_ptr<const PacketStore> store = build_title_store(path.c_str(), open_packet_index(path.c_str()));
+    std::vector<TitleWaiter> waiters;
+    {
+        std::lock_guard<std::mutex> lock(g_catalog->mtx);
+        CatalogEntry& entry = g_catalog->entries[title];
+        waiters.swap(entry.waiters);
+        if (!store) {
+            g_catalog->entries.erase(title); // 下次请求重新尝试
+        } else {
+            entry.loading = false;
+            entry.store = store;
+            for (const PacketStore* s : store->ladder) {
+                entry.bytes += s->data.size() + s->records.size() * sizeof(PacketRecord);
+            }
+            g_catalog->lru.push_front(title);
+            entry.lru_pos = g_catalog->lru.begin();
+            g_catalog->cached_bytes += entry.bytes;
+            catalog_evict();
+        }
+    }
+    long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    LOGI("Title %s %s in %lld ms, %zu waiting client(s).", title.c_str(), store ? "loaded" : "failed to load", ms,
+         waiters.size());
+    for (const TitleWaiter& w : waiters) {
+        WorkerInbox* inbox = g_inboxes[w.worker].get();
+        {
+            std::lock_guard<std::mutex> lock(inbox->mtx);
+            inbox->ready.push_back({w.clientsock, w.serial, store, nullptr, nullptr});
+        }
+        wake_eventfd(inbox->notify_fd);
+    }
+}
+
+//收件箱：为加载完成的片源启动等待中的客户端，客户端已断开（或fd已被新连接复用）的跳过
+//收件箱被唤醒：依次处理片库加载结果、打开好的文件、排队的客户端和转码输出的新包
+void handle_inbox(int epollfd) {
+    handle_catalog_ready(epollfd);
+    handle_probe_results(epollfd);
+    admission_release(epollfd);
+    notify_transcode_clients(epollfd);
+    notify_live_clients(epollfd); // 推流频道有新包时唤醒的是收件箱
+}
+
+static void handle_catalog_ready(int epollfd) {
+    std::vector<TitleReady> ready;
+    {
+        std::lock_guard<std::mutex> lock(t_inbox->mtx);
+        ready.swap(t_inbox->ready);
+    }
+    for (TitleReady& r : ready) {
+        auto it = client_states.find(r.clientsock);
+        if (it == client_states.end() || it->second.serial != r.serial || !it->second.awaiting_title) {
+            continue;
+        }
+        if (r.live) {
+            start_live_subscriber(epollfd, r.clientsock, it->second, r.live);
+            continue;
+        }
+        if (r.transcode) {
+            it->second.awaiting_title = false;
+            start_transcode_stream(it->second, r.transcode, r.clientsock);
+            handle_write(epollfd, r.clientsock);
+            continue;
+        }
+        if (!r.store) {
+            reject_client(epollfd, r.clientsock, "cannot open title");
+            continue;
+        }
+        if (needs_transcode(it->second, *r.store)) {
+            // 包存储里才知道视频编码；客户端解不了就改走默认档位的转码
+            std::string title = r.store->filename.substr(g_catalog->dir.size() + 1);
+            request_transcode(epollfd, r.clientsock, it->second, title, r.store->filename, g_config.profiles[0]);
+            continue;
+        }
+        it->second.awaiting_title = false;
+        start_vod_stream(it->second, r.store);
+        handle_write(epollfd, r.clientsock);
+    }
+}
+
+static const TranscodeProfile* find_profile(const std::string& name) {
+    if (g_config.transcode_threads == 0) {
+        return nullptr;
+    }
+    for (const TranscodeProfile& p : g_config.profiles) {
+        if (p.name == name) {
+            return &p;
+        }
+    }
+    return nullptr;
+}
+
+//v1客户端和没声明能解这种编码的v2客户端只当它能解H.264，其他视频编码的片源要转码后再发
+static bool needs_transcode(const ClientState& state, const PacketStore& store) {
+    if (g_config.transcode_threads == 0 || store.video_codec == AV_CODEC_ID_H264) {
+        return false;
+    }
+    return state.protocol < 2 ||
+           std::find(state.video_codecs.begin(), state.video_codecs.end(), store.video_codec) == state.video_codecs.end();
+}
+
+//转码请求：同一片名和档位已经有任务就加入它（编码器已打开的直接从头播放），否则新建任务排进线程池
+static void request_transcode(int epollfd, int clientsock, ClientState& state, const std::string& title,
+                              const std::string& path, const TranscodeProfile& profile) {
+    std::string key = title + TRANSCODE_SEPARATOR + profile.name;
+    std::shared_ptr<TranscodeJob> job;
+    bool ready;
+    {
+        std::lock_guard<std::mutex> lock(g_transcode_pool.mtx);
+        job = g_transcode_pool.active[key].lock();
+        if (!job) {
+            job = std::make_shared<TranscodeJob>();
+            job->key = key;
+            job->path = path;
+            job->profile = profile;
+            g_transcode_pool.active[key] = job;
+            g_transcode_pool.jobs.push_back(job);
+            g_transcode_pool.cv.notify_one();
+            LOGI("Queued transcode of %s, %zu job(s) waiting for a thread.", key.c_str(), g_transcode_pool.jobs.size());
+        }
+        std::lock_guard<std::mutex> job_lock(job->mtx);
+        ready = !job->info_packet.empty();
+        if (!ready) {
+            job->waiters.push_back({t_worker_id, clientsock, state.serial});
+        }
+    }
+    if (ready) {
+        state.awaiting_title = false;
+        start_transcode_stream(state, job, clientsock);
+        handle_write(epollfd, clientsock);
+    }
+}
+
+//从头播放一个转码输出：先发流信息包，登记为任务的观众以便追上进度后被唤醒
+static void start_transcode_stream(ClientState& state, const std::shared_ptr<TranscodeJob>& job, int clientsock) {
+    {
+        std::lock_guard<std::mutex> lock(job->mtx);
+        push_bytes(state.outq, job->info_packet);
+        TranscodeViewer& viewer = job->viewers[{t_worker_id, state.serial}];
+        viewer.clientsock = clientsock;
+        viewer.index = job->base;
+        state.transcode_index = job->base;
+    }
+    state.transcode = job;
+    state.paced = g_config.pace;
+    state.pace_start = std::chrono::steady_clock::now();
+    state.drop_enabled = state.paced && g_config.drop_bytes > 0;
+}
+
+//转码输出的流信息：视频按编码器的参数，音频照搬片源；借一个不做I/O的格式上下文复用build_stream_info
+static bool build_transcode_info(const Transcoder& tc, std::vector<uint8_t>& out) {
+    AVFormatContext* ctx = avformat_alloc_context();
+    if (!ctx) {
+        return false;
+    }
+    AVStream* video = avformat_new_stream(ctx, nullptr);
+    bool ok = video && avcodec_parameters_from_context(video->codecpar, tc.encoder()) >= 0;
+    if (ok) {
+        video->time_base = tc.encoder()->time_base;
+    }
+    int audio_index = -1;
+    if (ok && tc.audio_stream() >= 0) {
+        const AVStream* src = tc.input()->streams[tc.audio_stream()];
+        AVStream* audio = avformat_new_stream(ctx, nullptr);
+        ok = audio && avcodec_parameters_copy(audio->codecpar, src->codecpar) >= 0;
+        if (ok) {
+            audio->time_base = src->time_base;
+            audio_index = audio->index;
+        }
+    }
+    ok = ok && build_stream_info(ctx, video->index, audio_index, out);
+    avformat_free_context(ctx);
+    return ok;
+}
+
+//取出等新包的观众，清掉等待标记；调用者持有job->mtx
+static void take_transcode_waiting(TranscodeJob* job, std::vector<TitleWaiter>& out) {
+    for (auto& kv : job->viewers) {
+        if (kv.second.waiting) {
+            kv.second.waiting = false;
+            out.push_back({kv.first.first, kv.second.clientsock, kv.first.second});
+        }
+    }
+}
+
+//把观众交给各自工作线程的收件箱，每个工作线程只唤醒一次
+static void wake_transcode_viewers(std::vector<TitleWaiter>& viewers) {
+    std::sort(viewers.begin(), viewers.end(), [](const TitleWaiter& a, const TitleWaiter& b) { return a.worker < b.worker; });
+    for (size_t i = 0; i < viewers.size();) {
+        WorkerInbox* inbox = g_inboxes[viewers[i].worker].get();
+        {
+            std::lock_guard<std::mutex> lock(inbox->mtx);
+            for (int w = viewers[i].worker; i < viewers.size() && viewers[i].worker == w; ++i) {
+                inbox->transcoded.push_back(viewers[i]);
+            }
+        }
+        wake_eventfd(inbox->notify_fd);
+    }
+}
+
+//从头裁掉所有观众都已取过的整段GOP，直到裁够want字节或者只剩最新的一个GOP，返回裁掉的字节；
+//保留的输出总从关键帧开始，新观众、循环和跳转都能从这里解码。调用者持有job->mtx
+static size_t trim_transcode_job(TranscodeJob* job, size_t want) {
+    size_t passed = job->base + job->packets.size();
+    for (const auto& kv : job->viewers) {
+        passed = std::min(passed, kv.second.index);
+    }
+    size_t freed = 0;
+    while (freed < want && job->keyframes.size() > 1 && job->keyframes[1] <= passed) {
+        for (size_t next = job->keyframes[1]; job->base < next; ++job->base) {
+            freed += job->packets.front()->bytes.size();
+            job->packets.pop_front();
+        }
+        job->keyframes.pop_front();
+    }
+    job->bytes -= freed;
+    return freed;
+}
+
+//每个GOP把新增的输出记进片库缓存：超出预算先按LRU淘汰片名，还超就裁掉本任务观众都已取过的GOP
+static void transcode_account(TranscodeJob* job, size_t added) {
+    size_t over;
+    {
+        std::lock_guard<std::mutex> lock(g_catalog->mtx);
+        g_catalog->cached_bytes += added;
+        catalog_evict();
+        over = g_catalog->cached_bytes > g_catalog->budget_bytes ? g_catalog->cached_bytes - g_catalog->budget_bytes : 0;
+    }
+    if (over == 0) {
+        return;
+    }
+    size_t freed;
+    {
+        std::lock_guard<std::mutex> lock(job->mtx);
+        freed = trim_transcode_job(job, over);
+        job->counted_bytes -= freed;
+    }
+    if (freed > 0) {
+        std::lock_guard<std::mutex> lock(g_catalog->mtx);
+        g_catalog->cached_bytes -= freed;
+    }
+}
+
+//把一个输出包追加到转码任务；新包攒够TRANSCODE_WAKE_MS或者到了视频关键帧才唤醒已追上进度的观众，
+//不用每编码一帧就把各工作线程叫醒一次
+static void transcode_publish(TranscodeJob* job, FramedPacketPtr fp) {
+    std::vector<TitleWaiter> woken;
+    bool key = fp->dataType == 0 && fp->keyframe;
+    size_t added = 0;
+    {
+        std::lock_guard<std::mutex> lock(job->mtx);
+        if (key) {
+            job->keyframes.push_back(job->base + job->packets.size());
+            added = job->bytes - job->counted_bytes;
+            job->counted_bytes = job->bytes;
+        }
+        job->bytes += fp->bytes.size();
+        job->packets.push_back(std::move(fp));
+        auto now = std::chrono::steady_clock::now();
+        if (key || now - job->woke_at >= std::chrono::milliseconds(TRANSCODE_WAKE_MS)) {
+            job->woke_at = now;
+            take_transcode_waiting(job, woken);
+        }
+    }
+    wake_transcode_viewers(woken);
+    if (key) {
+        transcode_account(job, added);
+    }
+}
+
+//任务只剩转码线程自己持有说明观众都走了；在池的锁里判断，期间没有新请求能从active拿到它
+static bool transcode_abandoned(const std::shared_ptr<TranscodeJob>& job) {
+    std::lock_guard<std::mutex> lock(g_transcode_pool.mtx);
+    if (job.use_count() > 1) {
+        return false;
+    }
+    auto it = g_transcode_pool.active.find(job->key);
+    if (it != g_transcode_pool.active.end() && it->second.lock() == job) {
+        g_transcode_pool.active.erase(it);
+    }
+    return true;
+}
+
+//转一个片源：先打开片源和编码器，把流信息交给等待的客户端，之后逐包追加输出，直到文件尾或没人看了
+static void run_transcode_job(const std::shared_ptr<TranscodeJob>& job) {
+    auto start = std::chrono::steady_clock::now();
+    Transcoder tc;
+    std::vector<uint8_t> info;
+    bool ok = tc.open(job->path, job->profile) && build_transcode_info(tc, info);
+    std::vector<TitleWaiter> waiters;
+    if (ok) {
+        std::lock_guard<std::mutex> lock(job->mtx);
+        job->info_packet = std::move(info);
+        waiters.swap(job->waiters);
+    } else {
+        // 先从active摘掉再取等待者，之后的请求会新建任务重试，不会挂在这个失败的任务上
+        std::lock_guard<std::mutex> lock(g_transcode_pool.mtx);
+        auto it = g_transcode_pool.active.find(job->key);
+        if (it != g_transcode_pool.active.end() && it->second.lock() == job) {
+            g_transcode_pool.active.erase(it);
+        }
+        std::lock_guard<std::mutex> job_lock(job->mtx);
+        job->done = true;
+        waiters.swap(job->waiters);
+    }
+    long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    if (ok) {
+        LOGI("Transcode of %s started in %lld ms, %zu waiting client(s).", job->key.c_str(), ms, waiters.size());
+    } else {
+        LOGE("Cannot transcode %s: %s", job->key.c_str(), tc.error().empty() ? "cannot describe the output" : tc.error().c_str());
+    }
+    for (const TitleWaiter& w : waiters) {
+        WorkerInbox* inbox = g_inboxes[w.worker].get();
+        {
+            std::lock_guard<std::mutex> lock(inbox->mtx);
+            inbox->ready.push_back({w.clientsock, w.serial, nullptr, ok ? job : nullptr, nullptr});
+        }
+        wake_eventfd(inbox->notify_fd);
+    }
+    if (!ok) {
+        return;
+    }
+
+    AVPacket* pkt = av_packet_alloc();
+    uint32_t data_type;
+    uint64_t sampled_frames = 0;
+    auto sampled_at = std::chrono::steady_clock::now();
+    bool abandoned = false;
+    while (tc.next(pkt, &data_type)) {
+        transcode_publish(job.get(), make_framed_packet(data_type, pkt, tc.time_base(data_type),
+                                                        data_type == 0 ? AV_CODEC_ID_H264 : AV_CODEC_ID_NONE));
+        av_packet_unref(pkt);
+        // 每秒更新一次编码帧率，顺便看还有没有观众
+        auto now = std::chrono::steady_clock::now();
+        if (now - sampled_at >= std::chrono::seconds(1)) {
+            uint64_t frames = tc.frames_encoded();
+            job->encode_fps = (frames - sampled_frames) / std::chrono::duration<double>(now - sampled_at).count();
+            g_transcode_pool.frames.add(frames - sampled_frames);
+            sampled_frames = frames;
+            sampled_at = now;
+            if (transcode_abandoned(job)) {
+                abandoned = true;
+                break;
+            }
+        }
+    }
+    av_packet_free(&pkt);
+    g_transcode_pool.frames.add(tc.frames_encoded() - sampled_frames);
+    job->encode_fps = 0;
+    std::vector<TitleWaiter> woken;
+    size_t packets, added;
+    {
+        std::lock_guard<std::mutex> lock(job->mtx);
+        job->done = true;
+        take_transcode_waiting(job.get(), woken);
+        packets = job->base + job->packets.size();
+        added = job->bytes - job->counted_bytes;
+        job->counted_bytes = job->bytes;
+    }
+    transcode_account(job.get(), added); //最后一个GOP
+    // 追上转码进度的观众在等新包，唤醒它们发完攒下的包、回到开头
+    wake_transcode_viewers(woken);
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    LOGI("Transcode of %s %s: %llu frames, %zu packets in %.1f s (%.1f fps).", job->key.c_str(),
+         abandoned ? "stopped, no viewers left" : "finished", (unsigned long long)tc.frames_encoded(), packets, secs,
+         secs > 0 ? tc.frames_encoded() / secs : 0.0);
+}
+
+//转码线程：从池的队列取任务，一次转一个片源
+static void transcode_worker_loop() {
+    log_set_thread_name("transcode");
+    while (true) {
+        std::shared_ptr<TranscodeJob> job;
+        {
+            std::unique_lock<std::mutex> lock(g_transcode_pool.mtx);
+            g_transcode_pool.cv.wait(lock, [] { return !g_transcode_pool.jobs.empty(); });
+            job = std::move(g_transcode_pool.jobs.front());
+            g_transcode_pool.jobs.pop_front();
+        }
+        g_transcode_pool.running++;
+        run_transcode_job(job);
+        g_transcode_pool.running--;
+    }
+}
+
+//转码客户端：按下标从共享的转码输出取包，追上转码进度时等新包通知；转完之后到末尾回到开头
+bool fill_transcode_client(int clientsock, ClientState& state) {
+    std::vector<FramedPacketPtr> batch;
+    begin_fill(clientsock, state);
+    while (!output_full(state)) {
+        bool done;
+        size_t base;
+        batch.clear();
+        {
+            TranscodeJob& job = *state.transcode;
+            std::lock_guard<std::mutex> lock(job.mtx);
+            TranscodeViewer& viewer = job.viewers[{t_worker_id, state.serial}];
+            state.transcode_index = std::max(state.transcode_index, job.base); //回到开头时可能刚被裁过
+            viewer.index = state.transcode_index; //之前的包已经入队，可以裁掉
+            size_t end = std::min(job.base + job.packets.size(), state.transcode_index + 32);
+            if (state.transcode_index < end) {
+                batch.assign(job.packets.begin() + (state.transcode_index - job.base), job.packets.begin() + (end - job.base));
+            } else if (!job.done) {
+                viewer.waiting = true;
+            }
+            done = job.done;
+            base = job.base;
+        }
+        if (batch.empty()) {
+            if (!done || state.transcode_index == base) {
+                break; //已追上转码进度，取包时已登记等新包
+            }
+            LOGD("End of transcoded %s on socket %d. Looping.", state.transcode->key.c_str(), clientsock);
+            state.stats->wraparounds.add();
+            state.transcode_index = base; //开头被裁掉了就从保留的第一个关键帧循环
+            pace_restart_loop(state);
+            continue;
+        }
+        size_t i = 0;
+        for (; i < batch.size(); ++i) {
+            const FramedPacketPtr& fp = batch[i];
+            if (output_full(state) || !pace_due(clientsock, state, fp->ts_us, fp->dataType)) {
+                break;
+            }
+            if (admit_packet(clientsock, state, fp->dataType, fp->keyframe, fp->disposable, fp->bytes.size())) {
+                push_framed(state.outq, state.protocol, fp);
+            }
+        }
+        state.transcode_index += i;
+        if (i < batch.size()) {
+            break; //队列满了或者下一个包还没到发送时间
+        }
+    }
+    return true;
+}
+
+//转码任务有新包时，推送给转码线程交来的观众，已断开（或fd已被新连接复用）的跳过
+static void notify_transcode_clients(int epollfd) {
+    std::vector<TitleWaiter> ready;
+    {
+        std::lock_guard<std::mutex> lock(t_inbox->mtx);
+        ready.swap(t_inbox->transcoded);
+    }
+    for (const TitleWaiter& w : ready) {
+        auto it = client_states.find(w.clientsock);
+        if (it != client_states.end() && it->second.serial == w.serial && it->second.transcode) {
+            handle_write(epollfd, w.clientsock);
+        }
+    }
+}
+
+//转码跳转：只能跳到已经转出来、还没被裁掉的部分，目标还没转到时停在最新的关键帧，早于保留部分时停在最早的
+static int64_t seek_transcode_client(ClientState& state, int64_t target_us) {
+    TranscodeJob& job = *state.transcode;
+    std::lock_guard<std::mutex> lock(job.mtx);
+    auto it = std::upper_bound(job.keyframes.begin(), job.keyframes.end(), target_us,
+                               [&job](int64_t t, size_t index) { return t < job.packets[index - job.base]->ts_us; });
+    if (it != job.keyframes.begin()) {
+        --it;
+    }
+    state.transcode_index = it != job.keyframes.end() ? *it : job.base;
+    job.viewers[{t_worker_id, state.serial}].index = state.transcode_index;
+    return job.packets.empty() ? 0 : job.packets[state.transcode_index - job.base]->ts_us;
+}
+
+//推流请求：以live/<频道名>登记一个推流频道，同名频道正在推流时拒绝。之后这个连接只上行，
+//推上来的包经广播环转发给订阅者，不解封装也不重新封装负载
+static void handle_publish(int epollfd, int clientsock, ClientState& state, const std::string& channel) {
+    if (!g_catalog || !state.awaiting_title) {
+        LOGD("Client %d sent a publish request outside catalog setup, ignored.", clientsock);
+        return;
+    }
+    if (state.queued) {
+        reject_client(epollfd, clientsock, "server busy");
+        return;
+    }
+    if (channel.empty() || channel[0] == '.' || channel.find('/') != std::string::npos) {
+        reject_client(epollfd, clientsock, "invalid channel");
+        return;
+    }
+    auto src = std::make_shared<LiveSource>();
+    src->filename = CHANNEL_PREFIX + channel;
+    src->ingest = true;
+    // 推上来的包可能要送到任何一个工作线程上的观众，唤醒各线程的收件箱
+    for (auto& inbox : g_inboxes) {
+        if (inbox->notify_fd >= 0) {
+            src->notify_fds.push_back(inbox->notify_fd);
+        }
+    }
+    bool busy;
+    {
+        std::lock_guard<std::mutex> lock(g_channels.mtx);
+        std::shared_ptr<LiveSource>& slot = g_channels.channels[src->filename];
+        busy = slot != nullptr;
+        if (!busy) {
+            slot = src;
+        }
+    }
+    if (busy) {
+        reject_client(epollfd, clientsock, "channel busy");
+        return;
+    }
+    LOGI("Client %d publishing channel %s.", clientsock, src->filename.c_str());
+    state.awaiting_title = false;
+    state.publishing = std::move(src);
+}
+
+//订阅推流频道：开播（流信息收齐）之后才能订阅
+static void subscribe_channel(int epollfd, int clientsock, ClientState& state, const std::string& title) {
+    std::shared_ptr<LiveSource> src;
+    {
+        std::lock_guard<std::mutex> lock(g_channels.mtx);
+        auto it = g_channels.channels.find(title);
+        if (it != g_channels.channels.end() && !it->second->info_packet.empty()) {
+            src = it->second;
+        }
+    }
+    if (!src) {
+        reject_client(epollfd, clientsock, "unknown channel");
+        return;
+    }
+    LOGI("Client %d subscribed to channel %s.", clientsock, title.c_str());
+    start_live_subscriber(epollfd, clientsock, state, src);
+}
+
+//推流频道和上游会话的观众：关掉Nagle，每个包一到就发出去
+static void start_live_subscriber(int epollfd, int clientsock, ClientState& state, const std::shared_ptr<LiveSource>& src) {
+    int one = 1;
+    setsockopt(clientsock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    state.awaiting_title = false;
+    join_live_source(clientsock, state, src);
+    handle_write(epollfd, clientsock);
+}
+
+//编码参数消息中视频流的编码，找不到时按H.264
+static AVCodecID stream_info_video_codec(const uint8_t* payload, size_t size) {
+    uint32_t count;
+    if (size < sizeof(count)) {
+        return AV_CODEC_ID_H264;
+    }
+    memcpy(&count, payload, sizeof(count));
+    size_t pos = sizeof(count);
+    for (uint32_t i = 0; i < count && pos + sizeof(StreamInfoEntry) <= size; ++i) {
+        StreamInfoEntry entry;
+        memcpy(&entry, payload + pos, sizeof(entry));
+        if (entry.mediaType == 0) {
+            return (AVCodecID)entry.codecId;
+        }
+        pos += sizeof(entry) + entry.extradataSize;
+    }
+    return AV_CODEC_ID_H264;
+}
+
+//追加一个v1包头封装的消息
+static void append_v1_message(std::vector<uint8_t>& out, uint32_t data_type, const uint8_t* payload, uint32_t size, int64_t pts) {
+    PacketHeader header{PACKET_MAGIC, data_type, size, pts};
+    const uint8_t* h = (const uint8_t*)&header;
+    out.insert(out.end(), h, h + sizeof(header));
+    out.insert(out.end(), payload, payload + size);
+}
+
+//开播：攒好的流信息包交给频道，之后观众才能订阅
+static void channel_go_live(int clientsock, ClientState& state) {
+    {
+        std::lock_guard<std::mutex> lock(g_channels.mtx);
+        state.publishing->info_packet.swap(state.publish_info);
+    }
+    LOGI("Channel %s is live (publisher %d, video %s).", state.publishing->filename.c_str(), clientsock,
+         avcodec_get_name(state.publish_codec));
+}
+
+//推流端的一个包（包头已统一成v2的字段，v1包头没有标志和dts）：先是流信息（类型2，可选跟一个编码参数消息），
+//之后的音视频包换成v1包头进广播环，由各工作线程的事件循环发给订阅者。返回false表示协议错误
+static bool ingest_packet(int clientsock, ClientState& state, const PacketHeaderV2& header, bool has_flags,
+                          const uint8_t* payload) {
+    LiveSource* src = state.publishing.get();
+    bool live = !src->info_packet.empty(); // 只有本线程写，不用加锁
+    switch (header.dataType) {
+    case 2:
+    case DATA_STREAM_INFO:
+        if (live) {
+            LOGD("Publisher %d sent stream info after going live, ignored.", clientsock);
+            return true; //参数集在关键帧前随码流重复，订阅者不需要新的编码参数消息
+        }
+        if ((header.dataType == 2) != state.publish_info.empty()) {
+            LOGW("Publisher %d sent stream info out of order.", clientsock);
+            return false;
+        }
+        append_v1_message(state.publish_info, header.dataType, payload, header.dataSize, header.pts);
+        if (header.dataType == DATA_STREAM_INFO) {
+            state.publish_codec = stream_info_video_codec(payload, header.dataSize);
+            channel_go_live(clientsock, state);
+        }
+        return true;
+    case 0:
+    case 1:
+        if (!live) {
+            if (state.publish_info.empty()) {
+                LOGW("Publisher %d sent media before stream info.", clientsock);
+                return false;
+            }
+            channel_go_live(clientsock, state); //没有编码参数消息，订阅者按H.264/AAC处理
+        }
+        break;
+    case DATA_HEARTBEAT:
+        return true;
+    default:
+        LOGD("Publisher %d sent message type %u, ignored.", clientsock, header.dataType);
+        return true;
+    }
+
+    src->ingest_packets.add();
+    src->ingest_bytes.add(header.dataSize);
+    live_source_publish(src, reframe_packet(header, has_flags, payload, state.publish_codec));
+    return true;
+}
+
+//把转发来的一个包换成v1包头的共享包；没有v2标志时视频按NAL类型判断关键帧和可丢弃
+static FramedPacketPtr reframe_packet(const PacketHeaderV2& header, bool has_flags, const uint8_t* payload, AVCodecID codec_id) {
+    auto fp = std::make_shared<FramedPacket>();
+    append_v1_message(fp->bytes, header.dataType, payload, header.dataSize, header.pts);
+    fp->dataType = header.dataType;
+    if (has_flags) {
+        fp->keyframe = (header.flags & PACKET_FLAG_KEY) != 0;
+        fp->disposable = (header.flags & PACKET_FLAG_DISPOSABLE) != 0;
+    } else if (header.dataType == 0) {
+        annexb_picture_flags(payload, header.dataSize, codec_id, &fp->keyframe, &fp->disposable);
+    }
+    fp->pts = header.pts;
+    fp->dts = header.dts;
+    fp->duration = header.duration;
+    return fp;
+}
+
+//从缓冲开头解析一个包头，v1包头换成v2的字段（没有标志，dts未知）。返回包头字节数，数据还不够时返回0，
+//魔数不对、v2包头长度不对或负载超过MAX_INGEST_PACKET时返回-1
+static int parse_packet_header(const uint8_t* data, size_t len, PacketHeaderV2* header, bool* has_flags) {
+    uint32_t magic;
+    if (len < sizeof(magic)) return 0;
+    memcpy(&magic, data, sizeof(magic));
+    int header_size;
+    if (magic == PACKET_MAGIC) {
+        PacketHeader v1;
+        if (len < sizeof(v1)) return 0;
+        memcpy(&v1, data, sizeof(v1));
+        // 超出16位的类型都不认识，照样跳过负载
+        uint16_t data_type = v1.dataType > UINT16_MAX ? UINT16_MAX : (uint16_t)v1.dataType;
+        *header = PacketHeaderV2{PACKET_MAGIC_V2, 2, 0, (uint16_t)sizeof(PacketHeaderV2), data_type, 0, v1.dataSize,
+                                 v1.pts, AV_NOPTS_VALUE, 0};
+        *has_flags = false;
+        header_size = sizeof(v1);
+    } else if (magic == PACKET_MAGIC_V2) {
+        if (len < sizeof(*header)) return 0;
+        memcpy(header, data, sizeof(*header));
+        *has_flags = true;
+        header_size = header->headerSize;
+        if (header_size < (int)sizeof(*header)) return -1;
+    } else {
+        return -1;
+    }
+    return header->dataSize > MAX_INGEST_PACKET ? -1 : header_size;
+}
+
+//推流端的输入：缓冲里凑齐的包逐个处理，最后一次性去掉处理过的部分。v1、v2包头都接受
+static bool ingest_input(int clientsock, ClientState& state) {
+    const uint8_t* data = (const uint8_t*)state.inbuf.data();
+    size_t pos = 0;
+    bool ok = true;
+    while (ok) {
+        PacketHeaderV2 header;
+        bool has_flags;
+        int header_size = parse_packet_header(data + pos, state.inbuf.size() - pos, &header, &has_flags);
+        if (header_size < 0) {
+            LOGW("Publisher %d sent an invalid or oversized packet header.", clientsock);
+            ok = false;
+            break;
+        }
+        if (header_size == 0 || state.inbuf.size() - pos < header_size + header.dataSize) break;
+        ok = ingest_packet(clientsock, state, header, has_flags, data + pos + header_size);
+        pos += header_size + header.dataSize;
+    }
+    state.inbuf.erase(0, pos);
+    return ok;
+}
+
+//推流端断开：频道从登记表摘掉，订阅者发完环里剩下的包后断开
+static void end_publish(ClientState& state) {
+    LiveSource* src = state.publishing.get();
+    {
+        std::lock_guard<std::mutex> lock(g_channels.mtx);
+        auto it = g_channels.channels.find(src->filename);
+        if (it != g_channels.channels.end() && it->second.get() == src) {
+            g_channels.channels.erase(it);
+        }
+    }
+    std::vector<int> fds;
+    {
+        std::lock_guard<std::mutex> lock(src->mtx);
+        src->ended = true;
+        fds = src->notify_fds;
+    }
+    for (int fd : fds) {
+        wake_eventfd(fd);
+    }
+    LOGI("Channel %s ended after %llu packets.", src->filename.c_str(), (unsigned long long)src->ingest_packets.get());
+}
+
+//边缘节点的片名请求：同一片名的本地观众共享一路上游连接，第一个请求建立会话，上游开播前到的观众登记等待
+static void subscribe_upstream(int epollfd, int clientsock, ClientState& state, const std::string& title) {
+    if (title.empty()) {
+        reject_client(epollfd, clientsock, "unknown title");
+        return;
+    }
+    std::shared_ptr<Upstream> up;
+    std::shared_ptr<LiveSource> src;
+    bool start = false;
+    {
+        std::lock_guard<std::mutex> lock(g_upstreams.mtx);
+        std::shared_ptr<Upstream>& slot = g_upstreams.sessions[title];
+        if (!slot) {
+            slot = std::make_shared<Upstream>();
+            slot->title = title;
+            slot->src = std::make_shared<LiveSource>();
+            slot->src->filename = title;
+            slot->src->ingest = true;
+            for (auto& inbox : g_inboxes) {
+                if (inbox->notify_fd >= 0) {
+                    slot->src->notify_fds.push_back(inbox->notify_fd);
+                }
+            }
+            start = true;
+        }
+        up = slot;
+        if (!up->src->info_packet.empty()) {
+            src = up->src;
+        } else {
+            up->waiters.push_back({t_worker_id, clientsock, state.serial});
+        }
+    }
+    LOGI("Client %d requested title %s from upstream (%s).", clientsock, title.c_str(),
+         start ? "new session" : src ? "shared" : "waiting");
+    if (start) {
+        std::thread(upstream_loop, up).detach();
+    }
+    if (src) {
+        start_live_subscriber(epollfd, clientsock, state, src);
+    }
+}
+
+//连上源站并请求片名：要v2包头（带关键帧标志），收发超时让读线程定期醒来检查会话是否还有观众
+static int upstream_connect(const std::string& title, std::string& failure) {
+    addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* res = nullptr;
+    if (getaddrinfo(g_config.upstream_host.c_str(), std::to_string(g_config.upstream_port).c_str(), &hints, &res) != 0 || !res) {
+        failure = "cannot resolve " + g_config.upstream_host;
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    timeval tv = {UPSTREAM_POLL_MS / 1000, (UPSTREAM_POLL_MS % 1000) * 1000};
+    timeval connect_tv = {UPSTREAM_CONNECT_MS / 1000, (UPSTREAM_CONNECT_MS % 1000) * 1000};
+    int one = 1;
+    if (fd >= 0) {
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &connect_tv, sizeof(connect_tv)); // 也限制connect的等待
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        failure = std::string("cannot connect to upstream: ") + strerror(errno);
+        freeaddrinfo(res);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    freeaddrinfo(res);
+    std::string msg;
+    PacketHeader hello{PACKET_MAGIC, DATA_HELLO, 0, 2};
+    PacketHeader request{PACKET_MAGIC, DATA_TITLE_REQUEST, (uint32_t)title.size(), 0};
+    msg.append((const char*)&hello, sizeof(hello));
+    msg.append((const char*)&request, sizeof(request));
+    msg += title;
+    if (send(fd, msg.data(), msg.size(), MSG_NOSIGNAL) != (ssize_t)msg.size()) {
+        failure = "cannot send the title request upstream";
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//会话是否已经没有本地观众：持续UPSTREAM_LINGER_MS之后从登记表摘掉，之后的请求会建新会话
+static bool upstream_abandoned(Upstream* up, std::chrono::steady_clock::time_point& idle_since) {
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(g_upstreams.mtx);
+    if (up->src.use_count() > 1 || !up->waiters.empty()) {
+        idle_since = std::chrono::steady_clock::time_point();
+        return false;
+    }
+    if (idle_since == std::chrono::steady_clock::time_point()) {
+        idle_since = now;
+    }
+    if (ms_since(idle_since, now) < UPSTREAM_LINGER_MS) {
+        return false;
+    }
+    auto it = g_upstreams.sessions.find(up->title);
+    if (it != g_upstreams.sessions.end() && it->second.get() == up) {
+        g_upstreams.sessions.erase(it);
+    }
+    return true;
+}
+
+//上游发来了完整的流信息：第一次时开播并启动等待的观众；重连后编码参数变了，就在流里补发编码参数消息，
+//客户端像自适应码率切换时一样在之后的关键帧按新参数解码
+static void upstream_info(Upstream* up, const std::vector<uint8_t>& info) {
+    LiveSource* src = up->src.get();
+    std::vector<TitleWaiter> waiters;
+    bool changed = false;
+    {
+        std::lock_guard<std::mutex> lock(g_upstreams.mtx);
+        if (src->info_packet.empty()) {
+            src->info_packet = info;
+        } else {
+            // 和最近一次的比较，换成新的之后加入的观众直接拿到新参数；先换再发编码参数消息，
+            // 在这之前加入的观众从环里读到它
+            std::lock_guard<std::mutex> src_lock(src->mtx);
+            changed = info != src->info_packet;
+            if (changed) {
+                src->info_packet = info;
+            }
+        }
+        waiters.swap(up->waiters);
+    }
+    for (const TitleWaiter& w : waiters) {
+        WorkerInbox* inbox = g_inboxes[w.worker].get();
+        {
+            std::lock_guard<std::mutex> lock(inbox->mtx);
+            inbox->ready.push_back({w.clientsock, w.serial, nullptr, nullptr, up->src});
+        }
+        wake_eventfd(inbox->notify_fd);
+    }
+    PacketHeader first;
+    memcpy(&first, info.data(), sizeof(first));
+    size_t streams_at = sizeof(first) + first.dataSize;
+    if (changed && info.size() > streams_at) {
+        LOGI("Upstream stream parameters of %s changed, forwarding the new codec info.", up->title.c_str());
+        auto fp = std::make_shared<FramedPacket>();
+        fp->bytes.assign(info.begin() + streams_at, info.end());
+        fp->dataType = DATA_STREAM_INFO;
+        live_source_publish(src, std::move(fp));
+    }
+}
+
+//一次上游连接的接收循环：流信息之后的音视频包换成v1包头进广播环（每次连上都从关键帧开始）。
+//返回连接为什么结束，断开的原因写进failure
+static UpstreamEnd upstream_receive(int fd, Upstream* up, std::string& failure) {
+    LiveSource* src = up->src.get();
+    std::vector<char> chunk(INGEST_READ_BUFFER);
+    std::string inbuf;
+    std::vector<uint8_t> info;          // 这次连接收到的流信息包和编码参数消息
+    bool info_done = false;
+    bool wait_keyframe = true;
+    AVCodecID codec_id = AV_CODEC_ID_H264;
+    auto last_input = std::chrono::steady_clock::now();
+    auto last_check = last_input;
+    std::chrono::steady_clock::time_point idle_since;
+    while (true) {
+        ssize_t n = recv(fd, chunk.data(), chunk.size(), 0);
+        auto now = std::chrono::steady_clock::now();
+        if (n == 0) {
+            failure = "closed by upstream";
+            return UPSTREAM_LOST;
+        }
+        if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+            failure = strerror(errno);
+            return UPSTREAM_LOST;
+        }
+        if (n < 0 && ms_since(last_input, now) >= UPSTREAM_STALL_MS) {
+            failure = "upstream stalled"; // 源站没数据时也会发心跳，这么久什么都没有就是连接坏了
+            return UPSTREAM_LOST;
+        }
+        if (ms_since(last_check, now) >= UPSTREAM_POLL_MS) {
+            last_check = now;
+            if (upstream_abandoned(up, idle_since)) {
+                return UPSTREAM_ABANDONED;
+            }
+        }
+        if (n < 0) {
+            continue;
+        }
+        last_input = now;
+        g_upstreams.bytes.add(n);
+        inbuf.append(chunk.data(), n);
+
+        const uint8_t* data = (const uint8_t*)inbuf.data();
+        size_t pos = 0;
+        while (true) {
+            PacketHeaderV2 header;
+            bool has_flags;
+            int header_size = parse_packet_header(data + pos, inbuf.size() - pos, &header, &has_flags);
+            if (header_size < 0) {
+                failure = "invalid packet header from upstream";
+                return UPSTREAM_LOST;
+            }
+            if (header_size == 0 || inbuf.size() - pos < header_size + header.dataSize) break;
+            const uint8_t* payload = data + pos + header_size;
+            pos += header_size + header.dataSize;
+            switch (header.dataType) {
+            case 2:
+                info.clear();
+                append_v1_message(info, 2, payload, header.dataSize, header.pts);
+                info_done = false;
+                break;
+            case DATA_STREAM_INFO:
+                if (!info.empty() && !info_done) {
+                    append_v1_message(info, DATA_STREAM_INFO, payload, header.dataSize, header.pts);
+                    codec_id = stream_info_video_codec(payload, header.dataSize);
+                    upstream_info(up, info);
+                    info_done = true;
+                }
+                break;
+            case 0:
+            case 1: {
+                if (!info_done) {
+                    if (info.empty()) {
+                        failure = "media before stream info from upstream";
+                        return UPSTREAM_LOST;
+                    }
+                    upstream_info(up, info); //源站没发编码参数消息
+                    info_done = true;
+                }
+                FramedPacketPtr fp = reframe_packet(header, has_flags, payload, codec_id);
+                if (header.dataType == 0 && wait_keyframe) {
+                    if (!fp->keyframe) break;
+                    wait_keyframe = false;
+                    if (!up->connected.exchange(true)) {
+                        LOGI("Upstream for %s is streaming.", up->title.c_str());
+                    }
+                }
+                live_source_publish(src, fp);
+                break;
+            }
+            case DATA_ERROR:
+                failure = "upstream refused: " + std::string((const char*)payload, header.dataSize);
+                return UPSTREAM_REFUSED;
+            default:
+                break; //心跳、跳转完成等
+            }
+        }
+        inbuf.erase(0, pos);
+    }
+}
+
+//上游会话结束（源站拒绝，或者还没开播就连不上）：从登记表摘掉，等待的观众收到失败，已在看的观众发完环里剩下的包后断开
+static void upstream_fail(Upstream* up, const std::string& failure) {
+    LiveSource* src = up->src.get();
+    std::vector<TitleWaiter> waiters;
+    {
+        std::lock_guard<std::mutex> lock(g_upstreams.mtx);
+        waiters.swap(up->waiters);
+        auto it = g_upstreams.sessions.find(up->title);
+        if (it != g_upstreams.sessions.end() && it->second.get() == up) {
+            g_upstreams.sessions.erase(it);
+        }
+    }
+    LOGW("Upstream session for %s ended: %s (%zu waiting client(s)).", up->title.c_str(), failure.c_str(), waiters.size());
+    for (const TitleWaiter& w : waiters) {
+        WorkerInbox* inbox = g_inboxes[w.worker].get();
+        {
+            std::lock_guard<std::mutex> lock(inbox->mtx);
+            inbox->ready.push_back({w.clientsock, w.serial, nullptr, nullptr, nullptr});
+        }
+        wake_eventfd(inbox->notify_fd);
+    }
+    std::vector<int> fds;
+    {
+        std::lock_guard<std::mutex> lock(src->mtx);
+        src->ended = true;
+        fds = src->notify_fds;
+    }
+    for (int fd : fds) {
+        wake_eventfd(fd);
+    }
+}
+
+//上游会话线程：连接断开后按指数退避重连，本地观众一直留在同一个广播环上，重连后从下一个关键帧接着看；
+//最后一个观众离开一段时间后断开上游退出
+static void upstream_loop(std::shared_ptr<Upstream> up) {
+    log_set_thread_name("upstream");
+    int backoff_ms = UPSTREAM_RETRY_MIN_MS;
+    std::chrono::steady_clock::time_point idle_since;
+    while (true) {
+        std::string failure;
+        int fd = upstream_connect(up->title, failure);
+        UpstreamEnd end = UPSTREAM_LOST;
+        if (fd >= 0) {
+            end = upstream_receive(fd, up.get(), failure);
+            close(fd);
+        }
+        bool streamed = up->connected.exchange(false);
+        if (end == UPSTREAM_ABANDONED) {
+            LOGI("Upstream session for %s closed, no local viewers left.", up->title.c_str());
+            return;
+        }
+        // 从没开播过就失败的，或者源站明确拒绝的，不再重试
+        if (end == UPSTREAM_REFUSED || up->src->info_packet.empty()) {
+            upstream_fail(up.get(), failure);
+            return;
+        }
+        if (streamed) {
+            backoff_ms = UPSTREAM_RETRY_MIN_MS;
+        }
+        g_upstreams.reconnects.add();
+        LOGW("Upstream for %s lost (%s), reconnecting in %d ms.", up->title.c_str(), failure.c_str(), backoff_ms);
+        auto retry_at = std::chrono::steady_clock::now() + std::chrono::milliseconds(backoff_ms);
+        while (std::chrono::steady_clock::now() < retry_at) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(std::min(backoff_ms, UPSTREAM_POLL_MS)));
+            if (upstream_abandoned(up.get(), idle_since)) {
+                LOGI("Upstream session for %s closed, no local viewers left.", up->title.c_str());
+                return;
+            }
+        }
+        backoff_ms = std::min(backoff_ms * 2, UPSTREAM_RETRY_MAX_MS);
+    }
+}
+
+//告诉客户端请求失败的原因后断开；消息很短且此前没有发过数据，尽力发送即可
+static void reject_client(int epollfd, int clientsock, const char* reason) {
+    send_error(clientsock, reason);
+    LOGW("Rejected client %d: %s", clientsock, reason);
+    remove_client(epollfd, clientsock);
+}
+
+static void send_error(int clientsock, const char* reason) {
+    PacketHeader header;
+    header.magic = PACKET_MAGIC;
+    header.dataType = DATA_ERROR;
+    header.dataSize = strlen(reason);
+    header.pts = 0;
+    std::string msg((const char*)&header, sizeof(header));
+    msg += reason;
+    send(clientsock, msg.data(), msg.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+//客户端控制消息：跳转、暂停、恢复、调整实时发送的速率
+static void handle_control(int epollfd, int clientsock, ClientState& state, const PacketHeader& header) {
+    bool seekable = !state.awaiting_title && !state.opening && !state.live;
+    if (header.dataType == DATA_SEEK && !seekable) {
+        // 客户端在收到完成消息前丢弃所有数据，不能跳转也要回复，否则它会一直等下去
+        LOGD("Client %d tried to seek a stream that cannot seek, rejected.", clientsock);
+        push_message(state.outq, state.protocol, DATA_SEEK_DONE, SEEK_REJECTED);
+        handle_write(epollfd, clientsock);
+        return;
+    }
+    if (state.awaiting_title || state.opening) {
+        return;
+    }
+    switch (header.dataType) {
+    case DATA_SEEK:
+        state.seek_target_us = std::max<int64_t>(0, header.pts);
+        apply_pending_seek(epollfd, clientsock, state);
+        return;
+    case DATA_PAUSE:
+        if (!state.paused) {
+            state.paused = true;
+            state.paused_at = std::chrono::steady_clock::now();
+            state.drain_timer.cancel(); //暂停期间不发送，改由空闲超时管
+            LOGD("Client %d paused.", clientsock);
+        }
+        return;
+    case DATA_RESUME:
+        if (!state.paused) {
+            return;
+        }
+        state.paused = false;
+        // 时间线整体后移暂停的时长；直播没有回看，回到最近的关键帧重新起播
+        state.pace_start += std::chrono::steady_clock::now() - state.paused_at;
+        if (state.live) {
+            live_rejoin(state);
+        }
+        LOGD("Client %d resumed.", clientsock);
+        handle_write(epollfd, clientsock);
+        return;
+    case DATA_SET_RATE:
+        // 新速率从下一个包开始生效，已发出的部分不受影响
+        pace_restart_loop(state);
+        state.rate_permille = std::min<int64_t>(std::max<int64_t>(header.pts, 250), 4000);
+        LOGD("Client %d set rate to %d/1000.", clientsock, state.rate_permille);
+        return;
+    }
+}
+
+//执行登记的跳转：丢掉还没发出的数据，按关键帧索引重新定位，先发跳转完成消息再从新位置起播
+static void apply_pending_seek(int epollfd, int clientsock, ClientState& state) {
+    if (state.seek_target_us == AV_NOPTS_VALUE || state.send_inflight) {
+        return; //io_uring发送完成后再执行
+    }
+    int64_t target_us = state.seek_target_us;
+    state.seek_target_us = AV_NOPTS_VALUE;
+    auto start = std::chrono::steady_clock::now();
+    size_t dropped = state.outq.drop_unsent();
+    state.drain_timer.cancel(); //丢掉的积压不用再等它发完
+    int64_t landed_us = state.vod ? seek_vod_client(state, target_us)
+                      : state.transcode ? seek_transcode_client(state, target_us)
+                      : seek_file_client(state, target_us);
+    // 新位置重新起算时间线，立即补发burst-ms的数据以便快速出画面
+    state.pace_start = std::chrono::steady_clock::now();
+    if (state.paused) {
+        state.paused_at = state.pace_start; //时间线已从此刻重新起算，恢复时只需后移跳转之后暂停的时长
+    }
+    state.pace_base_us = 0;
+    state.pace_last_us = 0;
+    state.pace_origin_us = AV_NOPTS_VALUE;
+    state.pace_prev_us[0] = state.pace_prev_us[1] = AV_NOPTS_VALUE;
+    state.pace_wake = std::chrono::steady_clock::time_point();
+    state.skip_to_keyframe = false;
+    push_message(state.outq, state.protocol, DATA_SEEK_DONE, landed_us);
+    long long us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    LOGD("Client %d seek to %lld us landed at %lld us (%zu queued packets dropped, %lld us).", clientsock,
+         (long long)target_us, (long long)landed_us, dropped, us);
+    handle_write(epollfd, clientsock);
+}
+
+//点播跳转：在关键帧索引中二分查找不晚于目标时间的最后一个关键帧
+static int64_t seek_vod_client(ClientState& state, int64_t target_us) {
+    const PacketStore& store = *state.vod;
+    auto it = std::upper_bound(store.keyframes.begin(), store.keyframes.end(), target_us,
+                               [&store](int64_t t, size_t index) { return t < store.records[index].ts_us; });
+    if (it != store.keyframes.begin()) {
+        --it;
+    }
+    state.vod_index = it != store.keyframes.end() ? *it : 0;
+    state.vod_last_audio_us = INT64_MIN;
+    state.abr_video_from = 0;
+    state.abr_audio_after_us = INT64_MIN;
+    return store.records.empty() ? 0 : store.records[state.vod_index].ts_us;
+}
+
+//文件跳转：定位到目标之前的关键帧，丢掉BSF和暂存的旧包
+//有包索引时直接按关键帧自己的时间戳定位，落点是确定的；否则交给容器自己的索引
+static int64_t seek_file_client(ClientState& state, int64_t target_us) {
+    const PacketIndexEntry* kf = g_file_index ? g_file_index->keyframe_at(target_us) : nullptr;
+    if (kf) {
+        int64_t ts = kf->dts != AV_NOPTS_VALUE ? kf->dts : kf->pts;
+        if (av_seek_frame(state.fmt_ctx, state.video_stream_index, ts, AVSEEK_FLAG_BACKWARD) >= 0) {
+            av_bsf_flush(state.bsf_ctx);
+            av_packet_unref(state.held_pkt);
+            state.held = false;
+            return kf->ts_us;
+        }
+    }
+    if (av_seek_frame(state.fmt_ctx, -1, target_us, AVSEEK_FLAG_BACKWARD) < 0) {
+        av_seek_frame(state.fmt_ctx, state.video_stream_index, 0, AVSEEK_FLAG_BACKWARD);
+        target_us = 0;
+    }
+    av_bsf_flush(state.bsf_ctx);
+    av_packet_unref(state.held_pkt);
+    state.held = false;
+    return target_us;
+}
+
+//点播客户端：按记录下标把共享存储中的记录放进输出队列，到末尾后回到开头
+//队列元素直接指向存储内的数据，存储由state.vod持有，不需要逐包引用计数
+//（切换版本后旧版本的数据由state.vod_title保住）
+bool fill_vod_client(int clientsock, ClientState& state) {
+    begin_fill(clientsock, state);
+    while (!output_full(state)) {
+        const PacketStore& store = *state.vod;
+        const PacketRecord& rec = store.records[state.vod_index];
+        // 自适应码率只在视频关键帧处换版本，新版本从时间相同的关键帧接着发
+        if (state.abr_target != state.abr_level && rec.dataType == 0 && rec.keyframe &&
+            state.vod_index >= state.abr_video_from && abr_switch(clientsock, state, rec.ts_us)) {
+            continue;
+        }
+        // 刚切换过来：新版本上一个GOP的视频和旧版本已经发过的音频都跳过，也不参与节拍
+        bool skip = rec.dataType == 0 ? state.vod_index < state.abr_video_from : rec.ts_us <= state.abr_audio_after_us;
+        if (!skip && !pace_due(clientsock, state, rec.ts_us, rec.dataType)) {
+            break;
+        }
+        if (!skip && admit_packet(clientsock, state, rec.dataType, rec.keyframe, rec.disposable, rec.size)) {
+            OutputQueue::Slice& s = state.outq.prepare();
+            s.data = store.data.data() + rec.offset;
+            s.size = rec.size;
+            s.dataType = rec.dataType;
+            s.keyframe = rec.keyframe;
+            s.pts = rec.pts;
+            if (state.protocol >= 2) {
+                // 存储里是v1包头，v2客户端另写包头，负载仍直接引用存储
+                s.data += sizeof(PacketHeader);
+                s.size -= sizeof(PacketHeader);
+                s.header_len = frame_header(s.header, state.protocol, rec.dataType, s.size, rec.pts, rec.dts,
+                                            rec.duration, rec.keyframe, rec.disposable);
+            } else {
+                s.fixed = state.vod == g_packet_store; //只有主版本注册成了io_uring的固定缓冲区
+            }
+            state.outq.commit();
+            if (rec.dataType == 1) {
+                state.vod_last_audio_us = rec.ts_us;
+            }
+        }
+        if (++state.vod_index == store.records.size()) {
+            LOGD("End of packet store on socket %d. Looping.", clientsock);
+            state.stats->wraparounds.add();
+            state.vod_index = 0;
+            state.vod_last_audio_us = INT64_MIN;
+            state.abr_video_from = 0;
+            state.abr_audio_after_us = INT64_MIN;
+            pace_restart_loop(state);
+        }
+    }
+    return true;
+}
+
+//自适应码率采样：已经离开socket的字节（累计写入减去内核发送缓冲区里还没发出的）的增长速度就是排空速率。
+//积压超过当前版本半秒的数据说明链路跟不上，这时的排空速率就是链路能力，选平均码率不超过它ABR_SAFETY的最高版本；
+//不拥塞时排空速率大致等于当前版本的码率，连续abr_probe_samples次不拥塞、且排空速率的ABR_SAFETY够得上高一档的平均码率
+//（起播和跳转的突发、码率起伏都会让它冒头）才试着升一档；升上去跟不上会再降回来，下一次试探的等待次数加倍
+static void abr_sample(int clientsock, ClientState& state) {
+    auto now = std::chrono::steady_clock::now();
+    int unsent = 0;
+    if (ioctl(clientsock, SIOCOUTQ, &unsent) < 0) {
+        unsent = 0;
+    }
+    uint64_t delivered = state.stats->bytes_sent.get() - (uint64_t)unsent;
+    int64_t elapsed_ms = state.abr_sampled_at == std::chrono::steady_clock::time_point() ? ABR_SAMPLE_MS
+                                                                                         : ms_since(state.abr_sampled_at, now);
+    uint64_t gained = delivered > state.abr_delivered ? delivered - state.abr_delivered : 0;
+    state.abr_delivered = delivered;
+    state.abr_sampled_at = now;
+    if (state.paused || elapsed_ms <= 0) {
+        return; //暂停期间不发送，只更新起点
+    }
+    uint64_t bps = gained * 8 * 1000 / (uint64_t)elapsed_ms;
+    state.abr_rate_bps = state.abr_rate_bps ? (state.abr_rate_bps + bps) / 2 : bps;
+    state.stats->drain_bps.set(state.abr_rate_bps);
+
+    const std::vector<const PacketStore*>& ladder = state.vod_title->ladder;
+    uint64_t level_bps = ladder[state.abr_level]->avg_bps;
+    state.stats->rendition_bps.set(level_bps);
+    bool congested = (state.outq.queued_bytes() + (uint64_t)unsent) * 8 * 2 > level_bps;
+    size_t target = state.abr_level;
+    if (congested) {
+        state.abr_calm = 0;
+        if (state.abr_probing && state.abr_level == state.abr_target) {
+            state.abr_probe_samples = std::min(state.abr_probe_samples * 2, ABR_PROBE_MAX_SAMPLES);
+        }
+        state.abr_probing = false;
+        target = 0;
+        while (target + 1 < ladder.size() && ladder[target + 1]->avg_bps <= state.abr_rate_bps * ABR_SAFETY) {
+            target++;
+        }
+    } else {
+        ++state.abr_calm;
+        if (state.abr_probing && state.abr_level == state.abr_target && state.abr_calm >= ABR_PROBE_SAMPLES) {
+            state.abr_probing = false; //升上去稳住了
+            state.abr_probe_samples = ABR_PROBE_SAMPLES;
+        }
+        if (!state.abr_probing && state.abr_calm >= state.abr_probe_samples && state.abr_level + 1 < ladder.size() &&
+            ladder[state.abr_level + 1]->avg_bps <= state.abr_rate_bps * ABR_SAFETY) {
+            state.abr_calm = 0;
+            state.abr_probing = true;
+            target = state.abr_level + 1;
+        }
+    }
+    if (target != state.abr_target) {
+        LOGD("Client %d drains %llu kbit/s%s, rendition %zu -> %zu at the next aligned keyframe.", clientsock,
+             (unsigned long long)(state.abr_rate_bps / 1000), congested ? " (congested)" : "", state.abr_level, target);
+        state.abr_target = target;
+    }
+}
+
+//在当前版本时间为key_us的关键帧处换到abr_target：新版本有时间相同的关键帧才换，否则等下一个关键帧。
+//新版本从该关键帧之前最近的、旧版本还没发过的音频开始，编码参数变了（分辨率等）先重发编码参数消息
+static bool abr_switch(int clientsock, ClientState& state, int64_t key_us) {
+    const PacketStore* from = state.vod.get();
+    const PacketStore* to = state.vod_title->ladder[state.abr_target];
+    auto it = std::lower_bound(to->keyframes.begin(), to->keyframes.end(), key_us - ABR_ALIGN_US,
+                               [to](size_t index, int64_t t) { return to->records[index].ts_us < t; });
+    if (it == to->keyframes.end() || to->records[*it].ts_us > key_us + ABR_ALIGN_US) {
+        return false;
+    }
+    size_t key = *it;
+    size_t start = key;
+    while (start > 0 && key - start < ABR_AUDIO_BACKTRACK &&
+           !(to->records[start - 1].dataType == 1 && to->records[start - 1].ts_us <= state.vod_last_audio_us)) {
+        start--;
+    }
+    state.vod = std::shared_ptr<const PacketStore>(state.vod_title, to);
+    state.vod_index = start;
+    state.abr_video_from = key;
+    state.abr_audio_after_us = state.vod_last_audio_us;
+    LOGI("Client %d switched from %llu to %llu kbit/s at %.3f s.", clientsock, (unsigned long long)(from->avg_bps / 1000),
+         (unsigned long long)(to->avg_bps / 1000), key_us / 1e6);
+    state.abr_level = state.abr_target;
+    state.abr_calm = 0;
+    state.stats->rendition_switches.add();
+    state.stats->rendition_bps.set(to->avg_bps);
+    if (to->codec_info != from->codec_info) {
+        push_bytes(state.outq, to->codec_info);
+    }
+    return true;
+}
+
+//实时发送：ts_us映射到客户端时间线，领先播放进度不超过burst_ms的包才可以发送
+//还没到时间时登记定时器并返回false
+static bool pace_due(int clientsock, ClientState& state, int64_t ts_us, uint32_t data_type) {
+    if (!state.paced || ts_us == AV_NOPTS_VALUE) {
+        return true;
+    }
+    if (state.pace_origin_us == AV_NOPTS_VALUE) {
+        state.pace_origin_us = ts_us;
+    }
+    int64_t t = state.pace_base_us + (ts_us - state.pace_origin_us) * 1000 / state.rate_permille;
+    auto due = state.pace_start + std::chrono::microseconds(t - (int64_t)g_config.burst_ms * 1000);
+    if (due <= std::chrono::steady_clock::now()) {
+        state.pace_last_us = std::max(state.pace_last_us, t);
+        int k = data_type == 0 ? 0 : 1;
+        if (state.pace_prev_us[k] != AV_NOPTS_VALUE && t > state.pace_prev_us[k]) {
+            state.pace_step_us[k] = t - state.pace_prev_us[k];
+        }
+        state.pace_prev_us[k] = t;
+        return true;
+    }
+    schedule_pace_timer(clientsock, state, due);
+    return false;
+}
+
+//回到文件开头时，新一轮的时间戳接在上一轮最后一个包播完之后：最后一个包的时长按同类包的间隔估计，
+//否则新一轮的第一帧和上一轮的最后一帧同时到期，循环处多出一个零时长的帧
+static void pace_restart_loop(ClientState& state) {
+    int64_t base = state.pace_last_us;
+    for (int k = 0; k < 2; ++k) {
+        if (state.pace_prev_us[k] != AV_NOPTS_VALUE) {
+            base = std::max(base, state.pace_prev_us[k] + state.pace_step_us[k]);
+        }
+        state.pace_prev_us[k] = AV_NOPTS_VALUE;
+    }
+    state.pace_base_us = base;
+    state.pace_last_us = base;
+    state.pace_origin_us = AV_NOPTS_VALUE;
+}
+
+//登记客户端的唤醒时间，比timerfd当前到期时间更早时重新设置timerfd
+void schedule_pace_timer(int clientsock, ClientState& state, std::chrono::steady_clock::time_point when) {
+    if (state.pace_wake == when) {
+        return; //已经登记过
+    }
+    state.pace_wake = when;
+    pace_timers.push(PaceTimer{when, clientsock});
+    if (when < pace_timer_armed) {
+        arm_pace_timer(when);
+    }
+}
+
+//把timerfd设置到绝对时间when（steady_clock即CLOCK_MONOTONIC）
+static void arm_pace_timer(std::chrono::steady_clock::time_point when) {
+    pace_timer_armed = when;
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(when.time_since_epoch()).count();
+    itimerspec its = {};
+    its.it_value.tv_sec = ns / 1000000000;
+    its.it_value.tv_nsec = std::max<int64_t>(ns % 1000000000, 1);
+    timerfd_settime(pace_timer_fd, TFD_TIMER_ABSTIME, &its, nullptr);
+}
+
+//定时器到期：唤醒所有到时间的客户端继续发送，然后按堆顶重设timerfd
+void handle_pace_timer(int epollfd) {
+    pace_timer_armed = std::chrono::steady_clock::time_point::max();
+    auto now = std::chrono::steady_clock::now();
+    while (!pace_timers.empty() && pace_timers.top().when <= now) {
+        PaceTimer t = pace_timers.top();
+        pace_timers.pop();
+        auto it = client_states.find(t.clientsock);
+        // 客户端已断开或已重新登记了别的时间，这条是过期记录
+        if (it == client_states.end() || it->second.pace_wake != t.when) {
+            continue;
+        }
+        it->second.pace_wake = std::chrono::steady_clock::time_point();
+        handle_write(epollfd, t.clientsock);
+    }
+    if (!pace_timers.empty() && pace_timers.top().when < pace_timer_armed) {
+        arm_pace_timer(pace_timers.top().when);
+    }
+}
+
+//攒批发送：实时发送和直播的客户端每次被唤醒往往只有一两个到期的小包（音频几百字节），逐个sendmsg代价主要在系统调用上。
+//队列里不足coalesce_bytes、最早的数据也还没等满coalesce_ms时先不发，登记定时器，到时连同这期间到期的包一次发出
+static bool flush_due(int clientsock, ClientState& state) {
+    // 推流频道的观众要的是低延迟，每个包到了就发
+    if (g_config.coalesce_ms <= 0 || (state.live && state.live->ingest) || state.outq.queued_bytes() >= g_config.coalesce_bytes || output_full(state)) {
+        return true;
+    }
+    auto deadline = state.outq.since() + std::chrono::milliseconds(g_config.coalesce_ms);
+    if (deadline <= std::chrono::steady_clock::now()) {
+        return true;
+    }
+    // 节拍定时器更早到期时不用另外登记，那时会重新判断
+    if (state.pace_wake == std::chrono::steady_clock::time_point() || state.pace_wake > deadline) {
+        schedule_pace_timer(clientsock, state, deadline);
+    }
+    t_stats->coalesced.add();
+    return false;
+}
+
+//定时器轮的时间：steady_clock的毫秒数
+static int64_t client_timer_now_ms() {
+    return (int64_t)(metrics_now_ns() / 1000000);
+}
+
+static int64_t ms_since(std::chrono::steady_clock::time_point since, std::chrono::steady_clock::time_point now) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(now - since).count();
+}
+
+//事件循环等待的超时：到定时器轮的下一格，没有登记时一直等
+static int client_timer_timeout() {
+    return client_timers.timeout_ms(client_timer_now_ms());
+}
+
+//新连接登记心跳和空闲超时；排空期限在发送阻塞时才登记
+static void start_client_timers(int clientsock, ClientState& state) {
+    state.last_send = state.last_input = std::chrono::steady_clock::now();
+    state.heartbeat_timer.owner = state.idle_timer.owner = state.drain_timer.owner = clientsock;
+    state.heartbeat_timer.kind = TIMER_HEARTBEAT;
+    state.idle_timer.kind = TIMER_IDLE;
+    state.drain_timer.kind = TIMER_DRAIN;
+    state.abr_timer.owner = clientsock;
+    state.abr_timer.kind = TIMER_ABR;
+    int64_t now_ms = client_timer_now_ms();
+    if (state.vod_title) {
+        client_timers.schedule(&state.abr_timer, now_ms, ABR_SAMPLE_MS);
+    }
+    if (g_config.heartbeat_ms > 0) {
+        client_timers.schedule(&state.heartbeat_timer, now_ms, g_config.heartbeat_ms);
+    }
+    if (g_config.idle_ms > 0) {
+        client_timers.schedule(&state.idle_timer, now_ms, g_config.idle_ms);
+    }
+}
+
+//发送阻塞：还没有期限时记下当前积压全部发出后的累计发送字节数，drain_ms内达不到就断开。
+//只登记一次，发送每次阻塞都不必改期；队列发空时取消
+static void watch_drain(ClientState& state) {
+    if (g_config.drain_ms <= 0 || state.drain_timer.armed()) {
+        return;
+    }
+    state.drain_target = state.stats->bytes_sent.get() + state.outq.queued_bytes();
+    client_timers.schedule(&state.drain_timer, client_timer_now_ms(), g_config.drain_ms);
+}
+
+//心跳：只在流已经开始（流信息包发过了）而且输出队列空着时发，队列里有数据时连接本身就有动静
+static void send_heartbeat(int epollfd, int clientsock, ClientState& state) {
+    if (state.awaiting_title || state.opening || state.queued || state.publishing || !state.outq.empty() ||
+        state.send_inflight) {
+        return;
+    }
+    push_message(state.outq, state.protocol, DATA_HEARTBEAT, 0);
+    t_stats->heartbeats.add();
+#ifdef HAVE_LIBURING
+    if (g_config.io == IO_URING) {
+        uring_submit_send(clientsock, state);
+        return;
+    }
+#endif
+    int ret = flush_output(clientsock, state);
+    if (ret < 0) {
+        LOGD("Heartbeat to client %d failed: %s", clientsock, strerror(errno));
+        remove_client(epollfd, clientsock);
+    } else if (ret == 0 && !state.paused) {
+        watch_drain(state);
+    }
+}
+
+//定时器到期。活动时间只在发送和收包时记一笔，到期时才比较：还没到就按剩余时间改期，
+//这样数据正常流动时定时器每个周期只处理一次，而不是每次发送都改期
+static void on_client_timer(int epollfd, WheelTimer* timer) {
+    if (timer->kind == TIMER_HTTP_IDLE) {
+        http_idle(epollfd, timer);
+        return;
+    }
+    int clientsock = timer->owner;
+    auto it = client_states.find(clientsock);
+    if (it == client_states.end()) {
+        return;
+    }
+    ClientState& state = it->second;
+    auto now = std::chrono::steady_clock::now();
+    int64_t now_ms = client_timer_now_ms();
+    switch (timer->kind) {
+    case TIMER_HEARTBEAT: {
+        int64_t quiet_ms = ms_since(state.last_send, now);
+        if (quiet_ms < g_config.heartbeat_ms) {
+            client_timers.schedule(timer, now_ms, g_config.heartbeat_ms - quiet_ms);
+            return;
+        }
+        client_timers.schedule(timer, now_ms, g_config.heartbeat_ms);
+        send_heartbeat(epollfd, clientsock, state);
+        return;
+    }
+    case TIMER_IDLE: {
+        // 正在推流的客户端不算空闲，推不动的由排空期限处理；推流端则要一直有输入
+        if (!state.paused && !state.awaiting_title && !state.publishing) {
+            client_timers.schedule(timer, now_ms, g_config.idle_ms);
+            return;
+        }
+        auto since = state.paused ? std::max(state.last_input, state.paused_at) : state.last_input;
+        int64_t idle_ms = ms_since(since, now);
+        if (idle_ms < g_config.idle_ms) {
+            client_timers.schedule(timer, now_ms, g_config.idle_ms - idle_ms);
+            return;
+        }
+        t_stats->idle_timeouts.add();
+        LOGI("Client %d idle for %lld ms (%s), disconnecting.", clientsock, (long long)idle_ms,
+             state.paused ? "paused" : state.publishing ? "publisher stalled" : "no title request");
+        remove_client(epollfd, clientsock);
+        return;
+    }
+    case TIMER_ABR:
+        client_timers.schedule(timer, now_ms, ABR_SAMPLE_MS);
+        abr_sample(clientsock, state);
+        return;
+    case TIMER_DRAIN: {
+        uint64_t sent = state.stats->bytes_sent.get();
+        if (sent < state.drain_target) {
+            t_stats->slow_evictions.add();
+            LOGW("Client %d too slow: %llu of its backlog still unsent after %d ms, disconnecting.", clientsock,
+                 (unsigned long long)(state.drain_target - sent), g_config.drain_ms);
+            remove_client(epollfd, clientsock);
+            return;
+        }
+        // 按期发完了那批积压，但队列一直没空：从现在的积压重新计时
+        if (!state.outq.empty() && !state.paused) {
+            watch_drain(state);
+        }
+        return;
+    }
+    case TIMER_HTTP_IDLE:
+        return; // 上面已经分发给HTTP连接
+    }
+}
+
+//每轮事件处理完后推进定时器轮
+static void handle_client_timers(int epollfd) {
+    client_timers.advance(client_timer_now_ms(), [epollfd](WheelTimer* timer) { on_client_timer(epollfd, timer); });
+}
+
+//输出队列是否已满：启用丢包的客户端由丢包控制积压，只受槽位数限制，
+//这样落后时仍能继续消费源里到期的包，而不是整体停下来越积越晚
+static bool output_full(const ClientState& state) {
+    if (state.drop_enabled) {
+        return state.outq.size() == OutputQueue::SLOTS;
+    }
+    return state.outq.full(g_config.out_queue_bytes);
+}
+
+//每轮填充前采样一次积压（ioctl只调用一次），本轮的丢包决策都基于它
+static void begin_fill(int clientsock, ClientState& state) {
+    if (state.drop_enabled) {
+        state.fill_backlog = client_backlog_bytes(clientsock, state);
+    }
+}
+
+//拥塞控制：决定一个到期的包是入队还是丢弃，音频始终保留
+static bool admit_packet(int clientsock, ClientState& state, uint32_t data_type, bool keyframe, bool disposable, size_t size) {
+    if (!state.drop_enabled || data_type != 0) {
+        return true;
+    }
+    size_t backlog = state.fill_backlog;
+    if (state.skip_to_keyframe) {
+        // 到了关键帧且积压已降下来，才恢复发送
+        if (keyframe && backlog <= g_config.gop_drop_bytes) {
+            state.skip_to_keyframe = false;
+            LOGD("Client %d resumed at keyframe, backlog %zu bytes.", clientsock, backlog);
+            return true;
+        }
+        state.stats->dropped_gop.add();
+        state.stats->dropped_bytes.add(size);
+        return false;
+    }
+    if (backlog > g_config.gop_drop_bytes) {
+        LOGD("Client %d backlog %zu bytes, dropping video until next keyframe.", clientsock, backlog);
+        state.skip_to_keyframe = true;
+        state.stats->dropped_gop.add();
+        state.stats->dropped_bytes.add(size);
+        return false;
+    }
+    if (backlog > g_config.drop_bytes && disposable) {
+        state.stats->dropped_disposable.add();
+        state.stats->dropped_bytes.add(size);
+        return false;
+    }
+    return true;
+}
+
+//视频包是否可丢弃：容器标记了DISPOSABLE，或者annex-B中所有图像NAL都是非参考的。其他编码只看容器标记
+static bool packet_disposable(const AVPacket* pkt, AVCodecID codec_id) {
+    if (pkt->flags & AV_PKT_FLAG_DISPOSABLE) {
+        return true;
+    }
+    if (pkt->flags & AV_PKT_FLAG_KEY) {
+        return false;
+    }
+    bool keyframe, disposable;
+    annexb_picture_flags(pkt->data, pkt->size, codec_id, &keyframe, &disposable);
+    return disposable;
+}
+
+//扫描annex-B负载的图像NAL（H.264和HEVC，其他编码两个结果都是false）：
+//是IDR（H.264类型5；HEVC的IRAP类型16~21）算关键帧，全部是非参考的（H.264的nal_ref_idc为0；
+//HEVC的TRAIL_N、TSA_N等偶数类型）算可丢弃。同一帧的各个slice类型相同，遇到第一个参考slice就可以停下
+static void annexb_picture_flags(const uint8_t* data, size_t size, AVCodecID codec_id, bool* keyframe, bool* disposable) {
+    *keyframe = false;
+    *disposable = false;
+    if (codec_id != AV_CODEC_ID_H264 && codec_id != AV_CODEC_ID_HEVC) {
+        return;
+    }
+    const uint8_t* p = data;
+    const uint8_t* end = data + size;
+    bool found_slice = false;
+    while (p + 3 < end) {
+        // 找起始码 00 00 01（四字节起始码的前导0被前一个NAL吞掉，不影响判断）
+        if (p[0] != 0 || p[1] != 0 || p[2] != 1) {
+            p++;
+            continue;
+        }
+        uint8_t nal = p[3];
+        if (codec_id == AV_CODEC_ID_HEVC) {
+            int nal_type = (nal >> 1) & 0x3f;
+            if (nal_type <= 31) {  // VCL
+                if (nal_type > 14 || nal_type % 2 != 0) {
+                    *keyframe = nal_type >= 16 && nal_type <= 21;
+                    return;
+                }
+                found_slice = true;
+            }
+        } else {
+            int nal_type = nal & 0x1f;
+            int nal_ref_idc = (nal >> 5) & 0x3;
+            if (nal_type >= 1 && nal_type <= 5) {
+                if (nal_ref_idc != 0) {
+                    *keyframe = nal_type == 5;
+                    return;
+                }
+                found_slice = true;
+            }
+        }
+        p += 4;
+    }
+    *disposable = found_slice;
+}
+
+//取片名的HLS状态，第一次被请求时排进切片线程池；同一片名只切一次，之后的请求共用内存里的分片表。
+//切片失败的片名过了HLS_RETRY_MS换一个新状态重新排队，期间的请求直接拿到失败
+static std::shared_ptr<HlsTitle> hls_title(const std::string& title, const std::string& path) {
+    std::lock_guard<std::mutex> lock(g_hls.mtx);
+    std::shared_ptr<HlsTitle>& t = g_hls.titles[title];
+    if (t) {
+        std::lock_guard<std::mutex> title_lock(t->mtx);
+        if (!t->failed || ms_since(t->failed_at, std::chrono::steady_clock::now()) < HLS_RETRY_MS) {
+            return t;
+        }
+        LOGI("HLS %s: retrying after the earlier failure.", title.c_str());
+    }
+    t = std::make_shared<HlsTitle>();
+    t->title = title;
+    t->dir = g_config.hls_dir + "/" + title;
+    t->playlist = hls_playlist({}, g_config.hls_format, g_config.hls_segment_s, false);
+    g_hls.jobs.emplace_back(t, path);
+    g_hls.cv.notify_one();
+    return t;
+}
+
+//切片线程：线程数固定，一次切一个片名，同时请求很多新片名时多出来的排队，播放列表在轮到之前是空的
+static void hls_worker_loop() {
+    log_set_thread_name("hls");
+    while (true) {
+        std::pair<std::shared_ptr<HlsTitle>, std::string> job;
+        {
+            std::unique_lock<std::mutex> lock(g_hls.mtx);
+            g_hls.cv.wait(lock, [] { return !g_hls.jobs.empty(); });
+            job = std::move(g_hls.jobs.front());
+            g_hls.jobs.pop_front();
+        }
+        hls_segment_title(job.first, job.second);
+    }
+}
+
+//切一个片名：磁盘上有比片源新的完整播放列表时直接读回，否则重新切，每切好一个分片就更新内存里的播放列表，
+//播放器不必等整个片源切完就能开始播放
+static void hls_segment_title(const std::shared_ptr<HlsTitle>& t, const std::string& path) {
+    HlsFormat format = g_config.hls_format;
+    int target_s = g_config.hls_segment_s;
+    if (mkdir(t->dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        LOGE("HLS %s: cannot create %s: %s", t->title.c_str(), t->dir.c_str(), strerror(errno));
+        std::lock_guard<std::mutex> lock(t->mtx);
+        t->failed = true;
+        t->failed_at = std::chrono::steady_clock::now();
+        return;
+    }
+    struct stat source_st, playlist_st;
+    std::vector<HlsSegment> segments;
+    if (stat(path.c_str(), &source_st) == 0 && stat((t->dir + "/" + HLS_PLAYLIST).c_str(), &playlist_st) == 0 &&
+        playlist_st.st_mtime >= source_st.st_mtime && hls_load_playlist(t->dir, format, &segments)) {
+        LOGI("HLS %s: reusing %zu segments cached in %s.", t->title.c_str(), segments.size(), t->dir.c_str());
+        std::lock_guard<std::mutex> lock(t->mtx);
+        t->playlist = hls_playlist(segments, format, target_s, true);
+        t->segments = std::move(segments);
+        t->done = true;
+        return;
+    }
+
+    LOGI("HLS %s: segmenting into %s.", t->title.c_str(), t->dir.c_str());
+    auto started = std::chrono::steady_clock::now();
+    g_hls.segmenting++;
+    HlsSegmenter segmenter;
+    bool ok = segmenter.open(path, t->dir, format, target_s) &&
+              segmenter.run([&t, format, target_s](const HlsSegment& segment) {
+                  std::lock_guard<std::mutex> lock(t->mtx);
+                  t->segments.push_back(segment);
+                  t->playlist = hls_playlist(t->segments, format, target_s, false);
+              });
+    g_hls.segmenting--;
+    std::lock_guard<std::mutex> lock(t->mtx);
+    if (!ok) {
+        LOGE("HLS %s: segmenting failed: %s", t->title.c_str(), segmenter.error().c_str());
+        t->failed = true;
+        t->failed_at = std::chrono::steady_clock::now();
+        return;
+    }
+    t->done = true;
+    t->playlist = hls_playlist(t->segments, format, target_s, true);
+    LOGI("HLS %s: %zu segments in %lld ms.", t->title.c_str(), t->segments.size(),
+         (long long)ms_since(started, std::chrono::steady_clock::now()));
+}
+
+//接受HLS的HTTP连接：和推流客户端一样边缘触发，不经过准入控制，只登记空闲超时
+static void add_http_conn(int epollfd, int sock) {
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.fd = sock;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+        LOGE("epoll_ctl: add http conn: %s", strerror(errno));
+        close(sock);
+        return;
+    }
+    HttpConn& conn = http_conns[sock];
+    conn.last_active = std::chrono::steady_clock::now();
+    conn.idle_timer.owner = sock;
+    conn.idle_timer.kind = TIMER_HTTP_IDLE;
+    client_timers.schedule(&conn.idle_timer, client_timer_now_ms(), HTTP_IDLE_MS);
+}
+
+static void close_http_conn(int epollfd, int sock) {
+    auto it = http_conns.find(sock);
+    if (it == http_conns.end()) {
+        return;
+    }
+    if (it->second.file_fd >= 0) {
+        close(it->second.file_fd);
+    }
+    http_conns.erase(it);
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, sock, nullptr);
+    close(sock);
+}
+
+//HTTP连接空闲超时：按最后一次收发算，发送一直阻塞的连接也会到期
+static void http_idle(int epollfd, WheelTimer* timer) {
+    auto it = http_conns.find(timer->owner);
+    if (it == http_conns.end()) {
+        return;
+    }
+    int64_t idle_ms = ms_since(it->second.last_active, std::chrono::steady_clock::now());
+    if (idle_ms < HTTP_IDLE_MS) {
+        client_timers.schedule(timer, client_timer_now_ms(), HTTP_IDLE_MS - idle_ms);
+        return;
+    }
+    LOGD("HTTP connection %d idle for %lld ms, closing.", timer->owner, (long long)idle_ms);
+    close_http_conn(epollfd, timer->owner);
+}
+
+//读入请求字节直到EAGAIN（边缘触发），再接着处理和发送
+static void http_read(int epollfd, int sock) {
+    auto it = http_conns.find(sock);
+    if (it == http_conns.end()) {
+        return;
+    }
+    HttpConn& conn = it->second;
+    char buf[4096];
+    while (true) {
+        ssize_t n = recv(sock, buf, sizeof(buf), 0);
+        if (n > 0) {
+            conn.in.append(buf, n);
+            if (conn.in.size() > HTTP_MAX_PENDING) {
+                LOGW("HTTP connection %d has %zu bytes of unprocessed requests, closing.", sock, conn.in.size());
+                close_http_conn(epollfd, sock);
+                return;
+            }
+            continue;
+        }
+        if (n == 0) {
+            conn.peer_closed = true; // 对端关了写方向，已经收到的请求照样回应
+            break;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            LOGD("HTTP connection %d: recv failed: %s", sock, strerror(errno));
+            close_http_conn(epollfd, sock);
+            return;
+        }
+        break;
+    }
+    http_serve(epollfd, sock);
+}
+
+//发送当前响应，发完后处理流水线上的下一个请求，直到发送阻塞或没有完整的请求
+static void http_serve(int epollfd, int sock) {
+    auto it = http_conns.find(sock);
+    if (it == http_conns.end()) {
+        return;
+    }
+    HttpConn& conn = it->second;
+    conn.last_active = std::chrono::steady_clock::now();
+    while (true) {
+        int ret = http_send(sock, conn);
+        if (ret < 0) {
+            LOGD("HTTP connection %d: send failed: %s", sock, strerror(errno));
+            close_http_conn(epollfd, sock);
+            return;
+        }
+        if (ret == 0) {
+            return; // socket缓冲区满，等EPOLLOUT
+        }
+        if (conn.close_after) {
+            close_http_conn(epollfd, sock);
+            return;
+        }
+        if (!http_next_request(conn)) {
+            break;
+        }
+    }
+    if (conn.peer_closed) {
+        close_http_conn(epollfd, sock);
+    }
+}
+
+//发出当前响应：先是out里的响应头和内存里的响应体（后面还有文件时带MSG_MORE，和文件开头合成满的报文），
+//再用sendfile发分片文件。返回1表示发完，0表示socket缓冲区满，-1表示出错
+static int http_send(int sock, HttpConn& conn) {
+    while (conn.out_sent < conn.out.size()) {
+        ssize_t n = send(sock, conn.out.data() + conn.out_sent, conn.out.size() - conn.out_sent,
+                         MSG_NOSIGNAL | (conn.file_fd >= 0 ? MSG_MORE : 0));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        conn.out_sent += n;
+        t_stats->http_bytes.add(n);
+    }
+    while (conn.file_fd >= 0 && conn.file_off < conn.file_end) {
+        ssize_t n = sendfile(sock, conn.file_fd, &conn.file_off, conn.file_end - conn.file_off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        if (n == 0) {
+            errno = ENODATA; // 文件在发送途中变短了，已经发出的Content-Length无法兑现
+            return -1;
+        }
+        t_stats->http_bytes.add(n);
+    }
+    if (conn.file_fd >= 0) {
+        close(conn.file_fd);
+        conn.file_fd = -1;
+    }
+    conn.out.clear();
+    conn.out_sent = 0;
+    return 1;
+}
+
+//把响应头放进out，响应体由调用者追加或用文件发送
+static void http_respond(HttpConn& conn, int status, const char* reason, const char* content_type, size_t length,
+                         const char* cache_control, const char* extra_headers = "") {
+    char head[512];
+    int n = snprintf(head, sizeof(head),
+                     "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nCache-Control: %s\r\n"
+                     "Access-Control-Allow-Origin: *\r\n%sConnection: %s\r\n\r\n",
+                     status, reason, content_type, length, cache_control, extra_headers,
+                     conn.close_after ? "close" : "keep-alive");
+    conn.out.assign(head, std::min(n, (int)sizeof(head) - 1));
+    conn.out_sent = 0;
+}
+
+static void http_error(HttpConn& conn, int status, const char* reason, bool head_only) {
+    std::string body = std::string(reason) + "\n";
+    http_respond(conn, status, reason, "text/plain", body.size(), "no-cache", status == 405 ? "Allow: GET, HEAD\r\n" : "");
+    if (!head_only) {
+        conn.out += body;
+    }
+}
+
+//路径里的%XX解码；格式不对或解出NUL时返回false
+static bool url_decode(const std::string& in, std::string* out) {
+    out->clear();
+    for (size_t i = 0; i < in.size(); ++i) {
+        if (in[i] != '%') {
+            out->push_back(in[i]);
+            continue;
+        }
+        if (i + 2 >= in.size() || !isxdigit((unsigned char)in[i + 1]) || !isxdigit((unsigned char)in[i + 2])) {
+            return false;
+        }
+        char c = (char)strtol(in.substr(i + 1, 2).c_str(), nullptr, 16);
+        if (c == '\0') {
+            return false;
+        }
+        out->push_back(c);
+        i += 2;
+    }
+    return true;
+}
+
+//按路径回应：/hls/<片名>/index.m3u8是播放列表，同一目录下的其他名字是分片或fMP4的init.mp4
+static void http_route(HttpConn& conn, const std::string& target, bool head_only) {
+    static const std::string prefix = "/hls/";
+    std::string path = target.substr(0, target.find('?'));
+    size_t slash = path.rfind('/');
+    std::string title, source;
+    if (path.compare(0, prefix.size(), prefix) != 0 || slash < prefix.size() ||
+        !url_decode(path.substr(prefix.size(), slash - prefix.size()), &title) || !catalog_title_path(title, &source)) {
+        http_error(conn, 404, "Not Found", head_only);
+        return;
+    }
+    std::string file = path.substr(slash + 1);
+    std::shared_ptr<HlsTitle> t = hls_title(title, source);
+    if (file == HLS_PLAYLIST) {
+        std::string playlist;
+        bool done, failed;
+        {
+            std::lock_guard<std::mutex> lock(t->mtx);
+            playlist = t->playlist;
+            done = t->done;
+            failed = t->failed;
+        }
+        if (failed) {
+            http_error(conn, 500, "Internal Server Error", head_only);
+            return;
+        }
+        // 还在切的列表会变长，不能缓存；切完的只有片源更新后才会变
+        http_respond(conn, 200, "OK", "application/vnd.apple.mpegurl", playlist.size(), done ? "max-age=60" : "no-cache");
+        if (!head_only) {
+            conn.out += playlist;
+        }
+        return;
+    }
+    // 只发已经列进播放列表的分片：正在写的还是.tmp文件，改名到位后才列进去
+    bool listed = false;
+    {
+        std::lock_guard<std::mutex> lock(t->mtx);
+        if (file == HLS_INIT_SEGMENT) {
+            listed = g_config.hls_format == HLS_FMP4 && !t->segments.empty();
+        } else {
+            for (const HlsSegment& s : t->segments) {
+                if (s.name == file) {
+                    listed = true;
+                    break;
+                }
+            }
+        }
+    }
+    int fd = listed ? open((t->dir + "/" + file).c_str(), O_RDONLY | O_CLOEXEC) : -1;
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        http_error(conn, 404, "Not Found", head_only);
+        return;
+    }
+    http_respond(conn, 200, "OK", g_config.hls_format == HLS_FMP4 ? "video/mp4" : "video/mp2t", st.st_size,
+                 "max-age=86400");
+    if (head_only) {
+        close(fd);
+        return;
+    }
+    conn.file_fd = fd;
+    conn.file_off = 0;
+    conn.file_end = st.st_size;
+}
+
+//处理in里下一个完整的请求，把响应放进conn；还没有完整的请求时返回false
+static bool http_next_request(HttpConn& conn) {
+    size_t end = conn.in.find("\r\n\r\n");
+    if (end == std::string::npos || end > HTTP_MAX_HEADER) {
+        if (conn.in.size() <= HTTP_MAX_HEADER) {
+            return false;
+        }
+        t_stats->http_requests.add();
+        conn.close_after = true;
+        conn.in.clear();
+        http_error(conn, 431, "Request Header Fields Too Large", false);
+        return true;
+    }
+    std::string head = conn.in.substr(0, end);
+    conn.in.erase(0, end + 4);
+    t_stats->http_requests.add();
+
+    // 请求行：方法 目标 版本
+    size_t line_end = std::min(head.find("\r\n"), head.size());
+    std::string line = head.substr(0, line_end);
+    size_t sp1 = line.find(' ');
+    size_t sp2 = line.rfind(' ');
+    if (sp1 == std::string::npos || sp2 == sp1 || line.compare(sp2 + 1, 5, "HTTP/") != 0) {
+        conn.close_after = true;
+        http_error(conn, 400, "Bad Request", false);
+        return true;
+    }
+    std::string method = line.substr(0, sp1);
+    std::string target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+    bool keep_alive = line.compare(sp2 + 1, std::string::npos, "HTTP/1.0") != 0;
+    bool has_body = false;
+    // 头部只看Connection和请求体：GET/HEAD带请求体时无法可靠地找到下一个请求的开头
+    for (size_t pos = line_end; pos < head.size();) {
+        size_t next = std::min(head.find("\r\n", pos + 2), head.size());
+        const char* h = head.c_str() + pos + 2;
+        if (strncasecmp(h, "connection:", 11) == 0) {
+            std::string value = head.substr(pos + 2 + 11, next - pos - 2 - 11);
+            if (strcasestr(value.c_str(), "close")) {
+                keep_alive = false;
+            } else if (strcasestr(value.c_str(), "keep-alive")) {
+                keep_alive = true;
+            }
+        } else if (strncasecmp(h, "transfer-encoding:", 18) == 0 ||
+                   (strncasecmp(h, "content-length:", 15) == 0 && atoll(h + 15) != 0)) {
+            has_body = true;
+        }
+        pos = next;
+    }
+    conn.close_after = !keep_alive;
+    bool head_only = method == "HEAD";
+    if (method != "GET" && !head_only) {
+        conn.close_after = true;
+        http_error(conn, 405, "Method Not Allowed", false);
+    } else if (has_body) {
+        conn.close_after = true;
+        http_error(conn, 400, "Bad Request", head_only);
+    } else {
+        http_route(conn, target, head_only);
+    }
+    return true;
+}
+
+//为当前线程建立汇总指标，线程结束后仍保留在注册表中，计数不会倒退
+static void register_thread_stats(const char* name) {
+    t_stats = std::make_shared<ThreadStats>();
+    t_stats->name = name;
+    std::lock_guard<std::mutex> lock(g_metrics.mtx);
+    g_metrics.threads.push_back(t_stats);
+}
+
+//生成Prometheus文本：先在锁内复制注册表，读取指标本身不加锁
+std::string render_metrics() {
+    std::vector<std::shared_ptr<ThreadStats>> threads;
+    std::vector<std::shared_ptr<ClientStats>> clients;
+    {
+        std::lock_guard<std::mutex> lock(g_metrics.mtx);
+        threads = g_metrics.threads;
+        clients = g_metrics.clients;
+    }
+    std::string out;
+    std::vector<std::string> thread_labels;
+    for (auto& t : threads) {
+        thread_labels.push_back("thread=\"" + t->name + "\"");
+    }
+    std::vector<std::string> client_labels;
+    for (auto& c : clients) {
+        client_labels.push_back("worker=\"" + std::to_string(c->worker) + "\",sock=\"" + std::to_string(c->sock) +
+                                "\",peer=\"" + c->peer + "\",mode=\"" + c->mode + "\"");
+    }
+
+    struct ThreadCounter {
+        const char* name;
+        const char* type;
+        const char* help;
+        std::function<double(const ThreadStats&)> get;
+    };
+    const ThreadCounter thread_counters[] = {
+        {"stream_clients", "gauge", "Connected clients.", [](const ThreadStats& t) { return (double)t.clients.get(); }},
+        {"stream_accepts_total", "counter", "Accepted connections.", [](const ThreadStats& t) { return (double)t.accepts.get(); }},
+        {"stream_disconnects_total", "counter", "Closed connections.", [](const ThreadStats& t) { return (double)t.disconnects.get(); }},
+        {"stream_admission_rejected_total", "counter", "Connections refused by admission control.", [](const ThreadStats& t) { return (double)t.rejected.get(); }},
+        {"stream_admission_queued_total", "counter", "Connections that waited in the admission queue.", [](const ThreadStats& t) { return (double)t.queued.get(); }},
+        {"stream_sent_bytes_total", "counter", "Bytes written to client sockets.", [](const ThreadStats& t) { return (double)t.bytes_sent.get(); }},
+        {"stream_sent_packets_total", "counter", "Packets fully written to client sockets.", [](const ThreadStats& t) { return (double)t.packets_sent.get(); }},
+        {"stream_send_eagain_total", "counter", "Sends that hit a full socket buffer.", [](const ThreadStats& t) { return (double)t.eagain.get(); }},
+        {"stream_send_coalesced_total", "counter", "Sends postponed to batch more packets into one write.", [](const ThreadStats& t) { return (double)t.coalesced.get(); }},
+        {"stream_heartbeats_total", "counter", "Heartbeats sent to clients with nothing else to send.", [](const ThreadStats& t) { return (double)t.heartbeats.get(); }},
+        {"stream_idle_timeouts_total", "counter", "Clients disconnected after idling without input.", [](const ThreadStats& t) { return (double)t.idle_timeouts.get(); }},
+        {"stream_slow_evictions_total", "counter", "Clients disconnected because their backlog did not drain in time.", [](const ThreadStats& t) { return (double)t.slow_evictions.get(); }},
+        {"stream_http_requests_total", "counter", "HLS requests handled over HTTP.", [](const ThreadStats& t) { return (double)t.http_requests.get(); }},
+        {"stream_http_sent_bytes_total", "counter", "Bytes written to HLS HTTP connections, including sendfile.", [](const ThreadStats& t) { return (double)t.http_bytes.get(); }},
+    };
+    for (const ThreadCounter& m : thread_counters) {
+        metric_family(out, m.name, m.type, m.help);
+        for (size_t i = 0; i < threads.size(); ++i) {
+            metric_sample(out, m.name, thread_labels[i], m.get(*threads[i]));
+        }
+    }
+    struct ThreadHistogram {
+        const char* name;
+        const char* help;
+        MetricHistogram ThreadStats::*member;
+    };
+    const ThreadHistogram thread_histograms[] = {
+        {"stream_send_latency_seconds", "Time per socket send call (submit to completion with io_uring).", &ThreadStats::send_latency},
+        {"stream_demux_seconds", "av_read_frame plus bitstream filter time per packet.", &ThreadStats::demux_time},
+        {"stream_loop_iteration_seconds", "Time to handle one batch of events.", &ThreadStats::loop_time},
+    };
+    for (const ThreadHistogram& m : thread_histograms) {
+        metric_family(out, m.name, "histogram", m.help);
+        for (size_t i = 0; i < threads.size(); ++i) {
+            metric_histogram(out, m.name, thread_labels[i], (*threads[i]).*m.member);
+        }
+    }
+
+    struct ClientCounter {
+        const char* name;
+        const char* type;
+        const char* help;
+        std::function<double(const ClientStats&)> get;
+    };
+    const ClientCounter client_counters[] = {
+        {"stream_client_sent_bytes_total", "counter", "Bytes written to this client.", [](const ClientStats& c) { return (double)c.bytes_sent.get(); }},
+        {"stream_client_sent_packets_total", "counter", "Packets fully written to this client.", [](const ClientStats& c) { return (double)c.packets_sent.get(); }},
+        {"stream_client_backlog_bytes", "gauge", "Output queue plus unsent socket buffer bytes after the last send.", [](const ClientStats& c) { return (double)c.backlog_bytes.get(); }},
+        {"stream_client_send_eagain_total", "counter", "Sends to this client that hit a full socket buffer.", [](const ClientStats& c) { return (double)c.eagain.get(); }},
+        {"stream_client_wraparounds_total", "counter", "Times file or vod playback looped to the start.", [](const ClientStats& c) { return (double)c.wraparounds.get(); }},
+        {"stream_client_live_skips_total", "counter", "Times a broadcast client fell out of the live window.", [](const ClientStats& c) { return (double)c.live_skips.get(); }},
+        {"stream_client_dropped_disposable_total", "counter", "Non-reference video packets dropped under congestion.", [](const ClientStats& c) { return (double)c.dropped_disposable.get(); }},
+        {"stream_client_dropped_gop_total", "counter", "Video packets dropped while skipping to the next keyframe.", [](const ClientStats& c) { return (double)c.dropped_gop.get(); }},
+        {"stream_client_dropped_bytes_total", "counter", "Bytes of dropped video packets.", [](const ClientStats& c) { return (double)c.dropped_bytes.get(); }},
+        {"stream_client_rendition_switches_total", "counter", "Adaptive bitrate rendition switches.", [](const ClientStats& c) { return (double)c.rendition_switches.get(); }},
+        {"stream_client_rendition_bits_per_second", "gauge", "Average bitrate of the rendition being sent.", [](const ClientStats& c) { return (double)c.rendition_bps.get(); }},
+        {"stream_client_drain_bits_per_second", "gauge", "Smoothed rate at which the client's socket drains.", [](const ClientStats& c) { return (double)c.drain_bps.get(); }},
+    };
+    for (const ClientCounter& m : client_counters) {
+        metric_family(out, m.name, m.type, m.help);
+        for (size_t i = 0; i < clients.size(); ++i) {
+            metric_sample(out, m.name, client_labels[i], m.get(*clients[i]));
+        }
+    }
+
+    if (g_config.max_out_bps > 0 || g_config.max_cpu > 0) {
+        metric_family(out, "stream_admission_out_bits_per_second", "gauge", "Outbound bandwidth seen by admission control.");
+        metric_sample(out, "stream_admission_out_bits_per_second", "", (double)g_admission.out_bps.load());
+        metric_family(out, "stream_admission_cpu_percent", "gauge", "Process CPU time as a percentage of all cores.");
+        metric_sample(out, "stream_admission_cpu_percent", "", (double)g_admission.cpu_percent.load());
+        metric_family(out, "stream_admission_queue_depth", "gauge", "Clients waiting for admission.");
+        metric_sample(out, "stream_admission_queue_depth", "", (double)g_admission.queued.load());
+    }
+    if (g_config.mode == MODE_FILE && !g_catalog && g_config.upstream_host.empty()) {
+        size_t depth;
+        {
+            std::lock_guard<std::mutex> lock(g_probe_pool.mtx);
+            depth = g_probe_pool.jobs.size();
+        }
+        metric_family(out, "stream_probe_queue_depth", "gauge", "File-mode clients waiting for their source to be opened.");
+        metric_sample(out, "stream_probe_queue_depth", "", (double)depth);
+    }
+    if (g_catalog) {
+        size_t titles, bytes;
+        {
+            std::lock_guard<std::mutex> lock(g_catalog->mtx);
+            titles = g_catalog->lru.size();
+            bytes = g_catalog->cached_bytes;
+        }
+        metric_family(out, "stream_catalog_cached_titles", "gauge", "Titles held in the catalog cache.");
+        metric_sample(out, "stream_catalog_cached_titles", "", (double)titles);
+        metric_family(out, "stream_catalog_cached_bytes", "gauge", "Memory used by cached packet stores and transcoded output.");
+        metric_sample(out, "stream_catalog_cached_bytes", "", (double)bytes);
+
+        std::vector<std::shared_ptr<LiveSource>> channels;
+        {
+            std::lock_guard<std::mutex> lock(g_channels.mtx);
+            for (auto& kv : g_channels.channels) {
+                channels.push_back(kv.second);
+            }
+        }
+        metric_family(out, "stream_channels", "gauge", "Channels with a connected publisher.");
+        metric_sample(out, "stream_channels", "", (double)channels.size());
+        metric_family(out, "stream_channel_ingest_packets_total", "counter", "Media packets received from the publisher.");
+        for (const auto& src : channels) {
+            metric_sample(out, "stream_channel_ingest_packets_total", "channel=\"" + src->filename + "\"", (double)src->ingest_packets.get());
+        }
+        metric_family(out, "stream_channel_ingest_bytes_total", "counter", "Media payload bytes received from the publisher.");
+        for (const auto& src : channels) {
+            metric_sample(out, "stream_channel_ingest_bytes_total", "channel=\"" + src->filename + "\"", (double)src->ingest_bytes.get());
+        }
+    }
+    if (g_config.hls_port > 0) {
+        size_t titles, queued;
+        {
+            std::lock_guard<std::mutex> lock(g_hls.mtx);
+            titles = g_hls.titles.size();
+            queued = g_hls.jobs.size();
+        }
+        metric_family(out, "stream_hls_titles", "gauge", "Titles segmented (or being segmented) for HLS.");
+        metric_sample(out, "stream_hls_titles", "", (double)titles);
+        metric_family(out, "stream_hls_queued_titles", "gauge", "Titles waiting for an HLS segmenting thread.");
+        metric_sample(out, "stream_hls_queued_titles", "", (double)queued);
+        metric_family(out, "stream_hls_segmenting_titles", "gauge", "Titles whose HLS segments are being written.");
+        metric_sample(out, "stream_hls_segmenting_titles", "", (double)g_hls.segmenting.load());
+    }
+    if (!g_config.upstream_host.empty()) {
+        size_t sessions = 0, connected = 0;
+        {
+            std::lock_guard<std::mutex> lock(g_upstreams.mtx);
+            for (auto& kv : g_upstreams.sessions) {
+                sessions++;
+                connected += kv.second->connected.load() ? 1 : 0;
+            }
+        }
+        metric_family(out, "stream_upstream_sessions", "gauge", "Titles relayed from the upstream server.");
+        metric_sample(out, "stream_upstream_sessions", "", (double)sessions);
+        metric_family(out, "stream_upstream_connected_sessions", "gauge", "Upstream sessions currently receiving media.");
+        metric_sample(out, "stream_upstream_connected_sessions", "", (double)connected);
+        metric_family(out, "stream_upstream_reconnects_total", "counter", "Upstream connections lost and retried.");
+        metric_sample(out, "stream_upstream_reconnects_total", "", (double)g_upstreams.reconnects.get());
+        metric_family(out, "stream_upstream_received_bytes_total", "counter", "Bytes received from the upstream server.");
+        metric_sample(out, "stream_upstream_received_bytes_total", "", (double)g_upstreams.bytes.get());
+    }
+    if (g_catalog && g_config.transcode_threads > 0) {
+        size_t depth;
+        std::vector<std::shared_ptr<TranscodeJob>> jobs;
+        {
+            std::lock_guard<std::mutex> lock(g_transcode_pool.mtx);
+            depth = g_transcode_pool.jobs.size();
+            for (auto& kv : g_transcode_pool.active) {
+                if (auto job = kv.second.lock()) {
+                    jobs.push_back(std::move(job));
+                }
+            }
+        }
+        metric_family(out, "stream_transcode_queue_depth", "gauge", "Transcode jobs waiting for a free thread.");
+        metric_sample(out, "stream_transcode_queue_depth", "", (double)depth);
+        metric_family(out, "stream_transcode_running_jobs", "gauge", "Transcode jobs currently encoding.");
+        metric_sample(out, "stream_transcode_running_jobs", "", (double)g_transcode_pool.running.load());
+        metric_family(out, "stream_transcode_frames_total", "counter", "Video frames encoded by the transcode pool.");
+        metric_sample(out, "stream_transcode_frames_total", "", (double)g_transcode_pool.frames.get());
+        metric_family(out, "stream_transcode_encode_fps", "gauge", "Encoded frames per second over the last second, per job.");
+        for (const auto& job : jobs) {
+            size_t separator = job->key.rfind(TRANSCODE_SEPARATOR);
+            std::string labels = "title=\"" + job->key.substr(0, separator) + "\",profile=\"" + job->key.substr(separator + 1) + "\"";
+            metric_sample(out, "stream_transcode_encode_fps", labels, job->encode_fps.load());
+        }
+    }
+    return out;
+}
+
+#ifdef HAVE_LIBURING
+// io_uring后端：完成事件驱动，一轮处理中产生的accept/recv/send请求一次性批量提交
+enum UringOp {
+    URING_ACCEPT = 1,
+    URING_RECV,
+    URING_SEND,
+    URING_LIVE_NOTIFY,
+    URING_PACE_TIMER,
+    URING_INBOX
+};
+struct UringOrphan {
+    OutputQueue outq;
+    std::unique_ptr<UringSendCtx> ctx;
+};
+thread_local io_uring* t_ring = nullptr;
+thread_local uint32_t t_next_conn_id = 0;
+thread_local int t_fixed_buf_index = -1;  // 点播包存储注册成的固定缓冲区下标
+thread_local std::map<uint32_t, UringOrphan> t_orphans; // 已移除但发送仍在途的客户端数据
+thread_local uint64_t t_notify_buf, t_timer_buf, t_inbox_buf;
+
+// user_data：高32位连接编号（防止fd复用后串到新连接），中间24位fd，低8位操作类型
+static uint64_t uring_tag(UringOp op, int fd, uint32_t conn_id) {
+    return ((uint64_t)conn_id << 32) | ((uint64_t)(fd & 0xffffff) << 8) | op;
+}
+
+static io_uring_sqe* uring_sqe() {
+    io_uring_sqe* sqe = io_uring_get_sqe(t_ring);
+    if (!sqe) {
+        io_uring_submit(t_ring); //提交队列满了，先提交一批
+        sqe = io_uring_get_sqe(t_ring);
+    }
+    return sqe;
+}
+
+static void uring_post_accept(int listensock) {
+    io_uring_sqe* sqe = uring_sqe();
+    io_uring_prep_multishot_accept(sqe, listensock, nullptr, nullptr, SOCK_CLOEXEC);
+    io_uring_sqe_set_data64(sqe, uring_tag(URING_ACCEPT, listensock, 0));
+}
+
+static void uring_post_read(int fd, uint64_t* buf, UringOp op) {
+    io_uring_sqe* sqe = uring_sqe();
+    io_uring_prep_read(sqe, fd, buf, sizeof(*buf), 0);
+    io_uring_sqe_set_data64(sqe, uring_tag(op, fd, 0));
+}
+
+static void uring_post_recv(int clientsock, ClientState& state) {
+    std::vector<char>& buf = state.uring_send->recv_buf;
+    if (state.publishing && buf.size() < INGEST_READ_BUFFER) {
+        buf.resize(INGEST_READ_BUFFER); // 没有接收在途，可以换缓冲区
+    }
+    io_uring_sqe* sqe = uring_sqe();
+    io_uring_prep_recv(sqe, clientsock, buf.data(), buf.size(), 0);
+    io_uring_sqe_set_data64(sqe, uring_tag(URING_RECV, clientsock, state.conn_id));
+    state.uring_send->inflight++;
+}
+
+//新连接：分配连接编号并挂上接收请求（用于检测断开）
+static void uring_register_client(int clientsock, ClientState& state) {
+    // io_uring对阻塞socket会自己挂poll等待；非阻塞socket上的send会直接以EAGAIN完成
+    fcntl(clientsock, F_SETFL, fcntl(clientsock, F_GETFL, 0) & ~O_NONBLOCK);
+    state.conn_id = ++t_next_conn_id;
+    state.uring_send.reset(new UringSendCtx());
+    uring_post_recv(clientsock, state);
+}
+
+//提交一次异步发送：点播包存储中的连续记录用write_fixed，其余用sendmsg带多个iovec
+static void uring_submit_send(int clientsock, ClientState& state) {
+    if (state.send_inflight || state.outq.empty()) {
+        return;
+    }
+    io_uring_sqe* sqe = uring_sqe();
+    const uint8_t* data;
+    size_t len;
+    if (t_fixed_buf_index >= 0 && state.outq.fixed_run(&data, &len, 1024 * 1024)) {
+        io_uring_prep_write_fixed(sqe, clientsock, data, len, 0, t_fixed_buf_index);
+    } else {
+        UringSendCtx* ctx = state.uring_send.get();
+        memset(&ctx->msg, 0, sizeof(ctx->msg));
+        ctx->msg.msg_iov = ctx->iov;
+        ctx->msg.msg_iovlen = state.outq.fill_iov(ctx->iov, 16);
+        io_uring_prep_sendmsg(sqe, clientsock, &ctx->msg, MSG_NOSIGNAL);
+    }
+    io_uring_sqe_set_data64(sqe, uring_tag(URING_SEND, clientsock, state.conn_id));
+    state.uring_send->inflight++;
+    state.uring_send->send_start_ns = metrics_now_ns();
+    state.send_inflight = true;
+}
+
+//移除客户端：shutdown让在途的recv/send尽快完成，输出队列和参数暂存到它们全部完成为止
+static void uring_forget_client(int clientsock, ClientState& state) {
+    shutdown(clientsock, SHUT_RDWR);
+    if (state.uring_send && state.uring_send->inflight > 0) {
+        io_uring_submit(t_ring);
+        UringOrphan& orphan = t_orphans[state.conn_id];
+        orphan.outq = std::move(state.outq);
+        orphan.ctx = std::move(state.uring_send);
+    }
+}
+
+//按fd和连接编号找到请求所属的客户端；客户端已移除时结算暂存的请求，全部完成后释放
+static ClientState* uring_lookup_client(int clientsock, uint32_t conn_id) {
+    auto it = client_states.find(clientsock);
+    return it != client_states.end() && it->second.conn_id == conn_id ? &it->second : nullptr;
+}
+
+static ClientState* uring_find_client(int clientsock, uint32_t conn_id) {
+    if (ClientState* state = uring_lookup_client(clientsock, conn_id)) {
+        state->uring_send->inflight--;
+        return state;
+    }
+    auto orphan = t_orphans.find(conn_id);
+    if (orphan != t_orphans.end() && --orphan->second.ctx->inflight == 0) {
+        t_orphans.erase(orphan);
+    }
+    return nullptr;
+}
+
+//io_uring工作线程：multishot accept接收新连接，所有请求在每轮末尾一次提交
+void run_worker_uring(int worker_id, int listensock) {
+    io_uring ring;
+    int ret = io_uring_queue_init(4096, &ring, 0);
+    if (ret < 0) {
+        LOGE("io_uring_queue_init: %s", strerror(-ret));
+        return;
+    }
+    t_ring = &ring;
+    LOGD("Worker %d using io_uring.", worker_id);
+
+    // 点播包存储注册为固定缓冲区，发送时内核不必每次重新映射用户页
+    if (g_packet_store) {
+        iovec iov;
+        iov.iov_base = (void*)g_packet_store->data.data();
+        iov.iov_len = g_packet_store->data.size();
+        ret = io_uring_register_buffers(&ring, &iov, 1);
+        if (ret == 0) {
+            t_fixed_buf_index = 0;
+        } else {
+            LOGW("io_uring_register_buffers failed (%s), using sendmsg.", strerror(-ret));
+        }
+    }
+
+    int live_notify_fd = -1;
+    if (g_live_source) {
+        live_notify_fd = eventfd(0, EFD_CLOEXEC);
+        std::lock_guard<std::mutex> lock(g_live_source->mtx);
+        g_live_source->notify_fds.push_back(live_notify_fd);
+    }
+    if (live_notify_fd >= 0) {
+        uring_post_read(live_notify_fd, &t_notify_buf, URING_LIVE_NOTIFY);
+    }
+    t_inbox->notify_fd = eventfd(0, EFD_CLOEXEC);
+    uring_post_read(t_inbox->notify_fd, &t_inbox_buf, URING_INBOX);
+    if ((g_config.pace && !g_live_source) || g_config.coalesce_ms > 0) {
+        pace_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        uring_post_read(pace_timer_fd, &t_timer_buf, URING_PACE_TIMER);
+    }
+    uring_post_accept(listensock);
+
+    struct Completion {
+        uint64_t tag;
+        int res;
+        unsigned flags;
+    };
+    std::vector<io_uring_cqe*> cqes(256);
+    std::vector<Completion> done(256);
+    while (true) {
+        // 定时器轮有登记时最多等到它的下一格
+        int timeout = client_timer_timeout();
+        if (timeout < 0) {
+            ret = io_uring_submit_and_wait(&ring, 1);
+        } else {
+            __kernel_timespec ts;
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+            io_uring_cqe* cqe;
+            ret = io_uring_submit_and_wait_timeout(&ring, &cqe, 1, &ts, nullptr);
+        }
+        if (ret < 0 && ret != -EINTR && ret != -ETIME) {
+            LOGE("io_uring_submit_and_wait: %s", strerror(-ret));
+            break;
+        }
+        // 先拷出完成事件再推进CQ，处理过程中可以放心地提交新请求
+        unsigned n = io_uring_peek_batch_cqe(&ring, cqes.data(), cqes.size());
+        for (unsigned i = 0; i < n; ++i) {
+            done[i].tag = io_uring_cqe_get_data64(cqes[i]);
+            done[i].res = cqes[i]->res;
+            done[i].flags = cqes[i]->flags;
+        }
+        io_uring_cq_advance(&ring, n);
+        uint64_t loop_start = metrics_now_ns();
+
+        for (unsigned i = 0; i < n; ++i) {
+            UringOp op = (UringOp)(done[i].tag & 0xff);
+            int fd = (int)((done[i].tag >> 8) & 0xffffff);
+            uint32_t conn_id = (uint32_t)(done[i].tag >> 32);
+            int res = done[i].res;
+            switch (op) {
+            case URING_ACCEPT:
+                if (res >= 0) {
+                    t_stats->accepts.add();
+                    accept_client(-1, res);
+                } else {
+                    LOGE("accept: %s", strerror(-res));
+                }
+                if (!(done[i].flags & IORING_CQE_F_MORE)) {
+                    uring_post_accept(listensock); //multishot被内核终止，重新挂上
+                }
+                break;
+            case URING_RECV: {
+                ClientState* state = uring_find_client(fd, conn_id);
+                if (!state) break;
+                if (res <= 0 || !client_input(-1, fd, state->uring_send->recv_buf.data(), res)) {
+                    remove_client(-1, fd); // 断开、出错或协议错误
+                    break;
+                }
+                // 处理消息时客户端可能已被移除
+                state = uring_lookup_client(fd, conn_id);
+                if (state) {
+                    uring_post_recv(fd, *state);
+                }
+                break;
+            }
+            case URING_SEND: {
+                ClientState* state = uring_find_client(fd, conn_id);
+                if (!state) break;
+                state->send_inflight = false;
+                t_stats->send_latency.observe_ns(metrics_now_ns() - state->uring_send->send_start_ns);
+                if (res < 0 && res != -EAGAIN && res != -EINTR) {
+                    LOGE("send on socket %d: %s", fd, strerror(-res));
+                    remove_client(-1, fd);
+                    break;
+                }
+                if (res > 0) {
+                    note_sent(*state, res);
+                    state->stats->backlog_bytes.set(client_backlog_bytes(fd, *state));
+                }
+                if (state->outq.empty()) {
+                    state->drain_timer.cancel();
+                } else if (!state->paused) {
+                    watch_drain(*state);
+                }
+                if (res == -EAGAIN) {
+                    state->stats->eagain.add();
+                    t_stats->eagain.add();
+                }
+                apply_pending_seek(-1, fd, *state);
+                handle_write(-1, fd);
+                break;
+            }
+            case URING_LIVE_NOTIFY:
+                notify_live_clients(-1);
+                uring_post_read(live_notify_fd, &t_notify_buf, URING_LIVE_NOTIFY);
+                break;
+            case URING_PACE_TIMER:
+                handle_pace_timer(-1);
+                uring_post_read(pace_timer_fd, &t_timer_buf, URING_PACE_TIMER);
+                break;
+            case URING_INBOX:
+                handle_inbox(-1);
+                uring_post_read(t_inbox->notify_fd, &t_inbox_buf, URING_INBOX);
+                break;
+            }
+        }
+        handle_client_timers(-1);
+        t_stats->loop_time.observe_ns(metrics_now_ns() - loop_start);
+    }
+
+    io_uring_queue_exit(&ring);
+    t_ring = nullptr;
+    close(listensock);
+}
+#endif
@@ -0,0 +1,180 @@
+// 哈希定时器轮：连接级的粗粒度超时（心跳、空闲、积压排空期限）
+//
+// 时间按tick_ms切成格，定时器按到期的格号对槽数取模挂进对应槽的双向链表：登记、改期和取消都是O(1)的链表操作，
+// 与连接数无关。每走一格只看一个槽，槽里到期格号还没到的（要再转几圈的）留在原处。精度是一格，适合秒级的超时；
+// 毫秒级的发送节拍仍由最小堆加timerfd负责。
+// 定时器节点嵌在使用者的对象里，不另外分配，对象析构时自动摘链。只在单个线程内使用，不加锁。
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+struct TimerLink {
+    TimerLink* prev = nullptr;
+    TimerLink* next = nullptr;
+};
+
+class TimerWheel;
+
+// 一个定时器：owner和kind由使用者填写，到期回调靠它们找到所属对象
+struct WheelTimer : TimerLink {
+    WheelTimer() = default;
+    WheelTimer(const WheelTimer&) = delete;
+    WheelTimer& operator=(const WheelTimer&) = delete;
+    // 移动时接替原定时器在链表中的位置（所属对象可以先在局部变量里填好再移进容器）
+    WheelTimer(WheelTimer&& other) noexcept { take(other); }
+    WheelTimer& operator=(WheelTimer&& other) noexcept {
+        if (this != &other) {
+            cancel();
+            take(other);
+        }
+        return *this;
+    }
+    ~WheelTimer() { cancel(); }
+
+    bool armed() const { return next != nullptr; }
+    inline void cancel();
+
+    int owner = -1;
+    int kind = 0;
+    uint64_t tick = 0;            // 到期的格号
+    TimerWheel* wheel = nullptr;  // 登记在哪个轮上，未登记时为空
+
+private:
+    void take(WheelTimer& other) {
+        owner = other.owner;
+        kind = other.kind;
+        tick = other.tick;
+        wheel = other.wheel;
+        if (other.next) {
+            prev = other.prev;
+            next = other.next;
+            prev->next = this;
+            next->prev = this;
+            other.prev = other.next = nullptr;
+            other.wheel = nullptr;
+        }
+    }
+};
+
+class TimerWheel {
+public:
+    // slots必须是2的幂；一圈覆盖slots*tick_ms毫秒，更长的定时器多转几圈
+    TimerWheel(size_t slots, int64_t tick_ms) : slots_(slots), mask_(slots - 1), tick_ms_(tick_ms) {
+        for (TimerLink& s : slots_) {
+            s.prev = s.next = &s;
+        }
+        expired_.prev = expired_.next = &expired_;
+    }
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+    // 轮先于定时器销毁时（线程退出），把还挂着的定时器全部摘下，之后它们析构不再碰这里
+    ~TimerWheel() {
+        for (TimerLink& s : slots_) {
+            detach_all(&s);
+        }
+        detach_all(&expired_);
+    }
+
+    // 登记或改期：now_ms之后delay_ms到期，向上取整到格，至少下一格
+    void schedule(WheelTimer* t, int64_t now_ms, int64_t delay_ms) {
+        t->cancel();
+        start(now_ms);
+        uint64_t tick = (uint64_t)((now_ms + std::max<int64_t>(delay_ms, 0) + tick_ms_ - 1) / tick_ms_);
+        t->tick = std::max(tick, current_ + 1);
+        t->wheel = this;
+        link(&slots_[t->tick & mask_], t);
+        count_++;
+    }
+
+    size_t size() const { return count_; }
+
+    // 到下一格的毫秒数，作为epoll_wait的超时；没有定时器时返回-1（一直等）
+    int timeout_ms(int64_t now_ms) const {
+        if (count_ == 0) {
+            return -1;
+        }
+        int64_t next = (int64_t)(current_ + 1) * tick_ms_;
+        return (int)std::max<int64_t>(next - now_ms, 0);
+    }
+
+    // 走到now_ms，逐个回调到期的定时器（回调前已经摘下）。回调里可以登记、取消任何定时器，
+    // 也可以析构它们所属的对象：到期的先全部挪到单独的链表，被析构的定时器只是从那里摘掉
+    template <typename F>
+    void advance(int64_t now_ms, F on_expire) {
+        start(now_ms);
+        uint64_t target = (uint64_t)(now_ms / tick_ms_);
+        if (target > current_) {
+            // 落后一整圈以上时每个槽看一遍就够了
+            uint64_t steps = std::min<uint64_t>(target - current_, slots_.size());
+            for (uint64_t i = 1; i <= steps; ++i) {
+                TimerLink* head = &slots_[(current_ + i) & mask_];
+                for (TimerLink* l = head->next; l != head;) {
+                    WheelTimer* t = static_cast<WheelTimer*>(l);
+                    l = l->next;
+                    if (t->tick <= target) {
+                        unlink(t);
+                        link(&expired_, t);
+                    }
+                }
+            }
+            current_ = target;
+        }
+        while (expired_.next != &expired_) {
+            WheelTimer* t = static_cast<WheelTimer*>(expired_.next);
+            t->cancel();
+            on_expire(t);
+        }
+    }
+
+private:
+    friend struct WheelTimer;
+
+    void start(int64_t now_ms) {
+        if (!started_) {
+            current_ = (uint64_t)(now_ms / tick_ms_);
+            started_ = true;
+        }
+    }
+
+    static void link(TimerLink* head, TimerLink* l) {
+        l->prev = head->prev;
+        l->next = head;
+        head->prev->next = l;
+        head->prev = l;
+    }
+
+    static void unlink(TimerLink* l) {
+        l->prev->next = l->next;
+        l->next->prev = l->prev;
+        l->prev = l->next = nullptr;
+    }
+
+    static void detach_all(TimerLink* head) {
+        for (TimerLink* l = head->next; l != head;) {
+            WheelTimer* t = static_cast<WheelTimer*>(l);
+            l = l->next;
+            t->prev = t->next = nullptr;
+            t->wheel = nullptr;
+        }
+        head->prev = head->next = head;
+    }
+
+    std::vector<TimerLink> slots_;
+    TimerLink expired_;      // 本次advance到期、还没回调的定时器
+    uint64_t mask_;
+    int64_t tick_ms_;
+    uint64_t current_ = 0;   // 已经走过的格号
+    bool started_ = false;
+    size_t count_ = 0;       // 登记着的定时器个数（含到期待回调的）
+};
+
+inline void WheelTimer::cancel() {
+    if (!next) {
+        return;
+    }
+    TimerWheel::unlink(this);
+    wheel->count_--;
+    wheel = nullptr;
+}
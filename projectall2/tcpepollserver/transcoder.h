@@ -0,0 +1,264 @@
+// 服务器端转码：解码源视频，按档位缩放，再用libavcodec的软件H.264编码器重新编码；音频原样透传
+//
+// 客户端只能解H.264/AAC，HEVC或码率过高的片源要在服务器上转一遍。一个Transcoder从头到尾处理一个片源，
+// 按dts交错逐个交出输出包：视频是编码器的输出（annex-B，关键帧前重复参数集，时间基与源视频流相同），
+// 音频是源文件里的包。解码器和编码器的lookahead让视频输出落后于读取进度，音频先暂存，编码器交出的视频
+// 追上它的时间才放出来。到文件尾时冲刷解码器和编码器，之后next()返回false。只在一个线程里使用。
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <string>
+
+#include "mapped_source.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/opt.h>
+#include <libswscale/swscale.h>
+}
+
+// 转码档位：客户端在片名后加#<名字>选用
+struct TranscodeProfile {
+    std::string name;
+    int height = 0;        // 输出高度，0或不小于源高度时保持源尺寸；宽度按比例取偶数
+    int kbps = 2500;       // 视频目标码率
+};
+
+const int TRANSCODE_GOP_SECONDS = 2;  // 关键帧间隔，决定新观众和跳转要等多久才有画面
+const size_t TRANSCODE_AUDIO_HOLD = 1024; // 暂存音频包的上限，视频迟迟没有输出时不再等它
+
+class Transcoder {
+public:
+    Transcoder() = default;
+    Transcoder(const Transcoder&) = delete;
+    Transcoder& operator=(const Transcoder&) = delete;
+    ~Transcoder() {
+        for (AVPacket* p : audio_) {
+            av_packet_free(&p);
+        }
+        av_packet_free(&pkt_);
+        av_frame_free(&frame_);
+        av_frame_free(&scaled_);
+        sws_freeContext(sws_);
+        avcodec_free_context(&enc_);
+        avcodec_free_context(&dec_);
+        if (in_) mapped_close_input(&in_);
+    }
+
+    // 打开片源、视频解码器和H.264编码器；失败时返回false，原因见error()
+    bool open(const std::string& path, const TranscodeProfile& profile) {
+        if (mapped_open_input(&in_, path.c_str()) != 0) {
+            return fail("cannot open source");
+        }
+        if (avformat_find_stream_info(in_, nullptr) < 0) {
+            return fail("cannot find stream information");
+        }
+        video_stream_ = av_find_best_stream(in_, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+        audio_stream_ = av_find_best_stream(in_, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+        if (video_stream_ < 0) {
+            return fail("no video stream");
+        }
+        AVStream* vs = in_->streams[video_stream_];
+        const AVCodec* decoder = avcodec_find_decoder(vs->codecpar->codec_id);
+        dec_ = decoder ? avcodec_alloc_context3(decoder) : nullptr;
+        if (!dec_ || avcodec_parameters_to_context(dec_, vs->codecpar) < 0) {
+            return fail("no decoder for the source video");
+        }
+        dec_->pkt_timebase = vs->time_base;
+        dec_->thread_count = 0;
+        if (avcodec_open2(dec_, decoder, nullptr) < 0) {
+            return fail("cannot open the video decoder");
+        }
+
+        // 输出尺寸：按档位高度等比缩小，yuv420p要求宽高都是偶数
+        int width = vs->codecpar->width;
+        int height = vs->codecpar->height;
+        if (width <= 0 || height <= 0) {
+            return fail("unknown source size");
+        }
+        if (profile.height > 0 && profile.height < height) {
+            width = (int)((int64_t)width * profile.height / height);
+            height = profile.height;
+        }
+        width &= ~1;
+        height &= ~1;
+
+        const AVCodec* encoder = avcodec_find_encoder_by_name("libx264");
+        if (!encoder) {
+            encoder = avcodec_find_encoder(AV_CODEC_ID_H264);
+        }
+        enc_ = encoder ? avcodec_alloc_context3(encoder) : nullptr;
+        if (!enc_) {
+            return fail("no H.264 encoder");
+        }
+        AVRational fps = av_guess_frame_rate(in_, vs, nullptr);
+        if (fps.num <= 0 || fps.den <= 0) {
+            fps = AVRational{25, 1};
+        }
+        enc_->width = width;
+        enc_->height = height;
+        enc_->pix_fmt = AV_PIX_FMT_YUV420P;
+        enc_->time_base = vs->time_base;
+        enc_->framerate = fps;
+        enc_->sample_aspect_ratio = vs->codecpar->sample_aspect_ratio;
+        enc_->bit_rate = (int64_t)profile.kbps * 1000;
+        enc_->rc_max_rate = enc_->bit_rate * 3 / 2;
+        enc_->rc_buffer_size = (int)std::min<int64_t>(enc_->bit_rate * 2, INT32_MAX);
+        enc_->gop_size = std::max(1, (int)(av_q2d(fps) * TRANSCODE_GOP_SECONDS + 0.5));
+        enc_->keyint_min = enc_->gop_size;  // 固定GOP，和同一片源的其他档位关键帧对齐
+        enc_->thread_count = 0;
+        // 参数集既放进extradata（发给客户端的编码参数消息），也在每个关键帧前重复（中途加入的观众直接能解）
+        enc_->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        av_opt_set(enc_->priv_data, "preset", "veryfast", 0);
+        av_opt_set(enc_->priv_data, "x264-params", "repeat-headers=1:scenecut=0", 0);
+        if (avcodec_open2(enc_, encoder, nullptr) < 0) {
+            return fail("cannot open the H.264 encoder");
+        }
+
+        pkt_ = av_packet_alloc();
+        frame_ = av_frame_alloc();
+        scaled_ = av_frame_alloc();
+        if (!pkt_ || !frame_ || !scaled_) {
+            return fail("out of memory");
+        }
+        scaled_->format = enc_->pix_fmt;
+        scaled_->width = width;
+        scaled_->height = height;
+        if (av_frame_get_buffer(scaled_, 0) < 0) {
+            return fail("out of memory");
+        }
+        return true;
+    }
+
+    // 取下一个输出包：*data_type为0（视频）或1（音频），时间戳在time_base(*data_type)中；结束或出错时返回false
+    bool next(AVPacket* out, uint32_t* data_type) {
+        while (true) {
+            if (!audio_.empty() && audio_due(audio_.front())) {
+                AVPacket* p = audio_.front();
+                audio_.pop_front();
+                av_packet_move_ref(out, p);
+                av_packet_free(&p);
+                *data_type = 1;
+                return true;
+            }
+            int ret = avcodec_receive_packet(enc_, out);
+            if (ret == 0) {
+                int64_t ts = out->dts != AV_NOPTS_VALUE ? out->dts : out->pts;
+                if (ts != AV_NOPTS_VALUE) {
+                    video_us_ = av_rescale_q(ts, enc_->time_base, AV_TIME_BASE_Q);
+                }
+                *data_type = 0;
+                return true;
+            }
+            if (ret == AVERROR_EOF && !audio_.empty()) {
+                video_done_ = true; // 编码器已经冲刷完，放出剩下的音频
+                continue;
+            }
+            if (ret != AVERROR(EAGAIN)) {
+                return false; // AVERROR_EOF：编码器已经冲刷完
+            }
+
+            ret = avcodec_receive_frame(dec_, frame_);
+            if (ret == 0) {
+                bool ok = encode_frame();
+                av_frame_unref(frame_);
+                if (!ok) return false;
+                continue;
+            }
+            if (ret == AVERROR_EOF) {
+                avcodec_send_frame(enc_, nullptr); // 源读完了，冲刷编码器
+                continue;
+            }
+            if (ret != AVERROR(EAGAIN)) {
+                return fail("video decoding failed");
+            }
+
+            ret = av_read_frame(in_, pkt_);
+            if (ret < 0) {
+                avcodec_send_packet(dec_, nullptr);
+                continue;
+            }
+            if (pkt_->stream_index == audio_stream_) {
+                AVPacket* p = av_packet_alloc();
+                if (!p) {
+                    av_packet_unref(pkt_);
+                    return fail("out of memory");
+                }
+                av_packet_move_ref(p, pkt_);
+                audio_.push_back(p);
+                continue;
+            }
+            if (pkt_->stream_index == video_stream_) {
+                ret = avcodec_send_packet(dec_, pkt_);
+                if (ret < 0 && ret != AVERROR_INVALIDDATA) {
+                    av_packet_unref(pkt_);
+                    return fail("video decoding failed");
+                }
+            }
+            av_packet_unref(pkt_);
+        }
+    }
+
+    AVRational time_base(uint32_t data_type) const {
+        return data_type == 0 ? enc_->time_base : in_->streams[audio_stream_]->time_base;
+    }
+    AVFormatContext* input() const { return in_; }
+    const AVCodecContext* encoder() const { return enc_; }
+    int audio_stream() const { return audio_stream_; }
+    uint64_t frames_encoded() const { return frames_; }
+    const std::string& error() const { return error_; }
+
+private:
+    bool fail(const char* what) {
+        error_ = what;
+        return false;
+    }
+
+    // 暂存的音频包可以交出：视频已经输出到它的时间，或者视频结束了、暂存太多了
+    bool audio_due(const AVPacket* p) const {
+        if (video_done_ || audio_.size() > TRANSCODE_AUDIO_HOLD) {
+            return true;
+        }
+        int64_t ts = p->dts != AV_NOPTS_VALUE ? p->dts : p->pts;
+        if (ts == AV_NOPTS_VALUE) {
+            return true;
+        }
+        return video_us_ != AV_NOPTS_VALUE &&
+               av_rescale_q(ts, in_->streams[audio_stream_]->time_base, AV_TIME_BASE_Q) <= video_us_;
+    }
+
+    // 源帧缩放、转换成yuv420p后送进编码器；像素格式或尺寸变化时缩放上下文会自动重建
+    bool encode_frame() {
+        sws_ = sws_getCachedContext(sws_, frame_->width, frame_->height, (AVPixelFormat)frame_->format, scaled_->width,
+                                    scaled_->height, AV_PIX_FMT_YUV420P, SWS_BILINEAR, nullptr, nullptr, nullptr);
+        if (!sws_ || av_frame_make_writable(scaled_) < 0) {
+            return fail("cannot scale the decoded frame");
+        }
+        sws_scale(sws_, frame_->data, frame_->linesize, 0, frame_->height, scaled_->data, scaled_->linesize);
+        scaled_->pts = frame_->best_effort_timestamp;
+        scaled_->pict_type = AV_PICTURE_TYPE_NONE;
+        if (avcodec_send_frame(enc_, scaled_) < 0) {
+            return fail("video encoding failed");
+        }
+        frames_++;
+        return true;
+    }
+
+    AVFormatContext* in_ = nullptr;
+    AVCodecContext* dec_ = nullptr;
+    AVCodecContext* enc_ = nullptr;
+    SwsContext* sws_ = nullptr;
+    AVPacket* pkt_ = nullptr;
+    AVFrame* frame_ = nullptr;    // 解码器输出
+    AVFrame* scaled_ = nullptr;   // 编码器输入
+    int video_stream_ = -1;
+    int audio_stream_ = -1;
+    uint64_t frames_ = 0;
+    std::deque<AVPacket*> audio_;   // 等视频追上的源音频包
+    int64_t video_us_ = AV_NOPTS_VALUE; // 编码器最近输出的视频dts（微秒）
+    bool video_done_ = false;
+    std::string error_;
+};